@@ -0,0 +1,1282 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <argp.h>
+#include <assert.h>
+
+#include "bios.h"
+#include "tinyos.h"
+#include "tinyoslib.h"
+
+/*
+	A benchmark harness for the tinyos IPC and process API.
+
+	Each benchmark is a task, executed as the boot task of a new
+	virtual machine, once for each requested number of cores.
+	Benchmarks record per-operation latencies (in microseconds of
+	host time) with add_sample(), and the total amount of work with
+	bench_begin()/bench_end(). The harness reports one line per
+	(benchmark, cores) pair, in CSV or JSON.
+ */
+
+
+/*********************************************
+ *
+ *  Measurements
+ *
+ *********************************************/
+
+typedef struct benchmark {
+	const char* name;			/* Benchmark name */
+	const char* description;	/* One-line description */
+	Task task;					/* The boot task */
+	unsigned int ops;			/* Default number of operations */
+} benchmark;
+
+static struct {
+	unsigned int ops;			/* Number of operations to perform */
+	unsigned int cores;			/* Number of cores of the virtual machine */
+	double* samples;			/* Latencies, in usec */
+	unsigned int nsamples;		/* Number of samples recorded */
+	unsigned int capacity;		/* Size of the samples array */
+	double bytes;				/* Bytes moved, for throughput benchmarks */
+	double start, stop;			/* Host time of the measured region, in usec */
+} RUN;
+
+static double now_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1E6 + ts.tv_nsec/1E3;
+}
+
+/* Record a latency sample. This can be called by many threads concurrently. */
+static void add_sample(double usec)
+{
+	unsigned int i = __atomic_fetch_add(&RUN.nsamples, 1, __ATOMIC_RELAXED);
+	if(i < RUN.capacity)
+		RUN.samples[i] = usec;
+}
+
+static void bench_begin() { RUN.start = now_usec(); }
+static void bench_end() { RUN.stop = now_usec(); }
+
+
+/*********************************************
+ *
+ *  Benchmarks
+ *
+ *********************************************/
+
+#define MSG_SIZE 64
+#define STREAM_CHUNK 4096
+#define FANIN_WRITERS 4
+#define BENCH_PORT 100
+#define STORM_CLIENTS 4
+#define STORM_BATCH 8
+#define REUSEPORT_LISTENERS 2
+#define FANOUT_SUBSCRIBERS 6
+#define FANOUT_MSG 1024
+#define OPEN_THREADS 4
+#define PIPELINE_STAGES 4
+#define IO_BATCH 32
+#define FIB_N 27
+#define FIB_CUTOFF 14
+#define EVQ_IDLE 10000
+#define EVQ_ACTIVE 8
+#define EVQ_BATCH 1000
+
+static pipe_t pipe1, pipe2;
+static Fid_t sock_fid;
+
+/* Read exactly size bytes */
+static int read_all(Fid_t fid, char* buf, unsigned int size)
+{
+	unsigned int count = 0;
+	while(count < size) {
+		int rc = Read(fid, buf+count, size-count);
+		if(rc <= 0) return 0;
+		count += rc;
+	}
+	return 1;
+}
+
+/* Echo messages from fid in to fid out, until end of stream */
+static int echo_task(int argl, void* args)
+{
+	Fid_t* fids = args;
+	char buf[MSG_SIZE];
+	while(read_all(fids[0], buf, argl))
+		Write(fids[1], buf, argl);
+	return 0;
+}
+
+
+/* Round trip of one byte over a pair of pipes */
+static int bench_pipe_pingpong(int argl, void* args)
+{
+	Pipe(&pipe1);
+	Pipe(&pipe2);
+	Fid_t fids[2] = { pipe1.read, pipe2.write };
+	Tid_t t = CreateThread(echo_task, 1, fids);
+
+	char c = 'x';
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		Write(pipe1.write, &c, 1);
+		Read(pipe2.read, &c, 1);
+		add_sample(now_usec() - t0);
+	}
+	bench_end();
+
+	Close(pipe1.write);
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+
+static int stream_writer(int argl, void* args)
+{
+	static char buf[STREAM_CHUNK];
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		Write(pipe1.write, buf, STREAM_CHUNK);
+		add_sample(now_usec() - t0);
+	}
+	Close(pipe1.write);
+	return 0;
+}
+
+/* Bulk transfer over a pipe */
+static int bench_pipe_stream(int argl, void* args)
+{
+	static char buf[STREAM_CHUNK];
+	Pipe(&pipe1);
+
+	bench_begin();
+	Tid_t t = CreateThread(stream_writer, 0, NULL);
+	int rc;
+	while((rc = Read(pipe1.read, buf, STREAM_CHUNK)) > 0)
+		RUN.bytes += rc;
+	bench_end();
+
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+
+static int fanin_writer(int argl, void* args)
+{
+	char buf[MSG_SIZE] = { 0 };
+	for(unsigned int i = 0; i < RUN.ops/FANIN_WRITERS; i++) {
+		double t0 = now_usec();
+		Write(pipe1.write, buf, MSG_SIZE);
+		add_sample(now_usec() - t0);
+	}
+	return 0;
+}
+
+/* Many writer threads, one reader, on one pipe */
+static int bench_pipe_fanin(int argl, void* args)
+{
+	static char buf[STREAM_CHUNK];
+	Pipe(&pipe1);
+
+	bench_begin();
+	Tid_t t[FANIN_WRITERS];
+	for(int i = 0; i < FANIN_WRITERS; i++)
+		t[i] = CreateThread(fanin_writer, i, NULL);
+
+	/* The writers do not close the pipe, so never ask for more than what is left */
+	unsigned int left = (RUN.ops/FANIN_WRITERS) * FANIN_WRITERS * MSG_SIZE;
+	while(left > 0) {
+		int rc = Read(pipe1.read, buf, left < STREAM_CHUNK ? left : STREAM_CHUNK);
+		if(rc <= 0) break;
+		RUN.bytes += rc;
+		left -= rc;
+	}
+	bench_end();
+
+	for(int i = 0; i < FANIN_WRITERS; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
+
+
+static int accept_task(int argl, void* args)
+{
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		Fid_t s = Accept(sock_fid);
+		if(s == NOFILE) break;
+		Close(s);
+	}
+	return 0;
+}
+
+/* Socket + Connect + Close, against a thread that accepts and closes */
+static int bench_socket_connect(int argl, void* args)
+{
+	sock_fid = Socket(BENCH_PORT);
+	Listen(sock_fid);
+	Tid_t t = CreateThread(accept_task, 0, NULL);
+
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		Fid_t s = Socket(NOPORT);
+		Connect(s, BENCH_PORT, 1000);
+		Close(s);
+		add_sample(now_usec() - t0);
+	}
+	bench_end();
+
+	ThreadJoin(t, NULL);
+	Close(sock_fid);
+	return 0;
+}
+
+
+static int storm_client(int argl, void* args)
+{
+	for(unsigned int i = 0; i < RUN.ops / STORM_CLIENTS; i++) {
+		double t0 = now_usec();
+		Fid_t s = Socket(NOPORT);
+		Connect(s, BENCH_PORT, (timeout_t)-1);
+		Close(s);
+		add_sample(now_usec() - t0);
+	}
+	return 0;
+}
+
+/* Many clients connecting at once; the server accepts one or a batch at a time */
+static int accept_storm(unsigned int batch)
+{
+	sock_fid = Socket(BENCH_PORT);
+	Listen(sock_fid);
+	unsigned int total = (RUN.ops / STORM_CLIENTS) * STORM_CLIENTS;
+
+	bench_begin();
+	Tid_t t[STORM_CLIENTS];
+	for(int i = 0; i < STORM_CLIENTS; i++)
+		t[i] = CreateThread(storm_client, 0, NULL);
+
+	Fid_t fids[STORM_BATCH];
+	for(unsigned int accepted = 0; accepted < total; ) {
+		int n;
+		if(batch == 1)
+			n = ((fids[0] = Accept(sock_fid)) == NOFILE) ? -1 : 1;
+		else
+			n = AcceptMany(sock_fid, fids, batch);
+		if(n < 0) break;
+		for(int i = 0; i < n; i++)
+			Close(fids[i]);
+		accepted += n;
+	}
+
+	for(int i = 0; i < STORM_CLIENTS; i++)
+		ThreadJoin(t[i], NULL);
+	bench_end();
+
+	Close(sock_fid);
+	return 0;
+}
+
+static int reuseport_acceptor(int argl, void* args)
+{
+	Fid_t s;
+	while((s = Accept(argl)) != NOFILE)
+		Close(s);
+	return 0;
+}
+
+/* Many clients connecting at once, to listeners sharing the port */
+static int bench_reuseport_storm(int argl, void* args)
+{
+	Fid_t lsock[REUSEPORT_LISTENERS];
+	Tid_t acceptor[REUSEPORT_LISTENERS];
+	for(int i = 0; i < REUSEPORT_LISTENERS; i++) {
+		lsock[i] = Socket(BENCH_PORT);
+		SetSockOpt(lsock[i], SOCKOPT_REUSEPORT, 1);
+		Listen(lsock[i]);
+		acceptor[i] = CreateThread(reuseport_acceptor, lsock[i], NULL);
+	}
+
+	bench_begin();
+	Tid_t t[STORM_CLIENTS];
+	for(int i = 0; i < STORM_CLIENTS; i++)
+		t[i] = CreateThread(storm_client, 0, NULL);
+	for(int i = 0; i < STORM_CLIENTS; i++)
+		ThreadJoin(t[i], NULL);
+	bench_end();
+
+	for(int i = 0; i < REUSEPORT_LISTENERS; i++) {
+		Close(lsock[i]);
+		ThreadJoin(acceptor[i], NULL);
+	}
+	return 0;
+}
+
+static int bench_accept_storm(int argl, void* args) { return accept_storm(1); }
+static int bench_acceptmany_storm(int argl, void* args) { return accept_storm(STORM_BATCH); }
+
+
+static int socket_echo_task(int argl, void* args)
+{
+	Fid_t s = Accept(sock_fid);
+	Fid_t fids[2] = { s, s };
+	echo_task(MSG_SIZE, fids);
+	Close(s);
+	return 0;
+}
+
+/* Round trip of a small message over a socket connection */
+static int bench_socket_rtt(int argl, void* args)
+{
+	sock_fid = Socket(BENCH_PORT);
+	Listen(sock_fid);
+	Tid_t t = CreateThread(socket_echo_task, 0, NULL);
+
+	Fid_t s = Socket(NOPORT);
+	Connect(s, BENCH_PORT, 1000);
+
+	char buf[MSG_SIZE] = { 0 };
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		Write(s, buf, MSG_SIZE);
+		read_all(s, buf, MSG_SIZE);
+		add_sample(now_usec() - t0);
+	}
+	bench_end();
+
+	ShutDown(s, SHUTDOWN_WRITE);
+	ThreadJoin(t, NULL);
+	Close(s);
+	Close(sock_fid);
+	return 0;
+}
+
+
+static Fid_t msg_cli, msg_srv;
+
+static int accept_one(int argl, void* args)
+{
+	msg_srv = Accept(sock_fid);
+	return 0;
+}
+
+/* Connect msg_cli to msg_srv, in ring mode or not */
+static void connect_pair(int ring)
+{
+	sock_fid = Socket(BENCH_PORT);
+	msg_cli = Socket(NOPORT);
+	SetSockOpt(sock_fid, SOCKOPT_RING, ring);
+	SetSockOpt(msg_cli, SOCKOPT_RING, ring);
+	Listen(sock_fid);
+	Tid_t t = CreateThread(accept_one, 0, NULL);
+	Connect(msg_cli, BENCH_PORT, 1000);
+	ThreadJoin(t, NULL);
+	Close(sock_fid);
+}
+
+static int msg_sender(int argl, void* args)
+{
+	char buf[MSG_SIZE] = { 0 };
+	sock_ring *rx, *tx;
+	SockRing(msg_cli, &rx, &tx);
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		if(argl)
+			RingSend(msg_cli, tx, buf, MSG_SIZE);
+		else
+			Write(msg_cli, buf, MSG_SIZE);
+	}
+	ShutDown(msg_cli, SHUTDOWN_WRITE);
+	return 0;
+}
+
+/* One-way stream of small messages over a connection */
+static int socket_msgs(int ring)
+{
+	connect_pair(ring);
+	sock_ring *rx, *tx;
+	SockRing(msg_srv, &rx, &tx);
+
+	char buf[MSG_SIZE];
+	bench_begin();
+	Tid_t t = CreateThread(msg_sender, ring, NULL);
+	while((ring ? RingRecv(msg_srv, rx, buf, MSG_SIZE) : Read(msg_srv, buf, MSG_SIZE)) > 0)
+		;
+	bench_end();
+
+	ThreadJoin(t, NULL);
+	Close(msg_cli);
+	Close(msg_srv);
+	return 0;
+}
+
+static int bench_socket_msgs(int argl, void* args) { return socket_msgs(0); }
+static int bench_ring_msgs(int argl, void* args) { return socket_msgs(1); }
+
+
+/*
+	Small messages through asynchronous I/O rings, against Read/Write.
+	The sender submits IO_BATCH writes with one IoRingEnter, and the
+	receiver keeps IO_BATCH reads in flight.
+ */
+
+/* Write RUN.ops messages to fid argl, one by one or in batches */
+static void send_msgs(Fid_t fid, int batched)
+{
+	char buf[MSG_SIZE] = { 0 };
+	if(! batched) {
+		for(unsigned int i = 0; i < RUN.ops; i++)
+			Write(fid, buf, MSG_SIZE);
+		return;
+	}
+
+	io_ring* ring;
+	Fid_t rfid = IoRing(1, &ring);
+	io_sqe sqe = { .opcode = IO_WRITE, .fid = fid, .buf = buf, .size = MSG_SIZE };
+	io_cqe cqe;
+	for(unsigned int i = 0; i < RUN.ops; ) {
+		unsigned int n = RUN.ops - i < IO_BATCH ? RUN.ops - i : IO_BATCH;
+		for(unsigned int j = 0; j < n; j++)
+			IoSubmit(ring, &sqe);
+		IoRingEnter(rfid, n, (timeout_t)-1);
+		while(IoReap(ring, &cqe))
+			;
+		i += n;
+	}
+	Close(rfid);
+}
+
+/* Read messages from fid until EOF, one by one or with a ring */
+static void recv_msgs(Fid_t fid, int batched)
+{
+	static char buf[IO_BATCH][MSG_SIZE];
+	if(! batched) {
+		while(Read(fid, buf[0], MSG_SIZE) > 0)
+			;
+		return;
+	}
+
+	io_ring* ring;
+	Fid_t rfid = IoRing(1, &ring);
+	unsigned int inflight = 0;
+	int eof = 0;
+	do {
+		for(; ! eof && inflight < IO_BATCH; inflight++) {
+			io_sqe sqe = { .opcode = IO_READ, .fid = fid, .buf = buf[inflight], .size = MSG_SIZE };
+			IoSubmit(ring, &sqe);
+		}
+		IoRingEnter(rfid, inflight, (timeout_t)-1);
+
+		/* Reads complete in order, so the free buffers are the last ones */
+		io_cqe cqe;
+		while(IoReap(ring, &cqe)) {
+			inflight--;
+			if(cqe.result <= 0) eof = 1;
+		}
+	} while(! eof || inflight > 0);
+	Close(rfid);
+}
+
+static int pipe_msg_sender(int argl, void* args)
+{
+	send_msgs(argl, *(int*)args);
+	Close(argl);
+	return 0;
+}
+
+static int pipe_msgs(int batched)
+{
+	pipe_t p;
+	Pipe(&p);
+
+	bench_begin();
+	Tid_t t = CreateThread(pipe_msg_sender, p.write, &batched);
+	recv_msgs(p.read, batched);
+	bench_end();
+
+	ThreadJoin(t, NULL);
+	Close(p.read);
+	return 0;
+}
+
+static int socket_msg_sender(int argl, void* args)
+{
+	send_msgs(msg_cli, argl);
+	ShutDown(msg_cli, SHUTDOWN_WRITE);
+	return 0;
+}
+
+static int socket_msgs_ioring(int argl, void* args)
+{
+	connect_pair(0);
+
+	bench_begin();
+	Tid_t t = CreateThread(socket_msg_sender, 1, NULL);
+	recv_msgs(msg_srv, 1);
+	bench_end();
+
+	ThreadJoin(t, NULL);
+	Close(msg_cli);
+	Close(msg_srv);
+	return 0;
+}
+
+static int bench_pipe_msgs(int argl, void* args) { return pipe_msgs(0); }
+static int bench_pipe_msgs_ioring(int argl, void* args) { return pipe_msgs(1); }
+static int bench_socket_msgs_ioring(int argl, void* args) { return socket_msgs_ioring(argl, args); }
+
+
+/*
+	Broadcast of a message to many readers: a write to each of a number of
+	socket connections, against one write to a fan-out channel.
+
+	Messages are sent in rounds, and the sender waits for all readers at
+	the end of each round, so that no reader of the channel lags behind.
+ */
+#define FANOUT_ROUND 256
+
+static Fid_t fanout_fid[FANOUT_SUBSCRIBERS];
+static Mutex fanout_mx = MUTEX_INIT;
+static CondVar fanout_cv = COND_INIT;
+static unsigned int fanout_acks;
+
+static int fanout_reader(int argl, void* args)
+{
+	char buf[FANOUT_MSG];
+	Fid_t fid = *(Fid_t*) args;
+	for(;;) {
+		for(int i = 0; i < FANOUT_ROUND; i++)
+			if(! (argl ? Read(fid, buf, FANOUT_MSG) > 0 : read_all(fid, buf, FANOUT_MSG)))
+				return 0;
+		Mutex_Lock(&fanout_mx);
+		fanout_acks++;
+		Cond_Broadcast(&fanout_cv);
+		Mutex_Unlock(&fanout_mx);
+	}
+}
+
+static int fanout(int channel)
+{
+	Fid_t cli[FANOUT_SUBSCRIBERS], pub = NOFILE;
+	if(channel) {
+		pub = Channel(FANOUT_ROUND);
+		for(int i = 0; i < FANOUT_SUBSCRIBERS; i++)
+			fanout_fid[i] = Subscribe(pub);
+	} else {
+		for(int i = 0; i < FANOUT_SUBSCRIBERS; i++) {
+			connect_pair(0);
+			cli[i] = msg_cli;
+			fanout_fid[i] = msg_srv;
+		}
+	}
+
+	char buf[FANOUT_MSG] = { 0 };
+	fanout_acks = 0;
+	bench_begin();
+	Tid_t t[FANOUT_SUBSCRIBERS];
+	for(int i = 0; i < FANOUT_SUBSCRIBERS; i++)
+		t[i] = CreateThread(fanout_reader, channel, &fanout_fid[i]);
+
+	unsigned int rounds = RUN.ops / FANOUT_ROUND;
+	for(unsigned int r = 0; r < rounds; r++) {
+		for(unsigned int i = 0; i < FANOUT_ROUND; i++) {
+			double t0 = now_usec();
+			if(channel)
+				Write(pub, buf, FANOUT_MSG);
+			else
+				for(int j = 0; j < FANOUT_SUBSCRIBERS; j++)
+					Write(cli[j], buf, FANOUT_MSG);
+			add_sample(now_usec() - t0);
+		}
+		Mutex_Lock(&fanout_mx);
+		while(fanout_acks < (r+1)*FANOUT_SUBSCRIBERS)
+			Cond_Wait(&fanout_mx, &fanout_cv);
+		Mutex_Unlock(&fanout_mx);
+	}
+
+	if(channel)
+		Close(pub);
+	else
+		for(int i = 0; i < FANOUT_SUBSCRIBERS; i++)
+			Close(cli[i]);
+	for(int i = 0; i < FANOUT_SUBSCRIBERS; i++)
+		ThreadJoin(t[i], NULL);
+	bench_end();
+
+	for(int i = 0; i < FANOUT_SUBSCRIBERS; i++)
+		Close(fanout_fid[i]);
+	return 0;
+}
+
+static int bench_fanout_writes(int argl, void* args) { return fanout(0); }
+static int bench_fanout_channel(int argl, void* args) { return fanout(1); }
+
+
+static int null_task(int argl, void* args) { return 0; }
+
+/* Exec + WaitChild of an empty process */
+static int bench_exec_wait(int argl, void* args)
+{
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		WaitChild(Exec(null_task, 0, NULL), NULL);
+		add_sample(now_usec() - t0);
+	}
+	bench_end();
+	return 0;
+}
+
+
+static int open_close_task(int argl, void* args)
+{
+	for(unsigned int i = 0; i < RUN.ops/OPEN_THREADS; i++) {
+		double t0 = now_usec();
+		Close(OpenNull());
+		add_sample(now_usec() - t0);
+	}
+	return 0;
+}
+
+/* Many threads, each opening and closing a stream */
+static int bench_open_close(int argl, void* args)
+{
+	bench_begin();
+	Tid_t t[OPEN_THREADS];
+	for(int i = 0; i < OPEN_THREADS; i++)
+		t[i] = CreateThread(open_close_task, i, NULL);
+	for(int i = 0; i < OPEN_THREADS; i++)
+		ThreadJoin(t[i], NULL);
+	bench_end();
+	return 0;
+}
+
+
+/* CreateThread + ThreadJoin of an empty thread */
+static int bench_thread_join(int argl, void* args)
+{
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		ThreadJoin(CreateThread(null_task, 0, NULL), NULL);
+		add_sample(now_usec() - t0);
+	}
+	bench_end();
+	return 0;
+}
+
+
+/* Launch a pipeline of empty processes, as the shell did, with one Exec per stage */
+static int bench_pipeline_exec(int argl, void* args)
+{
+	bench_begin();
+	for(unsigned int n = 0; n < RUN.ops; n++) {
+		Pid_t pids[PIPELINE_STAGES];
+		double t0 = now_usec();
+		for(int i = 0; i < PIPELINE_STAGES; i++) {
+			pipe_t p;
+			if(i < PIPELINE_STAGES-1) {
+				Pipe(&p);
+				Dup2(p.write, 1);
+				Close(p.write);
+			} else
+				Close(1);
+			pids[i] = Exec(null_task, 0, NULL);
+			if(i < PIPELINE_STAGES-1) {
+				Dup2(p.read, 0);
+				Close(p.read);
+			} else
+				Close(0);
+		}
+		add_sample(now_usec() - t0);
+		for(int i = 0; i < PIPELINE_STAGES; i++)
+			WaitChild(pids[i], NULL);
+	}
+	bench_end();
+	return 0;
+}
+
+/* Launch a pipeline of empty processes with ExecMany and fid actions */
+static int bench_pipeline_spawn(int argl, void* args)
+{
+	bench_begin();
+	for(unsigned int n = 0; n < RUN.ops; n++) {
+		Pid_t pids[PIPELINE_STAGES];
+		pipe_t p[PIPELINE_STAGES-1];
+		spawn_request reqs[PIPELINE_STAGES];
+		spawn_action act[PIPELINE_STAGES][2*PIPELINE_STAGES];
+
+		double t0 = now_usec();
+		for(int j = 0; j < PIPELINE_STAGES-1; j++)
+			Pipe(&p[j]);
+		for(int i = 0; i < PIPELINE_STAGES; i++) {
+			spawn_action* a = act[i];
+			if(i > 0) *a++ = (spawn_action){ SPAWN_DUP2, p[i-1].read, 0 };
+			if(i < PIPELINE_STAGES-1) *a++ = (spawn_action){ SPAWN_DUP2, p[i].write, 1 };
+			for(int j = 0; j < PIPELINE_STAGES-1; j++) {
+				*a++ = (spawn_action){ SPAWN_CLOSE, p[j].read, NOFILE };
+				*a++ = (spawn_action){ SPAWN_CLOSE, p[j].write, NOFILE };
+			}
+			reqs[i] = (spawn_request){ null_task, 0, NULL, act[i], a - act[i] };
+		}
+		ExecMany(PIPELINE_STAGES, reqs, pids);
+		for(int j = 0; j < PIPELINE_STAGES-1; j++) {
+			Close(p[j].read);
+			Close(p[j].write);
+		}
+		add_sample(now_usec() - t0);
+		for(int i = 0; i < PIPELINE_STAGES; i++)
+			WaitChild(pids[i], NULL);
+	}
+	bench_end();
+	return 0;
+}
+
+
+/* Create many threads, then join them all */
+static int bench_join_many(int argl, void* args)
+{
+	Tid_t* t = malloc(RUN.ops * sizeof(Tid_t));
+	for(unsigned int i = 0; i < RUN.ops; i++)
+		t[i] = CreateThread(null_task, 0, NULL);
+
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		ThreadJoin(t[i], NULL);
+		add_sample(now_usec() - t0);
+	}
+	bench_end();
+	free(t);
+	return 0;
+}
+
+
+/* A worker that blocks reading fid argl, until it is told to exit */
+static int shutdown_worker(int argl, void* args)
+{
+	char c;
+	Read(argl, &c, 1);
+	return 0;
+}
+
+/* Shut down workers by signalling each one over its own pipe, and reaping them */
+static int bench_shutdown_signal(int argl, void* args)
+{
+	Fid_t* w = malloc(RUN.ops * sizeof(Fid_t));
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		pipe_t p;
+		Pipe(&p);
+		SetCloseOnExec(p.write, 1);
+		Exec(shutdown_worker, p.read, NULL);
+		Close(p.read);
+		w[i] = p.write;
+	}
+
+	bench_begin();
+	double t0 = now_usec();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		Write(w[i], "q", 1);
+		Close(w[i]);
+	}
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	add_sample(now_usec() - t0);
+	bench_end();
+	free(w);
+	return 0;
+}
+
+/* The root of a tree of workers, with args {n, ready}: create n-1 workers, tell ready, and block */
+static int shutdown_root(int argl, void* args)
+{
+	int n = ((int*)args)[0], ready = ((int*)args)[1];
+	pipe_t p;
+	Pipe(&p);
+	for(int i = 0; i < n-1; i++)
+		Exec(shutdown_worker, p.read, NULL);
+	Write(ready, "r", 1);
+	return shutdown_worker(p.read, NULL);
+}
+
+/* Shut down a tree of workers with one KillTree, and reap them */
+static int bench_shutdown_kill(int argl, void* args)
+{
+	pipe_t ready;
+	Pipe(&ready);
+	int root_args[2] = { RUN.ops, ready.write };
+	Pid_t root = Exec(shutdown_root, sizeof(root_args), root_args);
+	char c;
+	Read(ready.read, &c, 1);
+
+	/* The killed workers are adopted by this process, the initial one */
+	bench_begin();
+	double t0 = now_usec();
+	KillTree(root);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	add_sample(now_usec() - t0);
+	bench_end();
+	return 0;
+}
+
+
+static void fiber_count(void* arg)
+{
+	__atomic_fetch_add((unsigned int*) arg, 1, __ATOMIC_RELAXED);
+}
+
+static void fiber_spawner(void* arg)
+{
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		FiberSpawn(fiber_count, arg);
+		add_sample(now_usec() - t0);
+	}
+}
+
+/* Spawn many empty fibers on a carrier per core, and wait for them all; compare with join_many */
+static int bench_fiber_spawn(int argl, void* args)
+{
+	unsigned int done = 0;
+	bench_begin();
+	FiberRun(RUN.cores, fiber_spawner, &done);
+	bench_end();
+	assert(done == RUN.ops);
+	return 0;
+}
+
+
+typedef struct fiber_pingpong {
+	fiber_chan ping, pong;
+} fiber_pingpong;
+
+static void fiber_ponger(void* arg)
+{
+	fiber_pingpong* pp = arg;
+	void* msg;
+	while(FiberChanRecv(&pp->ping, &msg))
+		FiberChanSend(&pp->pong, msg);
+}
+
+static void fiber_pinger(void* arg)
+{
+	fiber_pingpong* pp = arg;
+	void* msg;
+	FiberSpawn(fiber_ponger, pp);
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		FiberChanSend(&pp->ping, NULL);
+		FiberChanRecv(&pp->pong, &msg);
+		add_sample(now_usec() - t0);
+	}
+	FiberChanClose(&pp->ping);
+}
+
+/* Round trip between two fibers over two channels */
+static int bench_fiber_pingpong(int argl, void* args)
+{
+	fiber_pingpong pp;
+	FiberChanInit(&pp.ping, 1);
+	FiberChanInit(&pp.pong, 1);
+	bench_begin();
+	FiberRun(RUN.cores, fiber_pinger, &pp);
+	bench_end();
+	FiberChanDestroy(&pp.ping);
+	FiberChanDestroy(&pp.pong);
+	return 0;
+}
+
+
+static struct {
+	Mutex mx;
+	CondVar cv;
+	unsigned int turn;
+} PINGPONG;
+
+/* Take the odd turns, until turn reaches 2*argl */
+static int cond_ponger(int argl, void* args)
+{
+	Mutex_Lock(&PINGPONG.mx);
+	for(unsigned int i = 0; i < (unsigned int)argl; i++) {
+		while(PINGPONG.turn % 2 == 0)
+			Cond_Wait(&PINGPONG.mx, &PINGPONG.cv);
+		PINGPONG.turn++;
+		Cond_Broadcast(&PINGPONG.cv);
+	}
+	Mutex_Unlock(&PINGPONG.mx);
+	return 0;
+}
+
+/* Round trip between two threads with a mutex and a condition variable; compare with fiber_pingpong */
+static int bench_cond_pingpong(int argl, void* args)
+{
+	PINGPONG.mx = MUTEX_INIT;
+	PINGPONG.cv = COND_INIT;
+	PINGPONG.turn = 0;
+	Tid_t t = CreateThread(cond_ponger, RUN.ops, NULL);
+
+	bench_begin();
+	Mutex_Lock(&PINGPONG.mx);
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		PINGPONG.turn++;
+		Cond_Broadcast(&PINGPONG.cv);
+		while(PINGPONG.turn % 2 == 1)
+			Cond_Wait(&PINGPONG.mx, &PINGPONG.cv);
+		add_sample(now_usec() - t0);
+	}
+	Mutex_Unlock(&PINGPONG.mx);
+	bench_end();
+
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+
+/*
+	A parallel Fibonacci on a task pool with a worker per core, against
+	the same recursion on one thread.
+ */
+
+typedef struct fib_job {
+	int n;
+	long result;
+} fib_job;
+
+static long fib(int n) { return n < 2 ? n : fib(n-1) + fib(n-2); }
+
+static void fib_task(pool_worker* w, void* arg)
+{
+	fib_job* job = arg;
+	if(job->n < FIB_CUTOFF) {
+		job->result = fib(job->n);
+		return;
+	}
+	fib_job a = { job->n - 1, 0 }, b = { job->n - 2, 0 };
+	task_group g = TASK_GROUP_INIT;
+	TaskSpawn(w, &g, fib_task, &a);
+	fib_task(w, &b);
+	TaskWait(w, &g);
+	job->result = a.result + b.result;
+}
+
+static int bench_fib_serial(int argl, void* args)
+{
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		double t0 = now_usec();
+		volatile long r = fib(FIB_N);
+		(void) r;
+		add_sample(now_usec() - t0);
+	}
+	bench_end();
+	return 0;
+}
+
+static int bench_fib_pool(int argl, void* args)
+{
+	long expected = fib(FIB_N);
+	task_pool* pool = TaskPoolCreate(RUN.cores);
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		fib_job job = { FIB_N, 0 };
+		double t0 = now_usec();
+		TaskPoolRun(pool, fib_task, &job);
+		add_sample(now_usec() - t0);
+		assert(job.result == expected);
+	}
+	bench_end();
+	TaskPoolDestroy(pool);
+	return 0;
+}
+
+
+/*
+	Register idle pipes with an event queue, plus EVQ_ACTIVE pipes. Each
+	operation writes a byte to every active pipe, collects the events with
+	WaitEvents, timing it, and reads the bytes back.
+
+	A process holds at most MAX_FILEID fids, so the idle pipes are made in
+	batches. Each batch is registered, inherited by a holder process that
+	keeps it open, and closed here; the registrations stay on the queue.
+ */
+static int bench_eventq(unsigned int idle)
+{
+	static pipe_t batch[EVQ_BATCH];
+	pipe_t active[EVQ_ACTIVE];
+	Fid_t evq = EventQueue();
+	SetCloseOnExec(evq, 1);
+	for(int k = 0; k < EVQ_ACTIVE; k++) {
+		Pipe(&active[k]);
+		SetCloseOnExec(active[k].read, 1);
+		SetCloseOnExec(active[k].write, 1);
+		EventCtl(evq, active[k].read, EVENT_READ);
+	}
+
+	pipe_t quit;
+	Pipe(&quit);
+	SetCloseOnExec(quit.write, 1);
+	for(unsigned int done = 0; done < idle; ) {
+		unsigned int n = idle - done < EVQ_BATCH ? idle - done : EVQ_BATCH;
+		for(unsigned int j = 0; j < n; j++) {
+			Pipe(&batch[j]);
+			int rc = EventCtl(evq, batch[j].read, EVENT_READ);
+			assert(rc == 0);
+		}
+		Exec(shutdown_worker, quit.read, NULL);
+		for(unsigned int j = 0; j < n; j++) {
+			Close(batch[j].read);
+			Close(batch[j].write);
+		}
+		done += n;
+	}
+	Close(quit.read);
+
+	event_t ev[EVQ_ACTIVE];
+	char c;
+	bench_begin();
+	for(unsigned int i = 0; i < RUN.ops; i++) {
+		for(int k = 0; k < EVQ_ACTIVE; k++)
+			Write(active[k].write, "e", 1);
+		for(int ready = 0; ready < EVQ_ACTIVE; ) {
+			double t0 = now_usec();
+			int n = WaitEvents(evq, ev, EVQ_ACTIVE, (timeout_t)-1);
+			add_sample(now_usec() - t0);
+			assert(n > 0);
+			for(int j = 0; j < n; j++)
+				Read(ev[j].fid, &c, 1);
+			ready += n;
+		}
+	}
+	bench_end();
+
+	Close(evq);
+	for(int k = 0; k < EVQ_ACTIVE; k++) {
+		Close(active[k].read);
+		Close(active[k].write);
+	}
+	Close(quit.write);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	return 0;
+}
+
+static int bench_eventq_active(int argl, void* args) { return bench_eventq(0); }
+static int bench_eventq_idle(int argl, void* args) { return bench_eventq(EVQ_IDLE); }
+
+
+static benchmark BENCHMARKS[] = {
+	{"pipe_pingpong", "1-byte round trip over two pipes", bench_pipe_pingpong, 20000},
+	{"pipe_stream", "4KB writes streamed over a pipe", bench_pipe_stream, 4000},
+	{"pipe_fanin", "4 writer threads, one reader, 64-byte writes", bench_pipe_fanin, 20000},
+	{"socket_connect", "Socket/Connect/Close against an accepting thread", bench_socket_connect, 5000},
+	{"accept_storm", "4 connecting threads, server calls Accept", bench_accept_storm, 8000},
+	{"acceptmany_storm", "4 connecting threads, server calls AcceptMany", bench_acceptmany_storm, 8000},
+	{"reuseport_storm", "4 connecting threads, 2 listeners sharing the port", bench_reuseport_storm, 8000},
+	{"socket_rtt", "64-byte round trip over a socket connection", bench_socket_rtt, 20000},
+	{"socket_msgs", "64-byte messages over a socket, with Read/Write", bench_socket_msgs, 100000},
+	{"ring_msgs", "64-byte messages over a socket in ring mode, with RingSend/RingRecv", bench_ring_msgs, 100000},
+	{"socket_msgs_ioring", "64-byte messages over a socket, with batches of I/O ring operations", bench_socket_msgs_ioring, 100000},
+	{"pipe_msgs", "64-byte messages over a pipe, with Read/Write", bench_pipe_msgs, 100000},
+	{"pipe_msgs_ioring", "64-byte messages over a pipe, with batches of I/O ring operations", bench_pipe_msgs_ioring, 100000},
+	{"fanout_writes", "1KB broadcast to 6 readers, one Write per socket connection", bench_fanout_writes, 20480},
+	{"fanout_channel", "1KB broadcast to 6 readers, one Write to a fan-out channel", bench_fanout_channel, 20480},
+	{"exec_wait", "Exec/WaitChild of an empty process", bench_exec_wait, 5000},
+	{"thread_join", "CreateThread/ThreadJoin of an empty thread", bench_thread_join, 20000},
+	{"pipeline_exec", "Launch a 4-stage pipeline with Exec, Dup2 and Close", bench_pipeline_exec, 2000},
+	{"pipeline_spawn", "Launch a 4-stage pipeline with one ExecMany", bench_pipeline_spawn, 2000},
+	{"join_many", "CreateThread many threads, then ThreadJoin them all", bench_join_many, 10000},
+	{"open_close", "4 threads, each calling OpenNull/Close", bench_open_close, 100000},
+	{"shutdown_signal", "Shut down 1000 worker processes, writing to a pipe of each", bench_shutdown_signal, 1000},
+	{"shutdown_kill", "Shut down a tree of 1000 worker processes with KillTree", bench_shutdown_kill, 1000},
+	{"fiber_spawn", "Spawn many empty fibers on a carrier per core, and run them all", bench_fiber_spawn, 1000000},
+	{"fiber_pingpong", "Round trip between two fibers over two fiber channels", bench_fiber_pingpong, 100000},
+	{"eventq_active", "Write a byte to each of 8 pipes, WaitEvents and read them back", bench_eventq_active, 100000},
+	{"eventq_idle", "As eventq_active, with 10000 idle pipes also registered", bench_eventq_idle, 100000},
+	{"cond_pingpong", "Round trip between two threads with Mutex and CondVar", bench_cond_pingpong, 100000},
+	{"fib_serial", "Fibonacci(27), recursive, on one thread", bench_fib_serial, 20},
+	{"fib_pool", "Fibonacci(27), recursive, on a work-stealing task pool with a worker per core", bench_fib_pool, 20},
+	{NULL, NULL, NULL, 0}
+};
+
+
+/*********************************************
+ *
+ *  Reporting
+ *
+ *********************************************/
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+	unsigned int n = RUN.nsamples < RUN.capacity ? RUN.nsamples : RUN.capacity;
+	if(n == 0) return 0.0;
+	unsigned int i = (unsigned int)(p * n);
+	return RUN.samples[i < n ? i : n-1];
+}
+
+static void report(FILE* out, int json, int first, const benchmark* b, uint ncores)
+{
+	unsigned int n = RUN.nsamples < RUN.capacity ? RUN.nsamples : RUN.capacity;
+	qsort(RUN.samples, n, sizeof(double), cmp_double);
+
+	double secs = (RUN.stop - RUN.start) / 1E6;
+	double rate;
+	const char* unit;
+	if(RUN.bytes > 0) {
+		rate = RUN.bytes / 1E6 / secs;
+		unit = "MB/s";
+	} else {
+		rate = RUN.ops / secs;
+		unit = "ops/s";
+	}
+
+	if(json)
+		fprintf(out, "%s  {\"benchmark\": \"%s\", \"cores\": %u, \"ops\": %u, \"seconds\": %.6f, "
+			"\"rate\": %.2f, \"unit\": \"%s\", \"p50_us\": %.2f, \"p99_us\": %.2f}",
+			first ? "" : ",\n", b->name, ncores, RUN.ops, secs, rate, unit,
+			percentile(0.50), percentile(0.99));
+	else
+		fprintf(out, "%s,%u,%u,%.6f,%.2f,%s,%.2f,%.2f\n",
+			b->name, ncores, RUN.ops, secs, rate, unit,
+			percentile(0.50), percentile(0.99));
+	fflush(out);
+}
+
+
+/*********************************************
+ *
+ *  Main: arguments
+ *
+ *********************************************/
+
+static struct {
+	int ncores;
+	int cores[MAX_CORES];
+	double scale;
+	int json;
+	int nbench;
+	const benchmark* bench[sizeof(BENCHMARKS)/sizeof(benchmark)];
+} ARGS = { .ncores = 0, .scale = 1.0, .json = 0, .nbench = 0 };
+
+static char doc[] =
+	"A benchmark program for the tinyos IPC and process API.\n"
+	"\vEach benchmark is run once for every number of cores in the list. "
+	"For example,\n\n   ./bench -c 1,2,4 -j pipe_pingpong socket_rtt\n\n"
+	"runs two benchmarks on 1, 2 and 4 cores and prints the results in JSON. "
+	"Without benchmark arguments, all benchmarks are run.";
+
+static char args_doc[] = " BENCHMARK ... ";
+
+static struct argp_option options [] = {
+	{"cores", 'c', "<cores>", 0, "List of number of cores (default: 1,2,4)" },
+	{"json", 'j', 0, 0, "Print results in JSON (default: CSV)" },
+	{"scale", 's', "<factor>", 0, "Multiply the number of operations by <factor>" },
+	{"list", 'l', 0, 0, "Show a list of available benchmarks" },
+	{ NULL }
+};
+
+static error_t parse_options(int key, char *arg, struct argp_state *state)
+{
+	switch(key)
+	{
+		case 'c':
+			ARGS.ncores = 0;
+			for(char* tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+				int n = atoi(tok);
+				if(n < 1 || n > MAX_CORES || ARGS.ncores == MAX_CORES)
+					argp_error(state, "Error in parsing list of cores: %s\n", tok);
+				ARGS.cores[ARGS.ncores++] = n;
+			}
+			break;
+
+		case 'j':
+			ARGS.json = 1;
+			break;
+
+		case 's':
+			ARGS.scale = atof(arg);
+			if(ARGS.scale <= 0)
+				argp_error(state, "Illegal scale: %s\n", arg);
+			break;
+
+		case 'l':
+			for(const benchmark* b = BENCHMARKS; b->name; b++)
+				printf("%-20s %s\n", b->name, b->description);
+			exit(0);
+
+		case ARGP_KEY_ARG: {
+			const benchmark* b;
+			for(b = BENCHMARKS; b->name; b++)
+				if(strcmp(b->name, arg) == 0) break;
+			if(b->name == NULL)
+				argp_error(state, "Unknown benchmark: %s\n", arg);
+			/* Each benchmark is run once, so ARGS.bench cannot overflow */
+			for(int i = 0; i < ARGS.nbench; i++)
+				if(ARGS.bench[i] == b) return 0;
+			ARGS.bench[ARGS.nbench++] = b;
+			break;
+		}
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = { options, parse_options, args_doc, doc };
+
+
+int main(int argc, char** argv)
+{
+	argp_parse(&argp, argc, argv, 0, 0, NULL);
+
+	if(ARGS.ncores == 0) {
+		ARGS.cores[0] = 1; ARGS.cores[1] = 2; ARGS.cores[2] = 4;
+		ARGS.ncores = 3;
+	}
+	if(ARGS.nbench == 0)
+		for(const benchmark* b = BENCHMARKS; b->name; b++)
+			ARGS.bench[ARGS.nbench++] = b;
+
+	FILE* out = stdout;
+	if(ARGS.json)
+		fprintf(out, "[\n");
+	else
+		fprintf(out, "benchmark,cores,ops,seconds,rate,unit,p50_us,p99_us\n");
+
+	int first = 1;
+	for(int i = 0; i < ARGS.nbench; i++) {
+		const benchmark* b = ARGS.bench[i];
+		for(int c = 0; c < ARGS.ncores; c++) {
+			RUN.cores = ARGS.cores[c];
+			RUN.ops = b->ops * ARGS.scale;
+			if(RUN.ops == 0) RUN.ops = 1;
+			RUN.capacity = RUN.ops;
+			RUN.samples = malloc(RUN.capacity * sizeof(double));
+			RUN.nsamples = 0;
+			RUN.bytes = 0;
+			RUN.start = RUN.stop = 0;
+
+			boot(ARGS.cores[c], 0, b->task, 0, NULL);
+
+			report(out, ARGS.json, first, b, ARGS.cores[c]);
+			first = 0;
+			free(RUN.samples);
+		}
+	}
+
+	if(ARGS.json)
+		fprintf(out, "\n]\n");
+	return 0;
+}
@@ -12,6 +12,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
 
 #include "util.h"
 #include "bios.h"
@@ -475,6 +479,149 @@ static int check_terminal(terminal* term)
 
 
 
+/*
+	A network device is a host UNIX-domain stream socket: a listener, bound
+	on a path, or a connection accepted from a listener.
+
+	The PIC daemon watches all network devices through a single epoll
+	descriptor, in edge-triggered mode, so that thousands of them do not
+	have to be passed to select(). As with io_device, a device is made 
+	not-ready by a failed transfer, and made ready (raising an interrupt)
+	by the next edge.
+
+	The table is changed by the cores, under netdev_mutex. The ready flags
+	are also written by the PIC daemon, without locking.
+ */
+typedef struct netdev
+{
+	int fd;						/* -1 if the slot is free */
+	char* path;					/* for listeners, removed at close */
+	volatile int rx_ready;		/* ready flags */
+	volatile int tx_ready;
+} netdev;
+
+/* The network device table */
+static netdev NETDEV[MAX_NET_DEVICES];
+static pthread_mutex_t netdev_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of open network devices, and where to look for a free slot */
+static volatile uint nnetdev = 0;
+static uint netdev_hint = 0;
+
+/* The epoll fd of the PIC daemon for the network devices */
+static int net_epollfd = -1;
+
+/* Cores to receive network interrupts */
+static volatile Core* net_rx_core;
+static volatile Core* net_tx_core;
+
+/* used for timeouts */
+static coarse_clock_t net_last_int;
+
+
+static void netdev_init_all()
+{
+	for(uint i=0; i<MAX_NET_DEVICES; i++) {
+		NETDEV[i].fd = -1;
+		NETDEV[i].path = NULL;
+	}
+	nnetdev = 0;
+	netdev_hint = 0;
+	net_rx_core = net_tx_core = &CORE[0];
+	net_last_int = system_clock;
+	net_epollfd = epoll_create1(0);
+	CHECK(net_epollfd);
+}
+
+/* Close a device; the caller holds netdev_mutex or is the PIC at shutdown */
+static void netdev_release(netdev* dev)
+{
+	CHECK(epoll_ctl(net_epollfd, EPOLL_CTL_DEL, dev->fd, NULL));
+	close(dev->fd);
+	if(dev->path) {
+		unlink(dev->path);
+		free(dev->path);
+		dev->path = NULL;
+	}
+	dev->fd = -1;
+	nnetdev--;
+}
+
+static void netdev_destroy_all()
+{
+	for(uint i=0; i<MAX_NET_DEVICES; i++)
+		if(NETDEV[i].fd != -1)
+			netdev_release(&NETDEV[i]);
+	CHECK(close(net_epollfd));
+	net_epollfd = -1;
+}
+
+/* Add an fd to the table and to the epoll set. Returns the device, or -1 */
+static int netdev_add(int fd, const char* path)
+{
+	int id = -1;
+	CHECKRC(pthread_mutex_lock(&netdev_mutex));
+	for(uint i=0; i<MAX_NET_DEVICES; i++) {
+		uint slot = (netdev_hint + i) % MAX_NET_DEVICES;
+		if(NETDEV[slot].fd == -1) {
+			id = slot;
+			break;
+		}
+	}
+	if(id != -1) {
+		netdev* dev = &NETDEV[id];
+		dev->fd = fd;
+		dev->path = path ? strdup(path) : NULL;
+		dev->rx_ready = dev->tx_ready = 1;
+		netdev_hint = id+1;
+		nnetdev++;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.u32 = id;
+		CHECK(epoll_ctl(net_epollfd, EPOLL_CTL_ADD, fd, &ev));
+	}
+	CHECKRC(pthread_mutex_unlock(&netdev_mutex));
+	return id;
+}
+
+static inline int netdev_valid(int id)
+{
+	return id >= 0 && id < MAX_NET_DEVICES && NETDEV[id].fd != -1;
+}
+
+/* Mark the device not-ready; the PIC will raise an interrupt at the next edge */
+static inline void netdev_not_ready(volatile int* flag)
+{
+	if(*flag) {
+		*flag = 0;
+		interrupt_pic_thread();
+	}
+}
+
+/* Helper for PIC_daemon: collect the epoll events */
+static void pic_poll_netdevs(int* raise_rx, int* raise_tx)
+{
+	struct epoll_event evs[64];
+	int n;
+	do {
+		do n = epoll_wait(net_epollfd, evs, 64, 0); while(n==-1 && errno==EINTR);
+		CHECK(n);
+		for(int i=0; i<n; i++) {
+			netdev* dev = &NETDEV[evs[i].data.u32];
+			if(evs[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) {
+				dev->rx_ready = 1;
+				*raise_rx = 1;
+			}
+			if(evs[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) {
+				dev->tx_ready = 1;
+				*raise_tx = 1;
+			}
+		}
+	} while(n == 64);
+}
+
+
 /* Helper for PIC_daemon */
 static void pic_drain_sigusr1(int sigusr1fd)
 {
@@ -499,6 +646,8 @@ static void pic_drain_sigusr1(int sigusr1fd)
 	(a) ALARM, when the per-core timer expires
 	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
 		io_device becomes ready.
+	(c) NET_RX_READY  &  NET_TX_READY, when some netdev
+		becomes ready.
 
  */
 static void PIC_daemon(uint serialno)
@@ -516,6 +665,8 @@ static void PIC_daemon(uint serialno)
 	for(uint i=0; i<nterm; i++)
 		open_terminal(& TERM[i], i);
 
+	netdev_init_all();
+
 	sigset_t saved_mask;
 
 	int sigusr1fd = signalfd(-1, &sigusr1_set, SFD_NONBLOCK);
@@ -546,6 +697,7 @@ static void PIC_daemon(uint serialno)
 
 		fdset_add(&readfds, sigalrmfd, &maxfd);
 		fdset_add(&readfds, sigusr1fd, &maxfd);
+		fdset_add(&readfds, net_epollfd, &maxfd);
 
 		/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
 		struct timeval sleeptime = { .tv_sec=0, .tv_usec = SLOW_HZ };
@@ -606,6 +758,19 @@ static void PIC_daemon(uint serialno)
 				raise_interrupt(core, SERIAL_RX_READY);
 			}
 		}
+
+		/* Handle the network devices */
+		int raise_rx = 0, raise_tx = 0;
+		if( FD_ISSET(net_epollfd, &readfds) )
+			pic_poll_netdevs(&raise_rx, &raise_tx);
+		if(nnetdev > 0 && (system_clock-net_last_int)>SERIAL_TIMEOUT)
+			raise_rx = raise_tx = 1;
+		if(raise_rx || raise_tx)
+			net_last_int = system_clock;
+		if(raise_rx)
+			raise_interrupt((Core*) net_rx_core, NET_RX_READY);
+		if(raise_tx)
+			raise_interrupt((Core*) net_tx_core, NET_TX_READY);
 	}
 
 	/* sync with all cores */
@@ -624,6 +789,9 @@ static void PIC_daemon(uint serialno)
 		close_terminal(& TERM[i]);
 	nterm = 0;
 
+	/* destroy network devices */
+	netdev_destroy_all();
+
 	/* Reset name */
 	CHECKRC(pthread_setname_np(pthread_self(), oldname));
 }
@@ -799,12 +967,18 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 }
 
 
+/*
+	Interrupts are disabled lazily: SIGUSR1 is not blocked, but the handler
+	returns at once while int_disabled is set, leaving the interrupt pending.
+	The pending interrupts are dispatched when interrupts are enabled again.
+	This saves two system calls on each preempt_off/preempt_on pair.
+ */
 void cpu_disable_interrupts()
 {
 	Core* core = curr_core();
 	if(! core->int_disabled) {
-		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 		core->int_disabled = 1;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
 	}
 }
 
@@ -812,9 +986,10 @@ void cpu_enable_interrupts()
 {
 	Core* core = curr_core();
 	if(core->int_disabled) {        
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
 		core->int_disabled = 0;
-		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
-		dispatch_interrupts(curr_core());
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		dispatch_interrupts(core);
 	}
 }
 
@@ -924,3 +1099,124 @@ int bios_write_serial(uint serial, char value)
 }
 
 
+
+/*
+	Network devices
+ */
+
+int bios_net_listen(const char* path)
+{
+	struct sockaddr_un addr;
+	if(path == NULL || strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd == -1) return -1;
+
+	unlink(path);
+	if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1
+		|| listen(fd, SOMAXCONN) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	int id = netdev_add(fd, path);
+	if(id == -1) {
+		close(fd);
+		unlink(path);
+	}
+	return id;
+}
+
+
+int bios_net_accept(int listener)
+{
+	if(! netdev_valid(listener)) return -1;
+	netdev* dev = &NETDEV[listener];
+
+	int fd;
+	while((fd = accept4(dev->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))==-1 && errno==EINTR);
+	if(fd == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			netdev_not_ready(&dev->rx_ready);
+		return -1;
+	}
+
+	int id = netdev_add(fd, NULL);
+	if(id == -1) close(fd);
+	return id;
+}
+
+
+int bios_net_read(int id, char* buf, uint size)
+{
+	if(! netdev_valid(id)) return 0;
+	netdev* dev = &NETDEV[id];
+
+	ssize_t rc;
+	while((rc = recv(dev->fd, buf, size, 0))==-1 && errno==EINTR);
+	if(rc >= 0) return rc;
+	if(errno == EAGAIN || errno == EWOULDBLOCK) {
+		netdev_not_ready(&dev->rx_ready);
+		return -1;
+	}
+	return 0;	/* e.g., connection reset */
+}
+
+
+int bios_net_write(int id, const char* buf, uint size)
+{
+	if(! netdev_valid(id)) return -1;
+	netdev* dev = &NETDEV[id];
+
+	ssize_t rc;
+	while((rc = send(dev->fd, buf, size, MSG_NOSIGNAL))==-1 && errno==EINTR);
+	if(rc >= 0) return rc;
+	if(errno == EAGAIN || errno == EWOULDBLOCK) {
+		netdev_not_ready(&dev->tx_ready);
+		return 0;
+	}
+	return -1;
+}
+
+
+int bios_net_shutdown(int id, int read, int write)
+{
+	if(! netdev_valid(id)) return -1;
+	if(! read && ! write) return 0;
+	int how = (read && write) ? SHUT_RDWR : read ? SHUT_RD : SHUT_WR;
+	return shutdown(NETDEV[id].fd, how) == 0 ? 0 : -1;
+}
+
+
+void bios_net_close(int id)
+{
+	if(! netdev_valid(id)) return;
+	CHECKRC(pthread_mutex_lock(&netdev_mutex));
+	netdev_release(&NETDEV[id]);
+	CHECKRC(pthread_mutex_unlock(&netdev_mutex));
+}
+
+
+int bios_net_ready(int id, Interrupt intno)
+{
+	assert(intno==NET_RX_READY || intno==NET_TX_READY);
+	if(! netdev_valid(id)) return 1;
+	return (intno==NET_RX_READY) ? NETDEV[id].rx_ready : NETDEV[id].tx_ready;
+}
+
+
+void bios_net_interrupt_core(Interrupt intno, uint coreid)
+{
+	assert(intno==NET_RX_READY || intno==NET_TX_READY);
+	assert(coreid < ncores);
+
+	if(intno==NET_RX_READY)
+		net_rx_core = &CORE[coreid];
+	else
+		net_tx_core = &CORE[coreid];
+}
@@ -123,6 +123,10 @@ typedef enum Interrupt
 						   from a serial port */
 	SERIAL_TX_READY,	/**< Raised when a serial port is ready to accept 
 						   data */
+	NET_RX_READY,		/**< Raised when a network device has data, a
+						   pending connection, or has been closed by the host */
+	NET_TX_READY,		/**< Raised when a network device is ready to accept
+						   data */
 
 	maximum_interrupt_no 
 } Interrupt;
@@ -134,6 +138,9 @@ typedef enum Interrupt
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
 
+/** @brief Maximum number of open network devices for a virtual machine. */
+#define MAX_NET_DEVICES 4096
+
 /**
 	@brief Boot a CPU with the given number of cores and boot function.
 
@@ -403,4 +410,99 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/********************************************************************************
+ ********************************************************************************/
+
+/**
+	@brief Open a network listener on a host UNIX-domain socket.
+
+	A stream socket is bound at @c path on the host, replacing any file
+	there, and set to accept connections. Host programs can then connect 
+	to it. The socket is removed from the host file system when the 
+	device is closed, or when the VM shuts down.
+
+	All network devices are non-blocking. When a transfer fails because
+	the device is not ready, a @c NET_RX_READY (or @c NET_TX_READY) interrupt
+	will be raised when it becomes ready. These interrupts are not specific
+	to a device; the driver has to try again on all of its devices.
+
+	@param path the path of the socket on the host
+	@returns a device number, or -1 on error
+	@see bios_net_accept
+ */
+int bios_net_listen(const char* path);
+
+/**
+	@brief Accept a connection on a network listener.
+
+	@param listener a device returned by @c bios_net_listen()
+	@returns the device number of the connection, or -1 if there is no
+		pending connection (or on error)
+ */
+int bios_net_accept(int listener);
+
+/**
+	@brief Read bytes from a network connection.
+
+	@param dev a device returned by @c bios_net_accept()
+	@param buf the buffer to store the bytes
+	@param size the size of @c buf
+	@returns the number of bytes read, 0 if the host closed the connection,
+		or -1 if there is no data.
+ */
+int bios_net_read(int dev, char* buf, uint size);
+
+/**
+	@brief Write bytes to a network connection.
+
+	@param dev a device returned by @c bios_net_accept()
+	@param buf the bytes to write
+	@param size the number of bytes
+	@returns the number of bytes written, 0 if none could be written now,
+		or -1 if the host closed the connection.
+ */
+int bios_net_write(int dev, const char* buf, uint size);
+
+/**
+	@brief Shut down one or both directions of a network connection.
+
+	After the write direction is shut down, the host program reads end of 
+	file, and @c bios_net_write() returns -1. After the read direction
+	is shut down, @c bios_net_read() returns 0.
+
+	@param dev a device returned by @c bios_net_accept()
+	@param read non-zero to shut down reading
+	@param write non-zero to shut down writing
+	@returns 0 on success, or -1 on error
+ */
+int bios_net_shutdown(int dev, int read, int write);
+
+/**
+	@brief Close a network device.
+ */
+void bios_net_close(int dev);
+
+/**
+	@brief Check if a network device may be ready.
+
+	A device is ready for @c NET_RX_READY (@c NET_TX_READY) from the time the
+	interrupt is raised for it, until a transfer fails.
+
+	@param dev the device
+	@param intno @c NET_RX_READY or @c NET_TX_READY
+	@returns non-zero if the device is ready
+ */
+int bios_net_ready(int dev, Interrupt intno);
+
+/**
+	@brief Assign a core to network interrupts.
+
+	By default, all interrupts are sent to core 0.
+
+	@param intno @c NET_RX_READY or @c NET_TX_READY
+	@param core the core
+ */
+void bios_net_interrupt_core(Interrupt intno, uint core);
+
+
 #endif
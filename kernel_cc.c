@@ -108,7 +108,11 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   because the thread was awoken by another kernel routine), 
   it first re-locks the mutex and then returns.  
 
+  If @c other is not NULL, it is a second mutex, which is unlocked
+  together with @c mutex, but is not re-locked.
+
   @param mx The mutex to be unlocked as the thread sleeps.
+  @param other Another mutex to be unlocked as the thread sleeps, or NULL.
   @param cv The condition variable to sleep on.
   @param cause A cause provided to the kernel scheduler.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
@@ -118,7 +122,7 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
+static int cv_wait_releasing(Mutex* mutex, Mutex* other, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
 	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
@@ -135,6 +139,7 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 
 	/* Now atomically release mutex and sleep */
 	Mutex_Unlock(mutex);
+	if(other) Mutex_Unlock(other);
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
@@ -151,6 +156,12 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	return waiter.signalled;
 }
 
+static inline int cv_wait(Mutex* mutex, CondVar* cv, 
+		enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	return cv_wait_releasing(mutex, NULL, cv, cause, timeout);
+}
+
 
 /**
   @internal
@@ -275,15 +286,24 @@ void kernel_unlock()
 	Mutex_Unlock(& kernel_mutex);
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan_name, TimerDuration timeout)
+static int kernel_wait_releasing(Mutex* lock, CondVar* cv, enum SCHED_CAUSE cause, 
+	TimerDuration timeout)
 {
+	/* A killed process does not block any more */
+	if(kernel_killed()) {
+		if(lock) Mutex_Unlock(lock);
+		return 0;
+	}
+
 	/* Atomically release kernel semaphore */
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);	
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+	/* kernel_kick() finds the condition here, under kernel_mutex */
+	CURTHREAD->wait_cv = cv;
+	int ret = cv_wait_releasing(&kernel_mutex, lock, cv, cause, timeout);
+	CURTHREAD->wait_cv = NULL;
 
 	/* Reacquire kernel semaphore */
 	while(kernel_sem<=0)
@@ -294,6 +314,49 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 	return ret;
 }
 
+int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return kernel_wait_releasing(NULL, cv, cause, timeout);
+}
+
+int kernel_timedwait_releasing(Mutex* lock, CondVar* cv, enum SCHED_CAUSE cause, 
+	TimerDuration timeout)
+{
+	return kernel_wait_releasing(lock, cv, cause, timeout);
+}
+
+void kernel_kick(TCB* tcb)
+{
+	/* 
+		The thread holds kernel_mutex until it is on the waitset of its 
+		condition, therefore it cannot miss the broadcast. The condition 
+		cannot go away while the thread is on it.
+	*/
+	Mutex_Lock(& kernel_mutex);
+	if(tcb->wait_cv != NULL)
+		Cond_Broadcast(tcb->wait_cv);
+	Mutex_Unlock(& kernel_mutex);
+}
+
+int kernel_killed()
+{
+	return CURTHREAD != NULL && CURPROC != NULL && CURPROC->killed;
+}
+
+TimerDuration kernel_deadline(timeout_t timeout)
+{
+	if(timeout == (timeout_t)-1) return NO_TIMEOUT;
+	return bios_clock() + timeout*1000ul;
+}
+
+TimerDuration kernel_time_left(TimerDuration deadline)
+{
+	if(deadline == NO_TIMEOUT) return NO_TIMEOUT;
+	TimerDuration now = bios_clock();
+	return (now < deadline) ? deadline - now : 0;
+}
+
 void kernel_signal(CondVar* cv) 
 { 
 	Cond_Signal(cv); 
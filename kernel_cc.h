@@ -59,6 +59,60 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 #define kernel_timedwait(cv, cause, timeout) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
 
+/**
+	@brief Wait on a condition variable using the kernel lock, releasing
+	a spinlock.
+
+	This must be called with the kernel lock and @c lock held. The thread
+	joins the waiters of @c cv before it releases @c lock. Therefore, code 
+	that broadcasts @c cv with @c lock held, such as an interrupt handler 
+	that cannot take the kernel lock, cannot be missed.
+
+	On return, the kernel lock is held again, but @c lock is not.
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_timedwait_releasing(Mutex* lock, CondVar* cv, enum SCHED_CAUSE cause, 
+	TimerDuration timeout);
+
+/**
+	@brief Wake up a thread from @c kernel_wait().
+
+	If the thread is blocked in @c kernel_wait(), its condition is broadcast,
+	and the thread returns from the wait. Other waiters on the same condition 
+	wake up too, and must check their condition again, as always.
+	This must be called with the kernel lock held.
+  */
+void kernel_kick(TCB* tcb);
+
+/**
+	@brief Check if the process of the current thread has been killed.
+
+	A killed process exits at the next system call boundary. Therefore,
+	a system call that blocks in a loop must give up and return when this 
+	is set. For a killed process, @c kernel_wait() returns at once.
+	@see Kill
+  */
+int kernel_killed();
+
+/**
+	@brief Return the deadline of a timeout given to a system call.
+
+	@param timeout the timeout in milliseconds, or @c (timeout_t)-1 for none
+	@returns the time of @c bios_clock() when the timeout expires, or
+		@c NO_TIMEOUT
+  */
+TimerDuration kernel_deadline(timeout_t timeout);
+
+/**
+	@brief Return the time left until a deadline.
+
+	This is meant to be passed to @c kernel_timedwait(), in a loop that 
+	waits for a condition until a deadline.
+	@returns the time left, 0 if the deadline has passed, or @c NO_TIMEOUT
+		if there is no deadline
+  */
+TimerDuration kernel_time_left(TimerDuration deadline);
+
 /**
 	@brief Signal a kernel condition to one waiter.
 
@@ -0,0 +1,326 @@
+#include <string.h>
+
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_mem.h"
+
+/*
+	Fan-out channels.
+
+	A channel has one publisher stream and any number of subscriber streams.
+	Each message written to the publisher is stored once, and every
+	subscriber reads it at its own pace.
+
+	Messages are numbered. The channel keeps the last `capacity` messages
+	in a cyclic array of slots, message `seq` in slot `seq % capacity`.
+	A subscriber keeps the number of the next message it will read. A
+	subscriber that falls more than `capacity` messages behind loses the
+	oldest ones, which are overwritten by the publisher, and skips ahead.
+	Therefore, the publisher never blocks, and the memory held by a
+	channel is bounded.
+
+	A message counts the subscribers that have not read it yet. It is
+	freed when the last of them reads it (or closes), or when it is
+	overwritten.
+
+	Channels are only accessed by system calls, under the kernel lock.
+*/
+
+typedef struct channel_message {
+	unsigned int refcount;		/* Subscribers that have not read it */
+	unsigned int size;
+	char data[];
+} channel_msg;
+
+typedef struct channel_control_block {
+	FCB* publisher;				/* NULL when closed */
+	rlnode subscribers;			/* List of subscriber_cb */
+	unsigned int nsubscribers;
+	unsigned int refcount;		/* Publisher and subscribers */
+
+	channel_msg** slots;		/* The last `capacity` messages */
+	unsigned int capacity;
+	unsigned long head;			/* Number of the next message published */
+	unsigned int retained;		/* Messages in slots */
+	CondVar has_data;			/* Signalled when a message is published */
+} channel_cb;
+
+typedef struct subscriber_control_block {
+	channel_cb* chan;
+	FCB* fcb;
+	rlnode node;				/* Node for chan->subscribers */
+	unsigned long next;			/* Number of the next message to read */
+	unsigned long received, missed;
+} subscriber_cb;
+
+static void channel_cb_ctor(void* obj){
+	channel_cb* chan = (channel_cb*) obj;
+	rlnode_new(&chan->subscribers);
+	chan->has_data = COND_INIT;
+}
+
+static void subscriber_cb_ctor(void* obj){
+	subscriber_cb* sub = (subscriber_cb*) obj;
+	rlnode_init(&sub->node, sub);
+}
+
+static kmem_cache channel_cache = KMEM_CACHE_INIT("channel", channel_cb, channel_cb_ctor);
+static kmem_cache subscriber_cache = KMEM_CACHE_INIT("channel_sub", subscriber_cb, subscriber_cb_ctor);
+
+
+/* Free the message in a slot */
+static void channel_drop(channel_cb* chan, unsigned long seq){
+	channel_msg** slot = &chan->slots[seq % chan->capacity];
+	if(*slot == NULL) return;
+	free(*slot);
+	*slot = NULL;
+	chan->retained--;
+}
+
+/* A subscriber is done with a message */
+static void channel_msg_decref(channel_cb* chan, unsigned long seq){
+	channel_msg* msg = chan->slots[seq % chan->capacity];
+	if(msg != NULL && --msg->refcount == 0)
+		channel_drop(chan, seq);
+}
+
+/* The oldest message that is still kept */
+static unsigned long channel_tail(channel_cb* chan){
+	return (chan->head > chan->capacity) ? chan->head - chan->capacity : 0;
+}
+
+static void channel_decref(channel_cb* chan){
+	if(--chan->refcount > 0) return;
+
+	for(unsigned long seq = channel_tail(chan); seq < chan->head; seq++)
+		channel_drop(chan, seq);
+	free(chan->slots);
+	kmem_free(&channel_cache, chan);
+}
+
+
+/*******************************************
+ *
+ * The publisher
+ *
+ *******************************************/
+
+static int channel_publish(void* this, const char* buf, unsigned int size){
+	channel_cb* chan = (channel_cb*) this;
+
+	if(size > MAX_PACKET_SIZE) return -1;
+	if(size == 0) return 0;
+
+	/* The oldest message is overwritten; subscribers that did not read it will miss it */
+	unsigned long seq = chan->head;
+	channel_drop(chan, seq);
+
+	if(chan->nsubscribers > 0) {
+		channel_msg* msg = (channel_msg*) xmalloc(sizeof(channel_msg) + size);
+		msg->refcount = chan->nsubscribers;
+		msg->size = size;
+		memcpy(msg->data, buf, size);
+		chan->slots[seq % chan->capacity] = msg;
+		chan->retained++;
+	}
+	chan->head++;
+
+	kernel_broadcast(&chan->has_data);
+
+	/* Only the subscribers that had read everything become readable */
+	for(rlnode* p = chan->subscribers.next; p != &chan->subscribers; p = p->next) {
+		subscriber_cb* sub = p->obj;
+		if(sub->next == seq)
+			event_notify(sub->fcb, EVENT_READ);
+	}
+	return size;
+}
+
+static int channel_publisher_close(void* this){
+	channel_cb* chan = (channel_cb*) this;
+	chan->publisher = NULL;
+
+	/* The subscribers will see EOF */
+	kernel_broadcast(&chan->has_data);
+	for(rlnode* p = chan->subscribers.next; p != &chan->subscribers; p = p->next) {
+		subscriber_cb* sub = p->obj;
+		event_notify(sub->fcb, EVENT_READ);
+	}
+
+	channel_decref(chan);
+	return 0;
+}
+
+static void* invalid_channel_open(uint minor){
+	return NULL;
+}
+
+static int invalid_channel_read(void* this, char* buf, unsigned int size){
+	return -1;
+}
+
+static int invalid_channel_write(void* this, const char* buf, unsigned int size){
+	return -1;
+}
+
+static file_ops publisher_file_ops = {
+	.Open = invalid_channel_open,
+	.Read = invalid_channel_read,
+	.Write = channel_publish,
+	.Close = channel_publisher_close
+};
+
+
+/*******************************************
+ *
+ * The subscribers
+ *
+ *******************************************/
+
+static int channel_receive(void* this, char* buf, unsigned int size){
+	subscriber_cb* sub = (subscriber_cb*) this;
+	channel_cb* chan = sub->chan;
+
+	while(sub->next == chan->head && chan->publisher != NULL && ! kernel_killed())
+		kernel_wait(&chan->has_data, SCHED_PIPE);
+	if(sub->next == chan->head) return 0;
+
+	/* Skip the messages that were overwritten */
+	unsigned long tail = channel_tail(chan);
+	if(sub->next < tail) {
+		sub->missed += tail - sub->next;
+		sub->next = tail;
+	}
+
+	channel_msg* msg = chan->slots[sub->next % chan->capacity];
+	unsigned int count = msg->size < size ? msg->size : size;
+	memcpy(buf, msg->data, count);		/* truncate */
+
+	channel_msg_decref(chan, sub->next);
+	sub->next++;
+	sub->received++;
+	return count;
+}
+
+static int channel_subscriber_close(void* this){
+	subscriber_cb* sub = (subscriber_cb*) this;
+	channel_cb* chan = sub->chan;
+
+	/* Give up the messages not read yet */
+	unsigned long tail = channel_tail(chan);
+	for(unsigned long seq = (sub->next > tail ? sub->next : tail); seq < chan->head; seq++)
+		channel_msg_decref(chan, seq);
+
+	rlist_remove(&sub->node);
+	chan->nsubscribers--;
+	kmem_free(&subscriber_cache, sub);
+
+	channel_decref(chan);
+	return 0;
+}
+
+static int channel_subscriber_poll(void* this){
+	subscriber_cb* sub = (subscriber_cb*) this;
+	channel_cb* chan = sub->chan;
+	return (sub->next != chan->head || chan->publisher == NULL) ? EVENT_READ : 0;
+}
+
+static file_ops subscriber_file_ops = {
+	.Open = invalid_channel_open,
+	.Read = channel_receive,
+	.Write = invalid_channel_write,
+	.Close = channel_subscriber_close,
+	.Poll = channel_subscriber_poll
+};
+
+
+/*******************************************
+ *
+ * System calls
+ *
+ *******************************************/
+
+/* Return the channel of a publisher or subscriber stream, or NULL */
+static channel_cb* get_channel(FCB* fcb){
+	if(fcb == NULL) return NULL;
+	if(fcb->streamfunc == &publisher_file_ops)
+		return fcb->streamobj;
+	if(fcb->streamfunc == &subscriber_file_ops)
+		return ((subscriber_cb*) fcb->streamobj)->chan;
+	return NULL;
+}
+
+Fid_t sys_Channel(unsigned int max_lag){
+	Fid_t fid;
+	FCB* fcb;
+
+	if(max_lag == 0)
+		max_lag = CHANNEL_DEFAULT_LAG;
+	if(max_lag > MAX_CHANNEL_LAG)
+		return NOFILE;
+
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	channel_cb* chan = (channel_cb*) kmem_alloc(&channel_cache);
+	chan->publisher = fcb;
+	chan->nsubscribers = 0;
+	chan->refcount = 1;
+	chan->capacity = max_lag;
+	chan->slots = (channel_msg**) xmalloc(max_lag * sizeof(channel_msg*));
+	memset(chan->slots, 0, max_lag * sizeof(channel_msg*));
+	chan->head = 0;
+	chan->retained = 0;
+
+	fcb->streamobj = chan;
+	fcb->streamfunc = &publisher_file_ops;
+	return fid;
+}
+
+Fid_t sys_Subscribe(Fid_t chanfid){
+	channel_cb* chan = get_channel(get_fcb(chanfid));
+	if(chan == NULL || chan->publisher == NULL)
+		return NOFILE;
+
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	/* Start from the next message to be published */
+	subscriber_cb* sub = (subscriber_cb*) kmem_alloc(&subscriber_cache);
+	sub->chan = chan;
+	sub->fcb = fcb;
+	sub->next = chan->head;
+	sub->received = sub->missed = 0;
+	rlist_push_back(&chan->subscribers, &sub->node);
+	chan->nsubscribers++;
+	chan->refcount++;
+
+	fcb->streamobj = sub;
+	fcb->streamfunc = &subscriber_file_ops;
+	return fid;
+}
+
+int sys_GetChannelStats(Fid_t fid, channel_stats* stats){
+	FCB* fcb = get_fcb(fid);
+	channel_cb* chan = get_channel(fcb);
+	if(chan == NULL || stats == NULL)
+		return -1;
+
+	memset(stats, 0, sizeof(channel_stats));
+	stats->subscribers = chan->nsubscribers;
+	stats->published = chan->head;
+	stats->retained = chan->retained;
+
+	if(fcb->streamfunc == &subscriber_file_ops) {
+		subscriber_cb* sub = fcb->streamobj;
+		unsigned long tail = channel_tail(chan);
+		unsigned long next = sub->next > tail ? sub->next : tail;
+		stats->pending = chan->head - next;
+		stats->received = sub->received;
+		stats->missed = sub->missed + (next - sub->next);
+	}
+	return 0;
+}
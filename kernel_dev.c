@@ -70,6 +70,7 @@ typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  rlnode watchers;
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -91,6 +92,7 @@ void serial_rx_handler()
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
     Cond_Broadcast(&dcb->rx_ready);
+    event_notify_list(&dcb->watchers, EVENT_READ);
   }
   if(pre) preempt_on;
 }
@@ -112,7 +114,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
     if (valid) {
       count++;
     }
-    else if(count==0) {
+    else if(count==0 && ! kernel_killed()) {
       kernel_wait(&dcb->rx_ready, SCHED_IO);
     }
     else
@@ -211,10 +213,13 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    rlnode_init(&serial_dcb[i].watchers, NULL);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
   cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+
+  initialize_net();
 }
 
 
@@ -233,4 +238,11 @@ uint device_no(Device_type major)
   return devtable[major].devnum;
 }
 
+rlnode* device_watchers(Device_type major, uint minor)
+{
+  if(major == DEV_SERIAL)
+    return & serial_dcb[minor].watchers;
+  return NULL;
+}
+
 
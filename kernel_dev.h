@@ -92,6 +92,15 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Poll operation.
+
+      Return the events (@c EVENT_READ, @c EVENT_WRITE) that hold now, i.e.,
+      whether a Read or a Write would not block. This is used to report the
+      state of a stream when it is registered on an event queue. It may be
+      NULL, for streams that raise no events.
+     */
+    int (*Poll)(void* this);
 } file_ops;
 
 
@@ -156,6 +165,32 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
   */
 uint device_no(Device_type major);
 
+/**
+  @brief Get the event queue registration list of a device.
+
+  Devices whose readiness changes in interrupt handlers keep the
+  event queue registrations of all their streams in a single list.
+  This returns that list, or NULL if the device does not have one.
+  */
+rlnode* device_watchers(Device_type major, uint minor);
+
+/**
+  @brief Initialization for the network device driver.
+
+  This is called by @ref initialize_devices.
+  @see NetListen
+  */
+void initialize_net();
+
+/**
+  @brief Shut down a direction of a host connection.
+
+  This implements @c ShutDown() for the streams returned by @c NetAccept().
+  @returns 0 on success, or -1 if @c fid is not a host connection
+  @see ShutDown
+  */
+int net_shutdown(Fid_t fid, shutdown_mode how);
+
 /** @} */
 
 #endif
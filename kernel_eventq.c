@@ -0,0 +1,359 @@
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_mem.h"
+
+/*
+	Event queues.
+
+	A registration (event_watch) links a watched stream to a queue. It is
+	kept on three lists:
+	- the registration list of the stream (fcb->event_list),
+	- the list of all registrations of its queue,
+	- the ready list of its queue, while it has pending events.
+
+	Streams report readiness transitions by event_notify(), which appends the
+	matching registrations to the ready lists. Therefore, WaitEvents only
+	touches the registrations that are actually ready.
+
+	All the lists are protected by event_spinlock, which is taken with
+	preemption off, because the serial driver reports events from its
+	interrupt handler. WaitEvents sleeps releasing event_spinlock, and
+	watch_raise broadcasts while holding it, so no wakeup is lost.
+*/
+
+typedef struct event_queue {
+	FCB* fcb;				/* The queue's own stream */
+	rlnode watches;			/* All registrations on this queue */
+	rlnode ready;			/* Registrations with pending events */
+	CondVar has_events;		/* Signalled when a registration becomes ready */
+} event_queue;
+
+typedef struct event_watch {
+	event_queue* evq;		/* The queue */
+	FCB* fcb;				/* The watched stream */
+	Fid_t fid;				/* The fid reported to the user */
+	int events;				/* Interest set */
+	int pending;			/* Events raised and not yet reported */
+	rlnode fcb_node;		/* Node for fcb->event_list */
+	rlnode evq_node;		/* Node for evq->watches */
+	rlnode ready_node;		/* Node for evq->ready */
+} event_watch;
+
+static Mutex event_spinlock = MUTEX_INIT;
+
+static void event_queue_ctor(void* obj)
+{
+	event_queue* evq = (event_queue*) obj;
+	rlnode_init(&evq->watches, NULL);
+	rlnode_init(&evq->ready, NULL);
+	evq->has_events = COND_INIT;
+}
+
+static void event_watch_ctor(void* obj)
+{
+	event_watch* watch = (event_watch*) obj;
+	rlnode_init(&watch->fcb_node, watch);
+	rlnode_init(&watch->evq_node, watch);
+	rlnode_init(&watch->ready_node, watch);
+}
+
+static kmem_cache event_queue_cache = KMEM_CACHE_INIT("event_queue", event_queue, event_queue_ctor);
+static kmem_cache event_watch_cache = KMEM_CACHE_INIT("event_watch", event_watch, event_watch_ctor);
+
+/*******************************************
+ *
+ * Registrations
+ *
+ *******************************************/
+
+/*
+	Mark events on a registration.
+
+	*** MUST BE CALLED WITH event_spinlock HELD ***
+*/
+static void watch_raise(event_watch* watch, int events)
+{
+	int raised = watch->events & events;
+	if(raised == 0) return;
+
+	if(watch->pending == 0)
+		rlist_push_back(&watch->evq->ready, &watch->ready_node);
+	watch->pending |= raised;
+	Cond_Broadcast(&watch->evq->has_events);
+}
+
+/*
+	Unlink and free a registration.
+
+	*** MUST BE CALLED WITH event_spinlock HELD ***
+*/
+static void watch_destroy(event_watch* watch)
+{
+	rlist_remove(&watch->fcb_node);
+	rlist_remove(&watch->evq_node);
+	if(watch->pending)
+		rlist_remove(&watch->ready_node);
+	kmem_free(&event_watch_cache, watch);
+}
+
+/*
+	Find the registration of a stream on a queue.
+
+	*** MUST BE CALLED WITH event_spinlock HELD ***
+*/
+static event_watch* watch_find(event_queue* evq, FCB* fcb)
+{
+	rlnode* list = fcb->event_list;
+	for(rlnode* n = list->next; n != list; n = n->next) {
+		event_watch* watch = n->obj;
+		if(watch->evq == evq && watch->fcb == fcb)
+			return watch;
+	}
+	return NULL;
+}
+
+static event_watch* watch_create(event_queue* evq, FCB* fcb, Fid_t fid, int events)
+{
+	event_watch* watch = (event_watch*) kmem_alloc(&event_watch_cache);
+	watch->evq = evq;
+	watch->fcb = fcb;
+	watch->fid = fid;
+	watch->events = events;
+	watch->pending = 0;
+	return watch;
+}
+
+
+void event_notify_list(rlnode* watchers, int events)
+{
+	if(is_rlist_empty(watchers)) return;
+
+	int pre = preempt_off;
+	Mutex_Lock(&event_spinlock);
+
+	for(rlnode* n = watchers->next; n != watchers; n = n->next)
+		watch_raise(n->obj, events);
+
+	Mutex_Unlock(&event_spinlock);
+	if(pre) preempt_on;
+}
+
+void event_notify(FCB* fcb, int events)
+{
+	if(fcb != NULL)
+		event_notify_list(fcb->event_list, events);
+}
+
+void event_release_fcb(FCB* fcb)
+{
+	rlnode* list = fcb->event_list;
+	if(is_rlist_empty(list)) return;
+
+	int pre = preempt_off;
+	Mutex_Lock(&event_spinlock);
+
+	rlnode* n = list->next;
+	while(n != list) {
+		event_watch* watch = n->obj;
+		n = n->next;
+		if(watch->fcb == fcb)
+			watch_destroy(watch);
+	}
+
+	Mutex_Unlock(&event_spinlock);
+	if(pre) preempt_on;
+}
+
+/*******************************************
+ *
+ * Read/Write/Close
+ *
+ *******************************************/
+
+void* invalid_event_queue_open(uint minor){
+	return NULL;
+}
+
+int invalid_event_queue_read(void* this, char* buf, unsigned int size){
+	return -1;
+}
+
+int invalid_event_queue_write(void* this, const char* buf, unsigned int size){
+	return -1;
+}
+
+int event_queue_close(void* this){
+	event_queue* evq = (event_queue*) this;
+
+	int pre = preempt_off;
+	Mutex_Lock(&event_spinlock);
+	while(! is_rlist_empty(&evq->watches))
+		watch_destroy(evq->watches.next->obj);
+	Mutex_Unlock(&event_spinlock);
+	if(pre) preempt_on;
+
+	kmem_free(&event_queue_cache, evq);
+	return 0;
+}
+
+static file_ops event_queue_file_ops = {
+	.Open = invalid_event_queue_open,
+	.Read = invalid_event_queue_read,
+	.Write = invalid_event_queue_write,
+	.Close = event_queue_close
+};
+
+/*******************************************
+ *
+ * sys_EventQueue
+ *
+ *******************************************/
+
+Fid_t sys_EventQueue(){
+	Fid_t fid;
+	FCB* fcb;
+
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	event_queue* evq = (event_queue*) kmem_alloc(&event_queue_cache);
+	evq->fcb = fcb;
+
+	fcb->streamobj = evq;
+	fcb->streamfunc = &event_queue_file_ops;
+
+	return fid;
+}
+
+/*******************************************
+ *
+ * sys_EventCtl
+ *
+ *******************************************/
+
+static event_queue* get_event_queue(Fid_t fid){
+	FCB* fcb = get_fcb(fid);
+	return (fcb == NULL || fcb->streamfunc != &event_queue_file_ops) ? NULL : fcb->streamobj;
+}
+
+int sys_EventCtl(Fid_t evqfid, Fid_t fid, int events){
+	event_queue* evq = get_event_queue(evqfid);
+	FCB* fcb = get_fcb(fid);
+
+	if(evq == NULL || fcb == NULL || fcb->streamfunc == &event_queue_file_ops
+		|| (events & ~(EVENT_READ|EVENT_WRITE)) != 0)
+		return -1;
+
+	/* Allocate outside the spinlock, we may not need it */
+	event_watch* newwatch = (events != 0) ? watch_create(evq, fcb, fid, events) : NULL;
+	int retval = 0;
+
+	int pre = preempt_off;
+	Mutex_Lock(&event_spinlock);
+
+	event_watch* watch = watch_find(evq, fcb);
+	if(events == 0) {
+		if(watch == NULL)
+			retval = -1;
+		else
+			watch_destroy(watch);
+		watch = NULL;
+	}
+	else if(watch != NULL) {
+		/* Modify the registration, dropping pending events that are no longer wanted */
+		watch->fid = fid;
+		watch->events = events;
+		if(watch->pending && (watch->pending & events) == 0)
+			rlist_remove(&watch->ready_node);
+		watch->pending &= events;
+	}
+	else {
+		rlist_push_back(fcb->event_list, &newwatch->fcb_node);
+		rlist_push_back(&evq->watches, &newwatch->evq_node);
+		watch = newwatch;
+		newwatch = NULL;
+	}
+
+	Mutex_Unlock(&event_spinlock);
+	if(pre) preempt_on;
+
+	if(newwatch != NULL)
+		kmem_free(&event_watch_cache, newwatch);
+
+	/* 
+		Report the events that already hold. The stream is polled after the 
+		registration, so a transition in between is reported at least once.
+		The registration cannot go away, since we hold the kernel lock.
+	 */
+	if(watch != NULL && fcb->streamfunc->Poll != NULL) {
+		int ready = fcb->streamfunc->Poll(fcb->streamobj);
+		if(ready) {
+			pre = preempt_off;
+			Mutex_Lock(&event_spinlock);
+			watch_raise(watch, ready);
+			Mutex_Unlock(&event_spinlock);
+			if(pre) preempt_on;
+		}
+	}
+	return retval;
+}
+
+/*******************************************
+ *
+ * sys_WaitEvents
+ *
+ *******************************************/
+
+/*
+	Move up to n pending events from the ready list to the user array.
+
+	*** MUST BE CALLED WITH event_spinlock HELD ***
+ */
+static int collect_events(event_queue* evq, event_t* events, unsigned int n){
+	unsigned int count = 0;
+
+	while(count < n && ! is_rlist_empty(&evq->ready)) {
+		event_watch* watch = rlist_pop_front(&evq->ready)->obj;
+		events[count].fid = watch->fid;
+		events[count].events = watch->pending;
+		watch->pending = 0;
+		count++;
+	}
+
+	return count;
+}
+
+int sys_WaitEvents(Fid_t evqfid, event_t* events, unsigned int n, timeout_t timeout){
+	event_queue* evq = get_event_queue(evqfid);
+
+	if(evq == NULL || events == NULL || n == 0)
+		return -1;
+
+	TimerDuration deadline = kernel_deadline(timeout);
+
+	/* make sure that the queue will not be closed (by another thread)
+	   while we are waiting on it! */
+	FCB* fcb = evq->fcb;
+	FCB_incref(fcb);
+
+	/* 
+		Events are raised from interrupt handlers, without the kernel lock.
+		We check the ready list and join the waiters of has_events under
+		event_spinlock, so that no event raised in between is missed.
+	 */
+	int count;
+	int pre = preempt_off;
+	Mutex_Lock(&event_spinlock);
+	while((count = collect_events(evq, events, n)) == 0) {
+		TimerDuration t = kernel_time_left(deadline);
+		if(t == 0 || kernel_killed()) break;
+		kernel_timedwait_releasing(&event_spinlock, &evq->has_events, SCHED_IO, t);
+		Mutex_Lock(&event_spinlock);
+	}
+	Mutex_Unlock(&event_spinlock);
+	if(pre) preempt_on;
+
+	FCB_decref(fcb);
+	return count;
+}
@@ -37,7 +37,6 @@ void boot_tinyos_kernel()
     /* Initialize the kenrel data structures */
     initialize_processes();
     initialize_devices();
-    initialize_files();
     initialize_scheduler();
 
     /* The boot task is executed normally! */
@@ -0,0 +1,214 @@
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_mem.h"
+#include "kernel_proc.h"
+#include "kernel_sys.h"
+
+/*
+	Asynchronous I/O rings.
+
+	The rings are shared by the kernel and the user code of the process.
+	The process writes sq_tail and cq_head, and the kernel writes sq_head
+	and cq_tail, so the process submits and reaps without system calls.
+
+	The entries are executed by the workers of the ring, which are detached
+	threads of the process that run in the kernel, under the kernel lock.
+	A worker takes entries one after the other, and executes each one with
+	the code of its system call. When an operation blocks, the kernel lock
+	is released, and an idle worker takes the next entry.
+
+	A worker takes an entry only if the completion ring will have room for
+	its result, so posting a completion never blocks.
+
+	The workers are counted in the io_workers of the process. When they
+	are the only threads left, the process is stopped, so they exit.
+	The ring is freed when its stream is closed, all its workers have
+	exited, and no thread waits in IoRingEnter.
+*/
+
+typedef struct io_ring_control_block {
+	io_ring ring;
+	FCB* fcb;					/* NULL when closed */
+	unsigned int refcount;		/* The stream, the workers and the waiters */
+	unsigned int idle;			/* Workers waiting for entries */
+	unsigned int waiters;		/* Threads waiting for completions */
+	CondVar has_work;			/* Signalled when entries are submitted */
+	CondVar has_completion;		/* Signalled when a completion is posted */
+} io_ring_cb;
+
+static void io_ring_cb_ctor(void* obj){
+	io_ring_cb* r = (io_ring_cb*) obj;
+	r->has_work = COND_INIT;
+	r->has_completion = COND_INIT;
+}
+
+static kmem_cache io_ring_cache = KMEM_CACHE_INIT("io_ring", io_ring_cb, io_ring_cb_ctor);
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+static void io_ring_decref(io_ring_cb* r){
+	if(--r->refcount == 0)
+		kmem_free(&io_ring_cache, r);
+}
+
+/* Return 1 if an entry can be taken */
+static int io_ring_has_work(io_ring_cb* r){
+	io_ring* ring = &r->ring;
+	unsigned int head = ring->sq_head;
+	return head != LOAD(ring->sq_tail)
+		&& head - LOAD(ring->cq_head) < IO_RING_ENTRIES;
+}
+
+static void io_take(io_ring_cb* r, io_sqe* sqe){
+	io_ring* ring = &r->ring;
+	unsigned int head = ring->sq_head;
+	*sqe = ring->sq[head & (IO_RING_ENTRIES-1)];
+	STORE(ring->sq_head, head + 1);
+}
+
+static void io_complete(io_ring_cb* r, uintptr_t user_data, int result){
+	io_ring* ring = &r->ring;
+	unsigned int tail = ring->cq_tail;
+	io_cqe* cqe = &ring->cq[tail & (IO_RING_ENTRIES-1)];
+	cqe->user_data = user_data;
+	cqe->result = result;
+	STORE(ring->cq_tail, tail + 1);
+
+	if(r->waiters > 0)
+		kernel_broadcast(&r->has_completion);
+}
+
+static int io_execute(io_sqe* sqe){
+	switch(sqe->opcode) {
+	case IO_NOP:
+		return 0;
+	case IO_READ:
+		return sys_Read(sqe->fid, sqe->buf, sqe->size);
+	case IO_WRITE:
+		return sys_Write(sqe->fid, sqe->buf, sqe->size);
+	case IO_ACCEPT:
+		return sys_Accept(sqe->fid);
+	case IO_CONNECT:
+		return sys_Connect(sqe->fid, sqe->port, sqe->timeout);
+	default:
+		return -1;
+	}
+}
+
+static int io_worker(int argl, void* args){
+	io_ring_cb* r = (io_ring_cb*) args;
+
+	kernel_lock();
+	while(r->fcb != NULL && ! kernel_killed()) {
+		if(! io_ring_has_work(r)) {
+			r->idle++;
+			kernel_wait(&r->has_work, SCHED_IO);
+			r->idle--;
+			continue;
+		}
+
+		io_sqe sqe;
+		io_take(r, &sqe);
+		int result = io_execute(&sqe);
+		io_complete(r, sqe.user_data, result);
+	}
+	CURPROC->io_workers--;
+	io_ring_decref(r);
+	kernel_unlock();
+	return 0;
+}
+
+
+static void* invalid_io_ring_open(uint minor){
+	return NULL;
+}
+
+static int invalid_io_ring_read(void* this, char* buf, unsigned int size){
+	return -1;
+}
+
+static int invalid_io_ring_write(void* this, const char* buf, unsigned int size){
+	return -1;
+}
+
+static int io_ring_close(void* this){
+	io_ring_cb* r = (io_ring_cb*) this;
+	r->fcb = NULL;
+	kernel_broadcast(&r->has_work);
+	kernel_broadcast(&r->has_completion);
+	io_ring_decref(r);
+	return 0;
+}
+
+static file_ops io_ring_file_ops = {
+	.Open = invalid_io_ring_open,
+	.Read = invalid_io_ring_read,
+	.Write = invalid_io_ring_write,
+	.Close = io_ring_close
+};
+
+
+Fid_t sys_IoRing(unsigned int workers, io_ring** ring){
+	Fid_t fid;
+	FCB* fcb;
+
+	if(workers == 0) workers = 1;
+	if(ring == NULL || workers > IO_RING_MAX_WORKERS)
+		return NOFILE;
+
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	io_ring_cb* r = (io_ring_cb*) kmem_alloc(&io_ring_cache);
+	r->ring.sq_head = r->ring.sq_tail = 0;
+	r->ring.cq_head = r->ring.cq_tail = 0;
+	r->fcb = fcb;
+	r->refcount = 1;
+	r->idle = r->waiters = 0;
+
+	for(unsigned int i = 0; i < workers; i++) {
+		Tid_t tid = sys_CreateThread(io_worker, 0, r);
+		if(tid == NOTHREAD) {
+			/* The workers that were created exit when they see the ring closed */
+			FCB_unreserve(1, &fid, &fcb);
+			io_ring_close(r);
+			return NOFILE;
+		}
+		sys_ThreadDetach(tid);
+		CURPROC->io_workers++;
+		r->refcount++;
+	}
+
+	fcb->streamobj = r;
+	fcb->streamfunc = &io_ring_file_ops;
+	*ring = &r->ring;
+	return fid;
+}
+
+
+int sys_IoRingEnter(Fid_t fid, unsigned int min_complete, timeout_t timeout){
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL || fcb->streamfunc != &io_ring_file_ops || min_complete > IO_RING_ENTRIES)
+		return -1;
+	io_ring_cb* r = fcb->streamobj;
+	io_ring* ring = &r->ring;
+
+	if(r->idle > 0 && io_ring_has_work(r))
+		kernel_broadcast(&r->has_work);
+
+	/* The ring may be closed (by another thread) while we are waiting on it */
+	r->refcount++;
+	TimerDuration deadline = kernel_deadline(timeout);
+	while(r->fcb != NULL && LOAD(ring->cq_tail) - LOAD(ring->cq_head) < min_complete) {
+		TimerDuration left = kernel_time_left(deadline);
+		if(left == 0 || kernel_killed()) break;
+		r->waiters++;
+		kernel_timedwait(&r->has_completion, SCHED_IO, left);
+		r->waiters--;
+	}
+	int ready = LOAD(ring->cq_tail) - LOAD(ring->cq_head);
+	io_ring_decref(r);
+	return ready;
+}
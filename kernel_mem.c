@@ -0,0 +1,223 @@
+#include <string.h>
+#include "tinyos.h"
+#include "kernel_mem.h"
+#include "kernel_sched.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+
+/*
+	Object caches.
+
+	Every object is preceded by a kmem_bufctl header, which links it on the
+	shared free list of its cache while it is free. The header is kept apart
+	from the object, so that linking does not disturb the constructed state.
+
+	The magazine of a core is only accessed by that core, with preemption off.
+	The shared free list and the slab counters are protected by the cache
+	spinlock.
+*/
+
+#define KMEM_ALIGN 16
+#define KMEM_ROUND(n) (((n) + KMEM_ALIGN - 1) & ~((size_t)KMEM_ALIGN - 1))
+#define KMEM_HEADER KMEM_ROUND(sizeof(kmem_bufctl))
+
+#define BUF_TO_OBJ(buf) ((void*)((char*)(buf) + KMEM_HEADER))
+#define OBJ_TO_BUF(obj) ((kmem_bufctl*)((char*)(obj) - KMEM_HEADER))
+
+/* The list of caches that have been used, for statistics */
+static rlnode cache_list = { .prev = &cache_list, .next = &cache_list };
+static Mutex cache_list_lock = MUTEX_INIT;
+
+
+/*
+	Allocate a new slab and add its objects to the free list.
+
+	*** MUST BE CALLED WITH cache->lock HELD ***
+*/
+static void kmem_grow(kmem_cache* cache)
+{
+	size_t bufsize = KMEM_HEADER + KMEM_ROUND(cache->size);
+	size_t nobj = KMEM_SLAB_SIZE / bufsize;
+	if(nobj < 1) nobj = 1;
+
+	char* slab = (char*) xmalloc(nobj * bufsize);
+	for(size_t i = 0; i < nobj; i++) {
+		kmem_bufctl* buf = (kmem_bufctl*) (slab + i*bufsize);
+		if(cache->ctor)
+			cache->ctor(BUF_TO_OBJ(buf));
+		buf->next = cache->freelist;
+		cache->freelist = buf;
+	}
+
+	cache->slabs++;
+	cache->objects += nobj;
+
+	if(! cache->registered) {
+		cache->registered = 1;
+		Mutex_Lock(&cache_list_lock);
+		rlist_push_back(&cache_list, rlnode_init(&cache->cache_node, cache));
+		Mutex_Unlock(&cache_list_lock);
+	}
+}
+
+
+/* Move half a magazine from the free list into an empty magazine. */
+static void kmem_refill(kmem_cache* cache, kmem_magazine* mag)
+{
+	Mutex_Lock(&cache->lock);
+	while(mag->rounds < KMEM_MAGAZINE_SIZE/2) {
+		if(cache->freelist == NULL)
+			kmem_grow(cache);
+		kmem_bufctl* buf = cache->freelist;
+		cache->freelist = buf->next;
+		mag->obj[mag->rounds++] = BUF_TO_OBJ(buf);
+	}
+	Mutex_Unlock(&cache->lock);
+	mag->refills++;
+}
+
+
+/* Move half of a full magazine to the free list. */
+static void kmem_flush(kmem_cache* cache, kmem_magazine* mag)
+{
+	Mutex_Lock(&cache->lock);
+	while(mag->rounds > KMEM_MAGAZINE_SIZE/2) {
+		kmem_bufctl* buf = OBJ_TO_BUF(mag->obj[--mag->rounds]);
+		buf->next = cache->freelist;
+		cache->freelist = buf;
+	}
+	Mutex_Unlock(&cache->lock);
+}
+
+
+void* kmem_alloc(kmem_cache* cache)
+{
+	int pre = preempt_off;
+
+	kmem_magazine* mag = &cache->mag[cpu_core_id];
+	if(mag->rounds == 0)
+		kmem_refill(cache, mag);
+	void* obj = mag->obj[--mag->rounds];
+	mag->allocs++;
+
+	if(pre) preempt_on;
+	return obj;
+}
+
+
+void kmem_free(kmem_cache* cache, void* obj)
+{
+	int pre = preempt_off;
+
+	kmem_magazine* mag = &cache->mag[cpu_core_id];
+	if(mag->rounds == KMEM_MAGAZINE_SIZE)
+		kmem_flush(cache, mag);
+	mag->obj[mag->rounds++] = obj;
+	mag->frees++;
+
+	if(pre) preempt_on;
+}
+
+
+void kmem_stats(kmem_cache* cache, meminfo* info)
+{
+	memset(info, 0, sizeof(meminfo));
+	strncpy(info->name, cache->name, MEMINFO_NAME_SIZE-1);
+	info->object_size = cache->size;
+
+	int pre = preempt_off;
+	Mutex_Lock(&cache->lock);
+	info->slabs = cache->slabs;
+	info->objects = cache->objects;
+	Mutex_Unlock(&cache->lock);
+	if(pre) preempt_on;
+
+	/* The per-core counters are read without locking, they are only indicative */
+	for(uint c = 0; c < MAX_CORES; c++) {
+		info->allocs += cache->mag[c].allocs;
+		info->frees += cache->mag[c].frees;
+		info->refills += cache->mag[c].refills;
+	}
+	info->in_use = info->allocs - info->frees;
+}
+
+
+kmem_cache* kmem_cache_at(unsigned int n)
+{
+	kmem_cache* cache = NULL;
+
+	int pre = preempt_off;
+	Mutex_Lock(&cache_list_lock);
+	for(rlnode* p = cache_list.next; p != &cache_list; p = p->next) {
+		if(n-- == 0) {
+			cache = p->obj;
+			break;
+		}
+	}
+	Mutex_Unlock(&cache_list_lock);
+	if(pre) preempt_on;
+
+	return cache;
+}
+
+
+/*******************************************
+ *
+ * Memory information stream
+ *
+ *******************************************/
+
+typedef struct meminfo_cb {
+	unsigned int cursor;
+} meminfo_cb;
+
+static void* invalid_meminfo_open(uint minor){
+	return NULL;
+}
+
+static int invalid_meminfo_write(void* this, const char* buf, unsigned int size){
+	return -1;
+}
+
+static int meminfo_read(void* this, char* buf, unsigned int size){
+	meminfo_cb* infoCB = (meminfo_cb*) this;
+
+	if(size < sizeof(meminfo))
+		return -1;
+
+	kmem_cache* cache = kmem_cache_at(infoCB->cursor);
+	if(cache == NULL)
+		return 0;
+
+	kmem_stats(cache, (meminfo*) buf);
+	infoCB->cursor++;
+	return sizeof(meminfo);
+}
+
+static int meminfo_close(void* this){
+	free(this);
+	return 0;
+}
+
+static file_ops meminfo_ops = {
+	.Open = invalid_meminfo_open,
+	.Read = meminfo_read,
+	.Write = invalid_meminfo_write,
+	.Close = meminfo_close
+};
+
+Fid_t sys_OpenMemInfo(){
+	Fid_t fid;
+	FCB* fcb;
+
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	meminfo_cb* infoCB = (meminfo_cb*) xmalloc(sizeof(meminfo_cb));
+	infoCB->cursor = 0;
+
+	fcb->streamobj = infoCB;
+	fcb->streamfunc = &meminfo_ops;
+
+	return fid;
+}
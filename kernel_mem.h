@@ -0,0 +1,124 @@
+#ifndef __KERNEL_MEM_H
+#define __KERNEL_MEM_H
+
+/**
+	@file kernel_mem.h
+	@brief TinyOS kernel: object caches.
+
+	@defgroup kmem Object caches
+	@ingroup kernel
+	@brief Slab allocation of kernel objects.
+
+	Kernel objects that are created and destroyed on hot system call
+	paths (pipes, sockets, threads etc) are allocated from per-type
+	object caches, instead of @c xmalloc and @c free.
+
+	A cache hands out objects of a single type. Objects are carved
+	out of larger memory blocks (slabs) and are initialized by the
+	cache's constructor only once, when the slab is created. Therefore,
+	an object must be returned to the cache in its constructed state,
+	e.g., with its condition variables having no waiters and its list
+	nodes unlinked. Memory is never returned to the system; freed objects
+	are kept for reuse.
+
+	Each core keeps a small stack of free objects (a magazine) per cache.
+	Allocations and frees are served from the magazine of the current core
+	without locking. Only when the magazine is empty (or full) does the core
+	take the cache lock, to move a batch of objects from (or to) the cache's
+	shared free list.
+
+	A cache is defined statically in the module that uses it:
+	@code
+	static void pipe_ctor(void* obj) { ... }
+	static kmem_cache pipe_cache = KMEM_CACHE_INIT("pipe", pipe_cb, pipe_ctor);
+
+	pipe_cb* p = kmem_alloc(&pipe_cache);
+	...
+	kmem_free(&pipe_cache, p);
+	@endcode
+
+	@{
+*/
+
+#include "bios.h"
+#include "tinyos.h"
+#include "util.h"
+
+/** @brief The number of free objects that a per-core magazine can hold. */
+#define KMEM_MAGAZINE_SIZE 16
+
+/** @brief The approximate size of a slab, in bytes. */
+#define KMEM_SLAB_SIZE (64*1024)
+
+/** @brief Free-list link, stored in front of each object. */
+typedef struct kmem_bufctl {
+	struct kmem_bufctl* next;
+} kmem_bufctl;
+
+/** @brief A per-core cache of free objects. */
+typedef struct kmem_magazine {
+	unsigned int rounds;				/**< @brief Number of objects in @c obj */
+	void* obj[KMEM_MAGAZINE_SIZE];		/**< @brief The objects */
+
+	unsigned long allocs;				/**< @brief Allocations on this core */
+	unsigned long frees;				/**< @brief Frees on this core */
+	unsigned long refills;				/**< @brief Allocations that had to go to the free list */
+} kmem_magazine;
+
+/** @brief An object cache.
+
+	Use @c KMEM_CACHE_INIT to initialize.
+*/
+typedef struct kmem_cache {
+	const char* name;					/**< @brief Name, reported by statistics */
+	size_t size;						/**< @brief Object size */
+	void (*ctor)(void*);				/**< @brief Object constructor, may be NULL */
+
+	Mutex lock;							/**< @brief Spinlock for the fields below */
+	kmem_bufctl* freelist;				/**< @brief Shared list of free objects */
+	unsigned long slabs;				/**< @brief Number of slabs allocated */
+	unsigned long objects;				/**< @brief Number of objects in all slabs */
+	int registered;						/**< @brief Non-zero when the cache is on the cache list */
+	rlnode cache_node;					/**< @brief Node for the cache list */
+
+	kmem_magazine mag[MAX_CORES];		/**< @brief Per-core magazines */
+} kmem_cache;
+
+/**
+	@brief Static initializer for a cache of objects of type @c type.
+
+	@param cname the name of the cache
+	@param type the type of objects
+	@param constructor a function @c void(void*), or NULL
+*/
+#define KMEM_CACHE_INIT(cname, type, constructor) \
+	{ .name = (cname), .size = sizeof(type), .ctor = (constructor), .lock = MUTEX_INIT, \
+	  .freelist = NULL, .slabs = 0, .objects = 0, .registered = 0 }
+
+/**
+	@brief Allocate an object from a cache.
+
+	The object is returned in its constructed state.
+*/
+void* kmem_alloc(kmem_cache* cache);
+
+/**
+	@brief Return an object to its cache.
+
+	The object must be in its constructed state.
+*/
+void kmem_free(kmem_cache* cache, void* obj);
+
+/**
+	@brief Get the statistics of a cache.
+*/
+void kmem_stats(kmem_cache* cache, meminfo* info);
+
+/**
+	@brief Return the n-th cache that has been used, or NULL.
+*/
+kmem_cache* kmem_cache_at(unsigned int n);
+
+/** @} */
+
+#endif
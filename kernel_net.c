@@ -0,0 +1,228 @@
+#include "tinyos.h"
+#include "kernel_dev.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+
+/*
+	The network device driver.
+
+	Each host listener or connection opened by the bios (see bios_net_listen)
+	is a stream. Network interrupts do not say which device is ready, so the
+	handlers go through all open streams and wake up the waiters of those
+	that the bios reports as ready.
+*/
+
+typedef struct net_control_block {
+	int dev;				/* bios device */
+	int listener;			/* Non-zero for listeners */
+	FCB* fcb;
+	CondVar rx_ready;		/* Signalled on NET_RX_READY */
+	CondVar tx_ready;		/* Signalled on NET_TX_READY */
+	rlnode net_node;		/* Node for net_list */
+} net_cb;
+
+/* All open network streams, protected by net_spinlock */
+static rlnode net_list = { .prev = &net_list, .next = &net_list };
+static Mutex net_spinlock = MUTEX_INIT;
+
+
+static void net_wakeup(Interrupt intno)
+{
+	int pre = preempt_off;
+	Mutex_Lock(&net_spinlock);
+	for(rlnode* p = net_list.next; p != &net_list; p = p->next) {
+		net_cb* net = p->obj;
+		if(! bios_net_ready(net->dev, intno))
+			continue;
+		if(intno == NET_RX_READY) {
+			Cond_Broadcast(&net->rx_ready);
+			event_notify(net->fcb, EVENT_READ);
+		} else {
+			Cond_Broadcast(&net->tx_ready);
+			event_notify(net->fcb, EVENT_WRITE);
+		}
+	}
+	Mutex_Unlock(&net_spinlock);
+	if(pre) preempt_on;
+}
+
+static void net_rx_handler() { net_wakeup(NET_RX_READY); }
+static void net_tx_handler() { net_wakeup(NET_TX_READY); }
+
+
+static void* invalid_net_open(uint minor){
+	return NULL;
+}
+
+static int net_read(void* this, char* buf, unsigned int size){
+	net_cb* net = (net_cb*) this;
+	if(net->listener) return -1;
+
+	int rc;
+	while((rc = bios_net_read(net->dev, buf, size)) == -1) {
+		if(kernel_killed()) return -1;
+		kernel_wait(&net->rx_ready, SCHED_IO);
+	}
+	return rc;
+}
+
+static int net_write(void* this, const char* buf, unsigned int size){
+	net_cb* net = (net_cb*) this;
+	if(net->listener) return -1;
+
+	unsigned int count = 0;
+	while(count < size) {
+		int rc = bios_net_write(net->dev, buf+count, size-count);
+		if(rc == -1)
+			return count > 0 ? count : -1;
+		if(rc == 0) {
+			if(kernel_killed())
+				return count > 0 ? count : -1;
+			kernel_wait(&net->tx_ready, SCHED_IO);
+		}
+		count += rc;
+	}
+	return count;
+}
+
+static int net_close(void* this){
+	net_cb* net = (net_cb*) this;
+
+	int pre = preempt_off;
+	Mutex_Lock(&net_spinlock);
+	rlist_remove(&net->net_node);
+	Mutex_Unlock(&net_spinlock);
+	if(pre) preempt_on;
+
+	bios_net_close(net->dev);
+	free(net);
+	return 0;
+}
+
+/* 
+	The bios flags stay set until a read or write finds the device not ready,
+	so a new connection may be reported ready once, spuriously.
+ */
+static int net_poll(void* this){
+	net_cb* net = (net_cb*) this;
+	int ready = bios_net_ready(net->dev, NET_RX_READY) ? EVENT_READ : 0;
+	if(! net->listener && bios_net_ready(net->dev, NET_TX_READY))
+		ready |= EVENT_WRITE;
+	return ready;
+}
+
+static file_ops net_file_ops = {
+	.Open = invalid_net_open,
+	.Read = net_read,
+	.Write = net_write,
+	.Close = net_close,
+	.Poll = net_poll
+};
+
+
+static void net_attach(FCB* fcb, int dev, int listener){
+	net_cb* net = (net_cb*) xmalloc(sizeof(net_cb));
+	net->dev = dev;
+	net->listener = listener;
+	net->fcb = fcb;
+	net->rx_ready = COND_INIT;
+	net->tx_ready = COND_INIT;
+	rlnode_init(&net->net_node, net);
+
+	fcb->streamobj = net;
+	fcb->streamfunc = &net_file_ops;
+
+	int pre = preempt_off;
+	Mutex_Lock(&net_spinlock);
+	rlist_push_back(&net_list, &net->net_node);
+	Mutex_Unlock(&net_spinlock);
+	if(pre) preempt_on;
+}
+
+void initialize_net()
+{
+	cpu_interrupt_handler(NET_RX_READY, net_rx_handler);
+	cpu_interrupt_handler(NET_TX_READY, net_tx_handler);
+}
+
+
+int net_shutdown(Fid_t fid, shutdown_mode how)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL || fcb->streamfunc != &net_file_ops)
+		return -1;
+	net_cb* net = fcb->streamobj;
+	if(net->listener) return -1;
+
+	int read = (how == SHUTDOWN_READ || how == SHUTDOWN_BOTH);
+	int write = (how == SHUTDOWN_WRITE || how == SHUTDOWN_BOTH);
+	if(! read && ! write) return -1;
+	if(bios_net_shutdown(net->dev, read, write) == -1)
+		return -1;
+
+	/* The waiters must see the new state */
+	kernel_broadcast(&net->rx_ready);
+	kernel_broadcast(&net->tx_ready);
+	return 0;
+}
+
+
+/*******************************************
+ *
+ * sys_NetListen
+ *
+ *******************************************/
+
+Fid_t sys_NetListen(const char* path){
+	Fid_t fid;
+	FCB* fcb;
+
+	if(path == NULL || ! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	int dev = bios_net_listen(path);
+	if(dev == -1) {
+		FCB_unreserve(1, &fid, &fcb);
+		return NOFILE;
+	}
+
+	net_attach(fcb, dev, 1);
+	return fid;
+}
+
+/*******************************************
+ *
+ * sys_NetAccept
+ *
+ *******************************************/
+
+Fid_t sys_NetAccept(Fid_t lsock){
+	FCB* lfcb = get_fcb(lsock);
+	if(lfcb == NULL || lfcb->streamfunc != &net_file_ops)
+		return NOFILE;
+	net_cb* listener = lfcb->streamobj;
+	if(! listener->listener)
+		return NOFILE;
+
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	/* make sure that the listener will not be closed (by another thread)
+	   while we are waiting on it! */
+	FCB_incref(lfcb);
+	int dev;
+	while((dev = bios_net_accept(listener->dev)) == -1 && ! kernel_killed())
+		kernel_wait(&listener->rx_ready, SCHED_IO);
+	FCB_decref(lfcb);
+
+	if(dev == -1) {
+		FCB_unreserve(1, &fid, &fcb);
+		return NOFILE;
+	}
+
+	net_attach(fcb, dev, 0);
+	return fid;
+}
@@ -2,6 +2,15 @@
 #include "tinyos.h"
 #include "kernel_streams.h"
 #include "kernel_cc.h"
+#include "kernel_mem.h"
+
+static void pipe_cb_ctor(void* obj){
+	pipe_cb* pipeCb = (pipe_cb*) obj;
+	pipeCb->has_data = COND_INIT;
+	pipeCb->has_space = COND_INIT;
+}
+
+static kmem_cache pipe_cache = KMEM_CACHE_INIT("pipe_cb", pipe_cb, pipe_cb_ctor);
 
 int get_expected_read_length(pipe_cb *pipeCb, unsigned int length){
 	int written_length = pipeCb->w_position >= pipeCb->r_position ? 
@@ -11,22 +20,141 @@ int get_expected_read_length(pipe_cb *pipeCb, unsigned int length){
 
 }
 
+/* Block on a condition, accounting the wait to the reader or writer side */
+static void pipe_wait(pipe_cb *pipeCb, CondVar *cv, int reader){
+	TimerDuration start = bios_clock();
+	kernel_wait(cv, SCHED_PIPE);
+	wait_stats *stats = reader ? pipeCb->reader_stats : pipeCb->writer_stats;
+	if(stats) {
+		stats->waits++;
+		stats->wait_time += bios_clock() - start;
+	}
+}
+
+/*******************************************
+ *
+ * Packet mode
+ *
+ * Each packet is stored in the buffer as its length
+ * (an unsigned int) followed by its bytes.
+ *
+ *******************************************/
+
+static unsigned int pipe_used_space(pipe_cb *pipeCb){
+	return (pipeCb->w_position - pipeCb->r_position + PIPE_BUFFER_SIZE) % PIPE_BUFFER_SIZE;
+}
+
+static unsigned int pipe_free_space(pipe_cb *pipeCb){
+	return PIPE_BUFFER_SIZE - 1 - pipe_used_space(pipeCb);
+}
+
+/* Copy bytes into the buffer, the caller has checked for space */
+static void pipe_put(pipe_cb *pipeCb, const char *buf, unsigned int length){
+	for(unsigned int i = 0; i < length; i++) {
+		pipeCb->w_position = (pipeCb->w_position+1) % PIPE_BUFFER_SIZE;
+		pipeCb->BUFFER[pipeCb->w_position] = buf[i];
+	}
+}
+
+/* Copy bytes out of the buffer; if buf is NULL the bytes are discarded */
+static void pipe_get(pipe_cb *pipeCb, char *buf, unsigned int length){
+	for(unsigned int i = 0; i < length; i++) {
+		pipeCb->r_position = (pipeCb->r_position+1) % PIPE_BUFFER_SIZE;
+		if(buf) buf[i] = pipeCb->BUFFER[pipeCb->r_position];
+	}
+}
+
+static int pipe_packet_read(pipe_cb *pipeCb, char *buf, unsigned int length){
+	if(pipeCb->reader == NULL) return -1;
+
+	while(pipeCb->r_position == pipeCb->w_position && pipeCb->writer != NULL && ! kernel_killed())
+		pipe_wait(pipeCb, &pipeCb->has_data, 1);
+	if(pipeCb->r_position == pipeCb->w_position) return 0;
+
+	/* A writer may be blocked if there was no room for a maximal packet */
+	int was_full = pipe_free_space(pipeCb) < sizeof(unsigned int) + MAX_PACKET_SIZE;
+
+	unsigned int size;
+	pipe_get(pipeCb, (char*) &size, sizeof(size));
+	unsigned int count = size < length ? size : length;
+	pipe_get(pipeCb, buf, count);
+	pipe_get(pipeCb, NULL, size - count);	/* truncate */
+
+	kernel_broadcast(&pipeCb->has_space);
+	if(was_full)
+		event_notify(pipeCb->writer, EVENT_WRITE);
+	return count;
+}
+
+static int pipe_packet_write(pipe_cb *pipeCb, const char *buf, unsigned int length){
+	if(pipeCb->reader == NULL || pipeCb->writer == NULL) return -1;
+	if(length > MAX_PACKET_SIZE) return -1;
+	if(length == 0) return 0;
+
+	/* The packet is copied as a whole, so it is never interleaved with other writers */
+	while(pipe_free_space(pipeCb) < sizeof(length) + length && pipeCb->reader != NULL && ! kernel_killed())
+		pipe_wait(pipeCb, &pipeCb->has_space, 0);
+	if(pipeCb->reader == NULL || pipeCb->writer == NULL || kernel_killed()) return -1;
+
+	pipe_put(pipeCb, (const char*) &length, sizeof(length));
+	pipe_put(pipeCb, buf, length);
+
+	kernel_broadcast(&pipeCb->has_data);
+	event_notify(pipeCb->reader, EVENT_READ);
+	return length;
+}
+
+/*******************************************
+ *
+ * Read/Write/Close
+ *
+ *******************************************/
+
+int pipe_poll(pipe_cb *pipeCb, int events){
+	int ready = 0;
+	if((events & EVENT_READ) && (pipeCb->r_position != pipeCb->w_position || pipeCb->writer == NULL))
+		ready |= EVENT_READ;
+	if(events & EVENT_WRITE) {
+		unsigned int needed = pipeCb->packet ? sizeof(unsigned int) + 1 : 1;
+		if(pipe_free_space(pipeCb) >= needed || pipeCb->reader == NULL)
+			ready |= EVENT_WRITE;
+	}
+	return ready;
+}
+
+static int pipe_reader_poll(void *this){
+	return pipe_poll((pipe_cb*) this, EVENT_READ);
+}
+
+static int pipe_writer_poll(void *this){
+	return pipe_poll((pipe_cb*) this, EVENT_WRITE);
+}
+
 int pipe_read(void *this, char *buf, unsigned int length){
 	pipe_cb *pipeCb = (pipe_cb*) this;
 
+	if(pipeCb->packet) return pipe_packet_read(pipeCb, buf, length);
+
 	if(pipeCb->reader == NULL) return -1;					/*If write end is closed pipe_read can still operate*/
 	if(pipeCb->r_position == pipeCb->w_position && pipeCb->writer == NULL) return 0;	/*If BUFFER is empty return 0*/
 
 	int expected_length = length;
+	int was_full = (pipeCb->w_position+1) % PIPE_BUFFER_SIZE == pipeCb->r_position;
 
 	int position;
 	for(position = 0; position < expected_length; position++)
 	{
 		
-		while(pipeCb->r_position == pipeCb->w_position && pipeCb->writer != NULL)
+		/* POSIX behaviour: return what has been read, rather than block */
+		if(pipeCb->r_position == pipeCb->w_position && position > 0)
+			break;
+
+		while(pipeCb->r_position == pipeCb->w_position && pipeCb->writer != NULL && ! kernel_killed())
 		{
 			kernel_broadcast(&pipeCb->has_space);
-			kernel_wait(&pipeCb->has_data, SCHED_PIPE);
+			event_notify(pipeCb->writer, EVENT_WRITE);
+			was_full = 0;
+			pipe_wait(pipeCb, &pipeCb->has_data, 1);
 			// POSIX behaviour: ensure that read will return when something has been read without blocking
 			expected_length = get_expected_read_length(pipeCb, length);
 		}
@@ -35,6 +163,10 @@ int pipe_read(void *this, char *buf, unsigned int length){
 		buf[position] = pipeCb->BUFFER[pipeCb->r_position];
 	}
 
+	/* The writer may now proceed */
+	if(was_full && position > 0)
+		event_notify(pipeCb->writer, EVENT_WRITE);
+
 	return position;
 }
 
@@ -42,6 +174,7 @@ int pipe_write(void *this, const char *buf, unsigned int length){
 
 	pipe_cb *pipeCb = (pipe_cb*) this;
 
+	if(pipeCb->packet) return pipe_packet_write(pipeCb, buf, length);
 	if(pipeCb->reader == NULL || pipeCb->writer == NULL) return -1;
 
 	int position;
@@ -51,28 +184,32 @@ int pipe_write(void *this, const char *buf, unsigned int length){
 		
 		/*In order to achieve cyclic BUFFER we need to start writing again in 
 	 	  position 0 once the PIPE_BUFFER_SIZE overflows*/
-		while((pipeCb->w_position+1) % PIPE_BUFFER_SIZE == pipeCb->r_position && pipeCb->reader != NULL)
+		while((pipeCb->w_position+1) % PIPE_BUFFER_SIZE == pipeCb->r_position && pipeCb->reader != NULL && ! kernel_killed())
 		{
 			kernel_broadcast(&pipeCb->has_data);
-			kernel_wait(&pipeCb->has_space, SCHED_PIPE);
+			event_notify(pipeCb->reader, EVENT_READ);
+			pipe_wait(pipeCb, &pipeCb->has_space, 0);
 		}
-		if(pipeCb->reader == NULL || pipeCb->writer == NULL) return -1;
+		if(pipeCb->reader == NULL || pipeCb->writer == NULL || kernel_killed()) return -1;
 		pipeCb->w_position = (pipeCb->w_position+1) % PIPE_BUFFER_SIZE;
 		pipeCb->BUFFER[pipeCb->w_position] = buf[position];
 	}
 
 	kernel_broadcast(&pipeCb->has_data);	/*Finished writing correctly, broadcast to start reading*/
+	event_notify(pipeCb->reader, EVENT_READ);
 	return position;
 }
 
 int pipe_writer_close(void *this){
 	pipe_cb* pipeCb = (pipe_cb*) this;
 	pipeCb->writer = NULL;
+	pipeCb->writer_stats = NULL;
 
 	if (pipeCb->reader == NULL){
-		free(pipeCb);
+		kmem_free(&pipe_cache, pipeCb);
 	}else{
 		kernel_broadcast(&pipeCb->has_data);
+		event_notify(pipeCb->reader, EVENT_READ);	/*The reader will see EOF*/
 	}
 	
 	return 0;
@@ -80,11 +217,13 @@ int pipe_writer_close(void *this){
 int pipe_reader_close(void *this){
 	pipe_cb* pipeCb = (pipe_cb*) this;
 	pipeCb->reader = NULL;
+	pipeCb->reader_stats = NULL;
 
 	if (pipeCb->writer == NULL){
-		free(pipeCb);
+		kmem_free(&pipe_cache, pipeCb);
 	}else{
 		kernel_broadcast(&pipeCb->has_space);
+		event_notify(pipeCb->writer, EVENT_WRITE);	/*The writer will see an error*/
 	}
 	
 	return 0;
@@ -107,31 +246,33 @@ static file_ops writer_file_ops = {
 	.Open = invalid_opn,
 	.Write = pipe_write,
 	.Close = pipe_writer_close,
-	.Read = invalid_reader
+	.Read = invalid_reader,
+	.Poll = pipe_writer_poll
 };
 static file_ops reader_file_ops = {
 	.Open = invalid_opn,
 	.Write = invalid_writer,
 	.Close = pipe_reader_close,
-	.Read = pipe_read
+	.Read = pipe_read,
+	.Poll = pipe_reader_poll
 };
 
 pipe_cb* initialize_pipe_cb(pipe_t* pipe, Fid_t* fid, FCB** fcb){
 	pipe->read = fid[0];
 	pipe->write = fid[1];
 
-	pipe_cb* pipeCb = (pipe_cb*) xmalloc(sizeof(pipe_cb));
+	pipe_cb* pipeCb = (pipe_cb*) kmem_alloc(&pipe_cache);
 	pipeCb->reader = fcb[0];
 	pipeCb->writer = fcb[1];
-	pipeCb->has_data = COND_INIT;
-	pipeCb->has_space = COND_INIT;
 	pipeCb->w_position = 0;
 	pipeCb->r_position = 0;
+	pipeCb->packet = 0;
+	pipeCb->reader_stats = pipeCb->writer_stats = NULL;
 	
 	return pipeCb;
 }
 
-int sys_Pipe(pipe_t* pipe)
+static int create_pipe(pipe_t* pipe, int packet)
 {
 	Fid_t fid[2];
 	FCB* fcb[2];
@@ -140,6 +281,7 @@ int sys_Pipe(pipe_t* pipe)
 		return -1;
 	
   	pipe_cb* pipeCb = initialize_pipe_cb(pipe, fid, fcb);
+	pipeCb->packet = packet;
 	fcb[0]->streamobj = pipeCb;
 	fcb[1]->streamobj = pipeCb;
 
@@ -147,4 +289,14 @@ int sys_Pipe(pipe_t* pipe)
 	fcb[1]->streamfunc = &writer_file_ops;
 
 	return 0;
-}
\ No newline at end of file
+}
+
+int sys_Pipe(pipe_t* pipe)
+{
+	return create_pipe(pipe, 0);
+}
+
+int sys_PacketPipe(pipe_t* pipe)
+{
+	return create_pipe(pipe, 1);
+}
@@ -4,6 +4,7 @@
 #include "kernel_proc.h"
 #include "kernel_streams.h"
 #include "kernel_threads.h"
+#include "kernel_mem.h"
 
 
 /* 
@@ -16,58 +17,135 @@
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
+/* 
+  The process table.
+
+  PCBs are allocated in chunks of PCB_CHUNK, as they are needed. The
+  chunk of a pid is found through a directory, so that get_pcb() is
+  a pair of array accesses, and each PCB holds its own pid.
+
+  Free PCBs are kept on a free list, linked through their parent field,
+  so that acquiring and releasing a PCB takes constant time. When the
+  list is empty, a new chunk is added to it.
+
+  The pids in use (ALIVE or ZOMBIE) are marked in a bitmap, so that the
+  info stream finds them without looking at every PCB.
+*/
+#define PCB_CHUNKS ((MAX_PROC + PCB_CHUNK - 1) / PCB_CHUNK)
+
+static PCB* PT[PCB_CHUNKS];     /* The chunk directory */
+static unsigned int pcb_chunks; /* Chunks allocated */
 unsigned int process_count;
 
+#define PID_WORD_BITS (8*sizeof(unsigned long))
+static unsigned long pid_used[(MAX_PROC + PID_WORD_BITS - 1) / PID_WORD_BITS];
+
+static inline void pid_mark(Pid_t pid, int used)
+{
+  unsigned long bit = 1ul << (pid % PID_WORD_BITS);
+  if(used)
+    pid_used[pid / PID_WORD_BITS] |= bit;
+  else
+    pid_used[pid / PID_WORD_BITS] &= ~bit;
+}
+
+/* Return the lowest pid in use that is >= pid, or NOPROC */
+static Pid_t next_used_pid(Pid_t pid)
+{
+  Pid_t limit = pcb_chunks * PCB_CHUNK;
+  if(limit > MAX_PROC) limit = MAX_PROC;
+  if(pid < 0 || pid >= limit) return NOPROC;
+
+  unsigned int w = pid / PID_WORD_BITS;
+  unsigned long word = pid_used[w] & (~0ul << (pid % PID_WORD_BITS));
+  unsigned int nwords = (limit + PID_WORD_BITS - 1) / PID_WORD_BITS;
+  while(word == 0) {
+    if(++w == nwords) return NOPROC;
+    word = pid_used[w];
+  }
+  return w * PID_WORD_BITS + __builtin_ctzl(word);
+}
+
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  if(pid < 0 || pid >= MAX_PROC) return NULL;
+  PCB* chunk = PT[pid >> PCB_CHUNK_BITS];
+  if(chunk == NULL) return NULL;
+  PCB* pcb = &chunk[pid & (PCB_CHUNK-1)];
+  return pcb->pstate==FREE ? NULL : pcb;
 }
 
 Pid_t get_pid(PCB* pcb)
 {
-  return pcb==NULL ? NOPROC : pcb-PT;
+  return pcb==NULL ? NOPROC : pcb->pid;
 }
 
 /* Initialize a PCB */
-static inline void initialize_PCB(PCB* pcb)
+static inline void initialize_PCB(PCB* pcb, Pid_t pid)
 {
   pcb->pstate = FREE;
+  pcb->pid = pid;
   pcb->argl = 0;
   pcb->args = NULL;
 
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  memset(& pcb->FIDT, 0, sizeof(fid_table));
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
   pcb->child_exit = COND_INIT;
+  pcb->waitany_count = 0;
+  pcb->killed = 0;
+  pcb->io_workers = 0;
+  rlnode_init(& pcb->procfd_list, NULL);
   
   rlnode_init(& pcb->ptcb_list, NULL);
   pcb->thread_count = 0;
+  pcb->thread_table = NULL;
+  pcb->thread_table_size = 0;
+  pcb->thread_table_free = -1;
 }
 
 
 static PCB* pcb_freelist;
 
-void initialize_processes()
+/*
+  Allocate the next chunk of PCBs and put them on the free list,
+  lowest pid first. Return 0 if the table is full.
+
+  Must be called with kernel_mutex held
+*/
+static int grow_PT()
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
+  if(pcb_chunks == PCB_CHUNKS) return 0;
+
+  Pid_t base = pcb_chunks * PCB_CHUNK;
+  Pid_t count = (MAX_PROC - base < PCB_CHUNK) ? MAX_PROC - base : PCB_CHUNK;
+  PCB* chunk = (PCB*) xmalloc(count * sizeof(PCB));
+
+  for(Pid_t i = count; i > 0; ) {
+    --i;
+    initialize_PCB(&chunk[i], base + i);
+    chunk[i].parent = pcb_freelist;
+    pcb_freelist = &chunk[i];
   }
 
-  /* use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
+  PT[pcb_chunks++] = chunk;
+  return 1;
+}
+
+void initialize_processes()
+{
+  /* Release the chunks of a previous boot */
+  for(unsigned int c = 0; c < pcb_chunks; c++) {
+    free(PT[c]);
+    PT[c] = NULL;
   }
+  pcb_chunks = 0;
+  pcb_freelist = NULL;
+  memset(pid_used, 0, sizeof(pid_used));
+  grow_PT();
 
   process_count = 0;
 
@@ -84,10 +162,18 @@ PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  if(pcb_freelist == NULL)
+    grow_PT();
+
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
+    memset(&pcb->usage, 0, sizeof(resource_usage));
+    memset(&pcb->child_usage, 0, sizeof(resource_usage));
+    pcb->killed = 0;
+    pcb->io_workers = 0;
+    pid_mark(pcb->pid, 1);
     process_count++;
   }
 
@@ -102,6 +188,7 @@ void release_PCB(PCB* pcb)
   pcb->pstate = FREE;
   pcb->parent = pcb_freelist;
   pcb_freelist = pcb;
+  pid_mark(pcb->pid, 0);
   process_count--;
 }
 
@@ -129,10 +216,32 @@ void start_main_thread()
 }
 
 
+/* Apply the fid actions of Spawn to the fids of a new process */
+static int apply_spawn_actions(fid_table* fidt, const spawn_action* actions, unsigned int nactions)
+{
+  for(unsigned int i=0; i<nactions; i++) {
+    int rc;
+    switch(actions[i].action) {
+      case SPAWN_DUP2:
+        rc = fidt_dup2(fidt, actions[i].fid, actions[i].newfid);
+        break;
+      case SPAWN_CLOSE:
+        rc = fidt_close(fidt, actions[i].fid);
+        break;
+      default:
+        rc = -1;
+    }
+    if(rc != 0) return -1;
+  }
+  return 0;
+}
+
+
 /*
-	System call to create a new process.
+	Create a new process, applying the given fid actions to its fids.
  */
-Pid_t sys_Exec(Task call, int argl, void* args)
+static Pid_t spawn_process(Task call, int argl, void* args, 
+  const spawn_action* actions, unsigned int nactions)
 {
   PCB *curproc, *newproc;
   
@@ -156,11 +265,16 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    fidt_inherit(& newproc->FIDT, & curproc->FIDT);
+  }
+
+  /* Rearrange the fids; on error, undo everything */
+  if(apply_spawn_actions(& newproc->FIDT, actions, nactions) != 0) {
+    fidt_close_all(& newproc->FIDT);
+    if(newproc->parent != NULL)
+      rlist_remove(& newproc->children_node);
+    release_PCB(newproc);
+    return NOPROC;
   }
 
 
@@ -197,6 +311,44 @@ finish:
 }
 
 
+/*
+	System call to create a new process.
+ */
+Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return spawn_process(call, argl, args, NULL, 0);
+}
+
+
+Pid_t sys_Spawn(Task call, int argl, void* args, const spawn_action* actions, unsigned int nactions)
+{
+  if(actions == NULL && nactions > 0)
+    return NOPROC;
+  return spawn_process(call, argl, args, actions, nactions);
+}
+
+
+int sys_ExecMany(unsigned int n, const spawn_request* reqs, Pid_t* pids)
+{
+  if(reqs == NULL || pids == NULL)
+    return -1;
+
+  unsigned int created = 0;
+  for(; created < n; created++) {
+    const spawn_request* req = & reqs[created];
+    if(req->actions == NULL && req->nactions > 0)
+      break;
+    pids[created] = spawn_process(req->task, req->argl, req->args, req->actions, req->nactions);
+    if(pids[created] == NOPROC)
+      break;
+  }
+
+  for(unsigned int i = created; i < n; i++)
+    pids[i] = NOPROC;
+  return created;
+}
+
+
 /* System call */
 Pid_t sys_GetPid()
 {
@@ -210,83 +362,304 @@ Pid_t sys_GetPPid()
 }
 
 
+/* Return the PCB of a child of the current process, or NULL */
+static PCB* get_child(Pid_t cpid)
+{
+  if((cpid<0) || (cpid>=MAX_PROC))
+    return NULL;
+
+  PCB* child = get_pcb(cpid);
+  return (child != NULL && child->parent == CURPROC) ? child : NULL;
+}
+
+
+/*
+  Process fids.
+
+  A process fid (procfd) is a stream for a child process, which becomes
+  readable when the child exits. The procfds of a process are kept in its
+  procfd_list. When the process exits, they keep its exit status, and
+  when it is reaped, they are detached from it. Therefore, a procfd 
+  outlives its process.
+*/
+
+typedef struct process_fid {
+  PCB* pcb;               /* The process, or NULL once it has been reaped */
+  FCB* fcb;
+  int exited;
+  int exitval;            /* Valid once exited */
+  CondVar exit_cv;        /* Broadcast when the process exits */
+  rlnode node;            /* Node for pcb->procfd_list */
+} procfd_cb;
+
+static void procfd_ctor(void* obj)
+{
+  procfd_cb* procfd = (procfd_cb*) obj;
+  procfd->exit_cv = COND_INIT;
+  rlnode_init(& procfd->node, procfd);
+}
+
+static kmem_cache procfd_cache = KMEM_CACHE_INIT("procfd", procfd_cb, procfd_ctor);
+
+/* Tell the procfds of an exiting process */
+static void procfd_notify_exit(PCB* pcb)
+{
+  for(rlnode* p = pcb->procfd_list.next; p != & pcb->procfd_list; p = p->next) {
+    procfd_cb* procfd = p->obj;
+    procfd->exited = 1;
+    procfd->exitval = pcb->exitval;
+    kernel_broadcast(& procfd->exit_cv);
+    event_notify(procfd->fcb, EVENT_READ);
+  }
+}
+
+/* Detach the procfds of a process that is being reaped */
+static void procfd_detach(PCB* pcb)
+{
+  while(! is_rlist_empty(& pcb->procfd_list)) {
+    procfd_cb* procfd = rlist_pop_front(& pcb->procfd_list)->obj;
+    procfd->pcb = NULL;
+  }
+}
+
+static void* invalid_procfd_open(uint minor)
+{
+  return NULL;
+}
+
+static int invalid_procfd_write(void* this, const char* buf, unsigned int size)
+{
+  return -1;
+}
+
+static int procfd_read(void* this, char* buf, unsigned int size)
+{
+  procfd_cb* procfd = (procfd_cb*) this;
+  if(size < sizeof(int)) return -1;
+
+  while(! procfd->exited) {
+    if(kernel_killed()) return -1;
+    kernel_wait(& procfd->exit_cv, SCHED_USER);
+  }
+
+  memcpy(buf, & procfd->exitval, sizeof(int));
+  return sizeof(int);
+}
+
+static int procfd_close(void* this)
+{
+  procfd_cb* procfd = (procfd_cb*) this;
+  if(procfd->pcb != NULL)
+    rlist_remove(& procfd->node);
+  kmem_free(& procfd_cache, procfd);
+  return 0;
+}
+
+static int procfd_poll(void* this)
+{
+  procfd_cb* procfd = (procfd_cb*) this;
+  return procfd->exited ? EVENT_READ : 0;
+}
+
+static file_ops procfd_ops = {
+  .Open = invalid_procfd_open,
+  .Read = procfd_read,
+  .Write = invalid_procfd_write,
+  .Close = procfd_close,
+  .Poll = procfd_poll
+};
+
+Fid_t sys_OpenProcess(Pid_t pid)
+{
+  PCB* child = get_child(pid);
+  if(child == NULL)
+    return NOFILE;
+
+  Fid_t fid;
+  FCB* fcb;
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  procfd_cb* procfd = (procfd_cb*) kmem_alloc(& procfd_cache);
+  procfd->pcb = child;
+  procfd->fcb = fcb;
+  procfd->exited = (child->pstate == ZOMBIE);
+  procfd->exitval = child->exitval;
+  rlist_push_back(& child->procfd_list, & procfd->node);
+
+  fcb->streamobj = procfd;
+  fcb->streamfunc = & procfd_ops;
+  return fid;
+}
+
+
+/* Add the usage of a reaped child to its parent */
+static void add_child_usage(resource_usage* total, const resource_usage* usage)
+{
+  total->cpu_time += usage->cpu_time;
+  total->ready_time += usage->ready_time;
+  total->stopped_time += usage->stopped_time;
+  total->voluntary += usage->voluntary;
+  total->involuntary += usage->involuntary;
+  for(int i=0; i<USAGE_CAUSES; i++)
+    total->switches[i] += usage->switches[i];
+  total->bytes_read += usage->bytes_read;
+  total->bytes_written += usage->bytes_written;
+  if(usage->peak_threads > total->peak_threads)
+    total->peak_threads = usage->peak_threads;
+}
+
 static void cleanup_zombie(PCB* pcb, int* status)
 {
   if(status != NULL)
     *status = pcb->exitval;
 
+  resource_usage usage;
+  sched_read_usage(&pcb->usage, &usage, 0);
+  add_child_usage(&CURPROC->child_usage, &usage);
+  add_child_usage(&CURPROC->child_usage, &pcb->child_usage);
+
   rlist_remove(& pcb->children_node);
   rlist_remove(& pcb->exited_node);
+  procfd_detach(pcb);
 
   release_PCB(pcb);
 }
 
 
-static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
+static Pid_t wait_for_specific_child(Pid_t cpid, int* status, TimerDuration deadline)
 {
-
-  /* Legality checks */
-  if((cpid<0) || (cpid>=MAX_PROC)) {
-    cpid = NOPROC;
-    goto finish;
-  }
-
   PCB* parent = CURPROC;
-  PCB* child = get_pcb(cpid);
-  if( child == NULL || child->parent != parent)
-  {
-    cpid = NOPROC;
-    goto finish;
-  }
+  PCB* child = get_child(cpid);
+  if(child == NULL)
+    return NOPROC;
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
-  while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+  while(child->pstate == ALIVE) {
+    TimerDuration t = kernel_time_left(deadline);
+    if(t == 0 || kernel_killed()) return NOPROC;
+    kernel_timedwait(& parent->child_exit, SCHED_USER, t);
+
+    /* Another thread of mine may have reaped it */
+    if(child->pstate == FREE || child->parent != parent)
+      return NOPROC;
+  }
   
   cleanup_zombie(child, status);
-  
-finish:
   return cpid;
 }
 
 
-static Pid_t wait_for_any_child(int* status)
+static Pid_t wait_for_any_child(int* status, TimerDuration deadline)
 {
-  Pid_t cpid;
-
   PCB* parent = CURPROC;
 
   /* Make sure I have children! */
-  if(is_rlist_empty(& parent->children_list)) {
-    cpid = NOPROC;
-    goto finish;
-  }
-
   while(is_rlist_empty(& parent->exited_list)) {
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    if(is_rlist_empty(& parent->children_list))
+      return NOPROC;
+    TimerDuration t = kernel_time_left(deadline);
+    if(t == 0 || kernel_killed()) return NOPROC;
+    kernel_timedwait(& parent->child_exit, SCHED_USER, t);
   }
 
   PCB* child = parent->exited_list.next->pcb;
   assert(child->pstate == ZOMBIE);
-  cpid = get_pid(child);
+  Pid_t cpid = get_pid(child);
   cleanup_zombie(child, status);
-
-finish:
   return cpid;
 }
 
 
-Pid_t sys_WaitChild(Pid_t cpid, int* status)
+Pid_t sys_WaitChildTimed(Pid_t cpid, int* status, timeout_t timeout)
 {
+  TimerDuration deadline = kernel_deadline(timeout);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    return wait_for_specific_child(cpid, status, deadline);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    return wait_for_any_child(status, deadline);
   }
+}
+
 
+Pid_t sys_WaitChild(Pid_t cpid, int* status)
+{
+  return sys_WaitChildTimed(cpid, status, (timeout_t)-1);
+}
+
+
+/*
+  Check the targets of WaitAnyOf. The threads are held with join_acquire(),
+  in ptcbs[]. On error, the threads held so far are released.
+*/
+static int waitany_acquire(const wait_target* targets, unsigned int n, PTCB** ptcbs)
+{
+  for(unsigned int i = 0; i < n; i++) {
+    ptcbs[i] = NULL;
+    if(targets[i].type == WAIT_PROCESS && targets[i].pid != NOPROC
+        && get_child(targets[i].pid) != NULL)
+      continue;
+    if(targets[i].type == WAIT_THREAD
+        && (ptcbs[i] = join_acquire(targets[i].tid)) != NULL)
+      continue;
+
+    while(i-- > 0)
+      if(ptcbs[i] != NULL) join_release(ptcbs[i], NULL);
+    return -1;
+  }
+  return 0;
+}
+
+/* Return the first target that is complete, -1 if none, or -2 if some target became invalid */
+static int waitany_find(const wait_target* targets, unsigned int n, PTCB** ptcbs)
+{
+  for(unsigned int i = 0; i < n; i++) {
+    if(ptcbs[i] != NULL) {
+      if(ptcbs[i]->detached) return -2;
+      if(ptcbs[i]->exited) return i;
+    }
+    else {
+      PCB* child = get_child(targets[i].pid);
+      if(child == NULL) return -2;
+      if(child->pstate == ZOMBIE) return i;
+    }
+  }
+  return -1;
+}
+
+int sys_WaitAnyOf(const wait_target* targets, unsigned int n, int* status, timeout_t timeout)
+{
+  if(targets == NULL || n == 0 || n > MAX_WAIT_TARGETS)
+    return -1;
+
+  PTCB* ptcbs[n];
+  if(waitany_acquire(targets, n, ptcbs) != 0)
+    return -1;
+
+  PCB* curproc = CURPROC;
+  TimerDuration deadline = kernel_deadline(timeout);
+
+  int found;
+  curproc->waitany_count++;
+  while((found = waitany_find(targets, n, ptcbs)) == -1) {
+    TimerDuration t = kernel_time_left(deadline);
+    if(t == 0 || kernel_killed()) break;
+    kernel_timedwait(& curproc->child_exit, SCHED_USER, t);
+  }
+  curproc->waitany_count--;
+
+  /* Reap or join the target found, and drop the other threads */
+  for(unsigned int i = 0; i < n; i++) {
+    if(ptcbs[i] != NULL)
+      join_release(ptcbs[i], (int)i == found ? status : NULL);
+    else if((int)i == found)
+      cleanup_zombie(get_child(targets[i].pid), status);
+  }
+  return (found >= 0) ? found : -1;
 }
 
 
@@ -303,6 +676,86 @@ void sys_Exit(int exitval)
   sys_ThreadExit(exitval);
 }
 
+/*
+  Killing processes.
+
+  A process is killed by setting its killed flag and kicking its threads 
+  out of kernel_wait(). A killed process does not block in the kernel any 
+  more, so each thread returns from its system call, and exits at the 
+  boundary, in exit_if_killed(). The last thread to exit cleans up the 
+  process, as usual. A thread that runs in user code without making 
+  system calls is not stopped.
+*/
+
+/* Return 1 if pcb is a descendant of the current process */
+static int is_descendant(PCB* pcb)
+{
+  for(PCB* p = pcb->parent; p != NULL; p = p->parent)
+    if(p == CURPROC) return 1;
+  return 0;
+}
+
+void stop_process(PCB* pcb)
+{
+  pcb->killed = 1;
+  for(rlnode* p = pcb->ptcb_list.next; p != & pcb->ptcb_list; p = p->next) {
+    PTCB* ptcb = p->ptcb;
+    if(! ptcb->exited)
+      kernel_kick(ptcb->tcb);
+  }
+}
+
+static void kill_process(PCB* pcb)
+{
+  if(pcb->pstate != ALIVE || pcb->killed) return;
+
+  pcb->exitval = EXIT_KILLED;
+  stop_process(pcb);
+}
+
+int sys_Kill(Pid_t pid)
+{
+  PCB* pcb = (pid < 0 || pid >= MAX_PROC) ? NULL : get_pcb(pid);
+  if(pcb == NULL || ! is_descendant(pcb))
+    return -1;
+
+  kill_process(pcb);
+  return 0;
+}
+
+int sys_KillTree(Pid_t pid)
+{
+  PCB* root = (pid < 0 || pid >= MAX_PROC) ? NULL : get_pcb(pid);
+  if(root == NULL || ! is_descendant(root))
+    return -1;
+
+  /* Visit the tree in preorder, following the children lists */
+  PCB* pcb = root;
+  for(;;) {
+    kill_process(pcb);
+
+    if(! is_rlist_empty(& pcb->children_list)) {
+      pcb = pcb->children_list.next->pcb;
+      continue;
+    }
+
+    /* Go up to the first ancestor with a next sibling */
+    while(pcb != root && pcb->children_node.next == & pcb->parent->children_list)
+      pcb = pcb->parent;
+    if(pcb == root) break;
+    pcb = pcb->children_node.next->pcb;
+  }
+  return 0;
+}
+
+void exit_if_killed()
+{
+  /* There is no current thread while the kernel boots */
+  if(CURTHREAD != NULL && CURPROC != NULL && CURPROC->killed)
+    sys_ThreadExit(CURPROC->exitval);
+}
+
+
 /** 
  * This function mostly consists of the original Exec syscall 
  * */
@@ -317,12 +770,7 @@ void process_cleanup()
   }
 
   /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
+  fidt_close_all(& curproc->FIDT);
 
   /* Reparent any children of the exiting process to the 
      initial task */
@@ -351,6 +799,7 @@ void process_cleanup()
 
   /* Now, mark the process as exited. */
   curproc->pstate = ZOMBIE; // ΖΟΜΒΙΕs are later cleaned by the kernel
+  procfd_notify_exit(curproc);
   // curproc->exitval = exitval;
 }
 
@@ -370,8 +819,32 @@ void curproc_decrement_thread_counter(){
   CURPROC->thread_count--;
   if (CURPROC->thread_count == 0){ // all threads ended, clean process
     curproc_ptcb_list_refcount_decrement();
+    release_thread_table(CURPROC);
     process_cleanup();
   }
+  else if (CURPROC->thread_count == CURPROC->io_workers && ! CURPROC->killed)
+    /* Only the workers of I/O rings are left, they must not keep the process alive */
+    stop_process(CURPROC);
+}
+
+
+int sys_GetRusage(usage_who who, resource_usage* usage)
+{
+  if(usage == NULL) return -1;
+
+  switch(who) {
+    case USAGE_THREAD:
+      sched_read_usage(&CURTHREAD->usage, usage, 1);
+      return 0;
+    case USAGE_PROCESS:
+      sched_read_usage(&CURPROC->usage, usage, 1);
+      return 0;
+    case USAGE_CHILDREN:
+      *usage = CURPROC->child_usage;
+      return 0;
+    default:
+      return -1;
+  }
 }
 
 
@@ -391,39 +864,53 @@ int invalid_write(void* this, const char* buf, unsigned int size){
 
 
 
-void update_procinfo(procinfoCB* infoCB, PCB *pcb){
-  infoCB->info->alive = pcb->pstate == ALIVE;
-  infoCB->info->argl = pcb->argl;
-  infoCB->info->main_task = pcb->main_task;
-  infoCB->info->pid = get_pid(pcb);
-  infoCB->info->ppid = get_pid(pcb->parent);
-  infoCB->info->thread_count = pcb->thread_count;
-  if (infoCB->info->argl < PROCINFO_MAX_ARGS_SIZE)
-    memcpy(infoCB->info->args, pcb->args, infoCB->info->argl);
-  else
-    memcpy(infoCB->info->args, pcb->args, PROCINFO_MAX_ARGS_SIZE);
+/* The info buffer is allocated once, when the cache constructs the object */
+static void procinfoCB_ctor(void* obj){
+  ((procinfoCB*) obj)->info = (procinfo*) xmalloc(sizeof(procinfo));
 }
 
-int procinfo_read(void* infoCB, char *buf, unsigned int size){
-  int i = ((procinfoCB*) infoCB)->PCB_cursor;
-  while (i < MAX_PROC){
-    PCB *pcb = &PT[i];
-    if (pcb->pstate == ALIVE || pcb->pstate == ZOMBIE){
-      update_procinfo((procinfoCB*) infoCB, pcb);
+static kmem_cache procinfo_cache = KMEM_CACHE_INIT("procinfoCB", procinfoCB, procinfoCB_ctor);
 
-      memcpy(buf, (char*) ((procinfoCB*) infoCB)->info, size);
-      
-      ((procinfoCB*) infoCB)->PCB_cursor++;
-      return size;
-    }
-    i = ++((procinfoCB*) infoCB)->PCB_cursor;
-  }
-  return 0;
+
+void update_procinfo(procinfo* info, PCB *pcb){
+  info->alive = pcb->pstate == ALIVE;
+  info->argl = pcb->argl;
+  info->main_task = pcb->main_task;
+  info->pid = get_pid(pcb);
+  info->ppid = get_pid(pcb->parent);
+  info->thread_count = pcb->thread_count;
+  sched_read_usage(&pcb->usage, &info->usage, 0);
+  if (info->argl < PROCINFO_MAX_ARGS_SIZE)
+    memcpy(info->args, pcb->args, info->argl);
+  else
+    memcpy(info->args, pcb->args, PROCINFO_MAX_ARGS_SIZE);
+}
+
+/*
+  Return as many records as fit in the buffer. A buffer smaller than one
+  record gets a prefix of the next record.
+*/
+int procinfo_read(void* this, char *buf, unsigned int size){
+  procinfoCB* infoCB = (procinfoCB*) this;
+  unsigned int count = 0;
+
+  do {
+    Pid_t pid = next_used_pid(infoCB->PCB_cursor);
+    if (pid == NOPROC)
+      break;
+    infoCB->PCB_cursor = pid + 1;
+
+    update_procinfo(infoCB->info, get_pcb(pid));
+    unsigned int n = (size - count < sizeof(procinfo)) ? size - count : sizeof(procinfo);
+    memcpy(buf + count, (char*) infoCB->info, n);
+    count += n;
+  } while (count + sizeof(procinfo) <= size);
+
+  return count;
 }
 
 int procinfo_close(void* infoCB){
-  free(((procinfoCB*) infoCB)->info);
-  free(infoCB);
+  kmem_free(&procinfo_cache, infoCB);
   return 0;
 }
 
@@ -437,8 +924,7 @@ file_ops procinfo_ops = {
 
 void initialize_procinfoCB(FCB* fcb){
 
-  procinfoCB* infoCB = (procinfoCB*) xmalloc(sizeof(procinfoCB));
-  infoCB->info = (procinfo*) xmalloc(sizeof(procinfo));
+  procinfoCB* infoCB = (procinfoCB*) kmem_alloc(&procinfo_cache);
   infoCB->PCB_cursor = 0;
 
   fcb->streamobj = infoCB;
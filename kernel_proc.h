@@ -17,6 +17,7 @@
 
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_streams.h"
 
 /**
   @brief PID state
@@ -30,6 +31,17 @@ typedef enum pid_state_e {
   ZOMBIE  /**< @brief The PID is held by a zombie */
 } pid_state;
 
+/**
+  @brief A slot of the thread table of a process.
+
+  A slot holds a PTCB, or it is free and links to the next free slot.
+  @see thread_table_insert
+  */
+typedef struct thread_table_slot {
+  PTCB* ptcb;             /**< @brief The PTCB, or NULL if the slot is free */
+  int next_free;          /**< @brief The next free slot, or -1 */
+} thread_slot;
+
 /**
   @brief Process Control Block.
 
@@ -37,6 +49,7 @@ typedef enum pid_state_e {
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< @brief The pid state for this PCB */
+  Pid_t pid;              /**< @brief The pid of this PCB, fixed when it is allocated */
 
   PCB* parent;            /**< @brief Parent's pcb. */
   int exitval;            /**< @brief The exit value of the process */
@@ -56,13 +69,28 @@ typedef struct process_control_block {
 
                              This condition variable is  broadcast each time a child
                              process terminates. It is used in the implementation of
-                             @c WaitChild() */
+                             @c WaitChild(). It is also broadcast when a thread
+                             of this process exits or is detached, while
+                             @c waitany_count is not 0. */
+  int waitany_count;      /**< @brief Number of threads blocked in @c WaitAnyOf() */
+
+  rlnode procfd_list;     /**< @brief The process fids of this process, see @c OpenProcess() */
 
-  FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  int killed;             /**< @brief Set by @c Kill(); the threads exit at the next system call boundary */
+  int io_workers;         /**< @brief Number of worker threads of I/O rings, see @c IoRing() */
+
+  fid_table FIDT;         /**< @brief The fileid table of the process */
 
   rlnode ptcb_list;       /**< @brief List of PTCBs */
   int thread_count;       /**< @brief Number of items in @c ptcb_list*/
 
+  thread_slot* thread_table;      /**< @brief Maps the Tids of the process to PTCBs */
+  unsigned int thread_table_size; /**< @brief Number of slots in @c thread_table */
+  int thread_table_free;          /**< @brief The first free slot, or -1 */
+
+  resource_usage usage;       /**< @brief Resource usage of all the threads of the process */
+  resource_usage child_usage; /**< @brief Resource usage of the reaped children */
+
 } PCB;
 
 
@@ -90,6 +118,7 @@ typedef struct process_thread_control_block {
   int joined;           /**< @brief Boolean (0, 1) for thread's joined status */
 
   int refcount;           /**< @brief How many refer to this thread */
+  Tid_t tid;              /**< @brief The Tid of this thread */
 
   rlnode ptcb_list_node;  /**< @brief Intrusive node for the process' @c ptcb_list */
 
@@ -102,6 +131,17 @@ typedef struct procinfo_control_block {
 
 } procinfoCB;
 
+/**
+  @brief The number of PCBs allocated together.
+
+  The process table is allocated on demand, in chunks of this many PCBs,
+  when the free PCBs run out. A chunk is never returned. Therefore, the
+  memory held by the table follows the largest number of processes that
+  existed at the same time, up to @c MAX_PROC.
+*/
+#define PCB_CHUNK_BITS 8
+#define PCB_CHUNK (1 << PCB_CHUNK_BITS)
+
 /**
   @brief Initialize the process table.
 
@@ -141,4 +181,20 @@ Pid_t get_pid(PCB* pcb);
 */
 void curproc_decrement_thread_counter();
 
+/**
+  @brief Terminate the current thread if its process has been killed.
+
+  This is called at the start and at the end of every system call, with
+  the kernel lock held. At these points, the thread holds no kernel 
+  resources, and it can exit safely.
+*/
+void exit_if_killed();
+
+/**
+  @brief Make the threads of a process exit, without changing its exit status.
+
+  The threads are kicked out of the kernel, as by @c Kill().
+*/
+void stop_process(PCB* pcb);
+
 #endif
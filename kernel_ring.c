@@ -0,0 +1,167 @@
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_mem.h"
+
+/*
+	Socket rings.
+
+	A ring is shared by the kernel and the user code of both peers. Only
+	the producer writes head and only the consumer writes tail, so neither
+	side takes a lock to move data. The kernel is entered only to block.
+
+	A side about to block sets its waiting flag, and then checks the ring
+	again, under the kernel lock. The other side, after moving its index,
+	checks the flag and wakes the waiter, which needs the kernel lock too.
+	Both sides order their two accesses with a full fence, so at least one
+	of them sees the other's update, and no wakeup is lost.
+*/
+
+static void ring_cb_ctor(void* obj){
+	ring_cb* ringCb = (ring_cb*) obj;
+	ringCb->changed = COND_INIT;
+}
+
+static kmem_cache ring_cache = KMEM_CACHE_INIT("sock_ring", ring_cb, ring_cb_ctor);
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+ring_cb* ring_create(FCB* reader, FCB* writer){
+	ring_cb* ringCb = (ring_cb*) kmem_alloc(&ring_cache);
+	sock_ring* ring = &ringCb->ring;
+	ring->head = ring->tail = 0;
+	ring->reader_waiting = ring->writer_waiting = 0;
+	ring->reader_closed = ring->writer_closed = 0;
+	ringCb->reader = reader;
+	ringCb->writer = writer;
+	ringCb->reader_stats = ringCb->writer_stats = NULL;
+	return ringCb;
+}
+
+static unsigned int ring_used(sock_ring* ring){
+	return LOAD(ring->head) - LOAD(ring->tail);
+}
+
+static int ring_ready(ring_cb* ringCb, int events){
+	sock_ring* ring = &ringCb->ring;
+	if(events == EVENT_READ)
+		return ring_used(ring) > 0 || ringCb->writer == NULL;
+	else
+		return ring_used(ring) < SOCK_RING_SIZE || ringCb->reader == NULL;
+}
+
+int ring_poll(ring_cb* ringCb, int events){
+	int ready = 0;
+	if((events & EVENT_READ) && ring_ready(ringCb, EVENT_READ)) ready |= EVENT_READ;
+	if((events & EVENT_WRITE) && ring_ready(ringCb, EVENT_WRITE)) ready |= EVENT_WRITE;
+	return ready;
+}
+
+int ring_wait(ring_cb* ringCb, int events, timeout_t timeout){
+	int* waiting = (events == EVENT_READ) ? &ringCb->ring.reader_waiting : &ringCb->ring.writer_waiting;
+	TimerDuration deadline = kernel_deadline(timeout);
+
+	int ready;
+	for(;;) {
+		STORE(*waiting, 1);
+		FENCE();
+		if((ready = ring_ready(ringCb, events)))
+			break;
+		TimerDuration t = kernel_time_left(deadline);
+		if(t == 0 || kernel_killed())
+			break;
+		TimerDuration start = bios_clock();
+		kernel_timedwait(&ringCb->changed, SCHED_PIPE, t);
+		wait_stats* stats = (events == EVENT_READ) ? ringCb->reader_stats : ringCb->writer_stats;
+		if(stats) {
+			stats->waits++;
+			stats->wait_time += bios_clock() - start;
+		}
+	}
+	STORE(*waiting, 0);
+	return ready ? 0 : -1;
+}
+
+void ring_wake(ring_cb* ringCb, int events){
+	kernel_broadcast(&ringCb->changed);
+	FCB* fcb = (events == EVENT_READ) ? ringCb->reader : ringCb->writer;
+	if(fcb != NULL)
+		event_notify(fcb, events);
+}
+
+/* Wake the other side, if it waits or is watching for the ring to change */
+static void ring_kick(ring_cb* ringCb, int events, int transition){
+	FENCE();
+	int* waiting = (events == EVENT_READ) ? &ringCb->ring.reader_waiting : &ringCb->ring.writer_waiting;
+	if(LOAD(*waiting) || transition)
+		ring_wake(ringCb, events);
+}
+
+int ring_read(ring_cb* ringCb, char *buf, unsigned int length){
+	sock_ring* ring = &ringCb->ring;
+	if(ringCb->reader == NULL) return -1;
+
+	if(ring_wait(ringCb, EVENT_READ, (timeout_t)-1) == -1) return -1;	/* killed */
+
+	unsigned int tail = ring->tail;
+	unsigned int used = LOAD(ring->head) - tail;
+	if(used == 0) return 0;		/* the writer has closed */
+
+	unsigned int count = used < length ? used : length;
+	for(unsigned int i = 0; i < count; i++)
+		buf[i] = ring->data[(tail+i) & (SOCK_RING_SIZE-1)];
+	STORE(ring->tail, tail + count);
+
+	ring_kick(ringCb, EVENT_WRITE, used == SOCK_RING_SIZE);
+	return count;
+}
+
+int ring_write(ring_cb* ringCb, const char *buf, unsigned int length){
+	sock_ring* ring = &ringCb->ring;
+	unsigned int position = 0;
+
+	while(position < length) {
+		if(ringCb->reader == NULL || ringCb->writer == NULL) return -1;
+		if(ring_wait(ringCb, EVENT_WRITE, (timeout_t)-1) == -1 || kernel_killed())
+			return position > 0 ? position : -1;
+		if(ringCb->reader == NULL || ringCb->writer == NULL) return -1;
+
+		unsigned int head = ring->head;
+		unsigned int used = head - LOAD(ring->tail);
+		unsigned int count = SOCK_RING_SIZE - used;
+		if(count > length - position) count = length - position;
+		for(unsigned int i = 0; i < count; i++)
+			ring->data[(head+i) & (SOCK_RING_SIZE-1)] = buf[position+i];
+		STORE(ring->head, head + count);
+		position += count;
+
+		ring_kick(ringCb, EVENT_READ, used == 0);
+	}
+	return position;
+}
+
+int ring_writer_close(ring_cb* ringCb){
+	ringCb->writer = NULL;
+	ringCb->writer_stats = NULL;
+	STORE(ringCb->ring.writer_closed, 1);
+
+	if(ringCb->reader == NULL)
+		kmem_free(&ring_cache, ringCb);
+	else
+		ring_wake(ringCb, EVENT_READ);	/* The reader will see EOF */
+	return 0;
+}
+
+int ring_reader_close(ring_cb* ringCb){
+	ringCb->reader = NULL;
+	ringCb->reader_stats = NULL;
+	STORE(ringCb->ring.reader_closed, 1);
+
+	if(ringCb->writer == NULL)
+		kmem_free(&ring_cache, ringCb);
+	else
+		ring_wake(ringCb, EVENT_WRITE);	/* The writer will see an error */
+	return 0;
+}
@@ -1,5 +1,7 @@
 
 #include <assert.h>
+#include <string.h>
+#include <time.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
@@ -129,12 +131,14 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->wait_cv = NULL;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
+	memset(&tcb->usage, 0, sizeof(resource_usage));
 
 	tcb->priority=MFQ_LEVEL_NUM-1;
 
@@ -199,6 +203,90 @@ rlnode SCHED[MFQ_LEVEL_NUM]; /* The multilevel scheduler queue */
 rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
 Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
 
+/*
+  Resource accounting.
+
+  At each state change, a thread adds the time since its previous
+  state change to the time of the state it leaves, for itself and for
+  its process. Once a thread has exited, only the thread is charged,
+  since its process may have been reaped already. Idle threads are
+  not accounted.
+
+  The accounting is done under sched_spinlock, and costs a clock read
+  per state change.
+*/
+
+_Static_assert(SCHED_USER + 1 == USAGE_CAUSES, "USAGE_CAUSES must match enum SCHED_CAUSE");
+
+static inline TimerDuration usage_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
+typedef enum { USAGE_CPU, USAGE_READY, USAGE_STOPPED } usage_state;
+
+static void usage_add_time(resource_usage* usage, usage_state what, TimerDuration delta)
+{
+	switch (what) {
+	case USAGE_CPU: usage->cpu_time += delta; break;
+	case USAGE_READY: usage->ready_time += delta; break;
+	case USAGE_STOPPED: usage->stopped_time += delta; break;
+	}
+}
+
+/*
+  Account the time since the last state change of tcb to state 'what'.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_account(TCB* tcb, usage_state what, TimerDuration now)
+{
+	if (tcb->type == IDLE_THREAD) return;
+
+	TimerDuration delta = now - tcb->usage_since;
+	tcb->usage_since = now;
+	usage_add_time(&tcb->usage, what, delta);
+	if (tcb->state != EXITED)
+		usage_add_time(&tcb->owner_pcb->usage, what, delta);
+}
+
+/*
+  Count a context switch of tcb.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_count_switch(TCB* tcb, enum SCHED_CAUSE cause)
+{
+	if (tcb->type == IDLE_THREAD) return;
+
+	int involuntary = (cause == SCHED_QUANTUM);
+	tcb->usage.switches[cause]++;
+	tcb->usage.involuntary += involuntary;
+	tcb->usage.voluntary += !involuntary;
+	if (tcb->state != EXITED) {
+		resource_usage* usage = &tcb->owner_pcb->usage;
+		usage->switches[cause]++;
+		usage->involuntary += involuntary;
+		usage->voluntary += !involuntary;
+	}
+}
+
+void sched_read_usage(const resource_usage* src, resource_usage* dst, int running)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+
+	*dst = *src;
+	if (running)
+		dst->cpu_time += usage_clock() - CURTHREAD->usage_since;
+
+	Mutex_Unlock(&sched_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
@@ -253,6 +341,12 @@ static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
+	/* Account the time blocked; a new thread starts accounting here */
+	if (tcb->state == STOPPED)
+		sched_account(tcb, USAGE_STOPPED, usage_clock());
+	else
+		tcb->usage_since = usage_clock();
+
 	/* Possibly remove from TIMEOUT_LIST */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
 		/* tcb is in TIMEOUT_LIST, fix it */
@@ -368,6 +462,9 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	int preempt = preempt_off;
 	Mutex_Lock(&sched_spinlock);
 
+	/* account the time slice now, since a wakeup may come before yield() */
+	sched_account(tcb, USAGE_CPU, usage_clock());
+
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
 
@@ -462,6 +559,8 @@ void yield(enum SCHED_CAUSE cause)
 	if (current->state == RUNNING)
 		current->state = READY;
 
+	sched_account(current, USAGE_CPU, usage_clock());
+
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
@@ -476,6 +575,9 @@ void yield(enum SCHED_CAUSE cause)
 	TCB* next = sched_queue_select(current);
 	assert(next != NULL);
 
+	if (next != current)
+		sched_count_switch(current, cause);
+
 	/* Save the current TCB for the gain phase */
 	CURCORE.previous_thread = current;
 
@@ -511,6 +613,9 @@ void gain(int preempt)
 
 	TCB* current = CURTHREAD;
 
+	/* Account the time ready */
+	sched_account(current, USAGE_READY, usage_clock());
+
 	/* Mark current state */
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
@@ -608,4 +713,8 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+
+	/* Outside the scheduler, there is no current thread. The kernel may be
+	   booted again, and the idle thread's PCB is gone. */
+	curcore->current_thread = NULL;
 }
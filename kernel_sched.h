@@ -122,6 +122,7 @@ typedef struct thread_control_block {
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	CondVar* wait_cv; /**< @brief The condition this thread waits on in @c kernel_wait(), or NULL */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler lists */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
@@ -130,6 +131,9 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	resource_usage usage; /**< @brief Resource usage of this thread */
+	TimerDuration usage_since; /**< @brief When the time of the current state started to be accounted */
+
 } TCB;
 
 /** @brief Thread stack size.
@@ -254,6 +258,20 @@ void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, T
  */
 void yield(enum SCHED_CAUSE cause);
 
+/**
+  @brief Read resource usage counters.
+
+  The scheduler updates the time and context switch counters of threads and
+  processes under its own lock. This call copies @c src to @c dst under that
+  lock. If @c running is non-zero, the time the current thread has been 
+  running in its current time-slice is added to @c dst.
+
+  @param src the counters of the current thread or its process
+  @param dst where the counters are copied
+  @param running whether to add the current time-slice
+*/
+void sched_read_usage(const resource_usage* src, resource_usage* dst, int running);
+
 /**
   @brief Enter the scheduler.
 
@@ -1,9 +1,159 @@
+#include <string.h>
 
 #include "tinyos.h"
 #include "kernel_streams.h"
 #include "kernel_cc.h"
+#include "kernel_dev.h"
+#include "kernel_mem.h"
 
-socket_cb* portMap[MAX_PORT + 1] = {NULL};
+static void socket_cb_ctor(void* obj){
+	socket_cb* socketCb = (socket_cb*) obj;
+	rlnode_init(&socketCb->port_node, socketCb);
+	rlnode_init(&socketCb->socket_node, socketCb);
+}
+
+static void listener_socket_ctor(void* obj){
+	listener_socket* listener = (listener_socket*) obj;
+	rlnode_new(&listener->queue);
+	listener->req_available = COND_INIT;
+}
+
+static void connection_r_ctor(void* obj){
+	connection_r* request = (connection_r*) obj;
+	request->connected_cv = COND_INIT;
+	rlnode_init(&request->queue_node, request);
+}
+
+static void datagram_socket_ctor(void* obj){
+	datagram_socket* dgram = (datagram_socket*) obj;
+	rlnode_new(&dgram->queue);
+	dgram->msg_available = COND_INIT;
+}
+
+static kmem_cache socket_cache = KMEM_CACHE_INIT("socket_cb", socket_cb, socket_cb_ctor);
+static kmem_cache listener_cache = KMEM_CACHE_INIT("listener_socket", listener_socket, listener_socket_ctor);
+static kmem_cache peer_cache = KMEM_CACHE_INIT("peer_socket", peer_socket, NULL);
+static kmem_cache request_cache = KMEM_CACHE_INIT("connection_r", connection_r, connection_r_ctor);
+static kmem_cache dgram_cache = KMEM_CACHE_INIT("datagram_socket", datagram_socket, datagram_socket_ctor);
+
+/* All sockets, for the socket information stream */
+static rlnode socket_list = { .prev = &socket_list, .next = &socket_list };
+
+/*******************************************
+ *
+ * The port table
+ *
+ *******************************************/
+
+/*
+	Bound sockets (listeners, datagram sockets, and connected sockets
+	holding an ephemeral port) are kept in a hash table keyed by port, with separate chaining
+	through socket_cb->port_node. The table doubles when the average chain
+	grows beyond PORT_TABLE_LOAD.
+
+	The table is only accessed by system calls, which hold the kernel lock,
+	so lookups take no lock of their own.
+*/
+
+#define PORT_TABLE_MIN_BITS 6
+#define PORT_TABLE_LOAD 2
+
+static struct {
+	rlnode* buckets;			/* 1<<bits list heads */
+	unsigned int bits;
+	unsigned int count;			/* number of bound sockets */
+	port_t next_ephemeral;		/* where to start looking for a free ephemeral port */
+} port_table = { NULL, 0, 0, MIN_EPHEMERAL_PORT };
+
+static rlnode* port_bucket(port_t port){
+	/* Fibonacci hashing, take the high bits */
+	uint32_t h = (uint32_t)port * 2654435761u;
+	return &port_table.buckets[h >> (32 - port_table.bits)];
+}
+
+static void port_table_resize(unsigned int bits){
+	rlnode* old = port_table.buckets;
+	unsigned int oldsize = old ? (1u << port_table.bits) : 0;
+
+	port_table.bits = bits;
+	port_table.buckets = (rlnode*) xmalloc(sizeof(rlnode) << bits);
+	for(unsigned int i = 0; i < (1u << bits); i++)
+		rlnode_new(&port_table.buckets[i]);
+
+	for(unsigned int i = 0; i < oldsize; i++) {
+		while(! is_rlist_empty(&old[i])) {
+			socket_cb* socketCb = rlist_pop_front(&old[i])->obj;
+			rlist_push_back(port_bucket(socketCb->port), &socketCb->port_node);
+		}
+	}
+	free(old);
+}
+
+/* Return the socket bound on a port, or NULL */
+socket_cb* port_lookup(port_t port){
+	if(port_table.count == 0) return NULL;
+
+	rlnode* bucket = port_bucket(port);
+	for(rlnode* p = bucket->next; p != bucket; p = p->next)
+		if(((socket_cb*) p->obj)->port == port)
+			return p->obj;
+	return NULL;
+}
+
+/*
+	Return the listener on a port to queue a connection request on.
+
+	With SOCKOPT_REUSEPORT, many listeners share a port. The one with the
+	fewest pending requests is chosen, and it is moved to the back of its
+	chain, so that listeners with equal queues take turns.
+*/
+socket_cb* port_listener(port_t port){
+	if(port_table.count == 0) return NULL;
+
+	rlnode* bucket = port_bucket(port);
+	socket_cb* best = NULL;
+	for(rlnode* p = bucket->next; p != bucket; p = p->next) {
+		socket_cb* socketCb = p->obj;
+		if(socketCb->port != port || socketCb->type != SOCKET_LISTENER)
+			continue;
+		if(best == NULL || socketCb->listener_s->pending < best->listener_s->pending)
+			best = socketCb;
+	}
+
+	if(best != NULL && best->reuseport) {
+		rlist_remove(&best->port_node);
+		rlist_push_back(bucket, &best->port_node);
+	}
+	return best;
+}
+
+static void port_bind(socket_cb* socketCb){
+	if(port_table.buckets == NULL)
+		port_table_resize(PORT_TABLE_MIN_BITS);
+	else if(port_table.count >= (PORT_TABLE_LOAD << port_table.bits))
+		port_table_resize(port_table.bits + 1);
+
+	rlist_push_back(port_bucket(socketCb->port), &socketCb->port_node);
+	port_table.count++;
+}
+
+static void port_unbind(socket_cb* socketCb){
+	if(is_rlist_empty(&socketCb->port_node)) return;	/* not bound */
+	rlist_remove(&socketCb->port_node);
+	port_table.count--;
+}
+
+/* Find a free ephemeral port, or return NOPORT */
+static port_t port_ephemeral(){
+	const port_t range = MAX_PORT - MIN_EPHEMERAL_PORT + 1;
+	for(port_t i = 0; i < range; i++) {
+		port_t port = port_table.next_ephemeral;
+		port_table.next_ephemeral = (port == MAX_PORT) ? MIN_EPHEMERAL_PORT : port + 1;
+		if(port_lookup(port) == NULL)
+			return port;
+	}
+	return NOPORT;
+}
 
 /*******************************************
  *
@@ -15,11 +165,22 @@ void* invalid_socket_open(uint minor){
   return NULL;
 }
 
+int datagram_recv(socket_cb* socketCb, char* buf, unsigned int size, port_t* from, timeout_t timeout);
+
 int socket_read(void *this, char *buf, unsigned int length){
 	socket_cb *socketCb = (socket_cb*) this;
 
 	if (socketCb->type == SOCKET_PEER){
-		return pipe_read(socketCb->peer_s->read_pipe, buf, length);
+		int n = socketCb->ring ?
+			ring_read(socketCb->peer_s->read_ring, buf, length) :
+			pipe_read(socketCb->peer_s->read_pipe, buf, length);
+		if (n > 0)
+			socketCb->bytes_in += n;
+		return n;
+	}
+
+	if (socketCb->type == SOCKET_DATAGRAM){
+		return datagram_recv(socketCb, buf, length, NULL, (timeout_t)-1);
 	}
 
 	return -1;
@@ -29,21 +190,38 @@ int socket_write(void *this, const char *buf, unsigned int length){
 	socket_cb *socketCb = (socket_cb*) this;
 
 	if (socketCb->type == SOCKET_PEER){
-		return pipe_write(socketCb->peer_s->write_pipe, buf, length);
+		int n = socketCb->ring ?
+			ring_write(socketCb->peer_s->write_ring, buf, length) :
+			pipe_write(socketCb->peer_s->write_pipe, buf, length);
+		if (n > 0)
+			socketCb->bytes_out += n;
+		return n;
 	}
 
 	return -1;
 }
 
+int socket_reader_close(socket_cb *socketCb){
+	if (socketCb->ring)
+		return ring_reader_close(socketCb->peer_s->read_ring);
+	return pipe_reader_close(socketCb->peer_s->read_pipe);
+}
+
+int socket_writer_close(socket_cb *socketCb){
+	if (socketCb->ring)
+		return ring_writer_close(socketCb->peer_s->write_ring);
+	return pipe_writer_close(socketCb->peer_s->write_pipe);
+}
+
 int socket_complete_shutdown(socket_cb *socketCb){
 	int returnValue = 0;
 	switch (socketCb->type){
 		case SOCKET_PEER:
 			if (socketCb->peer_s->peer != NULL){ // prevent double free from peer
-				returnValue = pipe_reader_close(socketCb->peer_s->read_pipe);
+				returnValue = socket_reader_close(socketCb);
 				if (returnValue != 0)
 					return returnValue;
-				returnValue = pipe_writer_close(socketCb->peer_s->write_pipe);
+				returnValue = socket_writer_close(socketCb);
 				if (returnValue != 0)
 					return returnValue;
 				socketCb->peer_s->peer->peer_s->peer = NULL;
@@ -59,17 +237,26 @@ int socket_complete_shutdown(socket_cb *socketCb){
 void release_socket_cb(socket_cb *socketCb){
 	switch (socketCb->type){
 		case SOCKET_PEER:
-			free(socketCb->peer_s);
+			kmem_free(&peer_cache, socketCb->peer_s);
 			break;
 		case SOCKET_LISTENER:
-			portMap[socketCb->port] = NULL;
-			free(socketCb->listener_s);
+			/* Unlink pending requests, their connectors still own them */
+			while (!is_rlist_empty(&socketCb->listener_s->queue))
+				rlist_pop_front(&socketCb->listener_s->queue);
+			kmem_free(&listener_cache, socketCb->listener_s);
+			break;
+		case SOCKET_DATAGRAM:
+			while (!is_rlist_empty(&socketCb->dgram_s->queue))
+				free(rlist_pop_front(&socketCb->dgram_s->queue)->obj);
+			kmem_free(&dgram_cache, socketCb->dgram_s);
 			break;
 		case SOCKET_UNBOUND:
 			// intentionally left blank
 			break;
 	}
-	free(socketCb);
+	port_unbind(socketCb);
+	rlist_remove(&socketCb->socket_node);
+	kmem_free(&socket_cache, socketCb);
 }
 
 int socket_refcount_decrement(socket_cb *socketCb){
@@ -90,11 +277,31 @@ int socket_close(void *this){
 	return socket_refcount_decrement(socketCb);
 }
 
+int socket_poll(void *this){
+	socket_cb *socketCb = (socket_cb*) this;
+
+	switch (socketCb->type){
+		case SOCKET_PEER:
+			if (socketCb->ring)
+				return ring_poll(socketCb->peer_s->read_ring, EVENT_READ)
+					| ring_poll(socketCb->peer_s->write_ring, EVENT_WRITE);
+			return pipe_poll(socketCb->peer_s->read_pipe, EVENT_READ)
+				| pipe_poll(socketCb->peer_s->write_pipe, EVENT_WRITE);
+		case SOCKET_LISTENER:
+			return is_rlist_empty(&socketCb->listener_s->queue) ? 0 : EVENT_READ;
+		case SOCKET_DATAGRAM:
+			return is_rlist_empty(&socketCb->dgram_s->queue) ? 0 : EVENT_READ;
+		default:
+			return 0;
+	}
+}
+
 static file_ops socket_file_ops = {
 	.Open = invalid_socket_open,
 	.Write = socket_write,
 	.Close = socket_close,
-	.Read = socket_read
+	.Read = socket_read,
+	.Poll = socket_poll
 };
 
 /*******************************************
@@ -104,7 +311,7 @@ static file_ops socket_file_ops = {
  *******************************************/
 
 void initialize_socket_cb(port_t port, FCB* fcb){
-	socket_cb* socketCb = (socket_cb*) xmalloc(sizeof(socket_cb));
+	socket_cb* socketCb = (socket_cb*) kmem_alloc(&socket_cache);
 	socketCb->refcount = 1;
 	socketCb->type = SOCKET_UNBOUND;
 	socketCb->listener_s = NULL;
@@ -112,6 +319,16 @@ void initialize_socket_cb(port_t port, FCB* fcb){
 	socketCb->peer_s = NULL;
 	socketCb->fcb = fcb;
 	socketCb->port = port;
+	socketCb->packet = 0;
+	socketCb->backlog = SOCKET_DEFAULT_BACKLOG;
+	socketCb->reuseport = 0;
+	socketCb->ring = 0;
+
+	socketCb->created = bios_clock();
+	socketCb->bytes_in = socketCb->bytes_out = 0;
+	socketCb->read_stats = socketCb->write_stats = (wait_stats){ 0, 0 };
+	socketCb->connect_time = 0;
+	rlist_push_back(&socket_list, &socketCb->socket_node);
 
 	fcb->streamobj = socketCb;
 	fcb->streamfunc = &socket_file_ops;
@@ -140,21 +357,27 @@ Fid_t sys_Socket(port_t port){
 
 socket_cb* get_socket_cb(Fid_t sock){
 	FCB* fcb = get_fcb(sock);
-	return fcb == NULL ? NULL : fcb->streamobj;
+	return (fcb == NULL || fcb->streamfunc != &socket_file_ops) ? NULL : fcb->streamobj;
 }
 
 void socket_listener_init(socket_cb* socketCb){
 	socketCb->type = SOCKET_LISTENER;
-	socketCb->listener_s = (listener_socket*) xmalloc(sizeof(listener_socket));
-	socketCb->listener_s->req_available = COND_INIT;
-	rlnode_new(&socketCb->listener_s->queue);
-	portMap[socketCb->port] = socketCb;
+	socketCb->listener_s = (listener_socket*) kmem_alloc(&listener_cache);
+	socketCb->listener_s->pending = 0;
+	socketCb->listener_s->backlog = socketCb->backlog;
+	socketCb->listener_s->max_pending = 0;
+	port_bind(socketCb);
 }
 
 int sys_Listen(Fid_t sock){
 	socket_cb* socketCb = get_socket_cb(sock);
 
-	if (socketCb == NULL || socketCb->port == NOPORT || socketCb->type != SOCKET_UNBOUND || portMap[socketCb->port] != NULL)
+	if (socketCb == NULL || socketCb->port == NOPORT || socketCb->type != SOCKET_UNBOUND)
+		return -1;
+
+	/* A port can be shared only by listeners that all set SOCKOPT_REUSEPORT */
+	socket_cb* owner = port_lookup(socketCb->port);
+	if (owner != NULL && !(socketCb->reuseport && owner->type == SOCKET_LISTENER && owner->reuseport))
 		return -1;
 
 	socket_listener_init(socketCb);
@@ -167,14 +390,17 @@ int sys_Listen(Fid_t sock){
  *
  *******************************************/
 
-connection_r* wait_for_connection(socket_cb* listeningCb){
+/* Wait until a request is queued; return 0 if the listener was closed meanwhile */
+int wait_for_connection(socket_cb* listeningCb){
 	while (is_rlist_empty(&listeningCb->listener_s->queue) && listeningCb->fcb != NULL){
+		if (kernel_killed()) return 0;
 		kernel_wait(&listeningCb->listener_s->req_available, SCHED_USER);
 	}
+	return listeningCb->fcb != NULL;
+}
 
-	if (listeningCb->fcb == NULL){
-		return NULL;
-	}
+connection_r* pop_connection(socket_cb* listeningCb){
+	listeningCb->listener_s->pending--;
 	return rlist_pop_front(&listeningCb->listener_s->queue)->request;
 }
 
@@ -183,14 +409,27 @@ void connect_peers(Fid_t serverPeerFid, socket_cb* clientPeer){
 	//initialize serverPeer
 	socket_cb* serverPeer = get_socket_cb(serverPeerFid);
 	serverPeer->type = SOCKET_PEER;
-	serverPeer->peer_s = (peer_socket*) xmalloc(sizeof(peer_socket));
+	serverPeer->peer_s = (peer_socket*) kmem_alloc(&peer_cache);
 	serverPeer->peer_s->peer = clientPeer;
 
 	//initialize clientPeer
 	clientPeer->type = SOCKET_PEER;
-	clientPeer->peer_s = (peer_socket*) xmalloc(sizeof(peer_socket));
+	clientPeer->peer_s = (peer_socket*) kmem_alloc(&peer_cache);
 	clientPeer->peer_s->peer = serverPeer;	
 
+	if (clientPeer->ring){
+		ring_cb* ringCb = ring_create(serverPeer->fcb, clientPeer->fcb);
+		ringCb->reader_stats = &serverPeer->read_stats;
+		ringCb->writer_stats = &clientPeer->write_stats;
+		serverPeer->peer_s->read_ring = clientPeer->peer_s->write_ring = ringCb;
+
+		ringCb = ring_create(clientPeer->fcb, serverPeer->fcb);
+		ringCb->reader_stats = &clientPeer->read_stats;
+		ringCb->writer_stats = &serverPeer->write_stats;
+		clientPeer->peer_s->read_ring = serverPeer->peer_s->write_ring = ringCb;
+		return;
+	}
+
 	// read end: server, write end: client
 	Fid_t fid[2];
 	FCB* fcb[2];
@@ -200,6 +439,9 @@ void connect_peers(Fid_t serverPeerFid, socket_cb* clientPeer){
 	fcb[0] = serverPeer->fcb;
 	fcb[1] = clientPeer->fcb;
 	pipe_cb* pipeCb = initialize_pipe_cb(&pipe_client_server, fid, fcb);
+	pipeCb->packet = clientPeer->packet;
+	pipeCb->reader_stats = &serverPeer->read_stats;
+	pipeCb->writer_stats = &clientPeer->write_stats;
 	serverPeer->peer_s->read_pipe = pipeCb;
 	clientPeer->peer_s->write_pipe = pipeCb;
 
@@ -210,40 +452,91 @@ void connect_peers(Fid_t serverPeerFid, socket_cb* clientPeer){
 	fcb[0] = clientPeer->fcb;
 	fcb[1] = serverPeer->fcb;
 	pipeCb = initialize_pipe_cb(&pipe_server_client, fid, fcb);
+	pipeCb->packet = clientPeer->packet;
+	pipeCb->reader_stats = &clientPeer->read_stats;
+	pipeCb->writer_stats = &serverPeer->write_stats;
 	clientPeer->peer_s->read_pipe = pipeCb;
 	serverPeer->peer_s->write_pipe = pipeCb;
 }
 
 
+/* Connect a queued request to a new socket of this process */
+void admit_connection(Fid_t newPeerFid, connection_r* request){
+	connect_peers(newPeerFid, request->peer);
+
+	TimerDuration latency = bios_clock() - request->start;
+	request->peer->connect_time = get_socket_cb(newPeerFid)->connect_time = latency;
+
+	request->admitted = 1;
+	kernel_signal(&request->connected_cv);
+	event_notify(request->peer->fcb, EVENT_WRITE);
+}
+
+Fid_t new_peer_socket(socket_cb* listeningCb){
+	Fid_t newPeerFid = sys_Socket(listeningCb->port);
+	if (newPeerFid != NOFILE){
+		get_socket_cb(newPeerFid)->packet = listeningCb->packet;
+		get_socket_cb(newPeerFid)->ring = listeningCb->ring;
+	}
+	return newPeerFid;
+}
+
 Fid_t sys_Accept(Fid_t lsock){
 	socket_cb* listeningCb = get_socket_cb(lsock);
 
 	if (listeningCb == NULL || listeningCb->type != SOCKET_LISTENER)
 		return NOFILE;
 
+	Fid_t newPeerFid = new_peer_socket(listeningCb);
+	if (newPeerFid == NOFILE)
+		return NOFILE;
+
 	listeningCb->refcount++;
 
-	Fid_t newPeerFid = sys_Socket(listeningCb->port);
-	if (newPeerFid == NOFILE){
-		fprintf(stderr, "newPeerFid == NOFILE");
+	if (! wait_for_connection(listeningCb)){
+		sys_Close(newPeerFid);
+		socket_refcount_decrement(listeningCb);
 		return NOFILE;
 	}
-	
-	connection_r* request = wait_for_connection(listeningCb);
-	if (request == NULL){
-		return NOFILE;
-	}
-
-	connect_peers(newPeerFid, request->peer);
 
-	request->admitted = 1;
-	kernel_signal(&request->connected_cv);
+	admit_connection(newPeerFid, pop_connection(listeningCb));
 
 	socket_refcount_decrement(listeningCb);
 	
 	return newPeerFid;
 }
 
+/*******************************************
+ *
+ * sys_AcceptMany
+ *
+ *******************************************/
+
+int sys_AcceptMany(Fid_t lsock, Fid_t* fids, unsigned int n){
+	socket_cb* listeningCb = get_socket_cb(lsock);
+
+	if (listeningCb == NULL || listeningCb->type != SOCKET_LISTENER || fids == NULL || n == 0)
+		return -1;
+
+	listeningCb->refcount++;
+
+	unsigned int count = 0;
+	if (wait_for_connection(listeningCb)){
+		/* Drain the queue, as far as file ids allow */
+		while (count < n && ! is_rlist_empty(&listeningCb->listener_s->queue)){
+			Fid_t newPeerFid = new_peer_socket(listeningCb);
+			if (newPeerFid == NOFILE)
+				break;
+			admit_connection(newPeerFid, pop_connection(listeningCb));
+			fids[count++] = newPeerFid;
+		}
+	}
+
+	socket_refcount_decrement(listeningCb);
+
+	return count > 0 ? count : -1;
+}
+
 /*******************************************
  *
  * sys_Connect
@@ -251,12 +544,16 @@ Fid_t sys_Accept(Fid_t lsock){
  *******************************************/
 
 connection_r* establish_connection_request(socket_cb* connectingCb, socket_cb* listeningCb){
-	connection_r* request = (connection_r*) xmalloc(sizeof(connection_r));
+	connection_r* request = (connection_r*) kmem_alloc(&request_cache);
 	request->admitted = 0;
-	request->connected_cv = COND_INIT;
 	request->peer = connectingCb;
+	request->start = bios_clock();
 
-	rlist_push_back(&listeningCb->listener_s->queue, rlnode_init(&request->queue_node, request));
+	listener_socket* listener = listeningCb->listener_s;
+	rlist_push_back(&listener->queue, &request->queue_node);
+	listener->pending++;
+	if (listener->pending > listener->max_pending)
+		listener->max_pending = listener->pending;
 	return request;
 }
 
@@ -264,26 +561,378 @@ connection_r* establish_connection_request(socket_cb* connectingCb, socket_cb* l
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout){
 	socket_cb* connectingCb = get_socket_cb(sock);
 
-	if (connectingCb == NULL || connectingCb->port < NOPORT || connectingCb->port > MAX_PORT
-		|| connectingCb->type != SOCKET_UNBOUND || portMap[port] == NULL || portMap[port]->type != SOCKET_LISTENER)
+	if (connectingCb == NULL || connectingCb->type != SOCKET_UNBOUND || port <= NOPORT || port > MAX_PORT)
+		return -1;
+
+	socket_cb* listeningCb = port_listener(port);
+	if (listeningCb == NULL || connectingCb->packet != listeningCb->packet || connectingCb->ring != listeningCb->ring)
+		return -1;
+
+	/* Fail fast when the backlog is full */
+	if (listeningCb->listener_s->pending >= listeningCb->listener_s->backlog)
 		return -1;
 
+	/* An unbound socket gets an ephemeral port for the connection */
+	int ephemeral = (connectingCb->port == NOPORT);
+	if (ephemeral){
+		connectingCb->port = port_ephemeral();
+		if (connectingCb->port == NOPORT)
+			return -1;
+		port_bind(connectingCb);
+	}
+
 	connectingCb->refcount++;
 
-	socket_cb* listeningCb = portMap[port];
 	connection_r* request = establish_connection_request(connectingCb, listeningCb);
 
 	kernel_signal(&listeningCb->listener_s->req_available);
+	event_notify(listeningCb->fcb, EVENT_READ);
 
-	kernel_timedwait(&request->connected_cv, SCHED_USER, timeout);
+	/* The timeout is in msec */
+	TimerDuration t = (timeout == (timeout_t)-1) ? NO_TIMEOUT : timeout*1000ul;
+	kernel_timedwait(&request->connected_cv, SCHED_USER, t);
 
 	int admitted = request->admitted;
 
+	/* Give back the ephemeral port of a failed connection */
+	if (!admitted && ephemeral){
+		port_unbind(connectingCb);
+		connectingCb->port = NOPORT;
+	}
+
+	/* If it timed out while queued, the listener is still there */
+	if (! is_rlist_empty(&request->queue_node)){
+		rlist_remove(&request->queue_node);
+		listeningCb->listener_s->pending--;
+	}
+
 	socket_refcount_decrement(connectingCb);
-	free(request);
+	kmem_free(&request_cache, request);
 	return admitted - 1;
 }
 
+/*******************************************
+ *
+ * Datagram sockets
+ *
+ *******************************************/
+
+Fid_t sys_DatagramSocket(port_t port){
+	if (port < NOPORT || port > MAX_PORT || (port != NOPORT && port_lookup(port) != NULL))
+		return NOFILE;
+
+	if (port == NOPORT && (port = port_ephemeral()) == NOPORT)
+		return NOFILE;
+
+	Fid_t fid = sys_Socket(port);
+	if (fid == NOFILE)
+		return NOFILE;
+
+	socket_cb* socketCb = get_socket_cb(fid);
+	socketCb->type = SOCKET_DATAGRAM;
+	socketCb->dgram_s = (datagram_socket*) kmem_alloc(&dgram_cache);
+	socketCb->dgram_s->queued = 0;
+	socketCb->dgram_s->max_queued = SOCKET_DEFAULT_DGRAM_QUEUE;
+	socketCb->dgram_s->sent = socketCb->dgram_s->received = socketCb->dgram_s->dropped = 0;
+	port_bind(socketCb);
+
+	return fid;
+}
+
+static socket_cb* get_datagram_socket(Fid_t sock){
+	socket_cb* socketCb = get_socket_cb(sock);
+	return (socketCb == NULL || socketCb->type != SOCKET_DATAGRAM) ? NULL : socketCb;
+}
+
+int sys_SendTo(Fid_t sock, port_t port, const char* buf, unsigned int size){
+	socket_cb* senderCb = get_datagram_socket(sock);
+	if (senderCb == NULL || size > MAX_DATAGRAM_SIZE || port <= NOPORT || port > MAX_PORT)
+		return -1;
+
+	socket_cb* receiverCb = port_lookup(port);
+	if (receiverCb == NULL || receiverCb->type != SOCKET_DATAGRAM)
+		return -1;
+
+	senderCb->dgram_s->sent++;
+	senderCb->bytes_out += size;
+
+	datagram_socket* dgram = receiverCb->dgram_s;
+	if (dgram->queued >= dgram->max_queued){
+		dgram->dropped++;
+		return 0;
+	}
+
+	datagram* msg = (datagram*) xmalloc(sizeof(datagram) + size);
+	rlnode_init(&msg->node, msg);
+	msg->from = senderCb->port;
+	msg->size = size;
+	memcpy(msg->data, buf, size);
+
+	rlist_push_back(&dgram->queue, &msg->node);
+	dgram->queued++;
+	dgram->received++;
+
+	kernel_signal(&dgram->msg_available);
+	event_notify(receiverCb->fcb, EVENT_READ);
+	return size;
+}
+
+int datagram_recv(socket_cb* socketCb, char* buf, unsigned int size, port_t* from, timeout_t timeout){
+	datagram_socket* dgram = socketCb->dgram_s;
+
+	TimerDuration deadline = kernel_deadline(timeout);
+	while (is_rlist_empty(&dgram->queue)){
+		TimerDuration t = kernel_time_left(deadline);
+		if (t == 0 || kernel_killed())
+			break;
+		TimerDuration start = bios_clock();
+		kernel_timedwait(&dgram->msg_available, SCHED_IO, t);
+		socketCb->read_stats.waits++;
+		socketCb->read_stats.wait_time += bios_clock() - start;
+	}
+	if (is_rlist_empty(&dgram->queue))
+		return -1;
+
+	datagram* msg = rlist_pop_front(&dgram->queue)->obj;
+	dgram->queued--;
+
+	unsigned int n = (msg->size < size) ? msg->size : size;
+	memcpy(buf, msg->data, n);
+	if (from != NULL)
+		*from = msg->from;
+	free(msg);
+	socketCb->bytes_in += n;
+	return n;
+}
+
+int sys_RecvFrom(Fid_t sock, char* buf, unsigned int size, port_t* from, timeout_t timeout){
+	socket_cb* socketCb = get_datagram_socket(sock);
+	if (socketCb == NULL)
+		return -1;
+
+	/* make sure that the socket will not be closed (by another thread)
+	   while we are waiting on it! */
+	FCB* fcb = socketCb->fcb;
+	FCB_incref(fcb);
+	int n = datagram_recv(socketCb, buf, size, from, timeout);
+	FCB_decref(fcb);
+	return n;
+}
+
+int sys_GetDatagramStats(Fid_t sock, datagram_stats* stats){
+	socket_cb* socketCb = get_datagram_socket(sock);
+	if (socketCb == NULL || stats == NULL)
+		return -1;
+
+	stats->queued = socketCb->dgram_s->queued;
+	stats->sent = socketCb->dgram_s->sent;
+	stats->received = socketCb->dgram_s->received;
+	stats->dropped = socketCb->dgram_s->dropped;
+	return 0;
+}
+
+/*******************************************
+ *
+ * Socket information stream
+ *
+ *******************************************/
+
+typedef struct sockinfo_cb {
+	unsigned int cursor;
+} sockinfo_cb;
+
+static socket_cb* socket_at(unsigned int n){
+	for(rlnode* p = socket_list.next; p != &socket_list; p = p->next)
+		if(n-- == 0)
+			return p->obj;
+	return NULL;
+}
+
+static void socket_stats(socket_cb* socketCb, sockinfo* info){
+	memset(info, 0, sizeof(sockinfo));
+	info->port = socketCb->port;
+	info->peer_port = NOPORT;
+	info->age = bios_clock() - socketCb->created;
+	info->bytes_in = socketCb->bytes_in;
+	info->bytes_out = socketCb->bytes_out;
+	info->read_waits = socketCb->read_stats.waits;
+	info->read_wait_time = socketCb->read_stats.wait_time;
+	info->write_waits = socketCb->write_stats.waits;
+	info->write_wait_time = socketCb->write_stats.wait_time;
+	info->connect_time = socketCb->connect_time;
+
+	switch (socketCb->type){
+		case SOCKET_UNBOUND:
+			info->type = SOCKINFO_UNBOUND;
+			break;
+		case SOCKET_LISTENER:
+			info->type = SOCKINFO_LISTENER;
+			info->pending = socketCb->listener_s->pending;
+			info->max_pending = socketCb->listener_s->max_pending;
+			break;
+		case SOCKET_PEER:
+			info->type = SOCKINFO_PEER;
+			if (socketCb->peer_s->peer != NULL)
+				info->peer_port = socketCb->peer_s->peer->port;
+			break;
+		case SOCKET_DATAGRAM:
+			info->type = SOCKINFO_DATAGRAM;
+			info->pending = socketCb->dgram_s->queued;
+			info->dgram_sent = socketCb->dgram_s->sent;
+			info->dgram_received = socketCb->dgram_s->received;
+			info->dgram_dropped = socketCb->dgram_s->dropped;
+			break;
+	}
+}
+
+static int sockinfo_read(void* this, char* buf, unsigned int size){
+	sockinfo_cb* infoCB = (sockinfo_cb*) this;
+
+	if (size < sizeof(sockinfo))
+		return -1;
+
+	socket_cb* socketCb = socket_at(infoCB->cursor);
+	if (socketCb == NULL)
+		return 0;
+
+	socket_stats(socketCb, (sockinfo*) buf);
+	infoCB->cursor++;
+	return sizeof(sockinfo);
+}
+
+static int sockinfo_close(void* this){
+	free(this);
+	return 0;
+}
+
+static int invalid_sockinfo_write(void* this, const char* buf, unsigned int size){
+	return -1;
+}
+
+static file_ops sockinfo_ops = {
+	.Open = invalid_socket_open,
+	.Read = sockinfo_read,
+	.Write = invalid_sockinfo_write,
+	.Close = sockinfo_close
+};
+
+Fid_t sys_OpenSockInfo(){
+	Fid_t fid;
+	FCB* fcb;
+
+	if (! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	sockinfo_cb* infoCB = (sockinfo_cb*) xmalloc(sizeof(sockinfo_cb));
+	infoCB->cursor = 0;
+
+	fcb->streamobj = infoCB;
+	fcb->streamfunc = &sockinfo_ops;
+
+	return fid;
+}
+
+/*******************************************
+ *
+ * sys_GetSockPort
+ *
+ *******************************************/
+
+port_t sys_GetSockPort(Fid_t sock){
+	socket_cb* socketCb = get_socket_cb(sock);
+	return socketCb == NULL ? -1 : socketCb->port;
+}
+
+/*******************************************
+ *
+ * sys_SetSockOpt
+ *
+ *******************************************/
+
+int sys_SetSockOpt(Fid_t sock, socket_option option, int value){
+	socket_cb* socketCb = get_socket_cb(sock);
+
+	if (socketCb == NULL)
+		return -1;
+
+	/* The queue length of a datagram socket can change at any time */
+	if (socketCb->type == SOCKET_DATAGRAM && option == SOCKOPT_BACKLOG && value >= 1){
+		socketCb->dgram_s->max_queued = value;
+		return 0;
+	}
+
+	if (socketCb->type != SOCKET_UNBOUND)
+		return -1;
+
+	switch (option){
+		case SOCKOPT_PACKET:
+			if (value && socketCb->ring)
+				return -1;
+			socketCb->packet = (value != 0);
+			return 0;
+		case SOCKOPT_BACKLOG:
+			if (value < 1)
+				return -1;
+			socketCb->backlog = value;
+			return 0;
+		case SOCKOPT_REUSEPORT:
+			socketCb->reuseport = (value != 0);
+			return 0;
+		case SOCKOPT_RING:
+			if (value && socketCb->packet)
+				return -1;
+			socketCb->ring = (value != 0);
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/*******************************************
+ *
+ * Ring mode
+ *
+ *******************************************/
+
+static socket_cb* get_ring_socket(Fid_t sock){
+	socket_cb* socketCb = get_socket_cb(sock);
+	return (socketCb == NULL || socketCb->type != SOCKET_PEER || !socketCb->ring) ? NULL : socketCb;
+}
+
+int sys_SockRing(Fid_t sock, sock_ring** rx, sock_ring** tx){
+	socket_cb* socketCb = get_ring_socket(sock);
+	if (socketCb == NULL || rx == NULL || tx == NULL)
+		return -1;
+
+	*rx = &socketCb->peer_s->read_ring->ring;
+	*tx = &socketCb->peer_s->write_ring->ring;
+	return 0;
+}
+
+int sys_SockRingWait(Fid_t sock, int events, timeout_t timeout){
+	socket_cb* socketCb = get_ring_socket(sock);
+	if (socketCb == NULL || (events != EVENT_READ && events != EVENT_WRITE))
+		return -1;
+
+	/* make sure that the socket will not be closed (by another thread)
+	   while we are waiting on it! */
+	FCB* fcb = socketCb->fcb;
+	FCB_incref(fcb);
+	ring_cb* ringCb = (events == EVENT_READ) ? socketCb->peer_s->read_ring : socketCb->peer_s->write_ring;
+	int ret = ring_wait(ringCb, events, timeout);
+	FCB_decref(fcb);
+	return ret;
+}
+
+int sys_SockRingWake(Fid_t sock, int events){
+	socket_cb* socketCb = get_ring_socket(sock);
+	if (socketCb == NULL || (events != EVENT_READ && events != EVENT_WRITE))
+		return -1;
+
+	ring_wake((events == EVENT_READ) ? socketCb->peer_s->write_ring : socketCb->peer_s->read_ring, events);
+	return 0;
+}
+
 /*******************************************
  *
  * sys_ShutDown
@@ -294,13 +943,17 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how){
 	socket_cb* socketCb = get_socket_cb(sock);
 	int returnValue = -1;
 
+	/* Connections from the host are shut down by the bios */
+	if (socketCb == NULL)
+		return net_shutdown(sock, how);
+
 	if (socketCb != NULL && socketCb->type == SOCKET_PEER){
 		switch (how) {
 			case SHUTDOWN_READ:
-				returnValue = pipe_reader_close(socketCb->peer_s->read_pipe);
+				returnValue = socket_reader_close(socketCb);
 				break;
 			case SHUTDOWN_WRITE:
-				returnValue = pipe_writer_close(socketCb->peer_s->write_pipe);
+				returnValue = socket_writer_close(socketCb);
 				break;
 			case SHUTDOWN_BOTH:
 				returnValue = socket_complete_shutdown(socketCb);
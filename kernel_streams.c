@@ -1,3 +1,4 @@
+#include <string.h>
 
 #include "util.h"
 #include "tinyos.h"
@@ -5,53 +6,48 @@
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_mem.h"
 
-#define MAX_FILES MAX_PROC
 
-FCB FT[MAX_FILES];
-rlnode FCB_freelist;
-
-
-void initialize_files()
+/* 
+  FCBs come from an object cache, which keeps a magazine of free FCBs
+  per core and grows on demand. There is no limit on the number of FCBs,
+  other than MAX_FILEID per process.
+ */
+static void FCB_ctor(void* obj)
 {
-  rlnode_init(&FCB_freelist,NULL);
-  for(int i=0;i<MAX_FILES;i++) {
-
-    FT[i].refcount = 0;
-    rlnode_init(& FT[i].freelist_node, &FT[i]);
-    rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
-  }
+  FCB* fcb = (FCB*) obj;
+  rlnode_init(& fcb->watchers, NULL);
 }
 
+static kmem_cache FCB_cache = KMEM_CACHE_INIT("FCB", FCB, FCB_ctor);
+
 
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
-    fcb->refcount = 0;
-    return fcb;
-  }
-  else
-    return NULL;
+  FCB* fcb = (FCB*) kmem_alloc(& FCB_cache);
+  fcb->refcount = 0;
+  fcb->event_list = & fcb->watchers;
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  event_release_fcb(fcb);
+  kmem_free(& FCB_cache, fcb);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -62,20 +58,160 @@ int FCB_decref(FCB* fcb)
 
 
 
+/*
+ *
+ *   The fid table
+ *
+ */
+
+#define FIDT_MIN_SIZE FID_WORD_BITS
+#define FIDT_MAX_SIZE ((MAX_FILEID + FID_WORD_BITS - 1) / FID_WORD_BITS * FID_WORD_BITS)
+
+_Static_assert(FIDT_MAX_SIZE <= FID_WORD_BITS * FID_WORD_BITS, "MAX_FILEID is too large");
+
+
+/* Grow the table to hold at least `size` fids */
+static void fidt_grow(fid_table* fidt, unsigned int size)
+{
+  unsigned int newsize = (fidt->size == 0) ? FIDT_MIN_SIZE : fidt->size;
+  while(newsize < size) newsize *= 2;
+  if(newsize > FIDT_MAX_SIZE) newsize = FIDT_MAX_SIZE;
+  if(newsize <= fidt->size) return;
+
+  /* The entries and the two bitmaps are kept in one block */
+  unsigned int words = newsize / FID_WORD_BITS;
+  FCB** fcb = (FCB**) xmalloc(newsize*sizeof(FCB*) + 2*words*sizeof(unsigned long));
+  unsigned long* used = (unsigned long*) (fcb + newsize);
+  unsigned long* cloexec = used + words;
+
+  memset(fcb, 0, newsize*sizeof(FCB*) + 2*words*sizeof(unsigned long));
+  if(fidt->size > 0) {
+    unsigned int oldwords = fidt->size / FID_WORD_BITS;
+    memcpy(fcb, fidt->fcb, fidt->size*sizeof(FCB*));
+    memcpy(used, fidt->used, oldwords*sizeof(unsigned long));
+    memcpy(cloexec, fidt->cloexec, oldwords*sizeof(unsigned long));
+    free(fidt->fcb);
+  }
+
+  fidt->fcb = fcb;
+  fidt->used = used;
+  fidt->cloexec = cloexec;
+  fidt->size = newsize;
+}
+
+
+/* Mark a fid as used, growing the table if needed */
+static void fidt_take(fid_table* fidt, Fid_t fid)
+{
+  if((unsigned int) fid >= fidt->size)
+    fidt_grow(fidt, fid+1);
+
+  unsigned int w = fid / FID_WORD_BITS;
+  fidt->used[w] |= 1ul << (fid % FID_WORD_BITS);
+  fidt->cloexec[w] &= ~(1ul << (fid % FID_WORD_BITS));
+  if(fidt->used[w] == ~0ul)
+    fidt->full |= 1ul << w;
+}
+
+
+/* Free a fid */
+static void fidt_put(fid_table* fidt, Fid_t fid)
+{
+  unsigned int w = fid / FID_WORD_BITS;
+  fidt->fcb[fid] = NULL;
+  fidt->used[w] &= ~(1ul << (fid % FID_WORD_BITS));
+  fidt->cloexec[w] &= ~(1ul << (fid % FID_WORD_BITS));
+  fidt->full &= ~(1ul << w);
+}
+
+
+/* Return the lowest free fid and mark it as used, or NOFILE */
+static Fid_t fidt_alloc(fid_table* fidt)
+{
+  /* The first word that is not full; words past the end of the table are free */
+  if(fidt->full == ~0ul) return NOFILE;
+  unsigned int w = __builtin_ctzl(~fidt->full);
+
+  Fid_t fid = w * FID_WORD_BITS;
+  if(fid < fidt->size)
+    fid += __builtin_ctzl(~fidt->used[w]);
+  if(fid >= MAX_FILEID) return NOFILE;
+
+  fidt_take(fidt, fid);
+  return fid;
+}
+
+
+/* Return the FCB of a fid, or NULL */
+static FCB* fidt_get(fid_table* fidt, Fid_t fid)
+{
+  if(fid < 0 || (unsigned int) fid >= fidt->size) return NULL;
+  return fidt->fcb[fid];
+}
+
+
+void fidt_inherit(fid_table* dst, fid_table* src)
+{
+  assert(dst->size == 0);
+  unsigned int words = src->size / FID_WORD_BITS;
+
+  /* Size the table for the highest inherited fid */
+  int last = -1;
+  for(unsigned int w = 0; w < words; w++)
+    if(src->used[w] & ~src->cloexec[w]) last = w;
+  if(last < 0) return;
+  fidt_grow(dst, (last+1) * FID_WORD_BITS);
+
+  for(unsigned int w = 0; w <= (unsigned int) last; w++) {
+    unsigned long word = src->used[w] & ~src->cloexec[w];
+    while(word) {
+      Fid_t fid = w * FID_WORD_BITS + __builtin_ctzl(word);
+      word &= word - 1;
+      fidt_take(dst, fid);
+      dst->fcb[fid] = src->fcb[fid];
+      FCB_incref(dst->fcb[fid]);
+    }
+  }
+}
+
+
+void fidt_close_all(fid_table* fidt)
+{
+  unsigned int words = fidt->size / FID_WORD_BITS;
+  for(unsigned int w = 0; w < words; w++) {
+    unsigned long word = fidt->used[w];
+    while(word) {
+      Fid_t fid = w * FID_WORD_BITS + __builtin_ctzl(word);
+      word &= word - 1;
+      FCB* fcb = fidt->fcb[fid];
+      fidt_put(fidt, fid);
+      if(fcb) FCB_decref(fcb);
+    }
+  }
+
+  free(fidt->fcb);
+  memset(fidt, 0, sizeof(fid_table));
+}
+
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
-    size_t f=0;
+    fid_table* fidt = & CURPROC->FIDT;
     uint i;
 
     /* Find distinct fids */
-    for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
-	fid[i] = f; f++;
+    for(i=0; i<num; i++)
+	if((fid[i] = fidt_alloc(fidt)) == NOFILE)
+	    break;
+    if(i<num) {
+	/* Roll back */
+	while(i>0) {
+	    fidt_put(fidt, fid[i-1]);
+	    i--;
+	}
+	return 0;
     }
-    if(i<num) return 0;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,11 +222,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
+	for(i=0;i<num;i++)
+	    fidt_put(fidt, fid[i]);
 	return 0;
     }
     /* Found all */
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
+	fidt->fcb[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
     return 1;
@@ -100,10 +238,10 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
+    fid_table* fidt = & CURPROC->FIDT;
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	assert(fidt->fcb[fid[i]]==fcb[i]);
+	fidt_put(fidt, fid[i]);
 	release_FCB(fcb[i]);
     }
 }
@@ -122,13 +260,11 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 
 FCB* get_fcb(Fid_t fid)
 {
-  if(fid < 0 || fid >= MAX_FILEID) return NULL;
-
-  return CURPROC->FIDT[fid];
+  return fidt_get(& CURPROC->FIDT, fid);
 }
 
 Fid_t get_fid(FCB** fcb){
-  return fcb==NULL ? NOFILE : fcb - CURPROC->FIDT;
+  return fcb==NULL ? NOFILE : fcb - CURPROC->FIDT.fcb;
 }
 
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
@@ -152,6 +288,11 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     if(devread)
       retcode = devread(sobj, buf, size);
 
+    if(retcode > 0) {
+      CURTHREAD->usage.bytes_read += retcode;
+      CURPROC->usage.bytes_read += retcode;
+    }
+
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
@@ -186,6 +327,11 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
+    if(retcode > 0) {
+      CURTHREAD->usage.bytes_written += retcode;
+      CURPROC->usage.bytes_written += retcode;
+    }
+
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
 
@@ -196,14 +342,14 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
-int sys_Close(int fd)
+int fidt_close(fid_table* fidt, Fid_t fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = fidt_get(fidt, fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+    fidt_put(fidt, fd);
     retcode = FCB_decref(fcb);    
   }
 
@@ -211,6 +357,12 @@ int sys_Close(int fd)
 }
 
 
+int sys_Close(int fd)
+{
+  return fidt_close(& CURPROC->FIDT, fd);
+}
+
+
 /*
   Copy file descriptor oldfd into file descriptor newfd.
 
@@ -218,14 +370,14 @@ int sys_Close(int fd)
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
  */
-int sys_Dup2(int oldfd, int newfd)
+int fidt_dup2(fid_table* fidt, Fid_t oldfd, Fid_t newfd)
 {
   int retcode=0;
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  FCB* old = fidt_get(fidt, oldfd);
+  FCB* new = fidt_get(fidt, newfd);
 
   if(old==NULL) {
     retcode = -1;
@@ -234,13 +386,35 @@ int sys_Dup2(int oldfd, int newfd)
     if(new)
       FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    fidt_take(fidt, newfd);
+    fidt->fcb[newfd] = old;
   }
 
   return retcode;
 }
 
 
+int sys_Dup2(int oldfd, int newfd)
+{
+  return fidt_dup2(& CURPROC->FIDT, oldfd, newfd);
+}
+
+
+int sys_SetCloseOnExec(Fid_t fd, int flag)
+{
+  if(get_fcb(fd) == NULL)
+    return -1;
+
+  fid_table* fidt = & CURPROC->FIDT;
+  unsigned long bit = 1ul << (fd % FID_WORD_BITS);
+  if(flag)
+    fidt->cloexec[fd / FID_WORD_BITS] |= bit;
+  else
+    fidt->cloexec[fd / FID_WORD_BITS] &= ~bit;
+  return 0;
+}
+
+
 
 unsigned int sys_GetTerminalDevices()
 {
@@ -264,6 +438,11 @@ Fid_t open_stream(Device_type major, unsigned int minor)
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+
+  /* Devices may keep their own list of event queue registrations */
+  rlnode* watchers = device_watchers(major, minor);
+  if(watchers != NULL)
+      fcb->event_list = watchers;
   
   goto finok;
 finerr:
@@ -40,33 +40,80 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter, updated atomically. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
-  rlnode freelist_node;		/**< @brief Intrusive list node */
+  rlnode watchers;			/**< @brief Event queue registrations on this stream */
+  rlnode* event_list;		/**< @brief The list that holds the registrations for this
+  								stream. This is usually @c watchers, but device streams
+  								share a per-device list. */
 } FCB;
 
+/**
+	@brief The file id table of a process.
+
+	The table is allocated when the first fid is used, and grows on
+	demand, doubling its size, up to @c MAX_FILEID entries. Bitmap
+	@c used marks the fids in use, and bit @c w of @c full is set when
+	word @c w of @c used is full. Therefore, the lowest free fid is found
+	with two bit scans. Bitmap @c cloexec marks the fids that are not
+	inherited by @c Exec().
+ */
+typedef struct file_id_table
+{
+  FCB** fcb;				/**< @brief The FCB of each fid, or NULL */
+  unsigned long* used;		/**< @brief Bitmap of the fids in use */
+  unsigned long* cloexec;	/**< @brief Bitmap of the close-on-exec fids */
+  unsigned int size;		/**< @brief Number of fids, a multiple of @c FID_WORD_BITS */
+  unsigned long full;		/**< @brief Bitmap of the full words of @c used */
+} fid_table;
+
+#define FID_WORD_BITS (8*sizeof(unsigned long))
+
 #define PIPE_BUFFER_SIZE (10*1024)
 
+/* Blocking statistics of one side of a connection, kept by its socket */
+typedef struct wait_stats{
+	unsigned long waits;			/* Number of blocking waits */
+	TimerDuration wait_time;		/* Total time blocked, in usec (coarse) */
+}wait_stats;
+
 typedef struct pipe_control_block{
 	FCB *reader, *writer;
 	CondVar has_space; 				/*For blocking writer if no space is available*/
 	CondVar has_data; 				/*For blocking reader until data are available*/
 	int w_position, r_position; 	/*write-read position in buffer*/
+	int packet;						/*Non-zero if the pipe preserves record boundaries*/
+	wait_stats *reader_stats, *writer_stats;	/*Where to account blocking, or NULL*/
 	char BUFFER[PIPE_BUFFER_SIZE]; 	/*Bounded (cyclic) byte buffer*/
 }pipe_cb;
 
+/* The kernel side of a sock_ring */
+typedef struct ring_control_block{
+	sock_ring ring;				/* Shared with user code */
+	FCB *reader, *writer;		/* NULL when closed */
+	CondVar changed;			/* Signalled when the ring changes */
+	wait_stats *reader_stats, *writer_stats;	/* Where to account blocking, or NULL */
+}ring_cb;
+
 typedef enum socket_type{
     SOCKET_LISTENER,
     SOCKET_UNBOUND,
-    SOCKET_PEER
+    SOCKET_PEER,
+    SOCKET_DATAGRAM
 }socket_type;
 
 typedef struct listener_socket{
 	rlnode queue;
 	CondVar req_available;
+	unsigned int pending;		/* Length of queue */
+	unsigned int backlog;		/* Max. length of queue */
+	unsigned int max_pending;	/* High-water mark of pending */
 }listener_socket;
 
+/* The backlog of a listener, unless set by SOCKOPT_BACKLOG */
+#define SOCKET_DEFAULT_BACKLOG 128
+
 typedef struct unbound_socket{
 	char placeholder;
 }unbound_socket;
@@ -76,37 +123,65 @@ typedef struct peer_socket{
 	socket_cb* peer;
 	pipe_cb* write_pipe;
 	pipe_cb* read_pipe;
+	ring_cb* write_ring;	/* In ring mode, instead of the pipes */
+	ring_cb* read_ring;
 }peer_socket;
+/* A message queued on a datagram socket */
+typedef struct datagram{
+	rlnode node;
+	port_t from;
+	unsigned int size;
+	char data[];
+}datagram;
+
+typedef struct datagram_socket{
+	rlnode queue;				/* Received messages */
+	CondVar msg_available;
+	unsigned int queued;		/* Length of queue */
+	unsigned int max_queued;	/* Max. length of queue, the rest are dropped */
+	unsigned long sent, received, dropped;
+}datagram_socket;
+
+/* The receive queue length of a datagram socket, unless set by SOCKOPT_BACKLOG */
+#define SOCKET_DEFAULT_DGRAM_QUEUE 64
+
 typedef struct socket_control_block{
     FCB *fcb;
     socket_type type;
     port_t port;
     unsigned int refcount;
+    int packet;                 /* SOCKOPT_PACKET */
+    unsigned int backlog;       /* SOCKOPT_BACKLOG */
+    int reuseport;              /* SOCKOPT_REUSEPORT */
+    int ring;                   /* SOCKOPT_RING */
+    rlnode port_node;           /* Node for the port table, while bound */
+    rlnode socket_node;         /* Node for the list of all sockets */
+    TimerDuration created;
+    unsigned long bytes_in, bytes_out;
+    wait_stats read_stats, write_stats;
+    TimerDuration connect_time; /* From Connect to admission, 0 if not connected */
     union{
         listener_socket* listener_s;
         unbound_socket* unbound_s;
         peer_socket* peer_s;
+        datagram_socket* dgram_s;
     };
 }socket_cb;
 
 typedef struct socket_connection_request{
 	int admitted;
 	socket_cb* peer;
+	TimerDuration start;		/* When Connect was called */
 	CondVar connected_cv;
 	rlnode queue_node;
 }connection_r;
 
-/** 
-  @brief Initialization for files and streams.
-
-  This function is called at kernel startup.
- */
-void initialize_files();
-
-
 /**
 	@brief Increase the reference count of an fcb 
 
+	The reference count is updated atomically, therefore a stream can
+	be pinned without the kernel lock.
+
 	@param fcb the fcb whose reference count will be increased
 */
 void FCB_incref(FCB* fcb);
@@ -166,6 +241,34 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Copy the inherited fids of a process to a child.
+
+	The open fids of @c src without the close-on-exec flag are copied to
+	the same fids of the empty table @c dst, and their FCBs are increfed.
+	Only the populated entries are visited.
+ */
+void fidt_inherit(fid_table* dst, fid_table* src);
+
+
+/** @brief Copy a fid to another fid of a table, as @c Dup2(). 
+	@returns 0 on success, or -1 if a fid is not valid or @c oldfd is not open.
+ */
+int fidt_dup2(fid_table* fidt, Fid_t oldfd, Fid_t newfd);
+
+
+/** @brief Close a fid of a table, as @c Close().
+	@returns 0 on success, or -1 on error.
+ */
+int fidt_close(fid_table* fidt, Fid_t fd);
+
+
+/** @brief Close all the fids of a table, and free it.
+
+	The table is left empty, ready to be used again.
+ */
+void fidt_close_all(fid_table* fidt);
+
+
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
@@ -185,8 +288,57 @@ int pipe_read(void *this, char *buf, unsigned int length);
 
 int pipe_write(void *this, const char *buf, unsigned int length);
 
+/* Return which of the given events hold for a pipe */
+int pipe_poll(pipe_cb *pipeCb, int events);
+
 pipe_cb* initialize_pipe_cb(pipe_t* pipe, Fid_t* fid, FCB** fcb);
 
+ring_cb* ring_create(FCB* reader, FCB* writer);
+
+int ring_read(ring_cb* ringCb, char *buf, unsigned int length);
+
+int ring_write(ring_cb* ringCb, const char *buf, unsigned int length);
+
+int ring_reader_close(ring_cb* ringCb);
+
+int ring_writer_close(ring_cb* ringCb);
+
+/* Return which of the given events hold for a ring */
+int ring_poll(ring_cb* ringCb, int events);
+
+int ring_wait(ring_cb* ringCb, int events, timeout_t timeout);
+
+void ring_wake(ring_cb* ringCb, int events);
+
+
+/**
+	@brief Report a readiness transition on a stream.
+
+	Every event queue registration on @c fcb whose interest set
+	intersects @c events is moved to the ready list of its queue.
+	A NULL @c fcb is ignored.
+
+	@param fcb the stream whose readiness changed
+	@param events a mask of @c EVENT_READ and @c EVENT_WRITE
+*/
+void event_notify(FCB* fcb, int events);
+
+/**
+	@brief Report a readiness transition on a registration list.
+
+	This is the same as @ref event_notify, for device streams whose 
+	registrations are kept in a per-device list. It is safe to call
+	from an interrupt handler.
+*/
+void event_notify_list(rlnode* watchers, int events);
+
+/**
+	@brief Drop all event queue registrations on an FCB.
+
+	This is called when the FCB is released.
+*/
+void event_release_fcb(FCB* fcb);
+
 
 /** @} */
 
@@ -2,6 +2,7 @@
 #include "tinyos.h"
 #include "kernel_sys.h"
 #include "kernel_cc.h"
+#include "kernel_proc.h"
 
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
@@ -14,10 +15,12 @@
 
 #define PRE_CALL \
 kernel_lock();\
+exit_if_killed();\
 
 
 
 #define POST_CALL \
+exit_if_killed();\
 kernel_unlock();\
 
 
@@ -6,13 +6,21 @@
 
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(Spawn, Pid_t, (Task task, int argl, void* args, const spawn_action* actions, unsigned int nactions), (task, argl, args, actions, nactions))\
+SYSCALL(ExecMany, int, (unsigned int n, const spawn_request* reqs, Pid_t* pids), (n, reqs, pids))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
+SYSCALL(WaitChildTimed, Pid_t, (Pid_t proc, int* exitval, timeout_t timeout), (proc, exitval, timeout))\
+SYSCALL(WaitAnyOf, int, (const wait_target* targets, unsigned int n, int* status, timeout_t timeout), (targets, n, status, timeout))\
+SYSCALL(OpenProcess, Fid_t, (Pid_t pid), (pid))\
+SYSCALL(Kill, int, (Pid_t pid), (pid))\
+SYSCALL(KillTree, int, (Pid_t pid), (pid))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
+SYSCALL(ThreadJoinTimed, int, (Tid_t tid, int* exitval, timeout_t timeout), (tid, exitval, timeout))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
@@ -22,13 +30,38 @@ SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(SetCloseOnExec,int, (Fid_t fd, int flag), (fd,flag))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PacketPipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(Channel, Fid_t, (unsigned int max_lag), (max_lag))\
+SYSCALL(Subscribe, Fid_t, (Fid_t chan), (chan))\
+SYSCALL(GetChannelStats, int, (Fid_t fid, channel_stats* stats), (fid, stats))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
+SYSCALL(AcceptMany, int, (Fid_t lsock, Fid_t* fids, unsigned int n), (lsock, fids, n))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
+SYSCALL(GetSockPort, port_t, (Fid_t sock), (sock))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(DatagramSocket, Fid_t, (port_t port), (port))\
+SYSCALL(SendTo, int, (Fid_t sock, port_t port, const char* buf, unsigned int size), (sock, port, buf, size))\
+SYSCALL(RecvFrom, int, (Fid_t sock, char* buf, unsigned int size, port_t* from, timeout_t timeout), (sock, buf, size, from, timeout))\
+SYSCALL(GetDatagramStats, int, (Fid_t sock, datagram_stats* stats), (sock, stats))\
+SYSCALL(SockRing, int, (Fid_t sock, sock_ring** rx, sock_ring** tx), (sock, rx, tx))\
+SYSCALL(SockRingWait, int, (Fid_t sock, int events, timeout_t timeout), (sock, events, timeout))\
+SYSCALL(SockRingWake, int, (Fid_t sock, int events), (sock, events))\
+SYSCALL(NetListen, Fid_t, (const char* path), (path))\
+SYSCALL(NetAccept, Fid_t, (Fid_t lsock), (lsock))\
+SYSCALL(SetSockOpt, int, (Fid_t sock, socket_option option, int value), (sock, option, value))\
+SYSCALL(GetRusage, int, (usage_who who, resource_usage* usage), (who, usage))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenMemInfo, Fid_t, (), ())\
+SYSCALL(OpenSockInfo, Fid_t, (), ())\
+SYSCALL(EventQueue, Fid_t, (), ())\
+SYSCALL(EventCtl, int, (Fid_t evq, Fid_t fid, int events), (evq, fid, events))\
+SYSCALL(WaitEvents, int, (Fid_t evq, event_t* events, unsigned int n, timeout_t timeout), (evq, events, n, timeout))\
+SYSCALL(IoRing, Fid_t, (unsigned int workers, io_ring** ring), (workers, ring))\
+SYSCALL(IoRingEnter, int, (Fid_t ring, unsigned int min_complete, timeout_t timeout), (ring, min_complete, timeout))\
 
 
 
@@ -1,9 +1,104 @@
+#include <assert.h>
+#include <string.h>
 
 #include "tinyos.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
+#include "kernel_mem.h"
+
+static void ptcb_ctor(void* obj)
+{
+	PTCB* ptcb = (PTCB*) obj;
+	ptcb->exit_cv = COND_INIT;
+	rlnode_init(& ptcb->ptcb_list_node, ptcb);
+}
+
+static kmem_cache ptcb_cache = KMEM_CACHE_INIT("PTCB", PTCB, ptcb_ctor);
+
+
+/*
+	The thread table.
+
+	Each process maps its Tids to PTCBs with a table of slots. The low 
+	TID_SLOT_BITS of a Tid hold its slot number plus one, and the high bits
+	hold a serial number, which is different for each thread created.
+	A Tid is valid only if its slot holds a PTCB with the same Tid. Therefore,
+	a Tid is resolved in O(1), and stale Tids, whose slot has been reused, 
+	or Tids of other processes are rejected.
+
+	The free slots are linked in a list, and the table doubles when it is full.
+*/
+#define TID_SLOT_BITS 24
+#define TID_SLOT_MASK ((((Tid_t) 1) << TID_SLOT_BITS) - 1)
+#define THREAD_TABLE_MIN 16
+
+static Tid_t tid_serial = 0;
+
+static void thread_table_grow(PCB* pcb)
+{
+	unsigned int oldsize = pcb->thread_table_size;
+	unsigned int newsize = (oldsize == 0) ? THREAD_TABLE_MIN : 2*oldsize;
+	if(newsize > TID_SLOT_MASK) 
+		FATAL("Too many threads in a process");
+
+	thread_slot* table = (thread_slot*) xmalloc(newsize*sizeof(thread_slot));
+	if(oldsize > 0) {
+		memcpy(table, pcb->thread_table, oldsize*sizeof(thread_slot));
+		free(pcb->thread_table);
+	}
+	pcb->thread_table = table;
+
+	/* Link the new slots, lowest first */
+	for(unsigned int i = oldsize; i < newsize; i++) {
+		pcb->thread_table[i].ptcb = NULL;
+		pcb->thread_table[i].next_free = (i+1 < newsize) ? (int)(i+1) : pcb->thread_table_free;
+	}
+	pcb->thread_table_free = oldsize;
+	pcb->thread_table_size = newsize;
+}
+
+/* Put a PTCB in a free slot of the thread table, and give it a Tid */
+static void thread_table_insert(PCB* pcb, PTCB* ptcb)
+{
+	if(pcb->thread_table_free < 0)
+		thread_table_grow(pcb);
+
+	int slot = pcb->thread_table_free;
+	pcb->thread_table_free = pcb->thread_table[slot].next_free;
+	pcb->thread_table[slot].ptcb = ptcb;
+
+	ptcb->tid = (++tid_serial << TID_SLOT_BITS) | (Tid_t)(slot + 1);
+}
+
+static void thread_table_remove(PCB* pcb, PTCB* ptcb)
+{
+	int slot = (int)(ptcb->tid & TID_SLOT_MASK) - 1;
+	assert(pcb->thread_table[slot].ptcb == ptcb);
+	pcb->thread_table[slot].ptcb = NULL;
+	pcb->thread_table[slot].next_free = pcb->thread_table_free;
+	pcb->thread_table_free = slot;
+}
+
+/* Return the PTCB of a Tid of the current process, or NULL */
+static PTCB* get_ptcb(Tid_t tid)
+{
+	PCB* pcb = CURPROC;
+	Tid_t slot = tid & TID_SLOT_MASK;
+	if(slot == 0 || slot > pcb->thread_table_size) return NULL;
+
+	PTCB* ptcb = pcb->thread_table[slot-1].ptcb;
+	return (ptcb != NULL && ptcb->tid == tid) ? ptcb : NULL;
+}
+
+void release_thread_table(PCB* pcb)
+{
+	free(pcb->thread_table);
+	pcb->thread_table = NULL;
+	pcb->thread_table_size = 0;
+	pcb->thread_table_free = -1;
+}
 
 
 /*
@@ -12,7 +107,7 @@
 PTCB* initialize_ptcb(Task call, int argl, void* args)
 {
 
-	PTCB* ptcb = (PTCB*) xmalloc(sizeof(PTCB));
+	PTCB* ptcb = (PTCB*) kmem_alloc(&ptcb_cache);
 
 	ptcb->task = call;
 	ptcb->argl = argl;
@@ -22,18 +117,19 @@ PTCB* initialize_ptcb(Task call, int argl, void* args)
 	ptcb->detached = 0;
 	ptcb->joined = 0;
 	ptcb->refcount = 0;
-
-	ptcb->exit_cv = COND_INIT;
+	ptcb->tid = NOTHREAD;
 
 	return ptcb;
 }
 
 void update_pcb_owner(PTCB* ptcb){
   PCB* pcb = ptcb->tcb->owner_pcb;
-  rlnode* node = rlnode_init(& ptcb->ptcb_list_node, ptcb);
-  rlist_push_front(& pcb->ptcb_list, node);
+  rlist_push_front(& pcb->ptcb_list, & ptcb->ptcb_list_node);
+	thread_table_insert(pcb, ptcb);
 	ptcb->refcount++;
 	pcb->thread_count++;
+	if(pcb->thread_count > pcb->usage.peak_threads)
+		pcb->usage.peak_threads = pcb->thread_count;
 }
 
 /*
@@ -67,16 +163,16 @@ void start_thread()
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
 
-  PTCB* ptcb = initialize_ptcb(task, argl, args);
-  if(task != NULL) {
-    ptcb->tcb = spawn_thread(CURPROC, start_thread);
-    ptcb->tcb->ptcb = ptcb;
-    update_pcb_owner(ptcb);
-    wakeup(ptcb->tcb);
+  if(task == NULL)
+    return NOTHREAD;
 
-  }
+  PTCB* ptcb = initialize_ptcb(task, argl, args);
+  ptcb->tcb = spawn_thread(CURPROC, start_thread);
+  ptcb->tcb->ptcb = ptcb;
+  update_pcb_owner(ptcb);
+  wakeup(ptcb->tcb);
 
-  return (Tid_t) ptcb;
+  return ptcb->tid;
 }
 
 /**
@@ -85,7 +181,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return CURTHREAD==NULL ? NOTHREAD : (Tid_t) CURTHREAD->ptcb;
+	return CURTHREAD==NULL ? NOTHREAD : CURTHREAD->ptcb->tid;
 }
 
 
@@ -93,36 +189,83 @@ void ptcb_refcount_decrement(PTCB* ptcb){
   ptcb->refcount--;
   if (ptcb->refcount == 0){ // PTCB no longer needed
     rlist_remove(&ptcb->ptcb_list_node);
-    free(ptcb);
+    thread_table_remove(CURPROC, ptcb);
+    kmem_free(&ptcb_cache, ptcb);
   }
 }
 
+/*
+  Drop the reference of the process to a PTCB, once its thread has exited 
+  and it has been joined or detached. Its Tid is no longer valid.
+*/
+static void ptcb_release(PTCB* ptcb){
+  rlist_remove(&ptcb->ptcb_list_node);
+  ptcb_refcount_decrement(ptcb);
+}
+
+/*
+  Take a reference to a thread of the current process that the caller
+  may join, or return NULL.
+*/
+PTCB* join_acquire(Tid_t tid)
+{
+  PTCB* ptcb = get_ptcb(tid);
+  if(ptcb == NULL || ptcb->detached == 1 || ptcb == CURTHREAD->ptcb || ptcb->joined == 1)
+      return NULL;
+  ptcb->refcount++;
+  return ptcb;
+}
+
+/*
+  Drop the reference taken by join_acquire(). If the thread has exited 
+  undetached, it is joined, its exit value is stored in *exitval and 0 is 
+  returned. Otherwise, -1 is returned.
+*/
+int join_release(PTCB* ptcb, int* exitval)
+{
+  int ret = -1;
+  if(ptcb->exited == 1 && ptcb->detached == 0) {
+    if(exitval != NULL)
+      *exitval = ptcb->exitval;
+    if(ptcb->joined == 0) {
+      ptcb->joined = 1;
+      ptcb_release(ptcb);
+    }
+    ret = 0;
+  }
+  ptcb_refcount_decrement(ptcb);
+  return ret;
+}
+
 /**
-  @brief Join the given thread.
+  @brief Join the given thread, waiting until a deadline.
 
   - Check if ThreadJoin is legal or not (return appropriate values if illegal)
-  - call kernel_wait() in a loop, with condVar for the other thread and change this thread's state (sleep). Also check detached setting.
-  - if other Thread exited, change this thread's state for waking up
+  - call kernel_timedwait() in a loop, with condVar for the other thread, until
+    it exits, it is detached or the timeout expires.
 
   */
-int sys_ThreadJoin(Tid_t tid, int* exitval)
+int sys_ThreadJoinTimed(Tid_t tid, int* exitval, timeout_t timeout)
 {
-  rlnode *node = rlist_find((&CURPROC->ptcb_list), (PTCB*)tid, NULL);
-  if(node == NULL || node->ptcb->detached == 1 || (PTCB*)tid == CURTHREAD->ptcb || node->ptcb->joined == 1)
-      return -1;
-  node->ptcb->refcount++;
-  while(node->ptcb->exited != 1){
-    kernel_wait(&(node->ptcb->exit_cv), SCHED_USER);
-    if(node->ptcb->detached == 1){
-      ptcb_refcount_decrement(node->ptcb);
-      return -1;
-    }
+  PTCB* ptcb = join_acquire(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  TimerDuration deadline = kernel_deadline(timeout);
+  while(ptcb->exited != 1 && ptcb->detached != 1){
+    TimerDuration t = kernel_time_left(deadline);
+    if(t == 0 || kernel_killed()) break;
+    kernel_timedwait(&(ptcb->exit_cv), SCHED_USER, t);
   }
-  if(exitval != NULL)
-    *exitval = node->ptcb->exitval;
-  node->ptcb->joined = 1;
-  ptcb_refcount_decrement(node->ptcb);
-  return 0;
+  return join_release(ptcb, exitval);
+}
+
+/**
+  @brief Join the given thread.
+  */
+int sys_ThreadJoin(Tid_t tid, int* exitval)
+{
+  return sys_ThreadJoinTimed(tid, exitval, (timeout_t)-1);
 }
 
 /**
@@ -133,10 +276,12 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-  rlnode *node = rlist_find((&CURPROC->ptcb_list), (PTCB*)tid, NULL);
-  if(node == NULL || node->ptcb->exited == 1) return -1;
-  (node->ptcb)->detached = 1;
-  kernel_broadcast(&node->ptcb->exit_cv);
+  PTCB* ptcb = get_ptcb(tid);
+  if(ptcb == NULL || ptcb->exited == 1) return -1;
+  ptcb->detached = 1;
+  kernel_broadcast(&ptcb->exit_cv);
+  if(CURPROC->waitany_count > 0)
+    kernel_broadcast(&CURPROC->child_exit);
   return 0;
 }
 
@@ -160,6 +305,12 @@ void sys_ThreadExit(int exitval)
     kernel_broadcast(& ptcb->exit_cv);
     //ptcb->refcount = 1;
   }
+  if(CURPROC->waitany_count > 0)
+    kernel_broadcast(& CURPROC->child_exit);
+
+  /* Nobody can join a detached thread, its PTCB is not needed any more */
+  if (ptcb->detached)
+    ptcb_release(ptcb);
 
   
   curproc_decrement_thread_counter();
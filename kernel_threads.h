@@ -12,3 +12,20 @@ void update_pcb_owner(PTCB* ptcb);
 
 void ptcb_refcount_decrement(PTCB* ptcb);
 
+/*
+  Take a reference to a thread of the current process that the caller 
+  may join, or return NULL.
+*/
+PTCB* join_acquire(Tid_t tid);
+
+/*
+  Drop the reference taken by join_acquire(). Return 0 and the exit value
+  if the thread has exited undetached, and it is now joined, or -1.
+*/
+int join_release(PTCB* ptcb, int* exitval);
+
+/*
+  Free the thread table of a process, after all its PTCBs are released.
+*/
+void release_thread_table(PCB* pcb);
+
@@ -176,17 +176,20 @@ int SymposiumOfProcesses(int argl, void* args)
   SymposiumTable S;
   SymposiumTable_init(&S, symp);
   
-  /* Execute philosophers */
+  /* Execute philosophers, all in one call */
+  philosopher_args Args[N];
+  spawn_request reqs[N];
+  Pid_t pids[N];
   for(int i=0;i<N;i++) {
-    philosopher_args Args;
-    Args.i = i;
-    Args.S = &S;
-    Exec(PhilosopherProcess, sizeof(Args), &Args);
-  }  
+    Args[i].i = i;
+    Args[i].S = &S;
+    reqs[i] = (spawn_request){ PhilosopherProcess, sizeof(philosopher_args), &Args[i], NULL, 0 };
+  }
+  int started = ExecMany(N, reqs, pids);
 
   /* Wait for philosophers to exit */  
-  for(int i=0;i<N;i++) {
-    WaitChild(NOPROC, NULL);
+  for(int i=0;i<started;i++) {
+    WaitChild(pids[i], NULL);
   }
 
   SymposiumTable_destroy(&S);
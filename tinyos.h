@@ -39,15 +39,27 @@ typedef unsigned long timeout_t;
 /** @brief The invalid PID */
 #define NOPROC (-1)
 
-/** @brief The maximum number of processes */
+/** @brief The maximum number of processes.
+
+  The process table grows on demand up to this limit. It can be
+  changed at compile time, e.g., with @c -DMAX_PROC=1048576.
+*/
+#ifndef MAX_PROC
 #define MAX_PROC 65536
+#endif
 
 /** @brief The type of a file ID. */
 typedef int Fid_t;  
 
 /** @brief The maximum number of open files per process. 
-   Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
-#define MAX_FILEID 16
+   Only values 0 to MAX_FILEID-1 are legal for file descriptors. 
+
+  The file id table of a process grows on demand up to this limit,
+  which can be at most 4096.
+*/
+#ifndef MAX_FILEID
+#define MAX_FILEID 4096
+#endif
 
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
@@ -241,6 +253,77 @@ typedef int (*Task)(int, void*);
 Pid_t Exec(Task task, int argl, void* args);
 
 
+/** @brief The kind of a file id action of @c Spawn().
+  @see spawn_action
+ */
+typedef enum spawn_action_type
+{
+  SPAWN_DUP2,   /**< @brief Copy @c fid to @c newfid, as @c Dup2(fid,newfid) */
+  SPAWN_CLOSE   /**< @brief Close @c fid, as @c Close(fid) */
+} spawn_action_type;
+
+/** @brief A file id action of @c Spawn().
+
+  The actions are applied in order to the file ids of the new process, 
+  after it has inherited the file ids of its parent. They do not affect 
+  the file ids of the parent.
+ */
+typedef struct spawn_action
+{
+  spawn_action_type action;  /**< @brief What to do */
+  Fid_t fid;                 /**< @brief The file id to copy or close */
+  Fid_t newfid;              /**< @brief The target of @c SPAWN_DUP2 */
+} spawn_action;
+
+/** @brief Create a new process, and rearrange its file ids.
+
+  This call is like @c Exec(), but before the new process starts, the
+  @c nactions actions of array @c actions are applied to its file ids.
+  It replaces the usual sequence of @c Dup2() and @c Close() calls 
+  around @c Exec(), in the style of @c posix_spawn.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param actions the file id actions, may be NULL if @c nactions is 0
+  @param nactions the number of actions
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned, and no process is created.
+    Possible errors:
+   -  The maximum number of processes has been reached.
+   -  An action is not valid, e.g., its @c fid is not open at that point.
+  @see Exec
+  */
+Pid_t Spawn(Task task, int argl, void* args, const spawn_action* actions, unsigned int nactions);
+
+
+/** @brief A request to create a process, for @c ExecMany(). 
+  @see Spawn
+ */
+typedef struct spawn_request
+{
+  Task task;                    /**< @brief The main function */
+  int argl;                     /**< @brief The length of @c args */
+  void* args;                   /**< @brief The argument of @c task */
+  const spawn_action* actions;  /**< @brief File id actions, or NULL */
+  unsigned int nactions;        /**< @brief The number of @c actions */
+} spawn_request;
+
+/** @brief Create many processes in one call.
+
+  The processes are created in order, as if by @c Spawn(), until all
+  are created or one fails. This takes a single system call, instead 
+  of one per process.
+
+  @param n the number of processes to create
+  @param reqs an array of @c n requests
+  @param pids an array of size @c n, the pid of each process is stored here,
+     or NOPROC if the process was not created
+  @return the number of processes created, or -1 if @c reqs or @c pids is NULL.
+  */
+int ExecMany(unsigned int n, const spawn_request* reqs, Pid_t* pids);
+
+
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
@@ -279,6 +362,122 @@ void Exit(int val);
 */
 Pid_t WaitChild(Pid_t pid, int* exitval);
 
+/** @brief Wait on a terminating child, for a limited time.
+
+   This is like @c WaitChild(), but it gives up when the timeout expires
+   before a child has exited. Then, the child is not reaped, and it can 
+   be waited on again.
+
+   @param pid the process ID of the child to wait on, or @c NOPROC to
+           designate waiting for any child.
+   @param exitval a location whithin which the exit status of the terminates
+   @param timeout the time to wait in milliseconds, or @c (timeout_t)-1 to
+           wait as long as needed
+   @return the pid of the exited child, or @c NOPROC on error or timeout.
+   @see WaitChild
+*/
+Pid_t WaitChildTimed(Pid_t pid, int* exitval, timeout_t timeout);
+
+/** @brief The kind of a @c wait_target */
+typedef enum wait_target_type { 
+  WAIT_PROCESS,     /**< @brief Wait for a child process to exit */
+  WAIT_THREAD       /**< @brief Wait for a thread of this process to exit */
+} wait_target_type;
+
+/** @brief A process or thread to wait for, in @c WaitAnyOf() */
+typedef struct wait_target {
+  wait_target_type type;  /**< @brief What to wait for */
+  Pid_t pid;              /**< @brief The child, for @c WAIT_PROCESS */
+  Tid_t tid;              /**< @brief The thread, for @c WAIT_THREAD */
+} wait_target;
+
+/** @brief The maximum number of targets of @c WaitAnyOf() */
+#define MAX_WAIT_TARGETS 64
+
+/** @brief Wait for the first of a set of children and threads to exit.
+
+   Each target is a child process of the caller, or a thread of the 
+   caller's process that could be joined with @c ThreadJoin(). The call
+   blocks until one of the targets exits, or the timeout expires. 
+
+   The first target that has exited is reaped, as by @c WaitChild(), or 
+   joined, as by @c ThreadJoin(), and its index in @c targets is returned.
+   The other targets are not affected. Therefore, a supervisor can monitor 
+   many children and threads by calling @c WaitAnyOf() in a loop, removing
+   each target returned.
+
+   @param targets the array of targets
+   @param n the number of targets, between 1 and @c MAX_WAIT_TARGETS
+   @param status if not NULL, the exit status of the target is stored here
+   @param timeout the time to wait in milliseconds, or @c (timeout_t)-1 to
+           wait as long as needed
+   @return the index of the target that exited, or -1 on error or timeout.
+   Possible errors are:
+   - @c targets is NULL, or @c n is out of range.
+   - a target is not a child of the caller, or it is not a thread that
+     the caller could join.
+   - while waiting, a target child was reaped by another thread, or a 
+     target thread was detached.
+*/
+int WaitAnyOf(const wait_target* targets, unsigned int n, int* status, timeout_t timeout);
+
+/** @brief Open a stream for a child process.
+
+   The returned stream becomes readable when the child exits. Then,
+   @c Read() stores the exit status of the child, as an @c int, into 
+   the buffer and returns @c sizeof(int). Before the child exits, @c Read()
+   blocks. Writing to the stream is an error.
+
+   The stream can be registered on an event queue with @c EventCtl(), for
+   @c EVENT_READ, so that a supervisor can wait for child exits and other
+   I/O in the same event loop. If the child has already exited when the
+   stream is registered, the exit is reported at once.
+
+   The stream does not reap the child; @c WaitChild() must still be called.
+   The stream remains valid, and returns the exit status, after the child
+   has been reaped. It is released by @c Close().
+
+   @param pid the child process
+   @return a file id for the stream, or @c NOFILE on error. Possible errors are:
+   - @c pid is not a child of this process.
+   - the available file ids for the process are exhausted.
+*/
+Fid_t OpenProcess(Pid_t pid);
+
+/** @brief The exit status of a process terminated by @c Kill() */
+#define EXIT_KILLED (-9)
+
+/** @brief Terminate a descendant process.
+
+   All the threads of the process are marked for exit. A thread that is
+   blocked in a system call wakes up, and the call returns at once. A 
+   thread exits when it enters or leaves a system call. Therefore, a thread
+   that runs without making system calls is not stopped. When the last 
+   thread exits, the process exits with status @c EXIT_KILLED, as if it had
+   called @c Exit(). Its parent reaps it with @c WaitChild(), as usual.
+
+   This call does not wait for the process to exit. Killing a process
+   that has already exited, or has been killed, has no effect.
+
+   @param pid the process to kill, which must be a child of the caller, 
+          or a child of a child etc.
+   @return 0 on success, or -1 if @c pid is not a descendant of the caller.
+   @see KillTree
+*/
+int Kill(Pid_t pid);
+
+/** @brief Terminate a descendant process and all its descendants.
+
+   This is like @c Kill(), applied to every process in the tree rooted at
+   @c pid, in one system call. The descendants of a killed process 
+   that exit after it are adopted by the initial process, as usual.
+
+   @param pid the root of the tree, which must be a descendant of the caller
+   @return 0 on success, or -1 if @c pid is not a descendant of the caller.
+   @see Kill
+*/
+int KillTree(Pid_t pid);
+
 /** @brief Return the PID of the caller.
 
  This function returns the pid of the current process 
@@ -351,6 +550,22 @@ Tid_t ThreadSelf();
   */
 int ThreadJoin(Tid_t tid, int* exitval);
 
+/**
+  @brief Join the given thread, waiting for a limited time.
+
+  This is like @c ThreadJoin(), but it gives up when the timeout expires
+  before the thread has exited. Then, the thread can be joined again.
+
+  @param tid the thread to join
+  @param exitval a location where to store the exit value of the joined 
+              thread. If NULL, the exit status is not returned.
+  @param timeout the time to wait in milliseconds, or @c (timeout_t)-1 to
+           wait as long as needed
+  @returns 0 on success and -1 on error or timeout. 
+  @see ThreadJoin
+  */
+int ThreadJoinTimed(Tid_t tid, int* exitval, timeout_t timeout);
+
 
 /**
   @brief Detach the given thread.
@@ -489,6 +704,19 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Set or clear the close-on-exec flag of a file id.
+
+  A file id with the flag set is not inherited by the children
+  created by @c Exec(). The flag is cleared when a file id is
+  closed, and @c Dup2() clears it for @c newfd.
+
+  @param fd the file id
+  @param flag non-zero to set the flag, zero to clear it
+  @return 0 on success, or -1 if @c fd is not an open file.
+ */
+int SetCloseOnExec(Fid_t fd, int flag);
+
 /*******************************************
  *
  * Pipes
@@ -531,6 +759,118 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/**
+	@brief The maximum size of a packet.
+
+	This is the largest @c Write accepted by a stream in packet mode.
+	@see PacketPipe
+	@see SOCKOPT_PACKET
+*/
+#define MAX_PACKET_SIZE (4096)
+
+/**
+	@brief Construct and return a pipe in packet mode.
+
+	A packet pipe is like a pipe created by @c Pipe(), except that it
+	preserves record boundaries:
+	- each call to @c Write() with a size of up to @c MAX_PACKET_SIZE bytes
+	  stores its data as a single packet. The packet is stored atomically:
+	  if there is not enough space in the buffer, the writer blocks until
+	  there is, and the data of concurrent writers is never interleaved.
+	  Writes larger than @c MAX_PACKET_SIZE fail with -1. A write of 0 bytes
+	  stores nothing and returns 0.
+	- each call to @c Read() returns exactly one packet. If the packet is
+	  larger than the size passed to @c Read(), the excess bytes of the
+	  packet are discarded.
+
+	End-of-stream and closing behave exactly as for @c Pipe().
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+	@see Pipe
+*/
+int PacketPipe(pipe_t* pipe);
+
+
+/*******************************************
+ *
+ * Fan-out channels
+ *
+ *******************************************/
+
+/** @brief The lag of a channel, when 0 is passed to @c Channel(). */
+#define CHANNEL_DEFAULT_LAG (64)
+
+/** @brief The maximum lag of a channel. */
+#define MAX_CHANNEL_LAG (4096)
+
+/**
+	@brief Construct a fan-out channel and return its publisher stream.
+
+	A channel broadcasts messages from one publisher to many subscribers.
+	Each @c Write() of up to @c MAX_PACKET_SIZE bytes to the publisher
+	stream publishes one message. The message is stored once in the
+	kernel, no matter how many subscribers there are, and each subscriber
+	stream returned by @c Subscribe() reads it with its own @c Read().
+	As with packet pipes, a @c Read() returns exactly one message,
+	truncated to the size passed to @c Read().
+
+	The publisher never blocks. The channel keeps only the last @c max_lag
+	messages. A subscriber that falls more than @c max_lag messages
+	behind misses the oldest ones, and continues from the oldest message
+	that is kept. The messages missed are counted in @c channel_stats.
+
+	When the publisher stream is closed, the subscribers read the messages
+	left and then @c Read() returns 0. The publisher stream cannot be read,
+	and subscriber streams cannot be written.
+
+	@param max_lag the number of messages kept, or 0 for @c CHANNEL_DEFAULT_LAG
+	@returns the publisher stream, or NOFILE on error. Possible reasons
+		for error:
+		- @c max_lag is larger than @c MAX_CHANNEL_LAG
+		- the available file ids for the process are exhausted
+	@see Subscribe
+*/
+Fid_t Channel(unsigned int max_lag);
+
+/**
+	@brief Subscribe to a fan-out channel.
+
+	The returned stream reads the messages published after this call.
+
+	@param chan the publisher stream, or a subscriber stream, of the channel
+	@returns a subscriber stream, or NOFILE on error. Possible reasons
+		for error:
+		- @c chan is not a stream of a channel
+		- the publisher stream has been closed
+		- the available file ids for the process are exhausted
+*/
+Fid_t Subscribe(Fid_t chan);
+
+/**
+	@brief Counters of a fan-out channel.
+	@see GetChannelStats
+*/
+typedef struct channel_stats {
+	unsigned int subscribers;	/**< Subscriber streams open */
+	unsigned long published;	/**< Messages published */
+	unsigned int retained;		/**< Messages stored in the kernel */
+	unsigned long pending;		/**< For a subscriber, messages it can still read */
+	unsigned long received;		/**< For a subscriber, messages read */
+	unsigned long missed;		/**< For a subscriber, messages lost because it lagged */
+} channel_stats;
+
+/**
+	@brief Get the counters of a fan-out channel.
+
+	@param fid the publisher stream, or a subscriber stream, of a channel
+	@param stats the counters are stored here
+	@returns 0 on success, or -1 if @c fid is not a stream of a channel
+*/
+int GetChannelStats(Fid_t fid, channel_stats* stats);
+
 /*******************************************
  *
  * Sockets (local)
@@ -542,12 +882,21 @@ int Pipe(pipe_t* pipe);
 
 	A socket port is an integer between 1 and @c MAX_PORT.
 */
-typedef int16_t port_t;
+typedef int32_t port_t;
 
 /**
 	@brief the maximum legal port 
 */
-#define MAX_PORT 1023
+#define MAX_PORT 65535
+
+/**
+	@brief the first ephemeral port
+
+	Ports from @c MIN_EPHEMERAL_PORT to @c MAX_PORT are assigned by the
+	kernel to unbound sockets that connect.
+	@see Connect
+*/
+#define MIN_EPHEMERAL_PORT 49152
 
 /**
 	@brief a null value for a port
@@ -581,7 +930,8 @@ Fid_t Socket(port_t port);
 
 	The socket must be bound to a port, as a result of calling @c Socket.
 	On each port there must be a unique listening socket (although any number
-	of non-listening sockets are allowed).
+	of non-listening sockets are allowed), unless all the listeners on the 
+	port have set @c SOCKOPT_REUSEPORT.
 
 	@param sock the socket to initialize as a listening socket
 	@returns 0 on success, -1 on error. Possible reasons for error:
@@ -620,6 +970,29 @@ int Listen(Fid_t sock);
 Fid_t Accept(Fid_t lsock);
 
 
+/**
+	@brief Accept a batch of connections.
+
+	This call is like @c Accept(), except that, once there are pending
+	connection requests, it accepts as many of them as are pending, up to
+	@c n, in a single call. It blocks only while no request is pending.
+
+	@param lsock the listening socket
+	@param fids an array of at least @c n elements, where the file ids of the
+		new sockets are stored
+	@param n the maximum number of connections to accept
+	@returns the number of connections accepted, or -1 on error. Possible
+		reasons for error:
+		- the file id is not legal, or not initialized by @c Listen()
+		- @c fids is NULL or @c n is 0
+		- the available file ids for the process are exhausted
+		- while waiting, the listening socket @c lsock was closed
+
+	@see Accept
+ */
+int AcceptMany(Fid_t lsock, Fid_t* fids, unsigned int n);
+
+
 
 /**
 	@brief Create a connection to a listener at a specific port.
@@ -631,6 +1004,9 @@ Fid_t Accept(Fid_t lsock);
 	The two connected sockets communicate by virtue of two pipes of opposite directions, 
 	but with one file descriptor servicing both pipes at each end.
 
+	If @c sock is not bound to a port, it is assigned a free port in the range
+	@c MIN_EPHEMERAL_PORT to @c MAX_PORT, which it holds while it is connected.
+
 	The connect call will block for approximately the specified amount of time.
 	The resolution of this timeout is implementation specific, but should be
 	in the order of 100's of msec. Therefore, a timeout of at least 500 msec is
@@ -645,10 +1021,26 @@ Fid_t Accept(Fid_t lsock);
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
 	   - the timeout has expired without a successful connection.
+	   - the backlog of the listener is full (this error is returned at once).
+	   - @c sock is not bound and all ephemeral ports are in use.
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
 
 
+/**
+	@brief Return the port of a socket.
+
+	This is the port given to @c Socket(), or the ephemeral port
+	assigned by @c Connect(). For the sockets returned by @c Accept(),
+	it is the port of the listener.
+
+	@param sock the socket
+	@returns the port, @c NOPORT if the socket is not bound, or -1 if
+	   the file id @c sock is not a socket.
+*/
+port_t GetSockPort(Fid_t sock);
+
+
 /**
    @brief Socket shutdown modes.
 
@@ -685,15 +1077,483 @@ typedef enum {
    will return -1.
 
    Shutting down multiple times is not an error.
+
+   A connection returned by @c NetAccept() can be shut down too. Then,
+   the host program reads end of file after `ShutDown(A, SHUTDOWN_WRITE)`.
    
    @param sock the file ID of the socket to shut down.
    @param how the type of shutdown requested
    @returns 0 on success and -1 on error. Possible reasons for error:
-       - the file id @c sock is not legal (a connected socket stream).
+       - the file id @c sock is not legal (a connected socket stream, or a
+         connection returned by @c NetAccept()).
 */
 int ShutDown(Fid_t sock, shutdown_mode how);
 
 
+/**
+   @brief Socket options.
+
+   These constants define the legal values for passing the second argument to
+   the @c SetSockOpt call.
+
+   @see SetSockOpt
+*/
+typedef enum {
+  SOCKOPT_PACKET=1,   /**< Non-zero for packet mode. 
+
+                          A connection is in packet mode when its listener
+                          is. Both directions of the connection then behave
+                          like a @c PacketPipe(). */
+  SOCKOPT_BACKLOG=2,  /**< The max. number of connection requests that
+                          may be pending on a listener (default 128).
+                          When the backlog is full, @c Connect() fails at once.
+
+                          For a datagram socket, the max. number of messages
+                          queued for @c RecvFrom() (default 64). This option
+                          may be set at any time. */
+  SOCKOPT_REUSEPORT=3,/**< Non-zero to share the port with other listeners.
+
+                          Any number of listeners that set this option may
+                          listen on the same port. @c Connect() queues each
+                          request on the listener with the fewest pending
+                          requests, taking turns among equals. */
+  SOCKOPT_RING=4      /**< Non-zero for ring mode.
+
+                          A connection is in ring mode when its listener
+                          is. Its data then flows through two @c sock_ring
+                          buffers, which both peers can access without
+                          system calls.
+                          @see SockRing */
+} socket_option;
+
+
+/**
+   @brief Set an option on a socket.
+
+   Options must be set before the socket is passed to @c Listen() or @c Connect(),
+   except for @c SOCKOPT_BACKLOG on datagram sockets.
+   For @c SOCKOPT_PACKET, the connecting socket must be in the same mode as
+   the listener, else @c Connect() fails.
+
+   @param sock the file ID of the socket
+   @param option the option to set
+   @param value the new value of the option
+   @returns 0 on success and -1 on error. Possible reasons for error:
+       - the file id @c sock is not legal (an unconnected, non-listening socket).
+       - the option is not legal.
+*/
+int SetSockOpt(Fid_t sock, socket_option option, int value);
+
+
+/** @brief The size of a @c sock_ring buffer, a power of 2. */
+#define SOCK_RING_SIZE (16384)
+
+/**
+	@brief A single-producer, single-consumer ring of bytes.
+
+	Connections in ring mode (see @c SOCKOPT_RING) carry their data in
+	two rings, one for each direction. The rings are shared by the kernel
+	and both peers. @c head counts the bytes ever written and @c tail the
+	bytes ever read, so that the ring holds @c head-tail bytes. Only the 
+	producer advances @c head, and only the consumer advances @c tail, 
+	so both sides can work at the same time without locks.
+
+	A side blocks by calling @c SockRingWait(), which sets its @c waiting
+	flag. After it has advanced its index, the other side must check the
+	flag and, if it is set, call @c SockRingWake(). The helpers @c RingSend()
+	and @c RingRecv() in @c tinyoslib.h follow this protocol.
+
+	@see SockRing
+*/
+typedef struct sock_ring {
+	unsigned int head;				/**< Bytes written, advanced by the producer */
+	unsigned int tail;				/**< Bytes read, advanced by the consumer */
+	int reader_waiting;				/**< Set while the consumer blocks */
+	int writer_waiting;				/**< Set while the producer blocks */
+	int reader_closed;				/**< Set when the consumer has shut down */
+	int writer_closed;				/**< Set when the producer has shut down */
+	char data[SOCK_RING_SIZE];		/**< The bytes, at index modulo @c SOCK_RING_SIZE */
+} sock_ring;
+
+/**
+	@brief Get the rings of a connection in ring mode.
+
+	The rings remain valid until @c sock is closed. @c Read() and 
+	@c Write() on the socket use the same rings, but should not be
+	mixed with direct access from another thread.
+
+	@param sock a connected socket in ring mode
+	@param rx the ring of received data is stored here
+	@param tx the ring of sent data is stored here
+	@returns 0 on success, or -1 if @c sock is not a connected socket in 
+		ring mode
+*/
+int SockRing(Fid_t sock, sock_ring** rx, sock_ring** tx);
+
+/**
+	@brief Wait until a ring of a socket is ready.
+
+	With @c EVENT_READ, wait until the received data ring is not empty, or
+	its producer has shut down. With @c EVENT_WRITE, wait until the ring of
+	sent data is not full, or its consumer has shut down.
+
+	@param sock a connected socket in ring mode
+	@param events @c EVENT_READ or @c EVENT_WRITE
+	@param timeout the time to wait in milliseconds, or @c (timeout_t)-1 to
+		wait for ever
+	@returns 0 when the ring is ready, -1 on error or timeout
+*/
+int SockRingWait(Fid_t sock, int events, timeout_t timeout);
+
+/**
+	@brief Wake up the peer blocked on a ring.
+
+	With @c EVENT_READ, wake up the consumer of the ring of sent data.
+	With @c EVENT_WRITE, wake up the producer of the ring of received data.
+	This also raises the event on the peer's event queues.
+
+	@param sock a connected socket in ring mode
+	@param events @c EVENT_READ or @c EVENT_WRITE
+	@returns 0 on success, -1 on error
+*/
+int SockRingWake(Fid_t sock, int events);
+
+
+/**
+	@brief The maximum size of a datagram.
+	@see SendTo
+*/
+#define MAX_DATAGRAM_SIZE (4096)
+
+/**
+	@brief Return a new datagram socket bound on a port.
+
+	Datagram sockets exchange messages with @c SendTo() and @c RecvFrom(),
+	without a connection. Each socket has a bounded queue of received 
+	messages; messages sent to a socket whose queue is full are dropped.
+	Message boundaries are preserved.
+
+	A datagram socket takes its port for itself, like a listener does.
+	@c Read() on a datagram socket is the same as @c RecvFrom() without a
+	timeout; @c Write() is not supported.
+
+	@param port the port to bind, or @c NOPORT for an ephemeral port
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is illegal, or is in use
+		- the available file ids for the process are exhausted
+	@see SendTo
+	@see RecvFrom
+*/
+Fid_t DatagramSocket(port_t port);
+
+/**
+	@brief Send a datagram to a port.
+
+	The message is queued on the datagram socket bound on @c port.
+	If that socket's queue is full, the message is dropped.
+
+	@param sock the sending datagram socket
+	@param port the destination port
+	@param buf the message
+	@param size the size of the message, at most @c MAX_DATAGRAM_SIZE
+	@returns @c size if the message was queued, 0 if it was dropped,
+	   or -1 on error. Possible reasons for error:
+	   - @c sock is not a datagram socket
+	   - there is no datagram socket on @c port
+	   - @c size is larger than @c MAX_DATAGRAM_SIZE
+*/
+int SendTo(Fid_t sock, port_t port, const char* buf, unsigned int size);
+
+/**
+	@brief Receive a datagram.
+
+	This call blocks until a message is queued on the socket, or the
+	timeout expires. A message longer than @c size is truncated; the
+	rest of it is discarded.
+
+	@param sock the datagram socket
+	@param buf the buffer to receive the message
+	@param size the size of @c buf
+	@param from if not NULL, the port of the sender is stored here
+	@param timeout the time to wait in milliseconds, or @c (timeout_t)-1 to
+		wait for ever
+	@returns the number of bytes stored in @c buf, or -1 on error. Possible
+		reasons for error:
+		- @c sock is not a datagram socket
+		- the timeout expired
+*/
+int RecvFrom(Fid_t sock, char* buf, unsigned int size, port_t* from, timeout_t timeout);
+
+/**
+	@brief Counters of a datagram socket.
+	@see GetDatagramStats
+*/
+typedef struct datagram_stats {
+	unsigned int queued;		/**< Messages waiting in the receive queue */
+	unsigned long sent;			/**< Messages sent by this socket */
+	unsigned long received;		/**< Messages queued on this socket */
+	unsigned long dropped;		/**< Messages to this socket dropped because the queue was full */
+} datagram_stats;
+
+/**
+	@brief Get the counters of a datagram socket.
+
+	@param sock the datagram socket
+	@param stats the counters are stored here
+	@returns 0 on success, or -1 if @c sock is not a datagram socket
+*/
+int GetDatagramStats(Fid_t sock, datagram_stats* stats);
+
+
+
+/**
+	@brief Listen for connections from the host.
+
+	This creates a UNIX-domain stream socket at @c path on the host file
+	system, where host programs can connect. Connections are accepted
+	with @c NetAccept(). The host socket is removed when the returned stream
+	is closed.
+
+	The @c netbridge shell program uses this to forward host connections 
+	to TinyOS sockets.
+
+	@param path the path of the host socket
+	@returns a file id for the listener, or NOFILE on error. Possible
+		reasons for error:
+		- the host socket cannot be created at @c path
+		- the available file ids for the process are exhausted
+	@see NetAccept
+*/
+Fid_t NetListen(const char* path);
+
+/**
+	@brief Accept a connection from the host.
+
+	This blocks until a host program connects to @c lsock. The returned
+	stream reads the bytes sent by the host program, and sends to it the
+	bytes written. @c Read() returns 0 when the host program has closed the
+	connection.
+
+	@param lsock a listener returned by @c NetListen()
+	@returns a file id for the connection, or NOFILE on error. Possible
+		reasons for error:
+		- @c lsock is not a listener returned by @c NetListen()
+		- the available file ids for the process are exhausted
+*/
+Fid_t NetAccept(Fid_t lsock);
+
+
+/*******************************************
+ *
+ * Event queues
+ *
+ *******************************************/
+
+/** @brief Event flag: the stream has become readable. */
+#define EVENT_READ  1
+
+/** @brief Event flag: the stream has become writable. */
+#define EVENT_WRITE 2
+
+/**
+	@brief An event returned by @c WaitEvents.
+*/
+typedef struct event_s {
+	Fid_t fid;			/**< The file id given at registration */
+	int events;			/**< The events raised (@c EVENT_READ, @c EVENT_WRITE) */
+} event_t;
+
+
+/**
+	@brief Create an event queue.
+
+	An event queue is a stream on which other streams are registered once,
+	by @c EventCtl. From then on, the queue is told about readiness transitions
+	of the registered streams, and @c WaitEvents returns a batch of them without
+	scanning the registered streams.
+
+	The queue is edge-triggered: an event is reported when a stream becomes
+	readable (new data arrived, the write end was closed, a connection
+	request is pending at a listener) or writable (space was freed, the 
+	socket was connected), and not again until the next transition. 
+	When a stream is registered, or its registration is changed, the events
+	that already hold are reported once, as if they had just happened.
+
+	The queue is released by @c Close.
+
+	@returns a file id for the new queue, or NOFILE on error. Possible
+		reasons for error:
+		- the available file ids for the process are exhausted
+	@see EventCtl
+	@see WaitEvents
+*/
+Fid_t EventQueue();
+
+/**
+	@brief Register, modify or remove a stream on an event queue.
+
+	If @c events is non-zero, the stream @c fid is registered on queue
+	@c evq for the given events, replacing any previous registration.
+	If @c events is zero, the registration is removed. The events that
+	already hold for the stream (e.g., a pipe that has data) are raised
+	when it is registered.
+
+	A registration is also removed when the registered stream is finally 
+	closed.
+
+	@param evq the event queue
+	@param fid the stream to watch
+	@param events a mask of @c EVENT_READ and @c EVENT_WRITE, or 0
+	@returns 0 on success, -1 on error. Possible reasons for error:
+		- @c evq is not an event queue
+		- @c fid is not a legal stream, or it is an event queue
+		- @c events is 0 and @c fid was not registered
+*/
+int EventCtl(Fid_t evq, Fid_t fid, int events);
+
+/**
+	@brief Wait for events on an event queue.
+
+	This call blocks until at least one registered stream has a pending
+	event, or the timeout expires. Then, it returns up to @c n events
+	into the array @c events, in the order they were raised. The time taken
+	depends only on the number of returned events.
+
+	@param evq the event queue
+	@param events an array of size at least @c n
+	@param n the maximum number of events to return
+	@param timeout the time to wait in milliseconds, or @c (timeout_t)-1 to 
+		wait for ever
+	@returns the number of events returned (0 if the timeout expired), or -1
+		on error. Possible reasons for error:
+		- @c evq is not an event queue
+		- @c events is NULL or @c n is 0
+*/
+int WaitEvents(Fid_t evq, event_t* events, unsigned int n, timeout_t timeout);
+
+
+
+/*******************************************
+ *
+ * Asynchronous I/O
+ *
+ *******************************************/
+
+/** @brief The number of entries of the rings of an @c io_ring, a power of 2. */
+#define IO_RING_ENTRIES 256
+
+/** @brief The maximum number of worker threads of an @c io_ring. */
+#define IO_RING_MAX_WORKERS 16
+
+/** @brief The operations of an @c io_sqe. */
+typedef enum io_opcode {
+	IO_NOP,			/**< Do nothing, and complete with 0 */
+	IO_READ,		/**< @c Read(fid, buf, size) */
+	IO_WRITE,		/**< @c Write(fid, buf, size) */
+	IO_ACCEPT,		/**< @c Accept(fid) */
+	IO_CONNECT		/**< @c Connect(fid, port, timeout) */
+} io_opcode;
+
+/**
+	@brief A submission queue entry: an operation for an @c io_ring.
+
+	The fields that an operation does not use are ignored.
+*/
+typedef struct io_sqe {
+	io_opcode opcode;		/**< The operation */
+	Fid_t fid;				/**< The stream of the operation */
+	char* buf;				/**< The buffer of @c IO_READ and @c IO_WRITE */
+	unsigned int size;		/**< The size of @c buf */
+	port_t port;			/**< The port of @c IO_CONNECT */
+	timeout_t timeout;		/**< The timeout of @c IO_CONNECT */
+	uintptr_t user_data;	/**< Copied to the completion */
+} io_sqe;
+
+/** @brief A completion queue entry: the result of an operation. */
+typedef struct io_cqe {
+	uintptr_t user_data;	/**< The @c user_data of the submission */
+	int result;				/**< The return value of the operation */
+} io_cqe;
+
+/**
+	@brief A pair of rings for asynchronous I/O.
+
+	The process submits operations by writing entries into the submission
+	ring @c sq and advancing @c sq_tail. The kernel takes entries by
+	advancing @c sq_head, and posts their results in the completion ring
+	@c cq, advancing @c cq_tail. The process reaps the results by advancing
+	@c cq_head. Like for a @c sock_ring, the indices count entries and the
+	entry of index @c i is at @c i modulo @c IO_RING_ENTRIES. Each index is
+	written by one side only, so the rings are accessed without locks.
+
+	The kernel only takes an entry when the completion ring will have room
+	for its result, that is, when less than @c IO_RING_ENTRIES operations
+	have been taken and not reaped. The helpers @c IoSubmit() and
+	@c IoReap() in @c tinyoslib.h follow this protocol.
+
+	@see IoRing
+*/
+typedef struct io_ring {
+	unsigned int sq_head;			/**< Entries taken, advanced by the kernel */
+	unsigned int sq_tail;			/**< Entries submitted, advanced by the process */
+	unsigned int cq_head;			/**< Completions reaped, advanced by the process */
+	unsigned int cq_tail;			/**< Completions posted, advanced by the kernel */
+	io_sqe sq[IO_RING_ENTRIES];		/**< The submission ring */
+	io_cqe cq[IO_RING_ENTRIES];		/**< The completion ring */
+} io_ring;
+
+/**
+	@brief Create an asynchronous I/O ring.
+
+	The submitted operations are executed by @c workers threads of the
+	process, which run in the kernel. A worker executes the operations in
+	the order they were submitted, until one of them blocks; then, the next
+	idle worker goes on with the next ones. Therefore, at most @c workers
+	operations may block at once, and operations that do not block complete
+	in order. The workers are detached, and they do not keep the process
+	alive: they exit when the ring is closed, or when all the other threads
+	of the process have exited. An operation that has started when the ring
+	is closed is still executed.
+
+	The ring is released by @c Close.
+
+	@param workers the number of worker threads, from 1 to
+		@c IO_RING_MAX_WORKERS; 0 is taken as 1
+	@param ring the address of the shared rings is stored here. It is valid
+		until the ring is closed.
+	@returns a file id for the ring, or NOFILE on error. Possible reasons
+		for error:
+		- @c ring is NULL, or @c workers is too large
+		- the available file ids for the process are exhausted
+		- a worker thread could not be created
+	@see IoRingEnter
+*/
+Fid_t IoRing(unsigned int workers, io_ring** ring);
+
+/**
+	@brief Start the submitted operations, and wait for completions.
+
+	This wakes up the workers of the ring, if there are new entries in
+	its submission ring. Then, it blocks until at least @c min_complete
+	completions are ready to be reaped, or the timeout expires. With
+	@c min_complete 0, it does not block. A batch of operations therefore
+	costs a single system call. If the ring is closed by another thread,
+	the call returns at once.
+
+	@param ring the file id of the ring
+	@param min_complete the number of completions to wait for, at most
+		@c IO_RING_ENTRIES
+	@param timeout the time to wait in milliseconds, or @c (timeout_t)-1 to
+		wait for ever
+	@returns the number of completions ready to be reaped, or -1 on error.
+		Possible reasons for error:
+		- @c ring is not an I/O ring
+		- @c min_complete is larger than @c IO_RING_ENTRIES
+*/
+int IoRingEnter(Fid_t ring, unsigned int min_complete, timeout_t timeout);
+
+
 
 /*******************************************
  *
@@ -701,6 +1561,61 @@ int ShutDown(Fid_t sock, shutdown_mode how);
  *
  *******************************************/
 
+/**
+  @brief The number of scheduler causes, by which context switches are counted.
+  @see resource_usage
+  */
+#define USAGE_CAUSES (7)
+
+/**
+	@brief Resource usage of a thread, a process, or the reaped children 
+	of a process.
+
+	Times are in usec, of the host's monotonic clock. A thread is either 
+	running on a core, ready to run, or blocked (stopped).
+
+	A context switch is counted when a thread gives up its core. It is
+	involuntary if its quantum expired, and voluntary otherwise. The
+	switches are also counted by the cause of the switch, in the order
+	quantum, I/O, mutex, pipe, poll, idle, user.
+
+	@see GetRusage
+  */
+typedef struct resource_usage
+{
+	unsigned long cpu_time;		/**< @brief Time running. */
+	unsigned long ready_time;	/**< @brief Time ready, waiting for a core. */
+	unsigned long stopped_time;	/**< @brief Time blocked. */
+	unsigned long voluntary;	/**< @brief Voluntary context switches. */
+	unsigned long involuntary;	/**< @brief Involuntary context switches. */
+	unsigned long switches[USAGE_CAUSES];	/**< @brief Context switches, by cause. */
+	unsigned long bytes_read;	/**< @brief Bytes returned by @c Read(). */
+	unsigned long bytes_written;	/**< @brief Bytes accepted by @c Write(). */
+	unsigned long peak_threads;	/**< @brief The largest number of threads of a process
+									at the same time. */
+} resource_usage;
+
+/**
+	@brief Whose resource usage is returned by @c GetRusage().
+  */
+typedef enum usage_who
+{
+	USAGE_THREAD,		/**< @brief The current thread. */
+	USAGE_PROCESS,		/**< @brief The current process, all its threads included. */
+	USAGE_CHILDREN		/**< @brief The children of the current process that have been 
+							waited for, and their own children. */
+} usage_who;
+
+/**
+	@brief Get resource usage.
+
+	@param who whose usage to return
+	@param usage the usage is stored here
+	@returns 0 on success, or -1 if @c who is not valid or @c usage is NULL
+  */
+int GetRusage(usage_who who, resource_usage* usage);
+
+
 /**
   @brief The max. size of args returned by a procinfo structure.
   */
@@ -736,6 +1651,8 @@ typedef struct procinfo
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+
+  resource_usage usage; /**< @brief The resource usage of the process. */
 } procinfo;
 
 
@@ -749,6 +1666,10 @@ typedef struct procinfo
 	Each procinfo structure contains information pertaining to some
 	used PCB (active or zombie) during the time of the stream. 
 
+	A @c Read() returns as many whole records as fit in its buffer, in
+	increasing pid order. A buffer smaller than @c sizeof(procinfo) 
+	receives a prefix of the next record.
+
 	There is no guarantee of the timeliness of the information.
 	A best-effort approach to return relevant system information is
 	made. 
@@ -760,6 +1681,109 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+  @brief The max. size of the cache name returned by a meminfo structure.
+  */
+#define MEMINFO_NAME_SIZE (16)
+
+/**
+	@brief A struct containing allocation statistics for a kernel object cache.
+
+	This structure is returned by memory information streams.
+	@see OpenMemInfo
+  */
+typedef struct meminfo
+{
+	char name[MEMINFO_NAME_SIZE];	/**< @brief The name of the cache. */
+	unsigned long object_size;		/**< @brief The size of each object in bytes. */
+	unsigned long slabs;			/**< @brief The number of slabs allocated. */
+	unsigned long objects;			/**< @brief The number of objects in all slabs. */
+	unsigned long in_use;			/**< @brief The number of objects currently allocated. */
+	unsigned long allocs;			/**< @brief The total number of allocations. */
+	unsigned long frees;			/**< @brief The total number of frees. */
+	unsigned long refills;			/**< @brief The number of allocations that were not
+										served by the per-core magazine. */
+} meminfo;
+
+
+/**
+	@brief Open a kernel memory information stream.
+
+	This is a read-only stream that returns a sequence of
+	@c meminfo structures, each packed into a block of size
+	@c sizeof(meminfo), one for each kernel object cache that
+	has been used.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+ */
+Fid_t OpenMemInfo();
+
+
+/**
+	@brief The kind of socket described by a sockinfo structure.
+  */
+typedef enum sockinfo_type
+{
+	SOCKINFO_UNBOUND,	/**< @brief Neither listening nor connected */
+	SOCKINFO_LISTENER,	/**< @brief A listening socket */
+	SOCKINFO_PEER,		/**< @brief A connected socket */
+	SOCKINFO_DATAGRAM	/**< @brief A datagram socket */
+} sockinfo_type;
+
+/**
+	@brief A struct containing traffic statistics for a socket.
+
+	All times are in usec, measured by the (coarse) hardware clock.
+	For sockets in ring mode, only the data moved through @c Read and @c Write
+	is counted, since @c RingSend and @c RingRecv do not enter the kernel.
+
+	This structure is returned by socket information streams.
+	@see OpenSockInfo
+  */
+typedef struct sockinfo
+{
+	sockinfo_type type;				/**< @brief The kind of socket. */
+	port_t port;					/**< @brief The port of the socket, or @c NOPORT. */
+	port_t peer_port;				/**< @brief For connected sockets, the port of the peer,
+										else @c NOPORT. */
+	unsigned long age;				/**< @brief Time since the socket was created. */
+	unsigned long bytes_in;			/**< @brief Bytes received. */
+	unsigned long bytes_out;		/**< @brief Bytes sent. */
+	unsigned long read_waits;		/**< @brief The number of times a reader blocked for data. */
+	unsigned long read_wait_time;	/**< @brief The total time readers were blocked. */
+	unsigned long write_waits;		/**< @brief The number of times a writer blocked for space. */
+	unsigned long write_wait_time;	/**< @brief The total time writers were blocked. */
+	unsigned long connect_time;		/**< @brief The time from @c Connect to the admission of the
+										connection by @c Accept, or 0. */
+	unsigned int pending;			/**< @brief The requests queued on a listener, or the
+										messages queued on a datagram socket. */
+	unsigned int max_pending;		/**< @brief The largest number of requests ever queued 
+										on a listener. */
+	unsigned long dgram_sent;		/**< @brief Datagrams sent. */
+	unsigned long dgram_received;	/**< @brief Datagrams queued for receipt. */
+	unsigned long dgram_dropped;	/**< @brief Datagrams dropped because the queue was full. */
+} sockinfo;
+
+
+/**
+	@brief Open a socket information stream.
+
+	This is a read-only stream that returns a sequence of
+	@c sockinfo structures, each packed into a block of size
+	@c sizeof(sockinfo), one for each socket in the system.
+
+	As with @ref OpenInfo, there is no guarantee of the timeliness 
+	of the information; sockets created or closed while the stream is
+	read may be missed or reported twice.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+ */
+Fid_t OpenSockInfo();
+
 
 
 /*******************************************
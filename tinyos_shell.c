@@ -21,6 +21,8 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int MemInfo(size_t,const char**);
+int NetStat(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -30,6 +32,7 @@ int Symposium_proc(size_t,const char**);
 int Symposium_thr(size_t,const char**);
 int RemoteServer(size_t,const char**);
 int RemoteClient(size_t,const char**);
+int NetBridge(size_t,const char**);
 int Echo(size_t,const char**);
 
 
@@ -39,6 +42,8 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"meminfo", MemInfo, 0, "Print allocation statistics of the kernel object caches."},
+	{"netstat", NetStat, 0, "netstat [<n>] (default: <n>=10). Print the <n> sockets with the highest throughput."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -53,6 +58,7 @@ COMMANDS[]  =
 	{"hanoi", Hanoi, 1, "The towers of Hanoi."},
 	{"rserver", RemoteServer, 0, "A server for remote execution."},
 	{"rcli", RemoteClient, 1, "Remote client: rcli <cmd> [<args...>]."},
+	{"netbridge", NetBridge, 1, "netbridge <path> [<port>]: forward host connections on UNIX socket <path> to <port> (default: the rserver port)."},
 	{"echo", Echo, 0, "echo [<args...>], send the <args...> to stdout"},
 
 	{NULL, NULL, 0, NULL}
@@ -171,33 +177,114 @@ int SystemInfo(size_t argc, const char** argv)
 	Fid_t finfo = OpenInfo();
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
-		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		procinfo infos[16];
+		int n;
+		printf("%5s %5s %6s %8s %8s %20s\n",
+			"PID", "PPID", "State", "Threads", "CPU ms", "Main program"
 			);
-		/* Read in next piece of info */		
-		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
-			Program prog=NULL;
-			const char* argv[10];
-			int argc = ParseProcInfo(&info, &prog, 10, argv);
-
-			const char* pname = "-";
-			if(argc>=1)  {
-				pname = argv[0];
-			} else if(argc==-1) {
-				/* Try to give some known names */
-				if(info.pid==1) pname = "init";
+		/* Read in the next batch of info */		
+		while((n = Read(finfo, (char*) infos, sizeof(infos))) > 0) {
+			for(procinfo* info = infos; info < infos + n/sizeof(procinfo); info++) {
+				Program prog=NULL;
+				const char* argv[10];
+				int argc = ParseProcInfo(info, &prog, 10, argv);
+
+				const char* pname = "-";
+				if(argc>=1)  {
+					pname = argv[0];
+				} else if(argc==-1) {
+					/* Try to give some known names */
+					if(info->pid==1) pname = "init";
+				}
+
+				printf("%5d %5d %6s %8lu %8lu %20s\n",
+					info->pid,
+					info->ppid,
+					(info->alive?"ALIVE":"ZOMBIE"),
+					info->thread_count,
+					info->usage.cpu_time/1000,
+					pname
+					);
 			}
+		}
+		Close(finfo);
+	}
+	printf("\n");
+	return 0;
+}
 
-			printf("%5d %5d %6s %8u %20s\n",
-				info.pid,
-				info.ppid,
-				(info.alive?"ALIVE":"ZOMBIE"),
-				info.thread_count,
-				pname
+int MemInfo(size_t argc, const char** argv)
+{
+	Fid_t finfo = OpenMemInfo();
+	if(finfo!=NOFILE) {
+		meminfo info;
+		printf("%-16s %6s %6s %8s %8s %10s %10s %8s\n",
+			"Cache", "Size", "Slabs", "Objects", "In use", "Allocs", "Frees", "Refills"
+			);
+		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
+			printf("%-16s %6lu %6lu %8lu %8lu %10lu %10lu %8lu\n",
+				info.name, info.object_size, info.slabs, info.objects,
+				info.in_use, info.allocs, info.frees, info.refills
 				);
 		}
+		Close(finfo);
+	}
+	printf("\n");
+	return 0;
+}
+
+
+/* Bytes per second over the lifetime of a socket */
+static double sock_throughput(const sockinfo* info)
+{
+	double age = info->age > 0 ? info->age : 1;
+	return (info->bytes_in + info->bytes_out) * 1E6 / age;
+}
+
+static int by_throughput(const void* a, const void* b)
+{
+	double ta = sock_throughput(a), tb = sock_throughput(b);
+	return (ta < tb) - (ta > tb);
+}
+
+int NetStat(size_t argc, const char** argv)
+{
+	int top = (argc > 1) ? getint(1) : 10;
+
+	Fid_t finfo = OpenSockInfo();
+	if(finfo==NOFILE) return 1;
+
+	/* Read all sockets, then sort them */
+	size_t n = 0, size = 16;
+	sockinfo* infos = malloc(size*sizeof(sockinfo));
+	while(Read(finfo, (char*) &infos[n], sizeof(sockinfo)) > 0) {
+		if(++n == size) {
+			size *= 2;
+			infos = realloc(infos, size*sizeof(sockinfo));
+		}
 	}
+	Close(finfo);
+	qsort(infos, n, sizeof(sockinfo), by_throughput);
+
+	static const char* types[] = { "UNBOUND", "LISTEN", "PEER", "DGRAM" };
+	printf("%-8s %5s %5s %10s %10s %10s %7s %9s %7s %9s %8s %7s\n",
+		"Type", "Port", "Peer", "Bytes in", "Bytes out", "Bytes/s",
+		"R.waits", "R.wait ms", "W.waits", "W.wait ms", "Conn ms", "Queue"
+		);
+	for(size_t i = 0; i < n && i < (size_t) top; i++) {
+		sockinfo* info = &infos[i];
+		printf("%-8s %5d %5d %10lu %10lu %10.0f %7lu %9lu %7lu %9lu %8lu %3u/%-3u\n",
+			types[info->type], info->port, info->peer_port,
+			info->bytes_in, info->bytes_out, sock_throughput(info),
+			info->read_waits, info->read_wait_time/1000,
+			info->write_waits, info->write_wait_time/1000,
+			info->connect_time/1000, info->pending, info->max_pending
+			);
+		if(info->type == SOCKINFO_DATAGRAM)
+			printf("%8s sent=%lu received=%lu dropped=%lu\n", "",
+				info->dgram_sent, info->dgram_received, info->dgram_dropped);
+	}
+	free(infos);
 	printf("\n");
 	return 0;
 }
@@ -773,6 +860,82 @@ int RemoteClient(size_t argc, const char** argv)
 
 
 
+
+/*************************************
+
+	The network bridge
+
+	Each connection accepted on the host socket is connected to a
+	TinyOS socket on the given port, and a relay process copies bytes
+	both ways, until each side closes.
+
+ *************************************/
+
+struct bridge_conn {
+	Fid_t listener;		/* the host listener, closed by the relay */
+	Fid_t host;			/* the host connection */
+	Fid_t sock;			/* the TinyOS connection */
+};
+
+/* Copy from fids[0] to fids[1] until end of stream */
+static int bridge_pump(int argl, void* args)
+{
+	Fid_t* fids = args;
+	char buf[1024];
+	int n;
+	while((n = Read(fids[0], buf, sizeof(buf))) > 0)
+		if(Write(fids[1], buf, n) != n) break;
+	ShutDown(fids[1], SHUTDOWN_WRITE);
+	return 0;
+}
+
+static int bridge_relay(int argl, void* args)
+{
+	struct bridge_conn* conn = args;
+	Close(conn->listener);
+
+	Fid_t up[2] = { conn->host, conn->sock };
+	Fid_t down[2] = { conn->sock, conn->host };
+	Tid_t t = CreateThread(bridge_pump, 0, up);
+	bridge_pump(0, down);
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+/* Start the relay as an orphan, so that the bridge need not wait for it */
+static int bridge_spawn(int argl, void* args)
+{
+	Exec(bridge_relay, argl, args);
+	return 0;
+}
+
+int NetBridge(size_t argc, const char** argv)
+{
+	checkargs(1);
+	port_t port = (argc > 2) ? getint(2) : REMOTE_SERVER_DEFAULT_PORT;
+
+	struct bridge_conn conn;
+	conn.listener = NetListen(argv[1]);
+	if(conn.listener == NOFILE) {
+		printf("Cannot listen on %s\n", argv[1]);
+		return -1;
+	}
+
+	while((conn.host = NetAccept(conn.listener)) != NOFILE) {
+		conn.sock = Socket(NOPORT);
+		if(conn.sock == NOFILE || Connect(conn.sock, port, 1000) == -1) {
+			printf("netbridge: cannot connect to port %d\n", port);
+		} else {
+			WaitChild(Exec(bridge_spawn, sizeof(conn), &conn), NULL);
+		}
+		Close(conn.host);
+		Close(conn.sock);
+	}
+	Close(conn.listener);
+	return 0;
+}
+
+
 /*************************************
 
 	A very simple shell for tinyos 
@@ -790,15 +953,6 @@ int process_builtin(int argc, const char** argv)
 }
 
 
-static inline Fid_t savefid(Fid_t fsaved)
-{
-	Fid_t savior = OpenNull();
-	assert(savior!=NOFILE);
-	Dup2(fsaved, savior);
-	return savior;
-}
-
-
 int process_line(int argc, const char** argv)
 {
 	/* Split up into pipeline fragments */
@@ -836,41 +990,51 @@ int process_line(int argc, const char** argv)
 		comd[i] = c;
 	}
 
-	/* Construct pipeline */
-	int child[frag];
-	int savein, saveout;
-
-	savein = savefid(0);
-	saveout = savefid(1);
+	/* Construct pipeline: pipe i connects fragment i to fragment i+1 */
+	pipe_t pipes[frag];
+	int npipes;
+	for(npipes=0; npipes<frag-1; npipes++)
+		if(Pipe(& pipes[npipes])!=0) {
+			printf("Error: cannot create a pipe.\n");
+			break;
+		}
 
-	pipe_t pipe;
-	for(int i=0; i<frag; i++) {
-		if(i<frag-1) {
-			/* Not the last fragment, make a pipe */
-			Pipe(& pipe);
-			Dup2(pipe.write,1);
-			Close(pipe.write);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(saveout, 1);
-			Close(saveout);				
+	/* Each child takes its ends of the pipes as 0 and 1, and closes the rest */
+	spawn_request reqs[frag];
+	spawn_action actions[frag][2 + 2*npipes];
+	int child[frag];
+	int nchild = 0;
+
+	if(npipes == frag-1) {
+		for(int i=0; i<frag; i++) {
+			PrepareExecute(& reqs[i], COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
+			spawn_action* act = actions[i];
+			if(i>0)
+				*act++ = (spawn_action){ SPAWN_DUP2, pipes[i-1].read, 0 };
+			if(i<frag-1)
+				*act++ = (spawn_action){ SPAWN_DUP2, pipes[i].write, 1 };
+			for(int j=0; j<npipes; j++) {
+				*act++ = (spawn_action){ SPAWN_CLOSE, pipes[j].read, NOFILE };
+				*act++ = (spawn_action){ SPAWN_CLOSE, pipes[j].write, NOFILE };
+			}
+			reqs[i].actions = actions[i];
+			reqs[i].nactions = act - actions[i];
 		}
 
-		child[i] = Execute(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
+		nchild = ExecMany(frag, reqs, child);
+		for(int i=0; i<frag; i++) 
+			free(reqs[i].args);
+		if(nchild < frag)
+			printf("Error: could only start %d of %d programs.\n", nchild, frag);
+	}
 
-		if(i<frag-1) {
-			/* Not the last fragment, make a pipe */
-			Dup2(pipe.read,0);
-			Close(pipe.read);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(savein, 0);
-			Close(savein);
-		}
+	for(int j=0; j<npipes; j++) {
+		Close(pipes[j].read);
+		Close(pipes[j].write);
 	}
 
 	/* Wait for the children */
-	for(int i=0; i<frag; i++) {
+	for(int i=0; i<nchild; i++) {
 		int exitval;
 		WaitChild(child[i], &exitval);
 		if(exitval) 
@@ -4,6 +4,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio_ext.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#ifndef NVALGRIND
+#include <valgrind/valgrind.h>
+#endif
 
 #include "util.h"
 #include "tinyos.h"
@@ -145,6 +151,21 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv )
 
 
 
+void PrepareExecute(spawn_request* req, Program prog, size_t argc, const char** argv)
+{
+	size_t argl = argvlen(argc, argv) + sizeof(prog);
+	char* args = malloc(argl);
+	memcpy(args, &prog, sizeof(prog));
+	argvpack(args+sizeof(prog), argc, argv);
+
+	req->task = exec_wrapper;
+	req->argl = argl;
+	req->args = args;
+	req->actions = NULL;
+	req->nactions = 0;
+}
+
+
 int Execute(Program prog, size_t argc, const char** argv)
 {
 	/* We will pack the prog pointer and the arguments to 
@@ -191,3 +212,976 @@ void BarrierSync(barrier* bar, unsigned int n)
 }
 
 
+
+
+/*
+	The ring protocol: move the index, then check the waiting flag of the
+	other side. The full fence pairs with the one in the kernel, taken after
+	a blocking side sets its flag.
+*/
+
+int RingSend(Fid_t sock, sock_ring* tx, const char* buf, unsigned int n)
+{
+	unsigned int sent = 0;
+	while(sent < n) {
+		if(__atomic_load_n(&tx->reader_closed, __ATOMIC_ACQUIRE))
+			return -1;
+
+		unsigned int head = tx->head;
+		unsigned int used = head - __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE);
+		if(used == SOCK_RING_SIZE) {
+			if(SockRingWait(sock, EVENT_WRITE, (timeout_t)-1) == -1)
+				return -1;
+			continue;
+		}
+
+		unsigned int count = SOCK_RING_SIZE - used;
+		if(count > n - sent) count = n - sent;
+		for(unsigned int i = 0; i < count; i++)
+			tx->data[(head+i) & (SOCK_RING_SIZE-1)] = buf[sent+i];
+		__atomic_store_n(&tx->head, head + count, __ATOMIC_RELEASE);
+		sent += count;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&tx->reader_waiting, __ATOMIC_ACQUIRE))
+			SockRingWake(sock, EVENT_READ);
+	}
+	return n;
+}
+
+
+int RingRecv(Fid_t sock, sock_ring* rx, char* buf, unsigned int n)
+{
+	unsigned int tail = rx->tail;
+	unsigned int used;
+	while((used = __atomic_load_n(&rx->head, __ATOMIC_ACQUIRE) - tail) == 0) {
+		if(__atomic_load_n(&rx->writer_closed, __ATOMIC_ACQUIRE))
+			return 0;
+		if(SockRingWait(sock, EVENT_READ, (timeout_t)-1) == -1)
+			return -1;
+	}
+
+	unsigned int count = used < n ? used : n;
+	for(unsigned int i = 0; i < count; i++)
+		buf[i] = rx->data[(tail+i) & (SOCK_RING_SIZE-1)];
+	__atomic_store_n(&rx->tail, tail + count, __ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&rx->writer_waiting, __ATOMIC_ACQUIRE))
+		SockRingWake(sock, EVENT_WRITE);
+	return count;
+}
+
+
+int IoSubmit(io_ring* ring, const io_sqe* sqe)
+{
+	unsigned int tail = ring->sq_tail;
+	if(tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE) == IO_RING_ENTRIES)
+		return -1;
+	ring->sq[tail & (IO_RING_ENTRIES-1)] = *sqe;
+	__atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+int IoReap(io_ring* ring, io_cqe* cqe)
+{
+	unsigned int head = ring->cq_head;
+	if(head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	*cqe = ring->cq[head & (IO_RING_ENTRIES-1)];
+	__atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+
+
+/*
+	Fibers.
+
+	A fiber scheduler keeps a FIFO queue of ready fibers, which its carriers
+	run. A carrier switches to a fiber, and the fiber switches back to the
+	carrier when it yields, parks or returns. The carrier then finishes the
+	job: it queues a yielding fiber, releases the lock of a parked fiber, or
+	frees a finished one. Thus, a parked fiber cannot be woken up and run by
+	another carrier before its context is saved.
+
+	The stack of a fiber is allocated when it first runs, and recycled when
+	it returns. It is aligned to its size, and its lowest word points to the
+	fiber, so that a fiber finds itself from the address of a local variable,
+	without a system call.
+
+	@c active counts the carriers that are not blocked in a system call. A
+	fiber that blocks hands out a ticket to a spare carrier, or creates a
+	new carrier, so that @c ncarriers stay active. A carrier that finds more
+	than @c ncarriers active becomes a spare.
+*/
+
+typedef enum { FIBER_READY, FIBER_YIELDED, FIBER_PARKED, FIBER_DONE } fiber_state;
+
+typedef struct fiber_scheduler fiber_scheduler;
+
+typedef struct fiber_carrier {
+	ucontext_t context;
+} fiber_carrier;
+
+struct fiber {
+	ucontext_t context;
+	fiber_state state;
+	FiberFunc func;
+	void* arg;
+	void* stack;
+	fiber_scheduler* sched;
+	fiber_carrier* carrier;		/* The carrier running the fiber */
+	Mutex* parklock;			/* Released by the carrier, after the fiber parks */
+	fiber* next;				/* Node in a fiber_queue */
+#ifndef NVALGRIND
+	unsigned valgrind_stack_id;
+#endif
+};
+
+struct fiber_scheduler {
+	Mutex lock;
+	fiber_queue ready;
+	unsigned int live;			/* Fibers that have not returned */
+	unsigned int ncarriers;		/* Carriers that should be active */
+	unsigned int carriers;		/* All carriers */
+	unsigned int active;		/* Carriers not blocked in a system call */
+	unsigned int idle;			/* Carriers waiting for a ready fiber */
+	unsigned int spares;		/* Carriers waiting for a ticket */
+	unsigned int tickets;
+	CondVar has_ready, has_ticket, finished;
+	void* stacks;				/* Free stacks, linked through their lowest word */
+	unsigned int nstacks;
+};
+
+#define FIBER_STACK_CACHE 256
+
+
+static void fiber_enqueue(fiber_queue* q, fiber* f)
+{
+	f->next = NULL;
+	if(q->tail) q->tail->next = f; else q->head = f;
+	q->tail = f;
+}
+
+static fiber* fiber_dequeue(fiber_queue* q)
+{
+	fiber* f = q->head;
+	if(f) {
+		q->head = f->next;
+		if(q->head == NULL) q->tail = NULL;
+	}
+	return f;
+}
+
+/* The fiber that owns the current stack */
+static fiber* fiber_self()
+{
+	char here;
+	uintptr_t base = (uintptr_t)&here & ~(uintptr_t)(FIBER_STACK_SIZE-1);
+	return *(fiber**) base;
+}
+
+/* Make a fiber ready. The fiber must not be running. */
+static void fiber_ready(fiber* f)
+{
+	fiber_scheduler* s = f->sched;
+	f->state = FIBER_READY;
+	Mutex_Lock(&s->lock);
+	fiber_enqueue(&s->ready, f);
+	if(s->idle > 0)
+		Cond_Signal(&s->has_ready);
+	Mutex_Unlock(&s->lock);
+}
+
+/* Switch from the running fiber back to its carrier */
+static void fiber_switch_out(fiber* f, fiber_state state)
+{
+	f->state = state;
+	swapcontext(&f->context, &f->carrier->context);
+}
+
+/* Park the running fiber, which holds lock. The lock is released after the switch. */
+static void fiber_park(fiber* f, Mutex* lock)
+{
+	f->parklock = lock;
+	fiber_switch_out(f, FIBER_PARKED);
+}
+
+static void fiber_start()
+{
+	fiber* f = fiber_self();
+	f->func(f->arg);
+	fiber_switch_out(f, FIBER_DONE);
+}
+
+
+static void* fiber_stack_alloc(fiber_scheduler* s)
+{
+	Mutex_Lock(&s->lock);
+	void* stack = s->stacks;
+	if(stack) {
+		s->stacks = *(void**)stack;
+		s->nstacks--;
+	}
+	Mutex_Unlock(&s->lock);
+
+	if(stack == NULL)
+		stack = aligned_alloc(FIBER_STACK_SIZE, FIBER_STACK_SIZE);
+	return stack;
+}
+
+static void fiber_stack_free(fiber_scheduler* s, void* stack)
+{
+	Mutex_Lock(&s->lock);
+	if(s->nstacks < FIBER_STACK_CACHE) {
+		*(void**)stack = s->stacks;
+		s->stacks = stack;
+		s->nstacks++;
+		stack = NULL;
+	}
+	Mutex_Unlock(&s->lock);
+	free(stack);
+}
+
+
+/* Run a fiber until it switches out, and finish the switch */
+static void fiber_run(fiber_carrier* c, fiber* f)
+{
+	fiber_scheduler* s = f->sched;
+
+	if(f->stack == NULL) {
+		f->stack = fiber_stack_alloc(s);
+		assert(f->stack != NULL);
+		*(fiber**)f->stack = f;
+#ifndef NVALGRIND
+		f->valgrind_stack_id = VALGRIND_STACK_REGISTER(f->stack, f->stack + FIBER_STACK_SIZE);
+#endif
+		getcontext(&f->context);
+		f->context.uc_link = NULL;
+		f->context.uc_stack.ss_sp = f->stack + sizeof(fiber*);
+		f->context.uc_stack.ss_size = FIBER_STACK_SIZE - sizeof(fiber*);
+		f->context.uc_stack.ss_flags = 0;
+		makecontext(&f->context, fiber_start, 0);
+	}
+
+	f->carrier = c;
+	swapcontext(&c->context, &f->context);
+
+	switch(f->state) {
+	case FIBER_YIELDED:
+		fiber_ready(f);
+		break;
+	case FIBER_PARKED:
+		/* After this, f may run on another carrier */
+		Mutex_Unlock(f->parklock);
+		break;
+	case FIBER_DONE:
+#ifndef NVALGRIND
+		VALGRIND_STACK_DEREGISTER(f->valgrind_stack_id);
+#endif
+		fiber_stack_free(s, f->stack);
+		free(f);
+		Mutex_Lock(&s->lock);
+		if(--s->live == 0) {
+			Cond_Broadcast(&s->has_ready);
+			Cond_Broadcast(&s->has_ticket);
+		}
+		Mutex_Unlock(&s->lock);
+		break;
+	default:
+		assert(0);
+	}
+}
+
+
+/* The scheduling loop of a carrier, which returns when all fibers are done */
+static void fiber_carrier_loop(fiber_scheduler* s)
+{
+	fiber_carrier c;
+
+	Mutex_Lock(&s->lock);
+	while(s->live > 0) {
+		if(s->active > s->ncarriers) {
+			/* Wait as a spare; the giver of the ticket counts us active */
+			s->active--;
+			s->spares++;
+			while(s->tickets == 0 && s->live > 0)
+				Cond_Wait(&s->lock, &s->has_ticket);
+			if(s->tickets == 0) {
+				s->spares--;
+				break;
+			}
+			s->tickets--;
+			continue;
+		}
+
+		fiber* f = fiber_dequeue(&s->ready);
+		if(f == NULL) {
+			s->idle++;
+			Cond_Wait(&s->lock, &s->has_ready);
+			s->idle--;
+			continue;
+		}
+
+		Mutex_Unlock(&s->lock);
+		fiber_run(&c, f);
+		Mutex_Lock(&s->lock);
+	}
+
+	if(--s->carriers == 0)
+		Cond_Broadcast(&s->finished);
+	Mutex_Unlock(&s->lock);
+}
+
+static int fiber_carrier_thread(int argl, void* args)
+{
+	ThreadDetach(ThreadSelf());
+	fiber_carrier_loop((fiber_scheduler*) args);
+	return 0;
+}
+
+/* Add a carrier, counted as active. Called with s->lock held. */
+static int fiber_add_carrier(fiber_scheduler* s)
+{
+	if(CreateThread(fiber_carrier_thread, 0, s) == NOTHREAD)
+		return -1;
+	s->carriers++;
+	s->active++;
+	return 0;
+}
+
+
+static fiber* fiber_new(fiber_scheduler* s, FiberFunc func, void* arg)
+{
+	fiber* f = (fiber*) malloc(sizeof(fiber));
+	if(f == NULL) return NULL;
+	f->func = func;
+	f->arg = arg;
+	f->stack = NULL;
+	f->sched = s;
+	f->carrier = NULL;
+	f->parklock = NULL;
+	f->next = NULL;
+	return f;
+}
+
+
+int FiberRun(unsigned int ncarriers, FiberFunc func, void* arg)
+{
+	if(ncarriers == 0) return -1;
+
+	fiber_scheduler s = {
+		.lock = MUTEX_INIT, .ready = { NULL, NULL },
+		.live = 1, .ncarriers = ncarriers, .carriers = 1, .active = 1,
+		.idle = 0, .spares = 0, .tickets = 0,
+		.has_ready = COND_INIT, .has_ticket = COND_INIT, .finished = COND_INIT,
+		.stacks = NULL, .nstacks = 0
+	};
+
+	fiber* f = fiber_new(&s, func, arg);
+	if(f == NULL) return -1;
+	fiber_enqueue(&s.ready, f);
+
+	int rc = 0;
+	Mutex_Lock(&s.lock);
+	for(unsigned int i = 1; i < ncarriers; i++)
+		if(fiber_add_carrier(&s) == -1) {
+			/* Run with fewer carriers */
+			s.ncarriers = s.carriers;
+			rc = -1;
+			break;
+		}
+	Mutex_Unlock(&s.lock);
+
+	fiber_carrier_loop(&s);
+
+	Mutex_Lock(&s.lock);
+	while(s.carriers > 0)
+		Cond_Wait(&s.lock, &s.finished);
+	Mutex_Unlock(&s.lock);
+
+	while(s.stacks) {
+		void* stack = s.stacks;
+		s.stacks = *(void**)stack;
+		free(stack);
+	}
+	return rc;
+}
+
+
+int FiberSpawn(FiberFunc func, void* arg)
+{
+	fiber_scheduler* s = fiber_self()->sched;
+	fiber* f = fiber_new(s, func, arg);
+	if(f == NULL) return -1;
+
+	Mutex_Lock(&s->lock);
+	s->live++;
+	Mutex_Unlock(&s->lock);
+	fiber_ready(f);
+	return 0;
+}
+
+
+void FiberYield()
+{
+	fiber_switch_out(fiber_self(), FIBER_YIELDED);
+}
+
+
+void FiberBlockingBegin()
+{
+	fiber_scheduler* s = fiber_self()->sched;
+
+	Mutex_Lock(&s->lock);
+	s->active--;
+	if(s->active < s->ncarriers) {
+		if(s->spares > 0) {
+			s->spares--;
+			s->tickets++;
+			s->active++;
+			Cond_Signal(&s->has_ticket);
+		} else
+			fiber_add_carrier(s);
+	}
+	Mutex_Unlock(&s->lock);
+}
+
+
+void FiberBlockingEnd()
+{
+	fiber_scheduler* s = fiber_self()->sched;
+
+	Mutex_Lock(&s->lock);
+	s->active++;
+	Mutex_Unlock(&s->lock);
+}
+
+
+int FiberRead(Fid_t fd, char* buf, unsigned int size)
+{
+	FiberBlockingBegin();
+	int rc = Read(fd, buf, size);
+	FiberBlockingEnd();
+	return rc;
+}
+
+
+int FiberWrite(Fid_t fd, const char* buf, unsigned int size)
+{
+	FiberBlockingBegin();
+	int rc = Write(fd, buf, size);
+	FiberBlockingEnd();
+	return rc;
+}
+
+
+void FiberMutex_Lock(fiber_mutex* mx)
+{
+	Mutex_Lock(&mx->lock);
+	if(! mx->locked) {
+		mx->locked = 1;
+		Mutex_Unlock(&mx->lock);
+		return;
+	}
+
+	/* The unlocking fiber hands the mutex over to us */
+	fiber* f = fiber_self();
+	fiber_enqueue(&mx->waiters, f);
+	fiber_park(f, &mx->lock);
+}
+
+
+void FiberMutex_Unlock(fiber_mutex* mx)
+{
+	Mutex_Lock(&mx->lock);
+	fiber* f = fiber_dequeue(&mx->waiters);
+	if(f == NULL)
+		mx->locked = 0;
+	Mutex_Unlock(&mx->lock);
+	if(f) fiber_ready(f);
+}
+
+
+int FiberChanInit(fiber_chan* ch, unsigned int capacity)
+{
+	if(capacity == 0) capacity = 1;
+	ch->buf = (void**) malloc(capacity * sizeof(void*));
+	if(ch->buf == NULL) return -1;
+	ch->lock = MUTEX_INIT;
+	ch->capacity = capacity;
+	ch->count = ch->first = 0;
+	ch->closed = 0;
+	ch->senders = ch->receivers = (fiber_queue){ NULL, NULL };
+	return 0;
+}
+
+
+void FiberChanDestroy(fiber_chan* ch)
+{
+	free(ch->buf);
+	ch->buf = NULL;
+}
+
+
+int FiberChanSend(fiber_chan* ch, void* msg)
+{
+	Mutex_Lock(&ch->lock);
+	while(ch->count == ch->capacity && ! ch->closed) {
+		fiber* f = fiber_self();
+		fiber_enqueue(&ch->senders, f);
+		fiber_park(f, &ch->lock);
+		Mutex_Lock(&ch->lock);
+	}
+	if(ch->closed) {
+		Mutex_Unlock(&ch->lock);
+		return -1;
+	}
+
+	ch->buf[(ch->first + ch->count++) % ch->capacity] = msg;
+	fiber* r = fiber_dequeue(&ch->receivers);
+	Mutex_Unlock(&ch->lock);
+	if(r) fiber_ready(r);
+	return 0;
+}
+
+
+int FiberChanRecv(fiber_chan* ch, void** msg)
+{
+	Mutex_Lock(&ch->lock);
+	while(ch->count == 0 && ! ch->closed) {
+		fiber* f = fiber_self();
+		fiber_enqueue(&ch->receivers, f);
+		fiber_park(f, &ch->lock);
+		Mutex_Lock(&ch->lock);
+	}
+	if(ch->count == 0) {
+		Mutex_Unlock(&ch->lock);
+		return 0;
+	}
+
+	*msg = ch->buf[ch->first];
+	ch->first = (ch->first + 1) % ch->capacity;
+	ch->count--;
+	fiber* w = fiber_dequeue(&ch->senders);
+	Mutex_Unlock(&ch->lock);
+	if(w) fiber_ready(w);
+	return 1;
+}
+
+
+void FiberChanClose(fiber_chan* ch)
+{
+	Mutex_Lock(&ch->lock);
+	ch->closed = 1;
+	fiber_queue waiters = ch->senders;
+	fiber* f;
+	while((f = fiber_dequeue(&ch->receivers)))
+		fiber_enqueue(&waiters, f);
+	ch->senders = ch->receivers = (fiber_queue){ NULL, NULL };
+	Mutex_Unlock(&ch->lock);
+
+	while((f = fiber_dequeue(&waiters)))
+		fiber_ready(f);
+}
+
+
+
+
+/*
+	Task pools.
+
+	The deque of a worker is a Chase-Lev deque of fixed size. The owner
+	pushes and pops at the bottom, and thieves take from the top. Only the
+	last task is contended by the owner and a thief, and the CAS on top
+	decides who gets it.
+
+	A worker that finds no task searches the other deques for a while, and
+	then sleeps on the pool. Searchers and sleepers are counted. A spawner
+	checks the counts after it pushes a task, and wakes up a sleeper only
+	if nobody searches. A searcher stops being counted before it sleeps,
+	and a sleeper checks the deques after it is counted, with full fences
+	in between, so a task is never left alone with all workers asleep.
+	The last task of a group wakes up all the sleepers, since one of them
+	may be waiting for the group.
+
+	A task runs after its record has been freed, so a worker does not touch
+	a group after it has finished the group's last task.
+*/
+
+#define POOL_SPINS 64
+#define CACHE_LINE 64
+
+#define ALOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define RLOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define RSTORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define FULL_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+typedef struct pool_task {
+	PoolTask func;
+	void* arg;
+	task_group* group;
+	struct pool_task* next;		/* Node in a free list or the injection queue */
+} pool_task;
+
+struct pool_worker {
+	task_pool* pool;
+	Tid_t tid;
+	unsigned int seed;			/* For choosing victims */
+	pool_task* free;			/* Free task records */
+
+	long top __attribute__((aligned(CACHE_LINE)));
+	long bottom __attribute__((aligned(CACHE_LINE)));
+	pool_task* deque[POOL_DEQUE_SIZE];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct task_pool {
+	unsigned int nworkers;
+	pool_worker* workers;
+
+	Mutex mx;
+	CondVar wake;				/* Workers sleep here */
+	CondVar done;				/* Callers of TaskPoolRun wait here */
+	unsigned int sleepers;		/* Workers sleeping on wake */
+	unsigned int searching;		/* Workers looking for a task to steal */
+	unsigned int runners;		/* Threads waiting on done */
+	pool_task *inject_head, *inject_tail;	/* Tasks of TaskPoolRun */
+	int shutdown;
+};
+
+
+static int deque_push(pool_worker* w, pool_task* t)
+{
+	long b = RLOAD(w->bottom);
+	long top = ALOAD(w->top);
+	if(b - top >= POOL_DEQUE_SIZE)
+		return -1;
+	RSTORE(w->deque[b & (POOL_DEQUE_SIZE-1)], t);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	RSTORE(w->bottom, b + 1);
+	return 0;
+}
+
+static pool_task* deque_pop(pool_worker* w)
+{
+	long b = RLOAD(w->bottom) - 1;
+	RSTORE(w->bottom, b);
+	FULL_FENCE();
+	long top = RLOAD(w->top);
+
+	pool_task* t = NULL;
+	if(top <= b) {
+		t = RLOAD(w->deque[b & (POOL_DEQUE_SIZE-1)]);
+		if(top == b) {
+			/* The last task; race the thieves for it */
+			if(! __atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				t = NULL;
+			RSTORE(w->bottom, b + 1);
+		}
+	} else
+		RSTORE(w->bottom, b + 1);
+	return t;
+}
+
+static pool_task* deque_steal(pool_worker* w)
+{
+	long top = ALOAD(w->top);
+	FULL_FENCE();
+	long b = ALOAD(w->bottom);
+	if(top >= b)
+		return NULL;
+
+	pool_task* t = RLOAD(w->deque[top & (POOL_DEQUE_SIZE-1)]);
+	if(! __atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return t;
+}
+
+
+/* Return 1 if a task may be found. Called with pool->mx held. */
+static int pool_has_work(task_pool* pool)
+{
+	if(pool->inject_head != NULL)
+		return 1;
+	for(unsigned int i = 0; i < pool->nworkers; i++) {
+		pool_worker* w = &pool->workers[i];
+		if(ALOAD(w->bottom) - ALOAD(w->top) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Wake up a sleeper to look for a new task, or all of them when a group is finished */
+static void pool_wake(task_pool* pool, int all)
+{
+	FULL_FENCE();
+	if(all ? RLOAD(pool->sleepers) == 0 && RLOAD(pool->runners) == 0
+		: RLOAD(pool->searching) > 0 || RLOAD(pool->sleepers) == 0)
+		return;
+	Mutex_Lock(&pool->mx);
+	if(all) {
+		Cond_Broadcast(&pool->wake);
+		Cond_Broadcast(&pool->done);
+	} else
+		Cond_Signal(&pool->wake);
+	Mutex_Unlock(&pool->mx);
+}
+
+/* Sleep until there may be a task, or g is finished, or the pool shuts down */
+static void pool_sleep(task_pool* pool, task_group* g)
+{
+	Mutex_Lock(&pool->mx);
+	__atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+	FULL_FENCE();
+	if(! pool_has_work(pool) && (g ? ALOAD(g->pending) > 0 : ! pool->shutdown))
+		Cond_Wait(&pool->mx, &pool->wake);
+	__atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+	Mutex_Unlock(&pool->mx);
+}
+
+
+/* Steal a task from another worker, or take one from the injection queue */
+static pool_task* pool_steal(pool_worker* w)
+{
+	task_pool* pool = w->pool;
+	pool_task* t = NULL;
+
+	/* Try every other worker once, starting at random */
+	unsigned int n = pool->nworkers;
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	unsigned int start = w->seed % n;
+	for(unsigned int i = 0; i < n; i++) {
+		pool_worker* victim = &pool->workers[(start + i) % n];
+		if(victim != w && (t = deque_steal(victim)))
+			return t;
+	}
+
+	if(ALOAD(pool->inject_head) != NULL) {
+		Mutex_Lock(&pool->mx);
+		t = pool->inject_head;
+		if(t) {
+			pool->inject_head = t->next;
+			if(pool->inject_head == NULL) pool->inject_tail = NULL;
+		}
+		Mutex_Unlock(&pool->mx);
+	}
+	return t;
+}
+
+
+static int pool_wait_over(task_pool* pool, task_group* g)
+{
+	return g ? ALOAD(g->pending) == 0 : ALOAD(pool->shutdown);
+}
+
+/* Find a task to run, or return NULL when g is finished (or the pool shuts down, if g is NULL) */
+static pool_task* pool_next_task(pool_worker* w, task_group* g)
+{
+	task_pool* pool = w->pool;
+
+	pool_task* t = deque_pop(w);
+	if(t) return t;
+
+	for(;;) {
+		__atomic_add_fetch(&pool->searching, 1, __ATOMIC_SEQ_CST);
+		for(unsigned int spins = 0; t == NULL && spins < POOL_SPINS; spins++) {
+			if(pool_wait_over(pool, g)) break;
+			t = pool_steal(w);
+		}
+
+		/* The last searcher to find a task wakes up another one to search */
+		if(__atomic_sub_fetch(&pool->searching, 1, __ATOMIC_SEQ_CST) == 0 && t != NULL)
+			pool_wake(pool, 0);
+		if(t != NULL || pool_wait_over(pool, g))
+			return t;
+
+		pool_sleep(pool, g);
+	}
+}
+
+
+static pool_task* pool_task_alloc(pool_worker* w)
+{
+	pool_task* t = w->free;
+	if(t)
+		w->free = t->next;
+	else
+		t = (pool_task*) malloc(sizeof(pool_task));
+	return t;
+}
+
+static void pool_execute(pool_worker* w, pool_task* t)
+{
+	PoolTask func = t->func;
+	void* arg = t->arg;
+	task_group* g = t->group;
+	t->next = w->free;
+	w->free = t;
+
+	func(w, arg);
+
+	if(__atomic_sub_fetch(&g->pending, 1, __ATOMIC_SEQ_CST) == 0)
+		pool_wake(w->pool, 1);
+}
+
+
+static int pool_worker_main(int argl, void* args)
+{
+	pool_worker* w = (pool_worker*) args;
+	task_pool* pool = w->pool;
+
+	while(! ALOAD(pool->shutdown)) {
+		pool_task* t = pool_next_task(w, NULL);
+		if(t) pool_execute(w, t);
+	}
+	return 0;
+}
+
+
+task_pool* TaskPoolCreate(unsigned int nworkers)
+{
+	if(nworkers == 0) return NULL;
+
+	task_pool* pool = (task_pool*) malloc(sizeof(task_pool));
+	pool->nworkers = nworkers;
+	pool->workers = (pool_worker*) aligned_alloc(CACHE_LINE, nworkers * sizeof(pool_worker));
+	pool->mx = MUTEX_INIT;
+	pool->wake = COND_INIT;
+	pool->done = COND_INIT;
+	pool->sleepers = pool->searching = pool->runners = 0;
+	pool->inject_head = pool->inject_tail = NULL;
+	pool->shutdown = 0;
+
+	for(unsigned int i = 0; i < nworkers; i++) {
+		pool_worker* w = &pool->workers[i];
+		w->pool = pool;
+		w->seed = 2*i + 1;
+		w->free = NULL;
+		w->top = w->bottom = 0;
+		w->tid = NOTHREAD;
+	}
+
+	for(unsigned int i = 0; i < nworkers; i++) {
+		pool->workers[i].tid = CreateThread(pool_worker_main, 0, &pool->workers[i]);
+		if(pool->workers[i].tid == NOTHREAD) {
+			TaskPoolDestroy(pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+
+void TaskPoolDestroy(task_pool* pool)
+{
+	Mutex_Lock(&pool->mx);
+	__atomic_store_n(&pool->shutdown, 1, __ATOMIC_SEQ_CST);
+	Cond_Broadcast(&pool->wake);
+	Mutex_Unlock(&pool->mx);
+
+	for(unsigned int i = 0; i < pool->nworkers; i++) {
+		pool_worker* w = &pool->workers[i];
+		if(w->tid != NOTHREAD)
+			ThreadJoin(w->tid, NULL);
+		while(w->free) {
+			pool_task* t = w->free;
+			w->free = t->next;
+			free(t);
+		}
+	}
+	free(pool->workers);
+	free(pool);
+}
+
+
+void TaskPoolRun(task_pool* pool, PoolTask task, void* arg)
+{
+	task_group g = TASK_GROUP_INIT;
+	pool_task* t = (pool_task*) malloc(sizeof(pool_task));
+	t->func = task;
+	t->arg = arg;
+	t->group = &g;
+	t->next = NULL;
+	g.pending = 1;
+
+	Mutex_Lock(&pool->mx);
+	if(pool->inject_tail) pool->inject_tail->next = t; else pool->inject_head = t;
+	pool->inject_tail = t;
+	Cond_Signal(&pool->wake);
+
+	__atomic_add_fetch(&pool->runners, 1, __ATOMIC_SEQ_CST);
+	FULL_FENCE();
+	while(ALOAD(g.pending) > 0)
+		Cond_Wait(&pool->mx, &pool->done);
+	__atomic_sub_fetch(&pool->runners, 1, __ATOMIC_SEQ_CST);
+	Mutex_Unlock(&pool->mx);
+}
+
+
+void TaskSpawn(pool_worker* w, task_group* g, PoolTask task, void* arg)
+{
+	__atomic_add_fetch(&g->pending, 1, __ATOMIC_RELAXED);
+
+	pool_task* t = pool_task_alloc(w);
+	t->func = task;
+	t->arg = arg;
+	t->group = g;
+	if(deque_push(w, t) == -1) {
+		/* The deque is full, run the task now */
+		pool_execute(w, t);
+		return;
+	}
+	pool_wake(w->pool, 0);
+}
+
+
+void TaskWait(pool_worker* w, task_group* g)
+{
+	while(ALOAD(g->pending) > 0) {
+		pool_task* t = pool_next_task(w, g);
+		if(t) pool_execute(w, t);
+	}
+}
+
+
+typedef struct parallel_range {
+	int begin, end, grain;
+	void (*body)(int, void*);
+	void* arg;
+} parallel_range;
+
+static void parallel_range_task(pool_worker* w, void* arg)
+{
+	parallel_range* r = (parallel_range*) arg;
+	if(r->end - r->begin <= r->grain) {
+		for(int i = r->begin; i < r->end; i++)
+			r->body(i, r->arg);
+		return;
+	}
+
+	/* Spawn the upper half, and do the lower half */
+	int mid = r->begin + (r->end - r->begin) / 2;
+	parallel_range upper = { mid, r->end, r->grain, r->body, r->arg };
+	parallel_range lower = { r->begin, mid, r->grain, r->body, r->arg };
+	task_group g = TASK_GROUP_INIT;
+	TaskSpawn(w, &g, parallel_range_task, &upper);
+	parallel_range_task(w, &lower);
+	TaskWait(w, &g);
+}
+
+
+void ParallelFor(pool_worker* w, int begin, int end, int grain, void (*body)(int i, void* arg), void* arg)
+{
+	if(end <= begin) return;
+	if(grain <= 0) {
+		grain = (end - begin) / (8 * w->pool->nworkers);
+		if(grain < 1) grain = 1;
+	}
+	parallel_range r = { begin, end, grain, body, arg };
+	parallel_range_task(w, &r);
+}
@@ -44,6 +44,17 @@ typedef int (*Program)(size_t argc, const char** argv);
 int Execute(Program prog, size_t argc, const char** argv);
 
 
+/**
+	@brief Prepare a request to execute a program with @c ExecMany.
+
+	The task and the arguments of @c req are set as @ref Execute would
+	pass them to @c Exec. The argument buffer is allocated with @c malloc,
+	and it must be freed by the caller, with `free(req->args)`, after 
+	the call to @c ExecMany. The file id actions of @c req are set to none.
+  */
+void PrepareExecute(spawn_request* req, Program prog, size_t argc, const char** argv);
+
+
 /**
 	@brief Try to reclaim the arguments of a process.
 
@@ -86,4 +97,296 @@ typedef struct barrier {
 void BarrierSync(barrier* bar, unsigned int n);
 
 
+/**
+	@brief Send bytes over a connection in ring mode.
+
+	The bytes are copied into the ring @c tx directly, blocking while the
+	ring is full. A system call is made only to block, or to wake up a
+	peer that is blocked.
+
+	@param sock the socket
+	@param tx the ring of sent data of @c sock, as returned by @c SockRing()
+	@param buf the bytes to send
+	@param n the number of bytes
+	@returns @c n, or -1 if the peer has stopped reading
+	@see SockRing
+*/
+int RingSend(Fid_t sock, sock_ring* tx, const char* buf, unsigned int n);
+
+/**
+	@brief Receive bytes over a connection in ring mode.
+
+	This blocks until at least one byte is in the ring @c rx, and returns up to
+	@c n bytes.
+
+	@param sock the socket
+	@param rx the ring of received data of @c sock, as returned by @c SockRing()
+	@param buf the buffer for the bytes
+	@param n the size of @c buf
+	@returns the number of bytes received, 0 if the peer has stopped writing,
+		or -1 on error
+	@see SockRing
+*/
+int RingRecv(Fid_t sock, sock_ring* rx, char* buf, unsigned int n);
+
+
+/**
+	@brief Add an operation to the submission ring of an I/O ring.
+
+	The operation is started by the next call to @c IoRingEnter(). Only
+	one thread at a time may submit to a ring.
+
+	@param ring the rings, as returned by @c IoRing()
+	@param sqe the operation, which is copied into the ring
+	@returns 0 on success, or -1 if the submission ring is full
+	@see IoRing
+*/
+int IoSubmit(io_ring* ring, const io_sqe* sqe);
+
+/**
+	@brief Reap a completion from an I/O ring, without blocking.
+
+	Only one thread at a time may reap from a ring.
+
+	@param ring the rings, as returned by @c IoRing()
+	@param cqe the completion is stored here
+	@returns 1 if a completion was reaped, or 0 if none was ready
+	@see IoRingEnter
+*/
+int IoReap(io_ring* ring, io_cqe* cqe);
+
+
+/**
+	@brief The stack size of a fiber.
+
+	Fiber stacks are aligned to their size, which must be a power of 2.
+	System calls and interrupts that happen while a fiber runs use its
+	stack, so it cannot be much smaller than this.
+*/
+#define FIBER_STACK_SIZE (64*1024)
+
+/** @brief The function executed by a fiber. */
+typedef void (*FiberFunc)(void* arg);
+
+typedef struct fiber fiber;
+
+/** @brief A FIFO queue of fibers, used by the fiber synchronization objects. */
+typedef struct fiber_queue {
+	fiber *head, *tail;
+} fiber_queue;
+
+/**
+	@brief Run fibers on a number of carrier threads.
+
+	Fibers are lightweight threads of execution, scheduled cooperatively in
+	user space. Many fibers share a few threads, called carriers, so that
+	switching between fibers makes no system call.
+
+	This call creates @c ncarriers carriers, the calling thread being one of
+	them, and runs @c func(arg) as the first fiber. It returns when all the
+	fibers spawned from it, directly or indirectly, have returned.
+
+	A fiber runs on its carrier until it returns, or calls @c FiberYield(), or
+	blocks on a fiber mutex or channel. Then, the carrier runs the next
+	fiber that is ready. The carriers are threads of the calling process,
+	scheduled by the kernel on any core; for a carrier per core, pass the
+	number of cores.
+
+	@param ncarriers the number of carriers, at least 1
+	@param func the first fiber
+	@param arg the argument of @c func
+	@returns 0 on success, or -1 if @c ncarriers is 0 or a carrier could not
+	   be created
+*/
+int FiberRun(unsigned int ncarriers, FiberFunc func, void* arg);
+
+/**
+	@brief Create a new fiber.
+
+	The new fiber runs @c func(arg), on the carriers of the caller.
+	This must be called by a fiber.
+
+	@returns 0 on success, -1 on failure
+*/
+int FiberSpawn(FiberFunc func, void* arg);
+
+/**
+	@brief Let the other ready fibers run before the caller.
+
+	This must be called by a fiber.
+*/
+void FiberYield();
+
+/**
+	@brief Hand the carrier over, before a blocking system call.
+
+	A fiber that makes a blocking system call also blocks its carrier.
+	Calling @c FiberBlockingBegin() before the call, and @c FiberBlockingEnd()
+	after it, lets the other fibers run on another carrier in the meantime.
+	This carrier is taken from a pool of spare carriers, or created, and it
+	is returned to the pool after the blocked call is over.
+
+	This must be called by a fiber.
+
+	@see FiberRead
+	@see FiberWrite
+*/
+void FiberBlockingBegin();
+
+/** @brief End a blocking system call, started by @c FiberBlockingBegin(). */
+void FiberBlockingEnd();
+
+/** @brief Call @c Read from a fiber, handing over the carrier while it blocks. */
+int FiberRead(Fid_t fd, char* buf, unsigned int size);
+
+/** @brief Call @c Write from a fiber, handing over the carrier while it blocks. */
+int FiberWrite(Fid_t fd, const char* buf, unsigned int size);
+
+
+/**
+	@brief A mutex for fibers.
+
+	A fiber that waits for the mutex gives its carrier to the other fibers,
+	unlike a @c Mutex, which spins. It is unlocked in FIFO order.
+*/
+typedef struct fiber_mutex {
+	Mutex lock;
+	int locked;
+	fiber_queue waiters;
+} fiber_mutex;
+
+#define FIBER_MUTEX_INIT ((fiber_mutex){ MUTEX_INIT, 0, { NULL, NULL } })
+
+void FiberMutex_Lock(fiber_mutex* mx);
+void FiberMutex_Unlock(fiber_mutex* mx);
+
+
+/**
+	@brief A bounded channel of pointers between fibers.
+
+	A fiber that sends to a full channel, or receives from an empty one,
+	gives its carrier to the other fibers until it can go on.
+*/
+typedef struct fiber_chan {
+	Mutex lock;
+	void** buf;
+	unsigned int capacity, count, first;
+	int closed;
+	fiber_queue senders, receivers;
+} fiber_chan;
+
+/**
+	@brief Initialize a channel that holds up to @c capacity messages.
+
+	A capacity of 0 is taken as 1.
+	@returns 0 on success, -1 if the buffer could not be allocated
+*/
+int FiberChanInit(fiber_chan* ch, unsigned int capacity);
+
+/** @brief Free the buffer of a channel, which no fiber may use any more. */
+void FiberChanDestroy(fiber_chan* ch);
+
+/**
+	@brief Send a message, waiting while the channel is full.
+	@returns 0 on success, or -1 if the channel is closed
+*/
+int FiberChanSend(fiber_chan* ch, void* msg);
+
+/**
+	@brief Receive a message, waiting while the channel is empty.
+
+	The messages sent before the channel was closed are still received.
+	@returns 1 on success, or 0 if the channel is closed and empty
+*/
+int FiberChanRecv(fiber_chan* ch, void** msg);
+
+/** @brief Close a channel, waking up its waiting senders and receivers. */
+void FiberChanClose(fiber_chan* ch);
+
+
+/**
+	@brief A pool of worker threads that run tasks, with work stealing.
+
+	Each worker keeps its tasks in a deque. It pushes and pops tasks at
+	the bottom of its own deque, without locks, and when the deque is
+	empty, it steals tasks from the top of the deques of other workers.
+	Tasks are meant to be small, and to be split recursively, as in
+	@c ParallelFor().
+
+	@see TaskPoolCreate
+*/
+typedef struct task_pool task_pool;
+
+/** @brief A worker of a @c task_pool, passed to each task it runs. */
+typedef struct pool_worker pool_worker;
+
+/** @brief A task of a @c task_pool. */
+typedef void (*PoolTask)(pool_worker* w, void* arg);
+
+/**
+	@brief A group of tasks that are waited for together.
+
+	A group is initialized to @c TASK_GROUP_INIT, tasks are added to it with
+	@c TaskSpawn(), and @c TaskWait() waits for all of them. A group lives
+	on the stack of the task that waits for it.
+*/
+typedef struct task_group {
+	unsigned int pending;		/**< Tasks spawned and not finished */
+} task_group;
+
+#define TASK_GROUP_INIT ((task_group){ 0 })
+
+/** @brief The capacity of the deque of a worker. A task spawned when it is full runs at once. */
+#define POOL_DEQUE_SIZE 1024
+
+/**
+	@brief Create a pool of @c nworkers worker threads.
+	@returns the new pool, or NULL if @c nworkers is 0 or a thread could
+		not be created
+*/
+task_pool* TaskPoolCreate(unsigned int nworkers);
+
+/**
+	@brief Stop the workers of a pool, and free it.
+
+	No task may be running on the pool.
+*/
+void TaskPoolDestroy(task_pool* pool);
+
+/**
+	@brief Run a task on a pool, and wait for it.
+
+	This is called by a thread that is not a worker of the pool, to start a
+	computation. The task, and the tasks that it spawns, run on the workers.
+	This call blocks until the task returns.
+*/
+void TaskPoolRun(task_pool* pool, PoolTask task, void* arg);
+
+/**
+	@brief Spawn a task in a group.
+
+	The task is pushed on the deque of worker @c w, the caller, where it can
+	be stolen by other workers.
+*/
+void TaskSpawn(pool_worker* w, task_group* g, PoolTask task, void* arg);
+
+/**
+	@brief Wait for the tasks of a group.
+
+	While it waits, worker @c w runs other tasks, its own or stolen ones.
+	It only blocks when there are none.
+*/
+void TaskWait(pool_worker* w, task_group* g);
+
+/**
+	@brief Call @c body(i, arg) for @c i from @c begin to @c end-1, in parallel.
+
+	The range is split in half recursively, and one half is spawned, until
+	the pieces have at most @c grain indices. With a @c grain of 0, the
+	range is split in about 8 pieces per worker. This must be called by a
+	task, running on worker @c w.
+*/
+void ParallelFor(pool_worker* w, int begin, int end, int grain, void (*body)(int i, void* arg), void* arg);
+
+
 #endif
@@ -5,6 +5,8 @@
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "util.h"
 #include "symposium.h"
@@ -2652,14 +2654,2721 @@ BOOT_TEST(test_pipe_reader_close_before_write,
 
 
 
+BOOT_TEST(test_event_queue_ctl_errors,
+	"Test that EventCtl and WaitEvents check their arguments."
+	)
+{
+	Fid_t evq = EventQueue();
+	ASSERT(evq!=NOFILE);
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	event_t ev[4];
+	ASSERT(EventCtl(pipe.read, pipe.write, EVENT_READ)==-1);
+	ASSERT(EventCtl(evq, NOFILE, EVENT_READ)==-1);
+	ASSERT(EventCtl(evq, MAX_FILEID, EVENT_READ)==-1);
+	ASSERT(EventCtl(evq, evq, EVENT_READ)==-1);
+	ASSERT(EventCtl(evq, pipe.read, 0)==-1);
+	ASSERT(EventCtl(evq, pipe.read, 8)==-1);
+	ASSERT(WaitEvents(pipe.read, ev, 4, 0)==-1);
+	ASSERT(WaitEvents(evq, NULL, 4, 0)==-1);
+	ASSERT(WaitEvents(evq, ev, 0, 0)==-1);
+
+	ASSERT(EventCtl(evq, pipe.read, EVENT_READ)==0);
+	ASSERT(EventCtl(evq, pipe.read, 0)==0);
+	ASSERT(EventCtl(evq, pipe.read, 0)==-1);
+
+	ASSERT(Close(evq)==0);
+	return 0;
+}
+
+BOOT_TEST(test_event_queue_pipe_edges,
+	"Test that an event queue reports each readiness transition of a pipe once."
+	)
+{
+	Fid_t evq = EventQueue();
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(EventCtl(evq, pipe.read, EVENT_READ)==0);
+
+	event_t ev[4];
+	ASSERT(WaitEvents(evq, ev, 4, 0)==0);
+
+	ASSERT(Write(pipe.write, "Hello", 6)==6);
+	ASSERT(Write(pipe.write, "Hello", 6)==6);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==1);
+	ASSERT(ev[0].fid==pipe.read);
+	ASSERT(ev[0].events==EVENT_READ);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==0);
+
+	/* EOF is a read event */
+	char buffer[12];
+	ASSERT(Read(pipe.read, buffer, 12)==12);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==1);
+	ASSERT(ev[0].fid==pipe.read);
+	ASSERT(Read(pipe.read, buffer, 12)==0);
+
+	/* Closing the registered stream drops the registration */
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(EventCtl(evq, pipe.read, 0)==-1);
+	return 0;
+}
+
+BOOT_TEST(test_event_queue_reports_ready_only,
+	"Test that WaitEvents returns only the ready streams, in order, in batches."
+	)
+{
+	Fid_t evq = EventQueue();
+	const int N = 6;
+	pipe_t pipe[N];
+	for(int i=0;i<N;i++) {
+		ASSERT(Pipe(&pipe[i])==0);
+		ASSERT(EventCtl(evq, pipe[i].read, EVENT_READ)==0);
+	}
+
+	ASSERT(Write(pipe[4].write, "x", 1)==1);
+	ASSERT(Write(pipe[1].write, "x", 1)==1);
+	ASSERT(Write(pipe[3].write, "x", 1)==1);
+
+	event_t ev[N];
+	ASSERT(WaitEvents(evq, ev, 2, 0)==2);
+	ASSERT(ev[0].fid==pipe[4].read);
+	ASSERT(ev[1].fid==pipe[1].read);
+	ASSERT(WaitEvents(evq, ev, N, 0)==1);
+	ASSERT(ev[0].fid==pipe[3].read);
+	return 0;
+}
+
+BOOT_TEST(test_event_queue_wakes_waiter,
+	"Test that WaitEvents blocks until a socket becomes ready."
+	)
+{
+	Fid_t evq = EventQueue();
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(EventCtl(evq, lsock, EVENT_READ)==0);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(EventCtl(evq, cli, EVENT_READ|EVENT_WRITE)==0);
+
+	int connect_thread(int argl, void* args) {
+		ASSERT(Connect(cli, 100, 1000)==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(connect_thread, 0, NULL);
+
+	event_t ev[4];
+	ASSERT(WaitEvents(evq, ev, 4, (timeout_t)-1)==1);
+	ASSERT(ev[0].fid==lsock && ev[0].events==EVENT_READ);
+
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==1);
+	ASSERT(ev[0].fid==cli && ev[0].events==EVENT_WRITE);
+
+	ASSERT(Write(srv, "Hello", 6)==6);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==1);
+	ASSERT(ev[0].fid==cli && ev[0].events==EVENT_READ);
+	return 0;
+}
+
+static int exit_with_7(int argl, void* args) { return 7; }
+
+BOOT_TEST(test_event_queue_reports_state_at_registration,
+	"Test that EventCtl reports the events that already hold when a stream is registered."
+	)
+{
+	Fid_t evq = EventQueue();
+	event_t ev[4];
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Write(pipe.write, "x", 1)==1);
+	ASSERT(EventCtl(evq, pipe.read, EVENT_READ)==0);
+	ASSERT(EventCtl(evq, pipe.write, EVENT_WRITE)==0);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==2);
+	ASSERT(ev[0].fid==pipe.read && ev[0].events==EVENT_READ);
+	ASSERT(ev[1].fid==pipe.write && ev[1].events==EVENT_WRITE);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==0);
+
+	/* Changing the registration reports the state again */
+	ASSERT(EventCtl(evq, pipe.read, EVENT_READ)==0);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==1);
+	ASSERT(ev[0].fid==pipe.read);
+
+	/* A child that exited before the registration */
+	Pid_t pid = Exec(exit_with_7, 0, NULL);
+	Fid_t pfd = OpenProcess(pid);
+	int status;
+	ASSERT(Read(pfd, (char*)&status, sizeof(int))==sizeof(int));
+	ASSERT(EventCtl(evq, pfd, EVENT_READ)==0);
+	ASSERT(WaitEvents(evq, ev, 4, 0)==1);
+	ASSERT(ev[0].fid==pfd && ev[0].events==EVENT_READ);
+	ASSERT(WaitChild(pid, &status)==pid && status==7);
+	return 0;
+}
+
+TEST_SUITE(event_queue_tests,
+	"Tests for event queues."
+	)
+{
+	&test_event_queue_ctl_errors,
+	&test_event_queue_pipe_edges,
+	&test_event_queue_reports_ready_only,
+	&test_event_queue_wakes_waiter,
+	&test_event_queue_reports_state_at_registration,
+	NULL
+};
+
+
+/* Read the statistics of a kernel object cache by name */
+static int get_meminfo(const char* name, meminfo* info)
+{
+	Fid_t finfo = OpenMemInfo();
+	ASSERT(finfo!=NOFILE);
+	int found = 0;
+	while(!found && Read(finfo, (char*) info, sizeof(meminfo)) == sizeof(meminfo))
+		found = (strcmp(info->name, name)==0);
+	ASSERT(Close(finfo)==0);
+	return found;
+}
+
+BOOT_TEST(test_meminfo_tracks_allocations,
+	"Test that the memory information stream reports the objects allocated by Pipe."
+	)
+{
+	pipe_t pipe;
+	meminfo before, after;
+
+	/* Make sure the cache has been used */
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Close(pipe.write)==0);
+
+	ASSERT(get_meminfo("pipe_cb", &before));
+	ASSERT(before.object_size > 0);
+	ASSERT(before.in_use <= before.objects);
+
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(get_meminfo("pipe_cb", &after));
+	ASSERT(after.in_use == before.in_use+1);
+	ASSERT(after.allocs == before.allocs+1);
+
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(get_meminfo("pipe_cb", &after));
+	ASSERT(after.in_use == before.in_use);
+	ASSERT(after.frees == before.frees+1);
+
+	return 0;
+}
+
+BOOT_TEST(test_meminfo_reuses_objects,
+	"Test that freed kernel objects are reused, instead of allocating more slabs."
+	)
+{
+	pipe_t pipe;
+	meminfo before, after;
+
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(get_meminfo("pipe_cb", &before));
+
+	for(int i=0; i<1000; i++) {
+		ASSERT(Pipe(&pipe)==0);
+		ASSERT(Close(pipe.read)==0);
+		ASSERT(Close(pipe.write)==0);
+	}
+
+	/* Objects may drift between the magazines of different cores, but
+	   the bulk of the allocations must be served by reuse */
+	ASSERT(get_meminfo("pipe_cb", &after));
+	ASSERT(after.allocs == before.allocs+1000);
+	ASSERT(after.objects - before.objects < 100);
+	ASSERT(after.refills - before.refills < 200);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_meminfo_tracks_fcbs,
+	"Test that FCBs come from an object cache, and are freed with their last reference."
+	)
+{
+	pipe_t pipe;
+	meminfo before, after;
+
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(get_meminfo("FCB", &before));
+	ASSERT(before.object_size > 0);
+
+	/* A copy of a fid shares the FCB */
+	ASSERT(Dup2(pipe.read, 5)==0);
+	ASSERT(get_meminfo("FCB", &after));
+	ASSERT(after.in_use == before.in_use);
+
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(get_meminfo("FCB", &after));
+	ASSERT(after.in_use == before.in_use);
+
+	ASSERT(Close(5)==0);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(get_meminfo("FCB", &after));
+	ASSERT(after.in_use == before.in_use-2);
+
+	return 0;
+}
+
+TEST_SUITE(kmem_tests,
+	"Tests for the kernel object caches."
+	)
+{
+	&test_meminfo_tracks_allocations,
+	&test_meminfo_reuses_objects,
+	&test_meminfo_tracks_fcbs,
+	NULL
+};
+
+
+BOOT_TEST(test_packet_pipe_preserves_boundaries,
+	"Test that each Read on a packet pipe returns exactly one Write."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PacketPipe(&pipe)==0);
+
+	char buf[64];
+	ASSERT(Write(pipe.write, "one", 3)==3);
+	ASSERT(Write(pipe.write, "", 0)==0);
+	ASSERT(Write(pipe.write, "two", 3)==3);
+	ASSERT(Write(pipe.write, "three", 5)==5);
+
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==3);
+	ASSERT(memcmp(buf, "one", 3)==0);
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==3);
+	ASSERT(memcmp(buf, "two", 3)==0);
+
+	/* The tail of a long packet is discarded */
+	ASSERT(Read(pipe.read, buf, 2)==2);
+	ASSERT(memcmp(buf, "th", 2)==0);
+
+	static char big[MAX_PACKET_SIZE+1];
+	ASSERT(Write(pipe.write, big, MAX_PACKET_SIZE+1)==-1);
+	ASSERT(Write(pipe.write, big, MAX_PACKET_SIZE)==MAX_PACKET_SIZE);
+	ASSERT(Read(pipe.read, big, sizeof(big))==MAX_PACKET_SIZE);
+
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==0);
+	return 0;
+}
+
+BOOT_TEST(test_packet_pipe_writers_do_not_interleave,
+	"Test that the packets of concurrent writers are delivered whole."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PacketPipe(&pipe)==0);
+
+	const int npackets = 200;
+	const int size = 1000;
+
+	int writer(int argl, void* args) {
+		char msg[size];
+		memset(msg, 'a'+argl, size);
+		for(int i=0; i<npackets; i++)
+			ASSERT(Write(pipe.write, msg, size)==size);
+		return 0;
+	}
+
+	Tid_t t1 = CreateThread(writer, 0, NULL);
+	Tid_t t2 = CreateThread(writer, 1, NULL);
+
+	char buf[MAX_PACKET_SIZE];
+	for(int i=0; i<2*npackets; i++) {
+		ASSERT(Read(pipe.read, buf, sizeof(buf))==size);
+		for(int j=1; j<size; j++)
+			ASSERT(buf[j]==buf[0]);
+	}
+
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+	return 0;
+}
+
+BOOT_TEST(test_packet_socket,
+	"Test that a connection to a packet listener preserves record boundaries in both directions."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_PACKET, 1)==0);
+	ASSERT(SetSockOpt(lsock, 0, 1)==-1);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_PACKET, 0)==-1);
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(SetSockOpt(pipe.read, SOCKOPT_PACKET, 1)==-1);
+
+	/* A byte-stream socket cannot connect to a packet listener */
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(Connect(cli, 100, 100)==-1);
+	ASSERT(SetSockOpt(cli, SOCKOPT_PACKET, 1)==0);
+
+	int connect_thread(int argl, void* args) {
+		ASSERT(Connect(cli, 100, 1000)==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(connect_thread, 0, NULL);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	char buf[16];
+	ASSERT(Write(cli, "ping", 4)==4);
+	ASSERT(Write(cli, "ping", 4)==4);
+	ASSERT(Read(srv, buf, sizeof(buf))==4);
+	ASSERT(Read(srv, buf, sizeof(buf))==4);
+	ASSERT(Write(srv, "pong!", 5)==5);
+	ASSERT(Read(cli, buf, sizeof(buf))==5);
+	ASSERT(memcmp(buf, "pong!", 5)==0);
+	return 0;
+}
+
+
+TEST_SUITE(packet_tests,
+	"Tests for packet pipes and sockets."
+	)
+{
+	&test_packet_pipe_preserves_boundaries,
+	&test_packet_pipe_writers_do_not_interleave,
+	&test_packet_socket,
+	NULL
+};
+
+
+BOOT_TEST(test_ephemeral_ports,
+	"Test that unbound sockets get distinct ephemeral ports when they connect."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(GetSockPort(lsock)==100);
+
+	Fid_t cli1 = Socket(NOPORT);
+	Fid_t cli2 = Socket(NOPORT);
+	ASSERT(GetSockPort(cli1)==NOPORT);
+
+	/* A failed connection gives back its port */
+	ASSERT(Connect(cli1, 200, 10)==-1);
+	ASSERT(GetSockPort(cli1)==NOPORT);
+
+	Fid_t srv1, srv2;
+	connect_sockets(cli1, lsock, &srv1, 100);
+	connect_sockets(cli2, lsock, &srv2, 100);
+
+	port_t p1 = GetSockPort(cli1);
+	port_t p2 = GetSockPort(cli2);
+	ASSERT(p1>=MIN_EPHEMERAL_PORT && p1<=MAX_PORT);
+	ASSERT(p2>=MIN_EPHEMERAL_PORT && p2<=MAX_PORT);
+	ASSERT(p1!=p2);
+	ASSERT(GetSockPort(srv1)==100);
+
+	/* The port is in use while connected */
+	Fid_t s = Socket(p1);
+	ASSERT(Listen(s)==-1);
+	ASSERT(Close(s)==0);
+
+	ASSERT(Close(cli1)==0);
+	s = Socket(p1);
+	ASSERT(Listen(s)==0);
+	ASSERT(Close(s)==0);
+
+	ASSERT(GetSockPort(NOFILE)==-1);
+	return 0;
+}
+
+
+#define LISTENERS_PER_PROC 12
+
+struct listener_proc_args {
+	port_t base;
+	pipe_t pipes[2];	/* pipes[0]: report readiness, pipes[1]: closed to release */
+};
+
+/* Listen on LISTENERS_PER_PROC ports from base and wait for the parent */
+static int listener_proc(int argl, void* args)
+{
+	struct listener_proc_args* a = args;
+	pipe_t* pipes = a->pipes;
+	ASSERT(Close(pipes[0].read)==0);
+	ASSERT(Close(pipes[1].write)==0);
+
+	for(int i=0; i<LISTENERS_PER_PROC; i++) {
+		Fid_t lsock = Socket(a->base+i);
+		ASSERT(lsock!=NOFILE);
+		ASSERT(Listen(lsock)==0);
+	}
+	ASSERT(Write(pipes[0].write, "x", 1)==1);
+
+	char c;
+	ASSERT(Read(pipes[1].read, &c, 1)==0);
+	return 0;
+}
+
+BOOT_TEST(test_many_listeners,
+	"Test that tens of thousands of listeners can be bound at the same time."
+	)
+{
+	const int nprocs = 20000 / LISTENERS_PER_PROC;
+	const int nports = nprocs * LISTENERS_PER_PROC;
+
+	struct listener_proc_args a;
+	pipe_t* pipes = a.pipes;
+	ASSERT(Pipe(&pipes[0])==0);
+	ASSERT(Pipe(&pipes[1])==0);
+
+	for(int i=0; i<nprocs; i++) {
+		a.base = 1+i*LISTENERS_PER_PROC;
+		ASSERT(Exec(listener_proc, sizeof(a), &a)!=NOPROC);
+	}
+	ASSERT(Close(pipes[0].write)==0);
+	ASSERT(Close(pipes[1].read)==0);
+
+	for(int i=0; i<nprocs; i++) {
+		char c;
+		ASSERT(Read(pipes[0].read, &c, 1)==1);
+	}
+
+	/* Every port is taken */
+	for(port_t p=1; p<=nports; p++) {
+		Fid_t s = Socket(p);
+		ASSERT(Listen(s)==-1);
+		ASSERT(Close(s)==0);
+	}
+	Fid_t s = Socket(nports+1);
+	ASSERT(Listen(s)==0);
+	ASSERT(Close(s)==0);
+
+	ASSERT(Close(pipes[1].write)==0);
+	for(int i=0; i<nprocs; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* Every port is free again */
+	for(port_t p=1; p<=nports; p++) {
+		Fid_t s = Socket(p);
+		ASSERT(Listen(s)==0);
+		ASSERT(Close(s)==0);
+	}
+	return 0;
+}
+
+
+TEST_SUITE(port_tests,
+	"Tests for the socket port table."
+	)
+{
+	&test_ephemeral_ports,
+	&test_many_listeners,
+	NULL
+};
+
+
+BOOT_TEST(test_backlog_full_fails_fast,
+	"Test that Connect fails at once when the backlog of the listener is full."
+	)
+{
+	Fid_t evq = EventQueue();
+	Fid_t lsock = Socket(100);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_BACKLOG, 0)==-1);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_BACKLOG, 1)==0);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_BACKLOG, 2)==-1);
+	ASSERT(EventCtl(evq, lsock, EVENT_READ)==0);
+
+	Fid_t cli1 = Socket(NOPORT);
+	Fid_t cli2 = Socket(NOPORT);
+
+	int connect_thread(int argl, void* args) {
+		ASSERT(Connect(cli1, 100, 10000)==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(connect_thread, 0, NULL);
+
+	/* Wait until the request of cli1 is queued */
+	event_t ev[1];
+	ASSERT(WaitEvents(evq, ev, 1, (timeout_t)-1)==1);
+
+	/* This must not wait for the timeout */
+	ASSERT(Connect(cli2, 100, (timeout_t)-1)==-1);
+	ASSERT(GetSockPort(cli2)==NOPORT);
+
+	Fid_t srv1 = Accept(lsock);
+	ASSERT(srv1!=NOFILE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	check_transfer(cli1, srv1);
+
+	/* There is room again */
+	Fid_t srv2;
+	connect_sockets(cli2, lsock, &srv2, 100);
+	check_transfer(srv2, cli2);
+	return 0;
+}
+
+
+BOOT_TEST(test_accept_many,
+	"Test that AcceptMany accepts all pending connections."
+	)
+{
+	const int N = 4;
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t fids[N];
+	ASSERT(AcceptMany(lsock, fids, 0)==-1);
+	ASSERT(AcceptMany(lsock, NULL, N)==-1);
+	ASSERT(AcceptMany(NOFILE, fids, N)==-1);
+
+	Fid_t cli[N];
+	Tid_t t[N];
+	int connect_thread(int argl, void* args) {
+		ASSERT(Connect(cli[argl], 100, 10000)==0);
+		return 0;
+	}
+	for(int i=0; i<N; i++) {
+		cli[i] = Socket(NOPORT);
+		ASSERT(cli[i]!=NOFILE);
+		t[i] = CreateThread(connect_thread, i, NULL);
+	}
+
+	int accepted = 0;
+	while(accepted < N) {
+		int n = AcceptMany(lsock, fids+accepted, N-accepted);
+		ASSERT(n>=1 && n<=N-accepted);
+		accepted += n;
+	}
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	/* Every accepted socket is connected to some client */
+	for(int i=0; i<N; i++) {
+		char c = 'a'+i;
+		ASSERT(Write(fids[i], &c, 1)==1);
+	}
+	int seen = 0;
+	for(int i=0; i<N; i++) {
+		char c;
+		ASSERT(Read(cli[i], &c, 1)==1);
+		ASSERT(c>='a' && c<'a'+N);
+		seen |= 1 << (c-'a');
+	}
+	ASSERT(seen == (1<<N)-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_reuseport_listeners,
+	"Test that listeners with SOCKOPT_REUSEPORT share a port and take turns in accepting."
+	)
+{
+	Fid_t l1 = Socket(100);
+	Fid_t l2 = Socket(100);
+	Fid_t l3 = Socket(100);
+	ASSERT(SetSockOpt(l1, SOCKOPT_REUSEPORT, 1)==0);
+	ASSERT(SetSockOpt(l2, SOCKOPT_REUSEPORT, 1)==0);
+	ASSERT(Listen(l1)==0);
+	ASSERT(Listen(l3)==-1);
+	ASSERT(Listen(l2)==0);
+	ASSERT(SetSockOpt(l2, SOCKOPT_REUSEPORT, 0)==-1);
+
+	/* Without the option, a listener keeps its port */
+	Fid_t m1 = Socket(200);
+	Fid_t m2 = Socket(200);
+	ASSERT(Listen(m1)==0);
+	ASSERT(SetSockOpt(m2, SOCKOPT_REUSEPORT, 1)==0);
+	ASSERT(Listen(m2)==-1);
+
+	int accept_thread(int argl, void* args) {
+		Fid_t lsock = argl;
+		int count = 0;
+		Fid_t s;
+		while((s = Accept(lsock)) != NOFILE) {
+			ASSERT(Close(s)==0);
+			count++;
+		}
+		return count;
+	}
+	Tid_t t1 = CreateThread(accept_thread, l1, NULL);
+	Tid_t t2 = CreateThread(accept_thread, l2, NULL);
+
+	/* Each connection finds both queues empty */
+	const int N = 8;
+	for(int i=0; i<N; i++) {
+		Fid_t cli = Socket(NOPORT);
+		ASSERT(Connect(cli, 100, 1000)==0);
+		ASSERT(Close(cli)==0);
+	}
+
+	ASSERT(Close(l1)==0);
+	ASSERT(Close(l2)==0);
+	int c1, c2;
+	ASSERT(ThreadJoin(t1, &c1)==0);
+	ASSERT(ThreadJoin(t2, &c2)==0);
+	ASSERT(c1==N/2 && c2==N/2);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(Connect(cli, 100, 1000)==-1);
+	return 0;
+}
+
+
+TEST_SUITE(backlog_tests,
+	"Tests for accepting connections."
+	)
+{
+	&test_backlog_full_fails_fast,
+	&test_accept_many,
+	&test_reuseport_listeners,
+	NULL
+};
+
+
+BOOT_TEST(test_datagram_send_recv,
+	"Test that datagrams are delivered between datagram sockets, keeping their boundaries."
+	)
+{
+	Fid_t a = DatagramSocket(100);
+	Fid_t b = DatagramSocket(NOPORT);
+	ASSERT(a!=NOFILE && b!=NOFILE);
+	ASSERT(GetSockPort(a)==100);
+	ASSERT(GetSockPort(b)>=MIN_EPHEMERAL_PORT);
+
+	/* The port is taken */
+	ASSERT(DatagramSocket(100)==NOFILE);
+	Fid_t s = Socket(100);
+	ASSERT(Listen(s)==-1);
+	ASSERT(SendTo(s, 100, "x", 1)==-1);
+	ASSERT(Close(s)==0);
+
+	ASSERT(SendTo(b, 100, "Hello", 6)==6);
+	ASSERT(SendTo(b, 100, "world", 6)==6);
+	ASSERT(SendTo(b, 100, "truncated", 10)==10);
+
+	char buf[16];
+	port_t from = NOPORT;
+	ASSERT(RecvFrom(a, buf, sizeof(buf), &from, 0)==6);
+	ASSERT(strcmp(buf, "Hello")==0);
+	ASSERT(from==GetSockPort(b));
+	ASSERT(Read(a, buf, sizeof(buf))==6);
+	ASSERT(strcmp(buf, "world")==0);
+	ASSERT(RecvFrom(a, buf, 5, NULL, 0)==5);
+	ASSERT(memcmp(buf, "trunc", 5)==0);
+
+	/* Empty queue */
+	ASSERT(RecvFrom(a, buf, sizeof(buf), NULL, 0)==-1);
+
+	/* Errors */
+	ASSERT(Write(a, "x", 1)==-1);
+	ASSERT(SendTo(a, 101, "x", 1)==-1);
+	ASSERT(SendTo(a, 100, buf, MAX_DATAGRAM_SIZE+1)==-1);
+	ASSERT(RecvFrom(NOFILE, buf, sizeof(buf), NULL, 0)==-1);
+
+	/* The port is free after close */
+	ASSERT(Close(a)==0);
+	ASSERT(SendTo(b, 100, "x", 1)==-1);
+	a = DatagramSocket(100);
+	ASSERT(a!=NOFILE);
+	return 0;
+}
+
+
+BOOT_TEST(test_datagram_drops_on_overflow,
+	"Test that datagrams to a full queue are dropped and counted."
+	)
+{
+	Fid_t a = DatagramSocket(100);
+	Fid_t b = DatagramSocket(NOPORT);
+	ASSERT(SetSockOpt(a, SOCKOPT_BACKLOG, 0)==-1);
+	ASSERT(SetSockOpt(a, SOCKOPT_BACKLOG, 4)==0);
+
+	for(int i=0; i<6; i++)
+		ASSERT(SendTo(b, 100, "x", 1)==(i<4 ? 1 : 0));
+
+	datagram_stats st;
+	ASSERT(GetDatagramStats(a, &st)==0);
+	ASSERT(st.queued==4 && st.received==4 && st.dropped==2 && st.sent==0);
+	ASSERT(GetDatagramStats(b, &st)==0);
+	ASSERT(st.queued==0 && st.sent==6);
+
+	char c;
+	ASSERT(RecvFrom(a, &c, 1, NULL, 0)==1);
+	ASSERT(SendTo(b, 100, "x", 1)==1);
+	ASSERT(GetDatagramStats(a, &st)==0);
+	ASSERT(st.queued==4 && st.received==5 && st.dropped==2);
+
+	Fid_t s = Socket(NOPORT);
+	ASSERT(GetDatagramStats(s, &st)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_datagram_wakes_receiver,
+	"Test that RecvFrom blocks until a datagram arrives."
+	)
+{
+	Fid_t a = DatagramSocket(100);
+	Fid_t b = DatagramSocket(200);
+
+	int recv_thread(int argl, void* args) {
+		char buf[8];
+		port_t from;
+		ASSERT(RecvFrom(a, buf, sizeof(buf), &from, (timeout_t)-1)==6);
+		ASSERT(from==200);
+		ASSERT(strcmp(buf, "Hello")==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(recv_thread, 0, NULL);
+	ASSERT(SendTo(b, 100, "Hello", 6)==6);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+TEST_SUITE(datagram_tests,
+	"Tests for datagram sockets."
+	)
+{
+	&test_datagram_send_recv,
+	&test_datagram_drops_on_overflow,
+	&test_datagram_wakes_receiver,
+	NULL
+};
+
+
+BOOT_TEST(test_ring_socket_options,
+	"Test that ring mode must match at both ends of a connection."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_RING, 1)==0);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_PACKET, 1)==-1);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(Connect(cli, 100, 100)==-1);
+	ASSERT(SetSockOpt(cli, SOCKOPT_PACKET, 1)==0);
+	ASSERT(SetSockOpt(cli, SOCKOPT_RING, 1)==-1);
+	ASSERT(SetSockOpt(cli, SOCKOPT_PACKET, 0)==0);
+	ASSERT(SetSockOpt(cli, SOCKOPT_RING, 1)==0);
+
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	check_transfer(cli, srv);
+	check_transfer(srv, cli);
+
+	sock_ring *rx, *tx;
+	ASSERT(SockRing(lsock, &rx, &tx)==-1);
+	ASSERT(SockRingWait(lsock, EVENT_READ, 0)==-1);
+	ASSERT(SockRing(cli, &rx, &tx)==0);
+	ASSERT(SockRingWait(cli, EVENT_READ, 0)==-1);
+	ASSERT(SockRingWait(cli, EVENT_WRITE, 0)==0);
+	ASSERT(SockRingWait(cli, 3, 0)==-1);
+
+	/* Plain sockets have no rings */
+	Fid_t p1 = Socket(NOPORT), p2;
+	ASSERT(Close(lsock)==0);
+	lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	connect_sockets(p1, lsock, &p2, 100);
+	ASSERT(SockRing(p1, &rx, &tx)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_ring_socket_stream,
+	"Test a stream much larger than the ring, through RingSend and RingRecv."
+	)
+{
+	Fid_t lsock = Socket(100);
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_RING, 1)==0);
+	ASSERT(SetSockOpt(cli, SOCKOPT_RING, 1)==0);
+	ASSERT(Listen(lsock)==0);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	const unsigned int N = 20*SOCK_RING_SIZE + 7;
+
+	int sender(int argl, void* args) {
+		sock_ring *rx, *tx;
+		ASSERT(SockRing(cli, &rx, &tx)==0);
+		char buf[1000];
+		for(unsigned int sent = 0; sent < N; ) {
+			unsigned int n = N-sent < sizeof(buf) ? N-sent : sizeof(buf);
+			for(unsigned int i = 0; i < n; i++)
+				buf[i] = (char)((sent+i) % 251);
+			ASSERT(RingSend(cli, tx, buf, n)==n);
+			sent += n;
+		}
+		ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(sender, 0, NULL);
+
+	sock_ring *rx, *tx;
+	ASSERT(SockRing(srv, &rx, &tx)==0);
+	char buf[777];
+	unsigned int received = 0;
+	int n;
+	while((n = RingRecv(srv, rx, buf, sizeof(buf))) > 0) {
+		for(int i = 0; i < n; i++)
+			ASSERT(buf[i] == (char)((received+i) % 251));
+		received += n;
+	}
+	ASSERT(n==0);
+	ASSERT(received==N);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A closed reader is an error for the writer */
+	ASSERT(ShutDown(srv, SHUTDOWN_READ)==0);
+	ASSERT(SockRing(cli, &rx, &tx)==0);
+	ASSERT(RingSend(cli, tx, "x", 1)==-1);
+
+	/* The other direction still works */
+	ASSERT(Write(srv, "y", 1)==1);
+	ASSERT(RingRecv(cli, rx, buf, 1)==1 && buf[0]=='y');
+	return 0;
+}
+
+
+TEST_SUITE(ring_tests,
+	"Tests for sockets in ring mode."
+	)
+{
+	&test_ring_socket_options,
+	&test_ring_socket_stream,
+	NULL
+};
+
+
+/* Connect to a host UNIX socket, from the host side */
+static int host_connect(const char* path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	ASSERT(fd != -1);
+	ASSERT(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+	return fd;
+}
+
+static void net_test_path(char* path)
+{
+	sprintf(path, "/tmp/tinyos_net_test_%d.sock", (int) getpid());
+}
+
+/* Sleep inside TinyOS, so that other threads can run while the host is busy */
+static void net_nap(timeout_t msec)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, msec);
+	Mutex_Unlock(&mx);
+}
+
+BOOT_TEST(test_net_host_connection,
+	"Test that a host program can connect to NetListen and exchange data."
+	)
+{
+	char path[64];
+	net_test_path(path);
+
+	ASSERT(NetListen(NULL)==NOFILE);
+	ASSERT(NetAccept(NOFILE)==NOFILE);
+	ASSERT(NetAccept(0)==NOFILE);
+
+	Fid_t lsock = NetListen(path);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(access(path, F_OK)==0);
+
+	int fd = host_connect(path);
+	ASSERT(write(fd, "Hello", 6)==6);
+
+	Fid_t conn = NetAccept(lsock);
+	ASSERT(conn!=NOFILE);
+	char buf[16];
+	ASSERT(Read(lsock, buf, 1)==-1);
+	ASSERT(Read(conn, buf, sizeof(buf))==6);
+	ASSERT(strcmp(buf, "Hello")==0);
+
+	ASSERT(Write(conn, "world", 6)==6);
+	ASSERT(read(fd, buf, sizeof(buf))==6);
+	ASSERT(strcmp(buf, "world")==0);
+
+	/* Half-close: the host reads end of file, and can still send */
+	ASSERT(ShutDown(lsock, SHUTDOWN_WRITE)==-1);
+	ASSERT(ShutDown(conn, SHUTDOWN_WRITE)==0);
+	ASSERT(read(fd, buf, sizeof(buf))==0);
+	ASSERT(Write(conn, "x", 1)==-1);
+	ASSERT(write(fd, "again", 6)==6);
+	ASSERT(Read(conn, buf, sizeof(buf))==6);
+	ASSERT(strcmp(buf, "again")==0);
+
+	/* The host closes */
+	ASSERT(close(fd)==0);
+	ASSERT(Read(conn, buf, sizeof(buf))==0);
+	ASSERT(Close(conn)==0);
+
+	/* The host socket goes away with the listener */
+	ASSERT(Close(lsock)==0);
+	ASSERT(access(path, F_OK)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_net_wakes_waiters,
+	"Test that NetAccept and Read block until the host connects and sends."
+	)
+{
+	char path[64];
+	net_test_path(path);
+	Fid_t lsock = NetListen(path);
+	ASSERT(lsock!=NOFILE);
+
+	int server(int argl, void* args) {
+		Fid_t conn = NetAccept(lsock);
+		ASSERT(conn!=NOFILE);
+		char buf[16];
+		int n, total = 0;
+		while((n = Read(conn, buf, sizeof(buf))) > 0) {
+			ASSERT(Write(conn, buf, n)==n);
+			total += n;
+		}
+		ASSERT(Close(conn)==0);
+		return total;
+	}
+	Tid_t t = CreateThread(server, 0, NULL);
+
+	/* Let the server block first */
+	net_nap(20);
+
+	int fd = host_connect(path);
+	char buf[8];
+	for(int i=0; i<10; i++) {
+		net_nap(5);
+		ASSERT(write(fd, "ping", 4)==4);
+		int n = 0;
+		while(n < 4) {
+			int rc = recv(fd, buf+n, 4-n, MSG_DONTWAIT);
+			if(rc > 0) n += rc;
+			else { ASSERT(rc==-1); net_nap(1); }
+		}
+		ASSERT(memcmp(buf, "ping", 4)==0);
+	}
+	ASSERT(close(fd)==0);
+
+	int total;
+	ASSERT(ThreadJoin(t, &total)==0);
+	ASSERT(total==40);
+	ASSERT(Close(lsock)==0);
+	return 0;
+}
+
+
+TEST_SUITE(net_tests,
+	"Tests for the host network device."
+	)
+{
+	&test_net_host_connection,
+	&test_net_wakes_waiters,
+	NULL
+};
+
+
+/* Find the statistics of a socket by its port and peer port */
+static int get_sockinfo(port_t port, port_t peer_port, sockinfo* info)
+{
+	Fid_t finfo = OpenSockInfo();
+	ASSERT(finfo!=NOFILE);
+	int found = 0;
+	while(!found && Read(finfo, (char*) info, sizeof(sockinfo)) == sizeof(sockinfo))
+		found = (info->port==port && info->peer_port==peer_port);
+	ASSERT(Close(finfo)==0);
+	return found;
+}
+
+BOOT_TEST(test_sockinfo_counts_traffic,
+	"Test that the socket information stream reports traffic, waits and queues."
+	)
+{
+	sockinfo info;
+	char buf[16];
+
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT), srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	port_t cport = GetSockPort(cli);
+
+	ASSERT(get_sockinfo(100, NOPORT, &info));
+	ASSERT(info.type==SOCKINFO_LISTENER);
+	ASSERT(info.pending==0 && info.max_pending==1);
+
+	/* The server blocks reading, until the client writes */
+	int reader(int argl, void* args) {
+		ASSERT(Read(srv, buf, sizeof(buf))==12);
+		return 0;
+	}
+	Tid_t t = CreateThread(reader, 0, NULL);
+	net_nap(20);
+	check_transfer(cli, srv);
+	ASSERT(Write(cli, "Hello world", 12)==12);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	ASSERT(get_sockinfo(cport, 100, &info));
+	ASSERT(info.type==SOCKINFO_PEER);
+	ASSERT(info.bytes_out==24 && info.bytes_in==0);
+	ASSERT(get_sockinfo(100, cport, &info));
+	ASSERT(info.bytes_in==24 && info.bytes_out==0);
+	ASSERT(info.read_waits>=1);
+
+	/* Datagram counters */
+	Fid_t d1 = DatagramSocket(NOPORT), d2 = DatagramSocket(NOPORT);
+	ASSERT(SendTo(d1, GetSockPort(d2), "abc", 3)==3);
+	ASSERT(get_sockinfo(GetSockPort(d2), NOPORT, &info));
+	ASSERT(info.type==SOCKINFO_DATAGRAM);
+	ASSERT(info.pending==1 && info.dgram_received==1);
+	ASSERT(RecvFrom(d2, buf, sizeof(buf), NULL, 0)==3);
+	ASSERT(get_sockinfo(GetSockPort(d2), NOPORT, &info));
+	ASSERT(info.pending==0 && info.bytes_in==3);
+	ASSERT(get_sockinfo(GetSockPort(d1), NOPORT, &info));
+	ASSERT(info.dgram_sent==1 && info.bytes_out==3);
+
+	/* Closed sockets are not reported */
+	ASSERT(Close(cli)==0);
+	ASSERT(! get_sockinfo(cport, 100, &info));
+	return 0;
+}
+
+
+TEST_SUITE(sockinfo_tests,
+	"Tests for the socket information stream."
+	)
+{
+	&test_sockinfo_counts_traffic,
+	NULL
+};
+
+
+BOOT_TEST(test_channel_broadcast,
+	"Test that every subscriber of a channel reads every message, stored once."
+	)
+{
+	char buf[16];
+	channel_stats stats;
+
+	ASSERT(Channel(MAX_CHANNEL_LAG+1)==NOFILE);
+	ASSERT(Subscribe(0)==NOFILE);
+
+	Fid_t chan = Channel(0);
+	ASSERT(chan!=NOFILE);
+	Fid_t sub[2] = { Subscribe(chan), Subscribe(chan) };
+	ASSERT(sub[0]!=NOFILE && sub[1]!=NOFILE);
+
+	ASSERT(Write(chan, "one", 4)==4);
+	ASSERT(Write(chan, "two", 4)==4);
+	ASSERT(Write(chan, "three", 6)==6);
+
+	ASSERT(GetChannelStats(chan, &stats)==0);
+	ASSERT(stats.subscribers==2 && stats.published==3 && stats.retained==3);
+
+	for(int i=0; i<2; i++) {
+		ASSERT(Read(sub[i], buf, sizeof(buf))==4 && strcmp(buf, "one")==0);
+		ASSERT(Read(sub[i], buf, 2)==2);		/* truncated */
+		ASSERT(Read(sub[i], buf, sizeof(buf))==6 && strcmp(buf, "three")==0);
+	}
+
+	/* All read, nothing is kept */
+	ASSERT(GetChannelStats(sub[0], &stats)==0);
+	ASSERT(stats.retained==0 && stats.pending==0 && stats.received==3 && stats.missed==0);
+
+	ASSERT(Write(sub[0], "x", 1)==-1);
+	ASSERT(Read(chan, buf, 1)==-1);
+
+	/* A subscriber that closes releases its messages */
+	ASSERT(Write(chan, "four", 5)==5);
+	ASSERT(Close(sub[1])==0);
+	ASSERT(GetChannelStats(chan, &stats)==0);
+	ASSERT(stats.subscribers==1 && stats.retained==1);
+
+	/* After the publisher is closed, the rest can be read */
+	ASSERT(Close(chan)==0);
+	ASSERT(Read(sub[0], buf, sizeof(buf))==5 && strcmp(buf, "four")==0);
+	ASSERT(Read(sub[0], buf, sizeof(buf))==0);
+	ASSERT(Subscribe(sub[0])==NOFILE);
+	ASSERT(Close(sub[0])==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_channel_lag,
+	"Test that a slow subscriber skips the messages beyond the lag of the channel."
+	)
+{
+	channel_stats stats;
+	Fid_t chan = Channel(4);
+	Fid_t slow = Subscribe(chan);
+
+	for(int i=0; i<10; i++)
+		ASSERT(Write(chan, (char*) &i, sizeof(i))==sizeof(i));
+
+	/* Memory is bounded by the lag */
+	ASSERT(GetChannelStats(slow, &stats)==0);
+	ASSERT(stats.retained==4 && stats.pending==4 && stats.missed==6);
+
+	/* A new subscriber only sees new messages */
+	Fid_t late = Subscribe(chan);
+	int i = 10;
+	ASSERT(Write(chan, (char*) &i, sizeof(i))==sizeof(i));
+	ASSERT(Read(late, (char*) &i, sizeof(i))==sizeof(i) && i==10);
+
+	for(int k=7; k<=10; k++) {
+		ASSERT(Read(slow, (char*) &i, sizeof(i))==sizeof(i));
+		ASSERT(i==k);
+	}
+	ASSERT(GetChannelStats(slow, &stats)==0);
+	ASSERT(stats.received==4 && stats.missed==7 && stats.retained==0);
+
+	ASSERT(Close(chan)==0);
+	ASSERT(Close(slow)==0);
+	ASSERT(Close(late)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_channel_wakes_subscribers,
+	"Test that blocked subscribers wake up when a message is published."
+	)
+{
+	Fid_t chan = Channel(0);
+	Fid_t sub[3];
+	for(int i=0; i<3; i++) sub[i] = Subscribe(chan);
+
+	int reader(int argl, void* args) {
+		char buf[8];
+		int count = 0;
+		while(Read(sub[argl], buf, sizeof(buf)) > 0)
+			count++;
+		return count;
+	}
+	Tid_t t[3];
+	for(int i=0; i<3; i++) t[i] = CreateThread(reader, i, NULL);
+
+	net_nap(20);
+	for(int i=0; i<20; i++)
+		ASSERT(Write(chan, "msg", 4)==4);
+	ASSERT(Close(chan)==0);
+
+	for(int i=0; i<3; i++) {
+		int count;
+		ASSERT(ThreadJoin(t[i], &count)==0);
+		ASSERT(count==20);
+		ASSERT(Close(sub[i])==0);
+	}
+	return 0;
+}
+
+
+TEST_SUITE(channel_tests,
+	"Tests for fan-out channels."
+	)
+{
+	&test_channel_broadcast,
+	&test_channel_lag,
+	&test_channel_wakes_subscribers,
+	NULL
+};
+
+
+BOOT_TEST(test_process_table_grows,
+	"Test that the process table grows to hold many processes, and reuses their pids."
+	)
+{
+	const int N = 600;
+	Pid_t pids[N];
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	/* The children block until the pipe is closed */
+	int child(int argl, void* args) {
+		char c;
+		Close(pipe.write);
+		return Read(pipe.read, &c, 1);
+	}
+
+	for(int i=0; i<N; i++) {
+		pids[i] = Exec(child, 0, NULL);
+		ASSERT(pids[i] > 1 && pids[i] < MAX_PROC);
+		for(int j=0; j<i; j++) ASSERT(pids[j]!=pids[i]);
+	}
+
+	/* All are reported by the info stream */
+	Fid_t finfo = OpenInfo();
+	procinfo info;
+	int count = 0;
+	while(Read(finfo, (char*) &info, sizeof(info))==sizeof(info))
+		if(info.ppid==GetPid()) count++;
+	ASSERT(count==N);
+	ASSERT(Close(finfo)==0);
+
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Close(pipe.read)==0);
+	for(int i=0; i<N; i++)
+		ASSERT(WaitChild(pids[i], NULL)==pids[i]);
+
+	/* Freed pids are reused */
+	Pid_t pid = Exec(child, 0, NULL);
+	int reused = 0;
+	for(int i=0; i<N; i++) reused |= (pids[i]==pid);
+	ASSERT(reused);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	return 0;
+}
+
+
+BOOT_TEST(test_procinfo_bulk_read,
+	"Test that a Read of the info stream returns many records, in pid order."
+	)
+{
+	int child(int argl, void* args) { return 0; }
+	Pid_t pids[20];
+	for(int i=0; i<20; i++)
+		pids[i] = Exec(child, 0, NULL);
+
+	/* One record per Read */
+	procinfo one[40];
+	int n1 = 0;
+	Fid_t finfo = OpenInfo();
+	while(Read(finfo, (char*) &one[n1], sizeof(procinfo))==sizeof(procinfo)) 
+		n1++;
+	ASSERT(Close(finfo)==0);
+	ASSERT(n1 >= 22);	/* the scheduler, init and the children */
+
+	/* Seven records per Read */
+	procinfo many[42];
+	int n2 = 0, rc;
+	finfo = OpenInfo();
+	while((rc = Read(finfo, (char*) &many[n2], 7*sizeof(procinfo))) > 0) {
+		ASSERT(rc % sizeof(procinfo) == 0);
+		n2 += rc / sizeof(procinfo);
+	}
+	ASSERT(Close(finfo)==0);
+
+	ASSERT(n1==n2);
+	for(int i=0; i<n1; i++) {
+		ASSERT(one[i].pid==many[i].pid);
+		if(i>0) ASSERT(many[i].pid > many[i-1].pid);
+	}
+
+	/* A short buffer gets part of a record */
+	finfo = OpenInfo();
+	ASSERT(Read(finfo, (char*) &one[0], sizeof(Pid_t))==sizeof(Pid_t));
+	ASSERT(one[0].pid==0);
+	ASSERT(Close(finfo)==0);
+
+	for(int i=0; i<20; i++)
+		ASSERT(WaitChild(pids[i], NULL)==pids[i]);
+	return 0;
+}
+
+
+TEST_SUITE(process_table_tests,
+	"Tests for the process table."
+	)
+{
+	&test_process_table_grows,
+	&test_procinfo_bulk_read,
+	NULL
+};
+
+
+BOOT_TEST(test_rusage_times,
+	"Test that GetRusage counts the time running and blocked, and context switches."
+	)
+{
+	resource_usage u1, u2;
+	ASSERT(GetRusage(USAGE_THREAD, &u1)==0);
+
+	/* Run for a while */
+	volatile unsigned long x = 0;
+	for(unsigned long i=0; i<20000000; i++) x += i;
+
+	ASSERT(GetRusage(USAGE_THREAD, &u2)==0);
+	ASSERT(u2.cpu_time > u1.cpu_time);
+
+	/* Block for a while */
+	net_nap(20);
+	ASSERT(GetRusage(USAGE_THREAD, &u1)==0);
+	ASSERT(u1.voluntary > u2.voluntary);
+	ASSERT(u1.stopped_time >= u2.stopped_time + 10000);
+
+	unsigned long total = 0;
+	for(int i=0; i<USAGE_CAUSES; i++) total += u1.switches[i];
+	ASSERT(total == u1.voluntary + u1.involuntary);
+
+	/* The process includes the thread */
+	ASSERT(GetRusage(USAGE_PROCESS, &u2)==0);
+	ASSERT(u2.cpu_time >= u1.cpu_time);
+	ASSERT(u2.voluntary >= u1.voluntary);
+
+	ASSERT(GetRusage(USAGE_THREAD, NULL)==-1);
+	ASSERT(GetRusage(3, &u1)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_rusage_io_and_threads,
+	"Test that GetRusage counts the bytes read and written, and the peak of threads."
+	)
+{
+	resource_usage u1, u2;
+	pipe_t pipe;
+	char buf[1000];
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(GetRusage(USAGE_PROCESS, &u1)==0);
+
+	ASSERT(Write(pipe.write, buf, 1000)==1000);
+	ASSERT(Read(pipe.read, buf, 300)==300);
+	ASSERT(Read(pipe.read, buf, 1000)==700);
+
+	ASSERT(GetRusage(USAGE_PROCESS, &u2)==0);
+	ASSERT(u2.bytes_written == u1.bytes_written + 1000);
+	ASSERT(u2.bytes_read == u1.bytes_read + 1000);
+	ASSERT(GetRusage(USAGE_THREAD, &u2)==0);
+	ASSERT(u2.bytes_read >= 1000);
+
+	/* Failed calls are not counted */
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buf, 1000)==0);
+	ASSERT(Write(pipe.read, buf, 10)==-1);
+	ASSERT(GetRusage(USAGE_PROCESS, &u2)==0);
+	ASSERT(u2.bytes_written == u1.bytes_written + 1000);
+	ASSERT(u2.bytes_read == u1.bytes_read + 1000);
+	ASSERT(Close(pipe.read)==0);
+
+	int task(int argl, void* args) { return 0; }
+	Tid_t tids[5];
+	for(int i=0; i<5; i++) tids[i] = CreateThread(task, 0, NULL);
+	for(int i=0; i<5; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(GetRusage(USAGE_PROCESS, &u2)==0);
+	ASSERT(u2.peak_threads >= 6);
+	return 0;
+}
+
+
+BOOT_TEST(test_rusage_children,
+	"Test that the usage of children is added to their parent when they are waited for."
+	)
+{
+	resource_usage u1, u2;
+	ASSERT(GetRusage(USAGE_CHILDREN, &u1)==0);
+	ASSERT(u1.cpu_time==0 && u1.bytes_written==0);
+
+	int grandchild(int argl, void* args) {
+		char buf[100];
+		Fid_t fid = OpenNull();
+		ASSERT(Write(fid, buf, 100)==100);
+		ASSERT(Close(fid)==0);
+		return 0;
+	}
+	int child(int argl, void* args) {
+		volatile unsigned long x = 0;
+		for(unsigned long i=0; i<5000000; i++) x += i;
+		ASSERT(WaitChild(Exec(grandchild, 0, NULL), NULL)!=NOPROC);
+		return 0;
+	}
+	int busy(int argl, void* args) {
+		char buf[100];
+		Fid_t fid = OpenNull();
+		for(int i=0; i<3; i++) ASSERT(Write(fid, buf, 100)==100);
+		ASSERT(Close(fid)==0);
+		return 0;
+	}
+
+	/* The info stream reports the usage of a live process, up to its last switch */
+	volatile unsigned long x = 0;
+	for(unsigned long i=0; i<5000000; i++) x += i;
+	net_nap(5);
+	Pid_t pid = Exec(busy, 0, NULL);
+	Fid_t finfo = OpenInfo();
+	procinfo info;
+	while(Read(finfo, (char*) &info, sizeof(info))==sizeof(info))
+		if(info.pid==GetPid()) break;
+	ASSERT(info.pid==GetPid());
+	ASSERT(info.usage.cpu_time > 0);
+	ASSERT(Close(finfo)==0);
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	ASSERT(GetRusage(USAGE_CHILDREN, &u2)==0);
+	ASSERT(u2.bytes_written == 300);
+
+	pid = Exec(child, 0, NULL);
+	ASSERT(GetRusage(USAGE_CHILDREN, &u1)==0);
+	ASSERT(u1.bytes_written == 300);
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	/* The grandchild is included */
+	ASSERT(GetRusage(USAGE_CHILDREN, &u1)==0);
+	ASSERT(u1.bytes_written == 400);
+	ASSERT(u1.cpu_time > u2.cpu_time);
+	ASSERT(u1.peak_threads == 1);
+	return 0;
+}
+
+
+TEST_SUITE(rusage_tests,
+	"Tests for resource usage accounting."
+	)
+{
+	&test_rusage_times,
+	&test_rusage_io_and_threads,
+	&test_rusage_children,
+	NULL
+};
+
+
+BOOT_TEST(test_fid_table_grows,
+	"Test that a process can open MAX_FILEID files, and that the lowest free fid is used."
+	)
+{
+	int n = 0;
+	Fid_t fid;
+	while((fid = OpenNull()) != NOFILE) {
+		ASSERT(fid == n);
+		n++;
+	}
+	ASSERT(n == MAX_FILEID);
+	ASSERT(Write(MAX_FILEID-1, "x", 1)==1);
+
+	/* The lowest free fid is returned */
+	ASSERT(Close(MAX_FILEID-1)==0);
+	ASSERT(Close(100)==0);
+	ASSERT(Close(7)==0);
+	ASSERT(OpenNull()==7);
+	ASSERT(OpenNull()==100);
+	ASSERT(OpenNull()==MAX_FILEID-1);
+	ASSERT(OpenNull()==NOFILE);
+
+	/* A pipe needs two fids */
+	pipe_t pipe;
+	ASSERT(Close(3)==0);
+	ASSERT(Pipe(&pipe)==-1);
+	ASSERT(OpenNull()==3);
+
+	for(fid = 0; fid < MAX_FILEID; fid++)
+		ASSERT(Close(fid)==0);
+	ASSERT(OpenNull()==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_close_on_exec,
+	"Test that Exec does not pass fids with the close-on-exec flag to the child."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	Fid_t high = MAX_FILEID-1;
+	ASSERT(Dup2(pipe.write, high)==0);
+
+	ASSERT(SetCloseOnExec(pipe.write, 1)==0);
+	ASSERT(SetCloseOnExec(pipe.read, 1)==0);
+	ASSERT(SetCloseOnExec(pipe.read, 0)==0);
+	ASSERT(SetCloseOnExec(high+1, 1)==-1);
+	ASSERT(SetCloseOnExec(10, 1)==-1);
+
+	int child(int argl, void* args) {
+		char c;
+		ASSERT(Write(pipe.write, "x", 1)==-1);
+		ASSERT(Write(high, "y", 1)==1);
+		ASSERT(Read(pipe.read, &c, 1)==1);
+		return c;
+	}
+
+	/* The child inherits only the fids without the flag */
+	Pid_t pid = Exec(child, 0, NULL);
+	int status;
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status=='y');
+
+	/* Dup2 clears the flag of the new fid, and the parent still has its fids */
+	ASSERT(Dup2(pipe.write, 5)==0);
+	int child2(int argl, void* args) {
+		return Write(5, "z", 1);
+	}
+	pid = Exec(child2, 0, NULL);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==1);
+
+	char c;
+	ASSERT(Write(pipe.write, "w", 1)==1);
+	ASSERT(Read(pipe.read, &c, 1)==1 && c=='z');
+	ASSERT(Read(pipe.read, &c, 1)==1 && c=='w');
+
+	/* A closed fid loses the flag */
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Dup2(5, pipe.write)==0);
+	ASSERT(Close(5)==0);
+	ASSERT(Close(high)==0);
+	pid = Exec(child2, 0, NULL);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==-1);
+	int child3(int argl, void* args) {
+		return Write(pipe.write, "v", 1);
+	}
+	pid = Exec(child3, 0, NULL);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==1);
+	return 0;
+}
+
+
+TEST_SUITE(fid_table_tests,
+	"Tests for the file id table."
+	)
+{
+	&test_fid_table_grows,
+	&test_close_on_exec,
+	NULL
+};
+
+
+BOOT_TEST(test_stale_tid_rejected,
+	"Test that a Tid is rejected after its thread is joined, even if its slot is reused."
+	)
+{
+	int task(int argl, void* args) { return argl; }
+
+	Tid_t t1 = CreateThread(task, 1, NULL);
+	int exitval;
+	ASSERT(ThreadJoin(t1, &exitval)==0);
+	ASSERT(exitval==1);
+
+	/* The new thread may take the slot of the old one, but not its Tid */
+	Tid_t t2 = CreateThread(task, 2, NULL);
+	ASSERT(t2 != t1);
+	ASSERT(ThreadJoin(t1, NULL)==-1);
+	ASSERT(ThreadDetach(t1)==-1);
+	ASSERT(ThreadJoin(t2, &exitval)==0);
+	ASSERT(exitval==2);
+
+	/* A detached thread that exited is gone too */
+	Tid_t t3 = CreateThread(task, 3, NULL);
+	ASSERT(ThreadDetach(t3)==0);
+	net_nap(10);
+	ASSERT(ThreadJoin(t3, NULL)==-1);
+	ASSERT(ThreadDetach(t3)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_foreign_tid_rejected,
+	"Test that a process cannot join or detach the threads of another process."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int done = 0;
+
+	int waiter(int argl, void* args) {
+		Mutex_Lock(&mx);
+		while(!done) Cond_Wait(&mx, &cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+	Tid_t t = CreateThread(waiter, 0, NULL);
+
+	int child(int argl, void* args) {
+		/* Fill the slots of the child, so that the slot of t is in use */
+		int task(int argl, void* args) { return 0; }
+		Tid_t mine[4];
+		for(int i=0; i<4; i++) mine[i] = CreateThread(task, 0, NULL);
+
+		ASSERT(ThreadJoin(t, NULL)==-1);
+		ASSERT(ThreadDetach(t)==-1);
+
+		for(int i=0; i<4; i++) ASSERT(ThreadJoin(mine[i], NULL)==0);
+		return 0;
+	}
+	ASSERT(WaitChild(Exec(child, 0, NULL), NULL)!=NOPROC);
+
+	Mutex_Lock(&mx);
+	done = 1;
+	Cond_Broadcast(&cv);
+	Mutex_Unlock(&mx);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_join_many_threads_in_any_order,
+	"Test that many threads can be joined, in any order, and their PTCBs are freed."
+	)
+{
+	const int N = 2000;
+	Tid_t tids[N];
+	meminfo before, after;
+	int task(int argl, void* args) { return argl; }
+
+	ASSERT(get_meminfo("PTCB", &before));
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThread(task, i, NULL);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+
+	for(int i=N-1; i>=0; i--) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval==i);
+	}
+	ASSERT(get_meminfo("PTCB", &after));
+	ASSERT(after.in_use == before.in_use);
+	return 0;
+}
+
+
+TEST_SUITE(thread_table_tests,
+	"Tests for the thread table of a process."
+	)
+{
+	&test_stale_tid_rejected,
+	&test_foreign_tid_rejected,
+	&test_join_many_threads_in_any_order,
+	NULL
+};
+
+
+BOOT_TEST(test_spawn_fid_actions,
+	"Test that Spawn rearranges the fids of the child, and not those of the parent."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	Fid_t out = OpenNull();
+
+	int child(int argl, void* args) {
+		ASSERT(Write(pipe.write, "x", 1)==-1);
+		ASSERT(Write(out, "x", 1)==-1);
+		ASSERT(Write(7, "hello", 5)==5);
+		return 0;
+	}
+
+	spawn_action actions[] = {
+		{ SPAWN_DUP2, pipe.write, 7 },
+		{ SPAWN_CLOSE, pipe.write, NOFILE },
+		{ SPAWN_CLOSE, pipe.read, NOFILE },
+		{ SPAWN_CLOSE, out, NOFILE }
+	};
+	Pid_t pid = Spawn(child, 0, NULL, actions, 4);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	/* The parent still has its fids, and fid 7 was not touched */
+	ASSERT(Write(out, "x", 1)==1);
+	ASSERT(Write(7, "x", 1)==-1);
+	ASSERT(Close(pipe.write)==0);
+
+	/* The child wrote to the pipe, and closed its ends */
+	char buf[10];
+	ASSERT(Read(pipe.read, buf, 10)==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+	ASSERT(Read(pipe.read, buf, 10)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_spawn_invalid_actions,
+	"Test that Spawn fails without creating a process if an action is not valid."
+	)
+{
+	int child(int argl, void* args) { return 0; }
+	Fid_t fid = OpenNull();
+	meminfo before, after;
+	ASSERT(get_meminfo("FCB", &before));
+
+	spawn_action bad_dup[] = { { SPAWN_DUP2, fid, 5 }, { SPAWN_DUP2, 7, 1 } };
+	spawn_action bad_fid[] = { { SPAWN_DUP2, fid, MAX_FILEID } };
+	spawn_action bad_close[] = { { SPAWN_CLOSE, -1, NOFILE } };
+	spawn_action bad_type[] = { { 42, fid, 1 } };
+
+	ASSERT(Spawn(child, 0, NULL, bad_dup, 2)==NOPROC);
+	ASSERT(Spawn(child, 0, NULL, bad_fid, 1)==NOPROC);
+	ASSERT(Spawn(child, 0, NULL, bad_close, 1)==NOPROC);
+	ASSERT(Spawn(child, 0, NULL, bad_type, 1)==NOPROC);
+	ASSERT(Spawn(child, 0, NULL, NULL, 1)==NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)==NOPROC);
+
+	/* Nothing leaked */
+	ASSERT(get_meminfo("FCB", &after));
+	ASSERT(after.in_use == before.in_use);
+
+	/* Closing a closed fid is fine, as with Close */
+	spawn_action ok[] = { { SPAWN_CLOSE, 9, NOFILE } };
+	Pid_t pid = Spawn(child, 0, NULL, ok, 1);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	return 0;
+}
+
+
+BOOT_TEST(test_exec_many,
+	"Test that ExecMany creates many processes, each with its own arguments."
+	)
+{
+	const int N = 20;
+	int child(int argl, void* args) { 
+		ASSERT(argl == sizeof(int));
+		return *(int*)args; 
+	}
+
+	int arg[N];
+	spawn_request reqs[N];
+	Pid_t pids[N];
+	for(int i=0; i<N; i++) {
+		arg[i] = 100+i;
+		reqs[i] = (spawn_request){ child, sizeof(int), &arg[i], NULL, 0 };
+	}
+
+	ASSERT(ExecMany(N, reqs, pids)==N);
+	for(int i=0; i<N; i++) {
+		int status;
+		ASSERT(pids[i] != NOPROC);
+		ASSERT(WaitChild(pids[i], &status)==pids[i]);
+		ASSERT(status == 100+i);
+	}
+
+	/* Creation stops at the first failure */
+	spawn_action bad[] = { { SPAWN_CLOSE, MAX_FILEID, NOFILE } };
+	reqs[2].actions = bad;
+	reqs[2].nactions = 1;
+	ASSERT(ExecMany(N, reqs, pids)==2);
+	for(int i=2; i<N; i++) ASSERT(pids[i]==NOPROC);
+	for(int i=0; i<2; i++) ASSERT(WaitChild(pids[i], NULL)==pids[i]);
+	ASSERT(WaitChild(NOPROC, NULL)==NOPROC);
+
+	ASSERT(ExecMany(0, reqs, pids)==0);
+	ASSERT(ExecMany(N, NULL, pids)==-1);
+	ASSERT(ExecMany(N, reqs, NULL)==-1);
+	return 0;
+}
+
+
+TEST_SUITE(spawn_tests,
+	"Tests for Spawn and ExecMany."
+	)
+{
+	&test_spawn_fid_actions,
+	&test_spawn_invalid_actions,
+	&test_exec_many,
+	NULL
+};
+
+
+/* Read one byte from the fid in argl, and return it */
+static int wait_for_byte(int argl, void* args)
+{
+	char c = 0;
+	ASSERT(Read(argl, &c, 1)==1);
+	return c;
+}
+
+
+BOOT_TEST(test_wait_child_timed,
+	"Test that WaitChildTimed gives up when the timeout expires, and the child can be waited on again."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	Pid_t pid = Exec(wait_for_byte, pipe.read, NULL);
+	ASSERT(pid != NOPROC);
+
+	ASSERT(WaitChildTimed(pid, NULL, 0)==NOPROC);
+	ASSERT(WaitChildTimed(pid, NULL, 20)==NOPROC);
+	ASSERT(WaitChildTimed(NOPROC, NULL, 20)==NOPROC);
+
+	ASSERT(Write(pipe.write, "A", 1)==1);
+	int status;
+	ASSERT(WaitChildTimed(pid, &status, 1000)==pid);
+	ASSERT(status == 'A');
+
+	/* Errors are the same as for WaitChild */
+	ASSERT(WaitChildTimed(pid, NULL, 10)==NOPROC);
+	ASSERT(WaitChildTimed(NOPROC, NULL, (timeout_t)-1)==NOPROC);
+	ASSERT(WaitChildTimed(MAX_PROC, NULL, 10)==NOPROC);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_join_timed,
+	"Test that ThreadJoinTimed gives up when the timeout expires, and the thread can be joined again."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	Tid_t tid = CreateThread(wait_for_byte, pipe.read, NULL);
+	ASSERT(tid != NOTHREAD);
+
+	ASSERT(ThreadJoinTimed(tid, NULL, 0)==-1);
+	ASSERT(ThreadJoinTimed(tid, NULL, 20)==-1);
+
+	ASSERT(Write(pipe.write, "B", 1)==1);
+	int exitval;
+	ASSERT(ThreadJoinTimed(tid, &exitval, (timeout_t)-1)==0);
+	ASSERT(exitval == 'B');
+
+	/* Errors are the same as for ThreadJoin */
+	ASSERT(ThreadJoinTimed(tid, NULL, 10)==-1);
+	ASSERT(ThreadJoinTimed(ThreadSelf(), NULL, 10)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_wait_any_of,
+	"Test that WaitAnyOf returns the first of a set of children and threads to exit."
+	)
+{
+	const int N = 4;
+	pipe_t pipe[N];
+	wait_target targets[N];
+	for(int i=0; i<N; i++) {
+		ASSERT(Pipe(&pipe[i])==0);
+		if(i % 2 == 0)
+			targets[i] = (wait_target){ WAIT_PROCESS, Exec(wait_for_byte, pipe[i].read, NULL), NOTHREAD };
+		else
+			targets[i] = (wait_target){ WAIT_THREAD, NOPROC, CreateThread(wait_for_byte, pipe[i].read, NULL) };
+	}
+
+	ASSERT(WaitAnyOf(targets, N, NULL, 20)==-1);
+
+	/* Release the targets in some order, and remove each one from the set when it exits */
+	int order[] = { 3, 0, 1, 2 };
+	int index[] = { 0, 1, 2, 3 };
+	for(int left=N; left>0; left--) {
+		int i = order[N-left];
+		char c = 'a'+i;
+		ASSERT(Write(pipe[i].write, &c, 1)==1);
+
+		int status;
+		int k = WaitAnyOf(targets, left, &status, (timeout_t)-1);
+		ASSERT(k >= 0 && index[k] == i);
+		ASSERT(status == c);
+		for(int j=k; j+1<left; j++) {
+			targets[j] = targets[j+1];
+			index[j] = index[j+1];
+		}
+	}
+
+	/* All were reaped or joined */
+	ASSERT(WaitChild(NOPROC, NULL)==NOPROC);
+	return 0;
+}
+
+
+/* Detach the thread *args, after a while */
+static int detach_after_nap(int argl, void* args)
+{
+	net_nap(20);
+	return ThreadDetach(*(Tid_t*)args);
+}
+
+
+BOOT_TEST(test_wait_any_of_errors,
+	"Test that WaitAnyOf fails on targets that cannot be waited on, or that are detached while waiting."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	Tid_t tid = CreateThread(wait_for_byte, pipe.read, NULL);
+	Pid_t pid = Exec(wait_for_byte, pipe.read, NULL);
+
+	wait_target ok[] = { { WAIT_THREAD, NOPROC, tid }, { WAIT_PROCESS, pid, NOTHREAD } };
+	wait_target bad_pid[] = { { WAIT_THREAD, NOPROC, tid }, { WAIT_PROCESS, NOPROC, NOTHREAD } };
+	wait_target not_child[] = { { WAIT_PROCESS, GetPid(), NOTHREAD } };
+	wait_target self[] = { { WAIT_THREAD, NOPROC, ThreadSelf() } };
+	wait_target bad_type[] = { { 42, pid, tid } };
+
+	ASSERT(WaitAnyOf(NULL, 1, NULL, 10)==-1);
+	ASSERT(WaitAnyOf(ok, 0, NULL, 10)==-1);
+	ASSERT(WaitAnyOf(ok, MAX_WAIT_TARGETS+1, NULL, 10)==-1);
+	ASSERT(WaitAnyOf(bad_pid, 2, NULL, 10)==-1);
+	ASSERT(WaitAnyOf(not_child, 1, NULL, 10)==-1);
+	ASSERT(WaitAnyOf(self, 1, NULL, 10)==-1);
+	ASSERT(WaitAnyOf(bad_type, 1, NULL, 10)==-1);
+
+	/* A thread detached while waiting fails the call */
+	Tid_t d = CreateThread(detach_after_nap, 0, &tid);
+	ASSERT(WaitAnyOf(ok, 2, NULL, (timeout_t)-1)==-1);
+	ASSERT(ThreadJoin(d, NULL)==0);
+
+	/* Nothing was reaped by the failed calls */
+	ASSERT(Write(pipe.write, "xy", 2)==2);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	return 0;
+}
+
+
+TEST_SUITE(wait_tests,
+	"Tests for the timed and multi-target waits."
+	)
+{
+	&test_wait_child_timed,
+	&test_thread_join_timed,
+	&test_wait_any_of,
+	&test_wait_any_of_errors,
+	NULL
+};
+
+
+BOOT_TEST(test_process_fid_read,
+	"Test that reading a process fid blocks until the child exits, and returns its status, even after it is reaped."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	Pid_t pid = Exec(wait_for_byte, pipe.read, NULL);
+	Fid_t pfd = OpenProcess(pid);
+	ASSERT(pfd != NOFILE);
+
+	int reader(int argl, void* args) {
+		int status = 0;
+		ASSERT(Read(argl, (char*)&status, sizeof(int))==sizeof(int));
+		return status;
+	}
+	Tid_t t = CreateThread(reader, pfd, NULL);
+	ASSERT(ThreadJoinTimed(t, NULL, 20)==-1);
+
+	ASSERT(Write(pipe.write, "P", 1)==1);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 'P');
+
+	/* It does not reap the child */
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	int status = 0;
+	ASSERT(Read(pfd, (char*)&status, sizeof(int))==sizeof(int));
+	ASSERT(status == 'P');
+	ASSERT(Read(pfd, (char*)&status, 1)==-1);
+	ASSERT(Write(pfd, (char*)&status, sizeof(int))==-1);
+	ASSERT(Close(pfd)==0);
+
+	/* Only children can be opened */
+	ASSERT(OpenProcess(pid)==NOFILE);
+	ASSERT(OpenProcess(GetPid())==NOFILE);
+	ASSERT(OpenProcess(NOPROC)==NOFILE);
+	return 0;
+}
+
+
+BOOT_TEST(test_process_fid_events,
+	"Test that a process fid reports the exit of the child on an event queue, with other streams."
+	)
+{
+	const int N = 3;
+	pipe_t pipe[N];
+	Pid_t pid[N];
+	Fid_t pfd[N];
+
+	Fid_t evq = EventQueue();
+	ASSERT(evq != NOFILE);
+	for(int i=0; i<N; i++) {
+		ASSERT(Pipe(&pipe[i])==0);
+		pid[i] = Exec(wait_for_byte, pipe[i].read, NULL);
+		pfd[i] = OpenProcess(pid[i]);
+		ASSERT(pfd[i] != NOFILE);
+		ASSERT(EventCtl(evq, pfd[i], EVENT_READ)==0);
+	}
+
+	/* A pipe in the same loop */
+	pipe_t data;
+	ASSERT(Pipe(&data)==0);
+	ASSERT(EventCtl(evq, data.read, EVENT_READ)==0);
+
+	event_t ev[N+1];
+	ASSERT(WaitEvents(evq, ev, N+1, 20)==0);
+
+	ASSERT(Write(data.write, "d", 1)==1);
+	ASSERT(WaitEvents(evq, ev, N+1, 1000)==1);
+	ASSERT(ev[0].fid == data.read && ev[0].events == EVENT_READ);
+
+	for(int i=N-1; i>=0; i--) {
+		char c = '0'+i;
+		ASSERT(Write(pipe[i].write, &c, 1)==1);
+		ASSERT(WaitEvents(evq, ev, N+1, 1000)==1);
+		ASSERT(ev[0].fid == pfd[i] && ev[0].events == EVENT_READ);
+
+		int status;
+		ASSERT(Read(pfd[i], (char*)&status, sizeof(int))==sizeof(int));
+		ASSERT(status == c);
+		ASSERT(WaitChild(pid[i], NULL)==pid[i]);
+		ASSERT(Close(pfd[i])==0);
+	}
+	return 0;
+}
+
+
+TEST_SUITE(process_fid_tests,
+	"Tests for process fids."
+	)
+{
+	&test_process_fid_read,
+	&test_process_fid_events,
+	NULL
+};
+
+
+/* Block for ever: a thread reads fid argl, and the main thread joins it */
+static int block_forever(int argl, void* args)
+{
+	Tid_t t = CreateThread(wait_for_byte, argl, NULL);
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+
+BOOT_TEST(test_kill_blocked_process,
+	"Test that Kill terminates a process whose threads are blocked in system calls."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	Pid_t pid = Exec(block_forever, pipe.read, NULL);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChildTimed(pid, NULL, 20)==NOPROC);
+
+	ASSERT(Kill(pid)==0);
+	int status;
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status == EXIT_KILLED);
+
+	/* The pipe was not written */
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Write(pipe.write, "x", 1)==-1);
+	return 0;
+}
+
+
+/* Write more than a ring holds to ring socket argl */
+static int write_ring_forever(int argl, void* args)
+{
+	static char buf[2*SOCK_RING_SIZE];
+	return Write(argl, buf, sizeof(buf));
+}
+
+
+BOOT_TEST(test_kill_blocked_ring_writer,
+	"Test that Kill terminates a process blocked writing to a full socket ring."
+	)
+{
+	Fid_t lsock = Socket(100);
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_RING, 1)==0);
+	ASSERT(SetSockOpt(cli, SOCKOPT_RING, 1)==0);
+	ASSERT(Listen(lsock)==0);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	Pid_t pid = Exec(write_ring_forever, cli, NULL);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChildTimed(pid, NULL, 20)==NOPROC);
+
+	ASSERT(Kill(pid)==0);
+	int status;
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status == EXIT_KILLED);
+
+	/* The ring was filled, and nothing more */
+	static char buf[2*SOCK_RING_SIZE];
+	ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+	unsigned int received = 0;
+	int n;
+	while((n = Read(srv, buf, sizeof(buf))) > 0)
+		received += n;
+	ASSERT(n==0);
+	ASSERT(received == SOCK_RING_SIZE);
+	return 0;
+}
+
+
+BOOT_TEST(test_kill_errors,
+	"Test that only descendants can be killed, and that killing an exited process has no effect."
+	)
+{
+	int child(int argl, void* args) { return Kill(GetPPid()) == -1 && Kill(GetPid()) == -1 ? 5 : 6; }
+
+	Pid_t pid = Exec(child, 0, NULL);
+	Fid_t pfd = OpenProcess(pid);
+	int status;
+	ASSERT(Read(pfd, (char*)&status, sizeof(int))==sizeof(int));
+
+	/* Now it is a zombie */
+	ASSERT(Kill(pid)==0);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status == 5);
+	ASSERT(Close(pfd)==0);
+
+	ASSERT(Kill(pid)==-1);
+	ASSERT(Kill(GetPid())==-1);
+	ASSERT(Kill(NOPROC)==-1);
+	ASSERT(Kill(MAX_PROC)==-1);
+	ASSERT(KillTree(GetPid())==-1);
+	ASSERT(KillTree(NOPROC)==-1);
+	return 0;
+}
+
+
+/* With args {n, fid}, create n children, each with n-1 children etc., and block reading fid */
+static int block_tree(int argl, void* args)
+{
+	int n = ((int*)args)[0], fid = ((int*)args)[1];
+	int child_args[2] = { n-1, fid };
+	for(int i=0; i<n; i++)
+		Exec(block_tree, sizeof(child_args), child_args);
+	return block_forever(fid, NULL);
+}
+
+
+BOOT_TEST(test_kill_tree,
+	"Test that KillTree terminates a tree of processes at once."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	/* 1 + 3 + 3*2 + 3*2*1 + 3*2*1*0 = 16 processes */
+	const int N = 16;
+	int root_args[2] = { 3, pipe.read };
+	Pid_t root = Exec(block_tree, sizeof(root_args), root_args);
+	ASSERT(root != NOPROC);
+
+	/* Wait for the tree to grow */
+	int count;
+	do {
+		net_nap(5);
+		procinfo info;
+		Fid_t fid = OpenInfo();
+		count = 0;
+		while(Read(fid, (char*)&info, sizeof(info))==sizeof(info))
+			if(info.alive && info.main_task == block_tree) count++;
+		Close(fid);
+	} while(count < N);
+
+	ASSERT(KillTree(root)==0);
+
+	/* The root's descendants are adopted by this process, the initial one */
+	int status, reaped = 0;
+	while(WaitChild(NOPROC, &status) != NOPROC) {
+		ASSERT(status == EXIT_KILLED);
+		reaped++;
+	}
+	ASSERT(reaped == N);
+	return 0;
+}
+
+
+TEST_SUITE(kill_tests,
+	"Tests for Kill and KillTree."
+	)
+{
+	&test_kill_blocked_process,
+	&test_kill_blocked_ring_writer,
+	&test_kill_errors,
+	&test_kill_tree,
+	NULL
+};
+
+
+/* State shared by the fibers of a test */
+typedef struct fiber_test_state {
+	fiber_mutex mx;
+	fiber_chan chan;
+	int counter;
+	int started;
+	long sum;
+	Fid_t fid;
+} fiber_test_state;
+
+/* Increment the counter, yielding inside the critical section */
+static void fiber_increment(void* arg)
+{
+	fiber_test_state* st = arg;
+	for(int i=0; i<20; i++) {
+		FiberMutex_Lock(&st->mx);
+		int c = st->counter;
+		FiberYield();
+		st->counter = c+1;
+		FiberMutex_Unlock(&st->mx);
+	}
+}
+
+static void fiber_spawn_incrementers(void* arg)
+{
+	for(int i=0; i<50; i++)
+		ASSERT(FiberSpawn(fiber_increment, arg)==0);
+}
+
+BOOT_TEST(test_fiber_mutex,
+	"Test that fibers on many carriers are mutually excluded by a fiber mutex, while they yield."
+	)
+{
+	fiber_test_state st = { .mx = FIBER_MUTEX_INIT, .counter = 0 };
+	ASSERT(FiberRun(3, fiber_spawn_incrementers, &st)==0);
+	ASSERT(st.counter == 1000);
+	ASSERT(FiberRun(0, fiber_spawn_incrementers, &st)==-1);
+	return 0;
+}
+
+
+static void fiber_consumer(void* arg)
+{
+	fiber_test_state* st = arg;
+	void* msg;
+	while(FiberChanRecv(&st->chan, &msg))
+		__atomic_fetch_add(&st->sum, (long)(intptr_t)msg, __ATOMIC_RELAXED);
+}
+
+static void fiber_producer(void* arg)
+{
+	fiber_test_state* st = arg;
+	for(int i=0; i<2; i++)
+		ASSERT(FiberSpawn(fiber_consumer, arg)==0);
+	for(intptr_t i=1; i<=1000; i++)
+		ASSERT(FiberChanSend(&st->chan, (void*)i)==0);
+	FiberChanClose(&st->chan);
+	ASSERT(FiberChanSend(&st->chan, NULL)==-1);
+}
+
+BOOT_TEST(test_fiber_channel,
+	"Test that messages sent over a small fiber channel are all received, until it is closed."
+	)
+{
+	fiber_test_state st = { .sum = 0 };
+	ASSERT(FiberChanInit(&st.chan, 4)==0);
+	ASSERT(FiberRun(2, fiber_producer, &st)==0);
+	ASSERT(st.sum == 500500);
+	FiberChanDestroy(&st.chan);
+	return 0;
+}
+
+
+static void fiber_reader(void* arg)
+{
+	fiber_test_state* st = arg;
+	char c;
+	st->started = 1;
+	ASSERT(FiberRead(st->fid, &c, 1)==1);
+	ASSERT(c == 'x');
+}
+
+static void fiber_start_reader(void* arg)
+{
+	fiber_test_state* st = arg;
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	st->fid = p.read;
+
+	/* On one carrier, we can only run again if the reader hands it over */
+	ASSERT(FiberSpawn(fiber_reader, arg)==0);
+	while(! st->started)
+		FiberYield();
+	ASSERT(FiberWrite(p.write, "x", 1)==1);
+	Close(p.write);
+}
+
+BOOT_TEST(test_fiber_blocking_read,
+	"Test that a fiber blocked in FiberRead lets the other fibers run, even on one carrier."
+	)
+{
+	fiber_test_state st = { .started = 0 };
+	ASSERT(FiberRun(1, fiber_start_reader, &st)==0);
+	Close(st.fid);
+	return 0;
+}
+
+
+TEST_SUITE(fiber_tests,
+	"Tests for fibers in tinyoslib."
+	)
+{
+	&test_fiber_mutex,
+	&test_fiber_channel,
+	&test_fiber_blocking_read,
+	NULL
+};
+
+
+/* Submit an operation, failing the test if the ring is full */
+static void io_submit(io_ring* ring, io_opcode op, Fid_t fid, char* buf, unsigned int size, uintptr_t user_data)
+{
+	io_sqe sqe = { .opcode = op, .fid = fid, .buf = buf, .size = size, .user_data = user_data };
+	ASSERT(IoSubmit(ring, &sqe)==0);
+}
+
+BOOT_TEST(test_io_ring_pipe,
+	"Test that a batch of reads and writes on a pipe completes in order, with one IoRingEnter each."
+	)
+{
+	io_ring* ring;
+	Fid_t rfid = IoRing(1, &ring);
+	ASSERT(rfid != NOFILE);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	char out[8] = "abcdefgh", in[8];
+	for(int i=0; i<8; i++)
+		io_submit(ring, IO_WRITE, p.write, out+i, 1, i);
+	io_submit(ring, IO_NOP, NOFILE, NULL, 0, 100);
+	io_submit(ring, (io_opcode)42, NOFILE, NULL, 0, 101);
+	ASSERT(IoRingEnter(rfid, 10, (timeout_t)-1)==10);
+
+	io_cqe cqe;
+	for(int i=0; i<8; i++) {
+		ASSERT(IoReap(ring, &cqe)==1);
+		ASSERT(cqe.user_data == i && cqe.result == 1);
+	}
+	ASSERT(IoReap(ring, &cqe)==1 && cqe.user_data == 100 && cqe.result == 0);
+	ASSERT(IoReap(ring, &cqe)==1 && cqe.user_data == 101 && cqe.result == -1);
+	ASSERT(IoReap(ring, &cqe)==0);
+
+	for(int i=0; i<8; i++)
+		io_submit(ring, IO_READ, p.read, in+i, 1, i);
+	ASSERT(IoRingEnter(rfid, 8, (timeout_t)-1)==8);
+	for(int i=0; i<8; i++)
+		ASSERT(IoReap(ring, &cqe)==1 && cqe.result == 1);
+	ASSERT(memcmp(in, out, 8)==0);
+
+	ASSERT(IoRingEnter(rfid, 0, (timeout_t)-1)==0);
+	ASSERT(Close(rfid)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_io_ring_blocking,
+	"Test that a blocked operation does not hold up the next ones, when the ring has two workers."
+	)
+{
+	io_ring* ring;
+	Fid_t rfid = IoRing(2, &ring);
+	ASSERT(rfid != NOFILE);
+
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0 && Pipe(&p2)==0);
+
+	char c1, c2 = 'y';
+	io_submit(ring, IO_READ, p1.read, &c1, 1, 1);
+	io_submit(ring, IO_WRITE, p2.write, &c2, 1, 2);
+	ASSERT(IoRingEnter(rfid, 1, (timeout_t)-1)==1);
+
+	io_cqe cqe;
+	ASSERT(IoReap(ring, &cqe)==1 && cqe.user_data == 2 && cqe.result == 1);
+
+	/* The read is still pending */
+	ASSERT(IoRingEnter(rfid, 1, 50)==0);
+	ASSERT(Write(p1.write, "x", 1)==1);
+	ASSERT(IoRingEnter(rfid, 1, (timeout_t)-1)==1);
+	ASSERT(IoReap(ring, &cqe)==1 && cqe.user_data == 1 && cqe.result == 1);
+	ASSERT(c1 == 'x');
+
+	ASSERT(Close(rfid)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_io_ring_accept_connect,
+	"Test that Accept and Connect can be submitted to an I/O ring."
+	)
+{
+	io_ring* ring;
+	Fid_t rfid = IoRing(2, &ring);
+	ASSERT(rfid != NOFILE);
+
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+
+	io_submit(ring, IO_ACCEPT, lsock, NULL, 0, 1);
+	io_sqe sqe = { .opcode = IO_CONNECT, .fid = cli, .port = 100, .timeout = 1000, .user_data = 2 };
+	ASSERT(IoSubmit(ring, &sqe)==0);
+	ASSERT(IoRingEnter(rfid, 2, (timeout_t)-1)==2);
+
+	io_cqe cqe;
+	Fid_t srv = NOFILE;
+	for(int i=0; i<2; i++) {
+		ASSERT(IoReap(ring, &cqe)==1);
+		if(cqe.user_data == 1)
+			srv = cqe.result;
+		else
+			ASSERT(cqe.result == 0);
+	}
+	ASSERT(srv != NOFILE);
+
+	char c;
+	ASSERT(Write(cli, "z", 1)==1);
+	ASSERT(Read(srv, &c, 1)==1 && c == 'z');
+
+	ASSERT(Close(rfid)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_io_ring_close_while_waiting,
+	"Test that closing an I/O ring wakes up a thread waiting in IoRingEnter."
+	)
+{
+	io_ring* ring;
+	Fid_t rfid = IoRing(1, &ring);
+	ASSERT(rfid != NOFILE);
+
+	int waiter(int argl, void* args) {
+		return IoRingEnter(rfid, 1, (timeout_t)-1);
+	}
+	Tid_t t = CreateThread(waiter, 0, NULL);
+	ASSERT(ThreadJoinTimed(t, NULL, 20)==-1);
+
+	ASSERT(Close(rfid)==0);
+	int ready;
+	ASSERT(ThreadJoin(t, &ready)==0);
+	ASSERT(ready == 0);
+	return 0;
+}
+
+
+/* Exit with a read pending on an I/O ring that is never closed */
+static int io_ring_leaver(int argl, void* args)
+{
+	io_ring* ring;
+	Fid_t rfid = IoRing(4, &ring);
+	pipe_t p;
+	Pipe(&p);
+	char c;
+	io_sqe sqe = { .opcode = IO_READ, .fid = p.read, .buf = &c, .size = 1 };
+	IoSubmit(ring, &sqe);
+	IoRingEnter(rfid, 0, (timeout_t)-1);
+	return 42;
+}
+
+BOOT_TEST(test_io_ring_errors,
+	"Test the errors of IoRing and IoRingEnter, and that the workers of a ring do not keep its process alive."
+	)
+{
+	io_ring* ring;
+	ASSERT(IoRing(1, NULL)==NOFILE);
+	ASSERT(IoRing(IO_RING_MAX_WORKERS+1, &ring)==NOFILE);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(IoRingEnter(p.read, 0, (timeout_t)-1)==-1);
+	ASSERT(IoRingEnter(NOFILE, 0, (timeout_t)-1)==-1);
+
+	Fid_t rfid = IoRing(0, &ring);
+	ASSERT(rfid != NOFILE);
+	ASSERT(IoRingEnter(rfid, IO_RING_ENTRIES+1, (timeout_t)-1)==-1);
+	ASSERT(Close(rfid)==0);
+
+	int status;
+	Pid_t pid = Exec(io_ring_leaver, 0, NULL);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status == 42);
+	return 0;
+}
+
+
+TEST_SUITE(io_ring_tests,
+	"Tests for asynchronous I/O rings."
+	)
+{
+	&test_io_ring_pipe,
+	&test_io_ring_blocking,
+	&test_io_ring_accept_connect,
+	&test_io_ring_close_while_waiting,
+	&test_io_ring_errors,
+	NULL
+};
+
+
+typedef struct pool_fib {
+	int n;
+	long result;
+} pool_fib;
+
+static long serial_fib(int n) { return n < 2 ? n : serial_fib(n-1) + serial_fib(n-2); }
+
+static void pool_fib_task(pool_worker* w, void* arg)
+{
+	pool_fib* f = arg;
+	if(f->n < 10) {
+		f->result = serial_fib(f->n);
+		return;
+	}
+	pool_fib a = { f->n - 1, 0 }, b = { f->n - 2, 0 };
+	task_group g = TASK_GROUP_INIT;
+	TaskSpawn(w, &g, pool_fib_task, &a);
+	pool_fib_task(w, &b);
+	TaskWait(w, &g);
+	f->result = a.result + b.result;
+}
+
+BOOT_TEST(test_pool_fibonacci,
+	"Test a recursive Fibonacci on a task pool, with nested task groups."
+	)
+{
+	ASSERT(TaskPoolCreate(0)==NULL);
+
+	task_pool* pool = TaskPoolCreate(4);
+	ASSERT(pool != NULL);
+	for(int n = 0; n <= 22; n += 11) {
+		pool_fib f = { n, -1 };
+		TaskPoolRun(pool, pool_fib_task, &f);
+		ASSERT(f.result == serial_fib(n));
+	}
+	TaskPoolDestroy(pool);
+	return 0;
+}
+
+
+static void pool_count_index(int i, void* arg)
+{
+	__atomic_fetch_add(&((int*)arg)[i], 1, __ATOMIC_RELAXED);
+}
+
+static void pool_for_task(pool_worker* w, void* arg)
+{
+	ParallelFor(w, 0, 10000, 0, pool_count_index, arg);
+	ParallelFor(w, 10000, 10007, 1, pool_count_index, arg);
+	ParallelFor(w, 5, 5, 1, pool_count_index, arg);
+}
+
+BOOT_TEST(test_pool_parallel_for,
+	"Test that ParallelFor visits every index once."
+	)
+{
+	static int count[10007];
+	memset(count, 0, sizeof(count));
+	task_pool* pool = TaskPoolCreate(3);
+	ASSERT(pool != NULL);
+	TaskPoolRun(pool, pool_for_task, count);
+	for(int i=0; i<10007; i++)
+		ASSERT_MSG(count[i]==1, "count[%d]=%d\n", i, count[i]);
+	TaskPoolDestroy(pool);
+	return 0;
+}
+
+
+static void pool_flood_count(pool_worker* w, void* arg)
+{
+	__atomic_fetch_add((int*)arg, 1, __ATOMIC_RELAXED);
+}
+
+static void pool_flood(pool_worker* w, void* arg)
+{
+	task_group g = TASK_GROUP_INIT;
+	for(int i=0; i<3*POOL_DEQUE_SIZE; i++)
+		TaskSpawn(w, &g, pool_flood_count, arg);
+	TaskWait(w, &g);
+}
+
+BOOT_TEST(test_pool_full_deque,
+	"Test that tasks spawned on a full deque are still run."
+	)
+{
+	int count = 0;
+	task_pool* pool = TaskPoolCreate(2);
+	ASSERT(pool != NULL);
+	TaskPoolRun(pool, pool_flood, &count);
+	ASSERT(count == 3*POOL_DEQUE_SIZE);
+	TaskPoolDestroy(pool);
+	return 0;
+}
+
+
+TEST_SUITE(task_pool_tests,
+	"Tests for the work-stealing task pool in tinyoslib."
+	)
+{
+	&test_pool_fibonacci,
+	&test_pool_parallel_for,
+	&test_pool_full_deque,
+	NULL
+};
+
+
+static int ici_count;
+static int ici_while_disabled, ici_after_enable;
+
+static void count_ici() { ici_count++; }
+
+static void ici_boot()
+{
+	cpu_interrupt_handler(ICI, count_ici);
+	ici_count = 0;
+
+	cpu_disable_interrupts();
+	cpu_ici(0);
+	cpu_ici(0);
+	for(volatile int i = 0; i < 1000000; i++);
+	ici_while_disabled = ici_count;
+	cpu_enable_interrupts();
+	ici_after_enable = ici_count;
+}
+
+BARE_TEST(test_interrupts_deferred,
+	"Test that an interrupt raised while interrupts are disabled is delivered\n"
+	"once, when they are enabled again."
+	)
+{
+	vm_boot(ici_boot, 1, 0);
+	ASSERT(ici_while_disabled == 0);
+	ASSERT(ici_after_enable == 1);
+}
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_interrupts_deferred,
 	&test_create_thread,
 	&test_system_info,
 	&test_pipe_reader_close_before_write,
+	&event_queue_tests,
+	&kmem_tests,
+	&packet_tests,
+	&port_tests,
+	&backlog_tests,
+	&datagram_tests,
+	&ring_tests,
+	&net_tests,
+	&sockinfo_tests,
+	&channel_tests,
+	&process_table_tests,
+	&rusage_tests,
+	&fid_table_tests,
+	&thread_table_tests,
+	&spawn_tests,
+	&wait_tests,
+	&process_fid_tests,
+	&kill_tests,
+	&fiber_tests,
+	&io_ring_tests,
+	&task_pool_tests,
 	NULL
 };
 